@@ -0,0 +1,29 @@
+#ifndef BLOCKDEVICE_H
+#define BLOCKDEVICE_H
+
+#include <stdint.h>
+
+// Interface between the transfer loops of SDCardManager.cpp and the storage behind the LUN. The
+// transfer loops only move bytes between the USB endpoints and a backend: readBlocks() pushes the
+// data of the blocks into a sink, writeBlocks() pulls it from a source, one or more whole blocks
+// at a time. A backend that holds the data in memory passes it straight to the endpoint, the card
+// goes through its block buffer because a block with a CRC error has to be read again before any
+// of it reaches the host. Caches or other transports can be put in front of a backend without
+// touching the endpoint loops.
+class BlockDevice {
+public:
+  // length is a multiple of 512, both return false if the host aborted the transfer or the
+  // endpoint timed out, the backend must then stop without touching the data any further
+  typedef bool (*Sink)(const uint8_t *data, uint16_t length);
+  typedef bool (*Source)(uint8_t *data, uint16_t length);
+
+  // number of 512 byte blocks visible to the host, zero while there is no medium
+  virtual uint32_t numBlocks() = 0;
+
+  // transfer count blocks starting at block number lba and return the number of blocks that were
+  // transferred completely, less than count if the medium failed or the transfer was aborted
+  virtual uint16_t readBlocks(uint32_t lba, uint16_t count, Sink sink) = 0;
+  virtual uint16_t writeBlocks(uint32_t lba, uint16_t count, Source source) = 0;
+};
+
+#endif // BLOCKDEVICE_H
@@ -0,0 +1,86 @@
+#include "BufferArena.h"
+
+#include "CommandStats.h"
+#include "CommandTrace.h"
+#include "EventLog.h"
+#include "SDCardDriver.h"
+#include "SDCardManager.h"
+#include "Telemetry.h"
+
+#include <avr/io.h>
+
+uint8_t BufferArena_Memory[BUFFER_ARENA_SLOTS][BUFFER_ARENA_SLOT_SIZE];
+
+// SRAM budget of the build. The arena and the buffers that grow with the options are counted below,
+// BUFFER_ARENA_BASE_RAM is the rest of the .data and .bss sections. The static assertion only sees
+// this sum, BufferArena_StackRoom() takes the real end of .bss from the linker and setup() stops
+// with a blinking LED if it leaves less than BUFFER_ARENA_STACK_RESERVE, so an estimate that is too
+// low shows up at the first boot instead of as a stack overwriting the statics. Only the AVR build
+// is checked, the host builds model configurations that don't fit into the chip.
+
+/** Estimate in bytes of the SRAM used besides the buffers counted below: Serial1 with its two 64 byte
+ *  rings and vtable (180), the LUFA device state and mass storage interface (70), InquiryData, SenseData
+ *  and the log page table of SCSI.c (66), the self-test results (158), the card driver, block device
+ *  and card manager (68), the metadata cache layout (40), the write log, zero map and scheduler (25)
+ *  and the millis() counters of the core and string constants (40), 647 bytes rounded up. The items
+ *  are counted from the sources and not yet checked against an avr-gcc build. To calibrate it, build
+ *  each MEMORY_PROFILE with `arduino-cli compile --fqbn arduino:avr:micro` and take the largest
+ *  .data + .bss of `avr-size -A` minus BUFFER_ARENA_RAM_USED without this term.
+ */
+#define BUFFER_ARENA_BASE_RAM     648
+
+#if defined(ENABLE_EVENT_LOG)
+#define BUFFER_ARENA_EVENT_LOG_RAM      (EVENT_LOG_ENTRIES * sizeof(EventLog_Record_t))
+#else
+#define BUFFER_ARENA_EVENT_LOG_RAM      0
+#endif
+
+#if defined(ENABLE_COMMAND_TRACE)
+#define BUFFER_ARENA_COMMAND_TRACE_RAM  (COMMAND_TRACE_ENTRIES * sizeof(CommandTrace_Record_t))
+#else
+#define BUFFER_ARENA_COMMAND_TRACE_RAM  0
+#endif
+
+// one histogram of three counters, the remainder and the buckets per slot, and the global counters
+#if defined(ENABLE_COMMAND_STATS)
+#define BUFFER_ARENA_COMMAND_STATS_RAM  (COMMAND_STATS_SLOTS * (14 + 2 * COMMAND_STATS_BUCKETS) + 16)
+#else
+#define BUFFER_ARENA_COMMAND_STATS_RAM  0
+#endif
+
+// the counters and the state of the CDC interface
+#if defined(ENABLE_TELEMETRY)
+#define BUFFER_ARENA_TELEMETRY_RAM      (TELEMETRY_COUNTERS * 4 + 80)
+#else
+#define BUFFER_ARENA_TELEMETRY_RAM      0
+#endif
+
+#if defined(SDCARD_DRIVER_PROFILE)
+#define BUFFER_ARENA_DRIVER_PROFILE_RAM (SDCardDriver::PHASE_COUNT * sizeof(SDCardDriver::PhaseStats) + 4)
+#else
+#define BUFFER_ARENA_DRIVER_PROFILE_RAM 0
+#endif
+
+/** SRAM of the build without the stack. */
+#define BUFFER_ARENA_RAM_USED (sizeof(BufferArena_Memory) + BUFFER_ARENA_EVENT_LOG_RAM + BUFFER_ARENA_COMMAND_TRACE_RAM + \
+                               BUFFER_ARENA_COMMAND_STATS_RAM + BUFFER_ARENA_TELEMETRY_RAM + \
+                               BUFFER_ARENA_DRIVER_PROFILE_RAM + SDCARD_METADATA_CACHE_SECTORS * 6 + SDCARD_EEPROM_PROFILE * 15 + \
+                               SDCARD_WRITE_LOG_BLOCKS * 4 + SDCARD_ZERO_MAP_RANGES * 8 + BUFFER_ARENA_BASE_RAM)
+
+#if defined(__AVR__)
+static_assert(BUFFER_ARENA_RAM_USED + BUFFER_ARENA_STACK_RESERVE <= BUFFER_ARENA_SRAM_SIZE,
+              "The buffers don't fit into the SRAM, choose a smaller MEMORY_PROFILE in LUFAConfig.h");
+
+// first byte after .bss and .noinit, set by the linker script of avr-libc
+extern "C" char __heap_start;
+
+uint16_t BufferArena_StackRoom(void)
+{
+  return RAMEND + 1 - (uintptr_t)&__heap_start;
+}
+#else
+uint16_t BufferArena_StackRoom(void)
+{
+  return BUFFER_ARENA_RAM_USED < BUFFER_ARENA_SRAM_SIZE ? BUFFER_ARENA_SRAM_SIZE - BUFFER_ARENA_RAM_USED : 0;
+}
+#endif
@@ -0,0 +1,72 @@
+#ifndef BUFFERARENA_H
+#define BUFFERARENA_H
+
+#include <stdint.h>
+
+#include "LUFAConfig.h"
+#include "MetadataCache.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// All 512 byte buffers of the firmware are slots of one static arena, so that their total is known
+// at compile time and checked against the SRAM in BufferArena.cpp. Every user leases fixed slots,
+// the number of slots follows from the options, see the memory profiles in LUFAConfig.h. The slots
+// are assigned at compile time, there is no run time ownership: users that share a slot must never
+// hold data in it at the same time.
+
+/** Size in bytes of a slot, one block of the card. */
+#define BUFFER_ARENA_SLOT_SIZE    512
+
+/** Slot of the block buffer of the transfer path, shared by the card manager and the self-test, which
+ *  only runs between the transfers.
+ */
+#define BUFFER_ARENA_BLOCK        0
+
+/** First of the \ref SDCARD_METADATA_CACHE_SECTORS slots of the metadata cache. */
+#define BUFFER_ARENA_METADATA     (BUFFER_ARENA_BLOCK + 1)
+
+/** Number of slots of the arena. */
+#define BUFFER_ARENA_SLOTS        (BUFFER_ARENA_METADATA + SDCARD_METADATA_CACHE_SECTORS)
+
+#if !defined(BUFFER_ARENA_SRAM_SIZE)
+/** SRAM of the ATmega32U4 in bytes. */
+#define BUFFER_ARENA_SRAM_SIZE    2560
+#endif
+
+#if !defined(BUFFER_ARENA_STACK_RESERVE)
+/** Bytes of SRAM kept free for the stack, the deepest path is a READ (10) with the USB interrupt on top. */
+#define BUFFER_ARENA_STACK_RESERVE 256
+#endif
+
+/** The arena, defined in BufferArena.cpp. It is only declared here so that a lease is a constant
+ *  address, the slots must only be taken with \ref BufferArena_Lease().
+ */
+extern uint8_t BufferArena_Memory[BUFFER_ARENA_SLOTS][BUFFER_ARENA_SLOT_SIZE];
+
+#if defined(__cplusplus)
+#define BUFFER_ARENA_CONSTEXPR    constexpr
+#else
+#define BUFFER_ARENA_CONSTEXPR
+#endif
+
+/** Returns the buffer of a slot of the arena, one of the BUFFER_ARENA_ slot numbers. For a constant
+ *  slot this is a constant expression, so a lease costs nothing in the transfer loops.
+ */
+static inline BUFFER_ARENA_CONSTEXPR uint8_t *BufferArena_Lease(const uint8_t Slot)
+{
+  return BufferArena_Memory[Slot];
+}
+
+/** Returns the bytes of SRAM between the end of the static data and the end of the SRAM, which are left
+ *  for the stack. On the AVR the end of the static data is taken from the linker, the host builds return
+ *  the estimate of BufferArena.cpp.
+ */
+uint16_t BufferArena_StackRoom(void);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // BUFFERARENA_H
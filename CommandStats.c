@@ -0,0 +1,180 @@
+/** \file
+ *
+ *  Per command latency statistics. Every SCSI command is timed by the Mass Storage command callback from
+ *  the reception of the command block to the end of its processing, and the latency is added to a logarithmic
+ *  histogram for the command's opcode and transfer size. The histograms are cheap enough to be enabled in production firmware and can be read
+ *  by the host through the vendor specific LOG SENSE page \ref COMMAND_STATS_LOG_PAGE.
+ */
+
+#include "CommandStats.h"
+
+#if defined(ENABLE_COMMAND_STATS)
+
+#include <string.h>
+
+/** Type define for a single latency histogram. */
+typedef struct
+{
+	uint32_t Count;                            /**< Number of commands */
+	uint32_t MaxMicroseconds;                  /**< Slowest command in microseconds */
+	uint32_t TotalMilliseconds;                /**< Sum of all latencies in milliseconds */
+	uint16_t RemainderMicroseconds;            /**< Part of the sum below one millisecond, carried into the next command */
+	uint16_t Buckets[COMMAND_STATS_BUCKETS];   /**< Saturating command counts per latency bucket */
+} CommandStats_Histogram_t;
+
+/** Latency histograms of all command slots. */
+static CommandStats_Histogram_t Histograms[COMMAND_STATS_SLOTS];
+
+/** Global command counters, reported in the \ref COMMAND_STATS_PARAM_COUNTERS parameter. */
+static struct
+{
+	uint32_t Commands;
+	uint32_t FailedCommands;
+	uint32_t BlocksRead;
+	uint32_t BlocksWritten;
+} Counters;
+
+/** Adds the latency of a processed command to the histogram of the command.
+ *
+ *  \param[in] CommandData     SCSI command block of the processed command
+ *  \param[in] Latency         Time in microseconds from the reception of the command to the end of its processing
+ *  \param[in] CommandSuccess  Boolean \c true if the command completed successfully, \c false otherwise
+ */
+void CommandStats_Record(const uint8_t* const CommandData,
+                         const uint32_t Latency,
+                         const bool CommandSuccess)
+{
+	uint32_t Range  = (Latency / COMMAND_STATS_BUCKET_BASE_US);
+	uint8_t  Bucket = 0;
+	uint16_t Blocks = 0;
+	uint8_t  Slot;
+
+	switch (CommandData[0])
+	{
+		case SCSI_CMD_READ_10:
+		case SCSI_CMD_WRITE_10:
+			Blocks = SwapEndian_16(*(uint16_t*)&CommandData[7]);
+
+			if (Blocks <= 1)
+			  Slot = COMMAND_STATS_READ_1;
+			else if (Blocks <= 8)
+			  Slot = COMMAND_STATS_READ_8;
+			else
+			  Slot = COMMAND_STATS_READ_LARGE;
+
+			if (CommandData[0] == SCSI_CMD_WRITE_10)
+			  Slot += (COMMAND_STATS_WRITE_1 - COMMAND_STATS_READ_1);
+			break;
+		case SCSI_CMD_TEST_UNIT_READY:
+			Slot = COMMAND_STATS_TEST_UNIT_READY;
+			break;
+		default:
+			Slot = COMMAND_STATS_OTHER;
+			break;
+	}
+
+	CommandStats_Histogram_t* Histogram = &Histograms[Slot];
+
+	/* Find the logarithmic bucket of the latency */
+	while (Range && (Bucket < (COMMAND_STATS_BUCKETS - 1)))
+	{
+		Range >>= 1;
+		Bucket++;
+	}
+
+	if (Histogram->Buckets[Bucket] != UINT16_MAX)
+	  Histogram->Buckets[Bucket]++;
+
+	Histogram->Count++;
+
+	/* Commands well below a millisecond must still add up, so the sub-millisecond part is carried over */
+	uint32_t Microseconds = Latency + Histogram->RemainderMicroseconds;
+	Histogram->TotalMilliseconds    += (Microseconds / 1000);
+	Histogram->RemainderMicroseconds = (Microseconds % 1000);
+
+	if (Latency > Histogram->MaxMicroseconds)
+	  Histogram->MaxMicroseconds = Latency;
+
+	Counters.Commands++;
+
+	if (!(CommandSuccess))
+	  Counters.FailedCommands++;
+	else if (CommandData[0] == SCSI_CMD_READ_10)
+	  Counters.BlocksRead += Blocks;
+	else if (CommandData[0] == SCSI_CMD_WRITE_10)
+	  Counters.BlocksWritten += Blocks;
+}
+
+/** Clears all histograms and counters, used by the LOG SELECT parameter code reset. */
+void CommandStats_Reset(void)
+{
+	memset(Histograms, 0, sizeof(Histograms));
+	memset(&Counters, 0, sizeof(Counters));
+}
+
+/** Stores a big-endian 32-bit value in a log parameter buffer. */
+static uint8_t* CommandStats_Put_32(uint8_t* Buffer,
+                                    const uint32_t Value)
+{
+	*(Buffer++) = (Value >> 24);
+	*(Buffer++) = (Value >> 16);
+	*(Buffer++) = (Value >> 8);
+	*(Buffer++) = (Value & 0xFF);
+
+	return Buffer;
+}
+
+/** Fills a buffer with a LOG SENSE parameter of the statistics log page. The histograms are returned as
+ *  binary parameters 0 to \ref COMMAND_STATS_SLOTS - 1 with the command count, the maximum latency in
+ *  microseconds, the total latency in milliseconds and the bucket counts, followed by the global counters.
+ *
+ *  \param[in]  Index   Index of the parameter to return
+ *  \param[out] Buffer  Buffer of at least \ref COMMAND_STATS_PARAMETER_MAX_SIZE bytes for the parameter
+ *
+ *  \return Size of the parameter in bytes, or zero if there are no more parameters
+ */
+uint8_t CommandStats_GetParameter(const uint8_t Index,
+                                  uint8_t* const Buffer)
+{
+	uint8_t* Data = &Buffer[4];
+
+	if (Index < COMMAND_STATS_SLOTS)
+	{
+		const CommandStats_Histogram_t* Histogram = &Histograms[Index];
+
+		Data = CommandStats_Put_32(Data, Histogram->Count);
+		Data = CommandStats_Put_32(Data, Histogram->MaxMicroseconds);
+		Data = CommandStats_Put_32(Data, Histogram->TotalMilliseconds);
+
+		for (uint8_t Bucket = 0; Bucket < COMMAND_STATS_BUCKETS; Bucket++)
+		{
+			*(Data++) = (Histogram->Buckets[Bucket] >> 8);
+			*(Data++) = (Histogram->Buckets[Bucket] & 0xFF);
+		}
+
+		Buffer[0] = 0;
+		Buffer[1] = Index;
+	}
+	else if (Index == COMMAND_STATS_SLOTS)
+	{
+		Data = CommandStats_Put_32(Data, Counters.Commands);
+		Data = CommandStats_Put_32(Data, Counters.FailedCommands);
+		Data = CommandStats_Put_32(Data, Counters.BlocksRead);
+		Data = CommandStats_Put_32(Data, Counters.BlocksWritten);
+
+		Buffer[0] = (COMMAND_STATS_PARAM_COUNTERS >> 8);
+		Buffer[1] = (COMMAND_STATS_PARAM_COUNTERS & 0xFF);
+	}
+	else
+	{
+		return 0;
+	}
+
+	/* Binary format parameter with the length of the data */
+	Buffer[2] = 0x03;
+	Buffer[3] = (Data - &Buffer[4]);
+
+	return (Data - Buffer);
+}
+
+#endif
@@ -0,0 +1,87 @@
+/** \file
+ *
+ *  Header file for CommandStats.c.
+ */
+
+#ifndef _COMMAND_STATS_H_
+#define _COMMAND_STATS_H_
+
+	/* Includes: */
+		#include <avr/io.h>
+
+		#include "Descriptors.h"
+
+	#if defined(__cplusplus)
+		extern "C" {
+	#endif
+
+	/* Macros: */
+		/** Vendor specific LOG SENSE page code of the command latency statistics. */
+		#define COMMAND_STATS_LOG_PAGE           0x30
+
+		/** Number of logarithmic latency buckets per histogram. Bucket 0 counts commands faster than
+		 *  \ref COMMAND_STATS_BUCKET_BASE_US, each following bucket covers twice the range of the previous
+		 *  one and the last bucket counts everything slower.
+		 */
+		#define COMMAND_STATS_BUCKETS            16
+
+		/** Upper latency bound in microseconds of the first histogram bucket. */
+		#define COMMAND_STATS_BUCKET_BASE_US     128
+
+		/** Parameter code of the global command counters in the statistics log page, the histograms use the
+		 *  parameter codes 0 to \ref COMMAND_STATS_SLOTS - 1 in the order of \ref CommandStats_Slots_t.
+		 */
+		#define COMMAND_STATS_PARAM_COUNTERS     0x0100
+
+		/** Size in bytes of a histogram parameter including its 4 byte header, this is also the largest parameter
+		 *  returned by \ref CommandStats_GetParameter().
+		 */
+		#define COMMAND_STATS_PARAMETER_MAX_SIZE (4 + 12 + (COMMAND_STATS_BUCKETS * 2))
+
+		/** Total length in bytes of all parameters of the statistics log page, the histograms followed by the
+		 *  16 bytes of global counters.
+		 */
+		#define COMMAND_STATS_PAGE_LENGTH        ((COMMAND_STATS_SLOTS * COMMAND_STATS_PARAMETER_MAX_SIZE) + (4 + 16))
+
+	/* Enums: */
+		/** Enum for the histograms kept by the statistics, one per opcode and for READ (10) and WRITE (10)
+		 *  also per transfer size.
+		 */
+		enum CommandStats_Slots_t
+		{
+			COMMAND_STATS_READ_1       = 0, /**< READ (10) of a single block */
+			COMMAND_STATS_READ_8,           /**< READ (10) of 2 to 8 blocks */
+			COMMAND_STATS_READ_LARGE,       /**< READ (10) of more than 8 blocks */
+			COMMAND_STATS_WRITE_1,          /**< WRITE (10) of a single block */
+			COMMAND_STATS_WRITE_8,          /**< WRITE (10) of 2 to 8 blocks */
+			COMMAND_STATS_WRITE_LARGE,      /**< WRITE (10) of more than 8 blocks */
+			COMMAND_STATS_TEST_UNIT_READY,  /**< TEST UNIT READY */
+			COMMAND_STATS_OTHER,            /**< All other commands */
+			COMMAND_STATS_SLOTS,
+		};
+
+	/* Function Prototypes: */
+		#if defined(ENABLE_COMMAND_STATS)
+			void    CommandStats_Record(const uint8_t* const CommandData,
+			                            const uint32_t Latency,
+			                            const bool CommandSuccess);
+			void    CommandStats_Reset(void);
+			uint8_t CommandStats_GetParameter(const uint8_t Index,
+			                                  uint8_t* const Buffer);
+		#else
+			static inline void CommandStats_Record(const uint8_t* const CommandData,
+			                                       const uint32_t Latency,
+			                                       const bool CommandSuccess)
+			{
+				(void)CommandData;
+				(void)Latency;
+				(void)CommandSuccess;
+			}
+			static inline void CommandStats_Reset(void) {}
+		#endif
+
+	#if defined(__cplusplus)
+		}
+	#endif
+
+#endif
@@ -0,0 +1,172 @@
+/** \file
+ *
+ *  SCSI command trace. Every SCSI command is recorded with its opcode, block range, timestamp, duration and
+ *  status in a small ring buffer in RAM, which the host reads with the vendor specific command
+ *  \ref SCSI_CMD_READ_COMMAND_TRACE. If \ref COMMAND_TRACE_SPILL_BLOCKS is set, new records are additionally
+ *  spilled to a reserved area at the end of the card between commands, so that traces longer than the ring
+ *  buffer can be captured on production units and read from the card afterwards.
+ */
+
+#include "CommandTrace.h"
+
+#if defined(ENABLE_COMMAND_TRACE)
+
+#include <Arduino.h>
+
+#include "Descriptors.h"
+#include "SDCardManager.h"
+
+_Static_assert(sizeof(CommandTrace_Record_t) == 16, "Trace record layout changed");
+_Static_assert(sizeof(CommandTrace_Header_t) == 16, "Trace header layout changed");
+_Static_assert((COMMAND_TRACE_ENTRIES & (COMMAND_TRACE_ENTRIES - 1)) == 0, "Trace size must be a power of two");
+_Static_assert(COMMAND_TRACE_ENTRIES <= 128, "Trace size too large");
+
+/** Ring buffer of the most recent commands. */
+static CommandTrace_Record_t Records[COMMAND_TRACE_ENTRIES];
+
+/** Index of the next record to write in \ref Records. */
+static uint8_t  NextRecord;
+
+/** Number of valid records in \ref Records. */
+static uint8_t  RecordCount;
+
+/** Number of commands recorded since power up, the sequence number of the next record. */
+static uint32_t TotalRecords;
+
+#if (COMMAND_TRACE_SPILL_BLOCKS > 0)
+_Static_assert(COMMAND_TRACE_SPILL_BLOCKS <= SDCARD_RESERVED_BLOCKS, "Trace spill area not reserved");
+_Static_assert(COMMAND_TRACE_ENTRIES <= COMMAND_TRACE_SPILL_RECORDS, "Trace does not fit a spill block");
+
+/** Number of records that have not been spilled to the card yet. */
+static uint8_t  UnspilledCount;
+
+/** Number of spill blocks written since power up, selects the next block of the spill area. */
+static uint32_t SpillBlocks;
+#endif
+
+/** Adds a processed command to the trace, overwriting the oldest record if the ring buffer is full.
+ *
+ *  \param[in] CommandData  SCSI command block of the processed command
+ *  \param[in] StartTime    Value of micros() when the command was received
+ *  \param[in] Duration     Processing time of the command in microseconds
+ *  \param[in] Status       Zero on success, else \ref COMMAND_TRACE_STATUS_FAILED and the sense key
+ */
+void CommandTrace_Record(const uint8_t* const CommandData,
+                         const uint32_t StartTime,
+                         const uint32_t Duration,
+                         const uint8_t Status)
+{
+	CommandTrace_Record_t* Record = &Records[NextRecord];
+
+	Record->Timestamp = StartTime;
+	Record->Duration  = Duration;
+	Record->Opcode    = CommandData[0];
+	Record->Status    = Status;
+
+	switch (CommandData[0])
+	{
+		case SCSI_CMD_READ_10:
+		case SCSI_CMD_WRITE_10:
+		case SCSI_CMD_VERIFY_10:
+			Record->BlockAddress = SwapEndian_32(*(uint32_t*)&CommandData[2]);
+			Record->TotalBlocks  = SwapEndian_16(*(uint16_t*)&CommandData[7]);
+			break;
+		default:
+			Record->BlockAddress = 0;
+			Record->TotalBlocks  = 0;
+			break;
+	}
+
+	NextRecord = ((NextRecord + 1) & (COMMAND_TRACE_ENTRIES - 1));
+	TotalRecords++;
+
+	if (RecordCount < COMMAND_TRACE_ENTRIES)
+	  RecordCount++;
+
+	#if (COMMAND_TRACE_SPILL_BLOCKS > 0)
+	if (UnspilledCount < COMMAND_TRACE_ENTRIES)
+	  UnspilledCount++;
+	#endif
+}
+
+/** Fills the header for the records currently held in the ring buffer.
+ *
+ *  \param[out] Header  Header to fill
+ */
+void CommandTrace_GetHeader(CommandTrace_Header_t* const Header)
+{
+	Header->Magic      = COMMAND_TRACE_MAGIC;
+	Header->Version    = COMMAND_TRACE_VERSION;
+	Header->RecordSize = sizeof(CommandTrace_Record_t);
+	Header->Count      = RecordCount;
+	Header->Sequence   = (TotalRecords - RecordCount);
+	Header->Timestamp  = micros();
+}
+
+/** Copies a record of the ring buffer.
+ *
+ *  \param[in]  Index   Index of the record, 0 is the oldest record in the ring buffer
+ *  \param[out] Record  Record to fill
+ */
+void CommandTrace_GetRecord(const uint8_t Index,
+                            CommandTrace_Record_t* const Record)
+{
+	*Record = Records[(NextRecord - RecordCount + Index) & (COMMAND_TRACE_ENTRIES - 1)];
+}
+
+/** Removes the oldest records from the ring buffer, after they were returned to the host.
+ *
+ *  \param[in] Count  Number of records to remove
+ */
+void CommandTrace_Discard(const uint8_t Count)
+{
+	RecordCount -= MIN(Count, RecordCount);
+
+	#if (COMMAND_TRACE_SPILL_BLOCKS > 0)
+	UnspilledCount = MIN(UnspilledCount, RecordCount);
+	#endif
+}
+
+#if (COMMAND_TRACE_SPILL_BLOCKS > 0)
+/** Builds a spill block from the records that have not been spilled yet, see \ref CommandTrace_Task(). */
+static void CommandTrace_FillSpillBlock(uint8_t* const Buffer)
+{
+	CommandTrace_Header_t* Header  = (CommandTrace_Header_t*)Buffer;
+	CommandTrace_Record_t* Spilled = (CommandTrace_Record_t*)&Buffer[sizeof(CommandTrace_Header_t)];
+
+	memset(Buffer, 0, 512);
+
+	CommandTrace_GetHeader(Header);
+	Header->Count     = UnspilledCount;
+	Header->Sequence  = (TotalRecords - UnspilledCount);
+
+	for (uint8_t Index = 0; Index < UnspilledCount; Index++)
+	  CommandTrace_GetRecord((RecordCount - UnspilledCount + Index), &Spilled[Index]);
+}
+#endif
+
+/** Spills new records to the reserved area of the card, must be called periodically between SCSI commands.
+ *  The spill area is written as a ring of blocks, every block holds a header and the records that were
+ *  added since the previous block. Records are lost if more than \ref COMMAND_TRACE_ENTRIES commands are
+ *  processed before the next call, which shows up as a gap in the sequence numbers.
+ *
+ *  \return Boolean \c false, one block holds all records that can be spilled at once.
+ */
+bool CommandTrace_Task(void)
+{
+	#if (COMMAND_TRACE_SPILL_BLOCKS > 0)
+	if (UnspilledCount < COMMAND_TRACE_SPILL_THRESHOLD)
+	  return false;
+
+	if (SDCardManager_WriteReservedBlock(SDCARD_TRACE_SPILL_BLOCK + (SpillBlocks % COMMAND_TRACE_SPILL_BLOCKS),
+	                                     CommandTrace_FillSpillBlock))
+	{
+		SpillBlocks++;
+		UnspilledCount = 0;
+	}
+	#endif
+
+	return false;
+}
+
+#endif
@@ -0,0 +1,108 @@
+/** \file
+ *
+ *  Header file for CommandTrace.c. The record layouts in this file are also used by the host side
+ *  trace decoder in host/TraceDecoder.cpp, so this header must not depend on LUFA or AVR headers.
+ */
+
+#ifndef _COMMAND_TRACE_H_
+#define _COMMAND_TRACE_H_
+
+	/* Includes: */
+		#include <stdint.h>
+		#include <stdbool.h>
+
+		#include "LUFAConfig.h"
+
+	#if defined(__cplusplus)
+		extern "C" {
+	#endif
+
+	/* Macros: */
+		/** Vendor specific SCSI command code that returns the contents of the trace ring buffer. */
+		#define SCSI_CMD_READ_COMMAND_TRACE    0xC0
+
+		/** Flag in byte 1 of the \ref SCSI_CMD_READ_COMMAND_TRACE command block to remove the returned records
+		 *  from the ring buffer, so that consecutive reads return every record exactly once.
+		 */
+		#define COMMAND_TRACE_FLAG_DISCARD     (1 << 0)
+
+		/** Magic value of \ref CommandTrace_Header_t, "SCTR" in little-endian byte order. */
+		#define COMMAND_TRACE_MAGIC            0x52544353UL
+
+		/** Version of the record layout, increased on every incompatible change. */
+		#define COMMAND_TRACE_VERSION          1
+
+		/** Bit in the status of a record that is set if the command failed, the lower bits hold the sense key. */
+		#define COMMAND_TRACE_STATUS_FAILED    0x80
+
+		#if !defined(COMMAND_TRACE_ENTRIES)
+			/** Number of records kept in RAM, must be a power of two no larger than 128. */
+			#define COMMAND_TRACE_ENTRIES      16
+		#endif
+
+		#if !defined(COMMAND_TRACE_SPILL_BLOCKS)
+			/** Number of blocks at the end of the card the trace is spilled to, zero to keep the trace in RAM only. */
+			#define COMMAND_TRACE_SPILL_BLOCKS 0
+		#endif
+
+		/** Number of records in a spill block, after the header. */
+		#define COMMAND_TRACE_SPILL_RECORDS    ((512 - sizeof(CommandTrace_Header_t)) / sizeof(CommandTrace_Record_t))
+
+		/** Number of new records after which the trace is spilled to the card. */
+		#define COMMAND_TRACE_SPILL_THRESHOLD  (COMMAND_TRACE_ENTRIES / 2)
+
+	/* Type Defines: */
+		/** Type define for a traced SCSI command. All values are little-endian. */
+		typedef struct
+		{
+			uint32_t Timestamp;        /**< Value of micros() when the command was received */
+			uint32_t BlockAddress;     /**< First logical block of READ (10), WRITE (10) and VERIFY (10), zero otherwise */
+			uint32_t Duration;         /**< Processing time of the command in microseconds */
+			uint16_t TotalBlocks;      /**< Number of blocks of READ (10), WRITE (10) and VERIFY (10), zero otherwise */
+			uint8_t  Opcode;           /**< SCSI command code */
+			uint8_t  Status;           /**< Zero on success, else \ref COMMAND_TRACE_STATUS_FAILED and the sense key */
+		} CommandTrace_Record_t;
+
+		/** Type define for the header in front of the records returned by \ref SCSI_CMD_READ_COMMAND_TRACE and in front
+		 *  of the records of every spill block. All values are little-endian.
+		 */
+		typedef struct
+		{
+			uint32_t Magic;            /**< Always \ref COMMAND_TRACE_MAGIC */
+			uint8_t  Version;          /**< Always \ref COMMAND_TRACE_VERSION */
+			uint8_t  RecordSize;       /**< Size of a \ref CommandTrace_Record_t in bytes */
+			uint16_t Count;            /**< Number of records following the header */
+			uint32_t Sequence;         /**< Sequence number of the first record, counting all commands since power up */
+			uint32_t Timestamp;        /**< Value of micros() when the header was created */
+		} CommandTrace_Header_t;
+
+	/* Function Prototypes: */
+		#if defined(ENABLE_COMMAND_TRACE)
+			void CommandTrace_Record(const uint8_t* const CommandData,
+			                         const uint32_t StartTime,
+			                         const uint32_t Duration,
+			                         const uint8_t Status);
+			void CommandTrace_GetHeader(CommandTrace_Header_t* const Header);
+			void CommandTrace_GetRecord(const uint8_t Index,
+			                            CommandTrace_Record_t* const Record);
+			void CommandTrace_Discard(const uint8_t Count);
+			bool CommandTrace_Task(void);
+		#else
+			static inline void CommandTrace_Record(const uint8_t* const CommandData,
+			                                       const uint32_t StartTime,
+			                                       const uint32_t Duration,
+			                                       const uint8_t Status)
+			{
+				(void)CommandData;
+				(void)StartTime;
+				(void)Duration;
+				(void)Status;
+			}
+			static inline bool CommandTrace_Task(void) { return false; }
+		#endif
+
+	#if defined(__cplusplus)
+		}
+	#endif
+
+#endif
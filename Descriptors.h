@@ -53,6 +53,23 @@
 		/** Size in bytes of the Mass Storage data endpoints. */
 		#define MASS_STORAGE_IO_EPSIZE         64
 
+		#if defined(ENABLE_TELEMETRY)
+			/** Endpoint address of the telemetry CDC device-to-host notification IN endpoint. */
+			#define CDC_NOTIFICATION_EPADDR    (ENDPOINT_DIR_IN  | 5)
+
+			/** Endpoint address of the telemetry CDC device-to-host data IN endpoint. */
+			#define CDC_TX_EPADDR              (ENDPOINT_DIR_IN  | 1)
+
+			/** Endpoint address of the telemetry CDC host-to-device data OUT endpoint. */
+			#define CDC_RX_EPADDR              (ENDPOINT_DIR_OUT | 2)
+
+			/** Size in bytes of the telemetry CDC device-to-host notification IN endpoint. */
+			#define CDC_NOTIFICATION_EPSIZE    8
+
+			/** Size in bytes of the telemetry CDC data IN and OUT endpoints, a telemetry record fits into one packet. */
+			#define CDC_TXRX_EPSIZE            64
+		#endif
+
 	/* Type Defines: */
 		/** Type define for the device configuration descriptor structure. This must be defined in the
 		 *  application code, as the configuration descriptor contains several sub-descriptors which
@@ -66,6 +83,21 @@
 			USB_Descriptor_Interface_t            MS_Interface;
 			USB_Descriptor_Endpoint_t             MS_DataInEndpoint;
 			USB_Descriptor_Endpoint_t             MS_DataOutEndpoint;
+
+			#if defined(ENABLE_TELEMETRY)
+			// CDC Command Interface of the telemetry port
+			USB_Descriptor_Interface_Association_t CDC_IAD;
+			USB_Descriptor_Interface_t            CDC_CCI_Interface;
+			USB_CDC_Descriptor_FunctionalHeader_t CDC_Functional_Header;
+			USB_CDC_Descriptor_FunctionalACM_t    CDC_Functional_ACM;
+			USB_CDC_Descriptor_FunctionalUnion_t  CDC_Functional_Union;
+			USB_Descriptor_Endpoint_t             CDC_NotificationEndpoint;
+
+			// CDC Data Interface of the telemetry port
+			USB_Descriptor_Interface_t            CDC_DCI_Interface;
+			USB_Descriptor_Endpoint_t             CDC_DataOutEndpoint;
+			USB_Descriptor_Endpoint_t             CDC_DataInEndpoint;
+			#endif
 		} USB_Descriptor_Configuration_t;
 
 		/** Enum for the device interface descriptor IDs within the device. Each interface descriptor
@@ -75,6 +107,11 @@
 		enum InterfaceDescriptors_t
 		{
 			INTERFACE_ID_MassStorage = 0, /**< Mass storage interface descriptor ID */
+			#if defined(ENABLE_TELEMETRY)
+			INTERFACE_ID_CDC_CCI     = 1, /**< Telemetry CDC CCI interface descriptor ID */
+			INTERFACE_ID_CDC_DCI     = 2, /**< Telemetry CDC DCI interface descriptor ID */
+			#endif
+			INTERFACE_ID_Count,           /**< Number of interfaces of the configuration */
 		};
 
 		/** Enum for the device string descriptor IDs within the device. Each string descriptor should
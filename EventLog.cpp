@@ -0,0 +1,106 @@
+#include "EventLog.h"
+
+#if defined(ENABLE_EVENT_LOG)
+
+#include "Arduino.h"
+#include "BufferArena.h"
+
+#include <avr/io.h>
+
+// Binary event log. EventLog_Add() only copies a record into a RAM ring, EventLog_Task() moves
+// whole records into the transmit buffer of Serial1 as long as it has room, which is sent by the
+// UART interrupt. Neither blocks, so logging doesn't change the timing of the data path. If the
+// ring is full new events are dropped and counted in an EVENT_LOG_DROPPED record. The records are
+// decoded by host/EventDecoder.cpp.
+
+static_assert(sizeof(EventLog_Record_t) == 16, "Event record layout changed");
+static_assert((EVENT_LOG_ENTRIES & (EVENT_LOG_ENTRIES - 1)) == 0, "Event log size must be a power of two");
+static_assert(EVENT_LOG_ENTRIES <= 128, "Event log size too large");
+
+static EventLog_Record_t s_records[EVENT_LOG_ENTRIES];
+static uint8_t s_first_record;
+static uint8_t s_record_count;
+
+// sequence number of the next event, dropped events included
+static uint16_t s_sequence;
+static uint16_t s_dropped;
+static uint32_t s_total_dropped;
+
+static bool EventLog_Push(const uint8_t Event, const uint8_t Code, const uint16_t Count, const uint32_t Argument)
+{
+  if (s_record_count == EVENT_LOG_ENTRIES)
+    return false;
+
+  EventLog_Record_t *record = &s_records[(s_first_record + s_record_count) & (EVENT_LOG_ENTRIES - 1)];
+  record->Event = Event;
+  record->Code = Code;
+  record->Sequence = s_sequence++;
+  record->Count = Count;
+  record->Timestamp = micros();
+  record->Argument = Argument;
+  ++s_record_count;
+  return true;
+}
+
+void EventLog_Init(void)
+{
+  Serial1.begin(EVENT_LOG_BAUD);
+  EventLog_Push(EVENT_LOG_BOOT, MCUSR, BufferArena_StackRoom(), EVENT_LOG_ENTRIES);
+}
+
+static void EventLog_Drop(void)
+{
+  ++s_sequence;
+  if (s_dropped < 0xFFFF)
+    ++s_dropped;
+  ++s_total_dropped;
+}
+
+// The drop count is reported once the ring has drained to half, so that a burst of events doesn't
+// alternate with drop reports. The dropped events keep their sequence numbers, the decoder sees
+// the gaps where they happened.
+static void EventLog_ReportDrops(void)
+{
+  if (s_dropped && s_record_count <= EVENT_LOG_ENTRIES / 2 &&
+      EventLog_Push(EVENT_LOG_DROPPED, 0, s_dropped, s_total_dropped))
+    s_dropped = 0;
+}
+
+/** Adds an event to the log, must not be called from interrupts.
+ *
+ *  \param[in] Event     Event of \ref EventLog_Event_t
+ *  \param[in] Code      Event specific
+ *  \param[in] Count     Event specific
+ *  \param[in] Argument  Event specific
+ */
+void EventLog_Add(const uint8_t Event, const uint8_t Code, const uint16_t Count, const uint32_t Argument)
+{
+  if (!EventLog_Push(Event, Code, Count, Argument))
+    EventLog_Drop();
+}
+
+/** Sends buffered records, a task of the background scheduler. Returns \c false, the records that
+ *  don't fit into the transmit buffer have to wait for the next pass anyway.
+ */
+bool EventLog_Task(void)
+{
+  while (s_record_count && Serial1.availableForWrite() >= (int)sizeof(EventLog_Record_t)) {
+    EventLog_Record_t *record = &s_records[s_first_record];
+    uint8_t *bytes = (uint8_t *)record;
+    uint8_t sum = 0;
+
+    record->Sync = EVENT_LOG_SYNC;
+    record->Checksum = 0;
+    for (uint8_t i = 0; i < sizeof(EventLog_Record_t); ++i)
+      sum += bytes[i];
+    record->Checksum = -sum;
+
+    Serial1.write(bytes, sizeof(EventLog_Record_t));
+    s_first_record = (s_first_record + 1) & (EVENT_LOG_ENTRIES - 1);
+    --s_record_count;
+  }
+  EventLog_ReportDrops();
+  return false;
+}
+
+#endif
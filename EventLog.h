@@ -0,0 +1,99 @@
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+// The record layout is also used by the host side decoder in host/EventDecoder.cpp, so this
+// header must not depend on LUFA, Arduino or AVR headers.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "LUFAConfig.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/** First byte of every record on the serial line, the decoder resynchronizes on it. */
+#define EVENT_LOG_SYNC     0xE5
+
+#if !defined(EVENT_LOG_ENTRIES)
+/** Number of records buffered in RAM until they are sent, must be a power of two no larger than 128. */
+#define EVENT_LOG_ENTRIES  8
+#endif
+
+#if !defined(EVENT_LOG_BAUD)
+/** Baud rate of Serial1 while the event log is enabled. */
+#define EVENT_LOG_BAUD     115200
+#endif
+
+/** Enum for the events of the log, the meaning of the Code, Count and Argument fields is given per event. */
+enum EventLog_Event_t
+{
+  EVENT_LOG_BOOT = 0,       /**< Code: MCUSR reset flags, Count: bytes of SRAM left for the stack, Argument: EVENT_LOG_ENTRIES */
+  EVENT_LOG_DROPPED,        /**< Count: records dropped since the last one, Argument: records dropped since boot */
+  EVENT_LOG_CARD_ERROR,     /**< Code: \ref EventLog_CardError_t, Count: last R1 or data response of the card */
+  EVENT_LOG_CARD_READY,     /**< Code: 1 if the card matched the profile in EEPROM, Count: milliseconds since the card was found, Argument: number of blocks of the card */
+  EVENT_LOG_CARD_REMOVED,
+  EVENT_LOG_CARD_REINIT,    /**< A transfer failed after all retries, the card is re-initialized */
+  EVENT_LOG_READ,           /**< Count: blocks, Argument: first block */
+  EVENT_LOG_WRITE,          /**< Count: blocks, Argument: first block */
+  EVENT_LOG_VERIFY,         /**< Count: blocks, Argument: first block */
+  EVENT_LOG_SELFTEST,       /**< Code: test, Count: \ref SDCardSelfTest_Status_t, Argument: total time in microseconds */
+  EVENT_LOG_EVENT_COUNT,
+};
+
+/** Enum for the errors of the card driver in \ref EVENT_LOG_CARD_ERROR records. */
+enum EventLog_CardError_t
+{
+  SD_CARD_ERROR_CMD0 = 1,           /**< Timeout of GO_IDLE_STATE */
+  SD_CARD_ERROR_CMD8,               /**< SEND_IF_COND failed */
+  SD_CARD_ERROR_ACMD41,             /**< Timeout of SD_SEND_OP_COND */
+  SD_CARD_ERROR_CMD58,              /**< READ_OCR failed */
+  SD_CARD_ERROR_CMD12,              /**< STOP_TRANSMISSION failed */
+  SD_CARD_ERROR_CMD17,              /**< READ_SINGLE_BLOCK failed */
+  SD_CARD_ERROR_CMD18,              /**< READ_MULTIPLE_BLOCK failed */
+  SD_CARD_ERROR_CMD24,              /**< WRITE_BLOCK failed */
+  SD_CARD_ERROR_CMD25,              /**< WRITE_MULTIPLE_BLOCK failed */
+  SD_CARD_ERROR_ACMD23,             /**< SET_WR_BLK_ERASE_COUNT failed */
+  SD_CARD_ERROR_READ_REG,           /**< Reading the CID or CSD failed */
+  SD_CARD_ERROR_READ,               /**< Bad data start token */
+  SD_CARD_ERROR_READ_TIMEOUT,       /**< Timeout waiting for the data start token */
+  SD_CARD_ERROR_CRC,                /**< CRC16 mismatch of a data block */
+  SD_CARD_ERROR_WRITE,              /**< Data response token rejected a block */
+  SD_CARD_ERROR_WRITE_TIMEOUT,      /**< Timeout waiting for the card to finish programming */
+  SD_CARD_ERROR_WRITE_PROGRAMMING,  /**< SEND_STATUS reported a programming error */
+  SD_CARD_ERROR_STOP_TRAN,          /**< Timeout before the stop token of a multi-block write */
+  SD_CARD_ERROR_BUSY_TIMEOUT,       /**< Timeout waiting for the card to become ready */
+  SD_CARD_ERROR_ERASE,              /**< ERASE failed or timed out */
+  SD_CARD_ERROR_COUNT,
+};
+
+/** Type define for a record of the event log as it is sent on the serial line. All values are little-endian. */
+typedef struct
+{
+  uint8_t  Sync;       /**< Always \ref EVENT_LOG_SYNC */
+  uint8_t  Checksum;   /**< Makes the sum of all bytes of the record zero */
+  uint8_t  Event;      /**< \ref EventLog_Event_t */
+  uint8_t  Code;       /**< Event specific */
+  uint16_t Sequence;   /**< Counts all events since boot including the dropped ones */
+  uint16_t Count;      /**< Event specific */
+  uint32_t Timestamp;  /**< Value of micros() when the event was added */
+  uint32_t Argument;   /**< Event specific */
+} EventLog_Record_t;
+
+#if defined(ENABLE_EVENT_LOG)
+void EventLog_Init(void);
+void EventLog_Add(const uint8_t Event, const uint8_t Code, const uint16_t Count, const uint32_t Argument);
+bool EventLog_Task(void);
+#else
+static inline void EventLog_Init(void) {}
+static inline void EventLog_Add(const uint8_t Event, const uint8_t Code, const uint16_t Count,
+                                const uint32_t Argument) {}
+static inline bool EventLog_Task(void) { return false; }
+#endif
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // EVENTLOG_H
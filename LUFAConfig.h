@@ -52,7 +52,61 @@
 
 // Config for SD Card Driver
 #define OPTIMIZE_SDCARD_HARDWARE_SPI
-//#define SDCARD_DRIVER_DEBUG
+// Binary event log of card errors, transfers and medium changes, sent on Serial1 from loop() and decoded by host/EventDecoder
+#define ENABLE_EVENT_LOG
+
+// Per command latency histograms, readable with LOG SENSE page 0x30
+#define ENABLE_COMMAND_STATS
+// SPI phase timing of the card driver, readable with LOG SENSE page 0x31
+//#define SDCARD_DRIVER_PROFILE
+// SCSI command trace ring buffer, readable with the vendor command 0xC0
+#define ENABLE_COMMAND_TRACE
+// Spill the command trace to blocks reserved at the end of the card, the card must be reformatted
+//#define COMMAND_TRACE_SPILL_BLOCKS 64
+// Scratch blocks reserved at the end of the card for the write tests of SEND DIAGNOSTIC, the card must be reformatted
+//#define SDCARD_SELFTEST_BLOCKS 64
+// Sectors of the cache of FAT32/exFAT metadata, 512 bytes of SRAM each, disable ENABLE_COMMAND_TRACE to make room
+//#define SDCARD_METADATA_CACHE_SECTORS 2
+// Log at the end of the card that small random writes are appended to, 4 bytes of SRAM per block, the card must be reformatted
+//#define SDCARD_WRITE_LOG_BLOCKS 64
+// Runs of zero blocks are erased instead of written and reads of them answered with zeros, 8 bytes of SRAM per range
+//#define SDCARD_ZERO_MAP_RANGES 8
+// Logical block size reported to the host, 512 or 4096, the card must be reformatted with the same sector size
+//#define SDCARD_LOGICAL_BLOCK_SIZE 4096
+// Type, capacity and erase state of the last card in EEPROM, the same card is ready after a reset or re-insert without reading the OCR, CSD and SCR
+//#define SDCARD_EEPROM_PROFILE 1
+// Null backend without a card for measuring the USB path, reads return a pattern and writes are discarded
+//#define SDCARD_NULL_BACKEND
+// CDC-ACM telemetry port next to the mass storage interface, decoded by host/TelemetryDecoder
+//#define ENABLE_TELEMETRY
+// Phase markers written to GPIOR0 for the cycle counts of host/AvrBench.cpp under simavr
+//#define SIMAVR_MARKERS
+// Memory profile that sizes the buffer arena and the RAM rings instead of the options above, see BufferArena.h
+//#define MEMORY_PROFILE MEMORY_PROFILE_CACHE_HEAVY
+
+// min-RAM: only the block buffer, without command statistics and trace and with a short event log
+#define MEMORY_PROFILE_MIN_RAM     1
+// throughput: one metadata cache sector for the FAT sector of file copies, without the command trace
+#define MEMORY_PROFILE_THROUGHPUT  2
+// cache-heavy: two metadata cache sectors, without command statistics and trace and with a short event log
+#define MEMORY_PROFILE_CACHE_HEAVY 3
+
+#if defined(MEMORY_PROFILE)
+#undef ENABLE_COMMAND_TRACE
+#if (MEMORY_PROFILE == MEMORY_PROFILE_MIN_RAM)
+#undef ENABLE_COMMAND_STATS
+#define SDCARD_METADATA_CACHE_SECTORS 0
+#define EVENT_LOG_ENTRIES 4
+#elif (MEMORY_PROFILE == MEMORY_PROFILE_THROUGHPUT)
+#define SDCARD_METADATA_CACHE_SECTORS 1
+#elif (MEMORY_PROFILE == MEMORY_PROFILE_CACHE_HEAVY)
+#undef ENABLE_COMMAND_STATS
+#define SDCARD_METADATA_CACHE_SECTORS 2
+#define EVENT_LOG_ENTRIES 4
+#else
+#error "Unknown MEMORY_PROFILE"
+#endif
+#endif
 
 /* Non-USB Related Configuration Tokens: */
 //		#define DISABLE_TERMINAL_CODES
@@ -67,7 +121,10 @@
 //		#define NO_CLASS_DRIVER_AUTOFLUSH
 
 /* General USB Driver Related Tokens: */
+// the telemetry endpoints are configured after the higher numbered mass storage endpoints
+#if !defined(ENABLE_TELEMETRY)
 #define ORDERED_EP_CONFIG
+#endif
 #define USE_STATIC_OPTIONS               (USB_DEVICE_OPT_FULLSPEED | USB_OPT_REG_ENABLED | USB_OPT_AUTO_PLL)
 #define USB_DEVICE_ONLY
 //		#define USB_HOST_ONLY
@@ -36,6 +36,12 @@
 
 #include "MassStorage.h"
 #include "SDCardManager.h"
+#include "CommandStats.h"
+#include "CommandTrace.h"
+#include "SimMarkers.h"
+#include "Telemetry.h"
+
+#include <Arduino.h>
 
 /** LUFA Mass Storage Class driver interface configuration and state information. This structure is
  *  passed to all Mass Storage Class driver functions, so that multiple instances of the same class
@@ -62,6 +68,38 @@ USB_ClassInfo_MS_Device_t Disk_MS_Interface =
 			},
 	};
 
+#if defined(ENABLE_TELEMETRY)
+/** LUFA CDC Class driver interface configuration and state information of the telemetry port, see Telemetry.cpp.
+ *  Only the control requests are handled by the class driver, the data endpoints are accessed directly so that
+ *  the telemetry never waits for the host.
+ */
+USB_ClassInfo_CDC_Device_t Telemetry_CDC_Interface =
+	{
+		.Config =
+			{
+				.ControlInterfaceNumber    = INTERFACE_ID_CDC_CCI,
+				.DataINEndpoint            =
+					{
+						.Address           = CDC_TX_EPADDR,
+						.Size              = CDC_TXRX_EPSIZE,
+						.Banks             = 1,
+					},
+				.DataOUTEndpoint           =
+					{
+						.Address           = CDC_RX_EPADDR,
+						.Size              = CDC_TXRX_EPSIZE,
+						.Banks             = 1,
+					},
+				.NotificationEndpoint      =
+					{
+						.Address           = CDC_NOTIFICATION_EPADDR,
+						.Size              = CDC_NOTIFICATION_EPSIZE,
+						.Banks             = 1,
+					},
+			},
+	};
+#endif
+
 /** Configures the board hardware and chip peripherals for the demo's functionality. */
 void SetupHardware(void)
 {
@@ -97,12 +135,18 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 	bool ConfigSuccess = true;
 
 	ConfigSuccess &= MS_Device_ConfigureEndpoints(&Disk_MS_Interface);
+	#if defined(ENABLE_TELEMETRY)
+	ConfigSuccess &= CDC_Device_ConfigureEndpoints(&Telemetry_CDC_Interface);
+	#endif
 }
 
 /** Event handler for the library USB Control Request reception event. */
 void EVENT_USB_Device_ControlRequest(void)
 {
 	MS_Device_ProcessControlRequest(&Disk_MS_Interface);
+	#if defined(ENABLE_TELEMETRY)
+	CDC_Device_ProcessControlRequest(&Telemetry_CDC_Interface);
+	#endif
 }
 
 /** Mass Storage class driver callback function the reception of SCSI commands from the host, which must be processed.
@@ -111,9 +155,20 @@ void EVENT_USB_Device_ControlRequest(void)
  */
 bool CALLBACK_MS_Device_SCSICommandReceived(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
 {
-	bool CommandSuccess;
+	const uint8_t* CommandData = MSInterfaceInfo->State.CommandBlock.SCSICommandData;
+	uint32_t       StartTime   = micros();
+	bool           CommandSuccess;
+	uint32_t       Duration;
 
+	SimMarker(SIM_MARKER_COMMAND_BEGIN);
 	CommandSuccess = SCSI_DecodeSCSICommand(MSInterfaceInfo);
+	SimMarker(SIM_MARKER_COMMAND_END);
+	Duration       = (micros() - StartTime);
+
+	CommandStats_Record(CommandData, Duration, CommandSuccess);
+	Telemetry_RecordCommand(CommandData, Duration, CommandSuccess);
+	CommandTrace_Record(CommandData, StartTime, Duration,
+	                    (CommandSuccess ? 0 : (COMMAND_TRACE_STATUS_FAILED | SCSI_GetSenseKey())));
 
 	return CommandSuccess;
 }
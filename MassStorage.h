@@ -52,6 +52,11 @@ extern "C" {
 #include <LUFA/LUFA/Drivers/USB/USB.h>
 #include <LUFA/LUFA/Platform/Platform.h>
 
+/* External Variables: */
+#if defined(ENABLE_TELEMETRY)
+extern USB_ClassInfo_CDC_Device_t Telemetry_CDC_Interface;
+#endif
+
 /* Function Prototypes: */
 void SetupHardware(void);
 void ProcessHardware(void);
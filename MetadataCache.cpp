@@ -0,0 +1,288 @@
+#include "MetadataCache.h"
+
+#if SDCARD_METADATA_CACHE_SECTORS > 0
+
+#include <string.h>
+
+#include "BufferArena.h"
+#include "Telemetry.h"
+
+// Cache of the filesystem metadata of the card. The partition table and the boot sector of the
+// first partition are parsed when a card becomes ready, the blocks of the boot region, the FATs,
+// the first cluster of the root directory and of the exFAT allocation bitmap are the only ones
+// that are cached. Bulk file data never enters the cache, so a large copy can't evict the FAT
+// sectors the host reads before and after every file. The cache is write-through, the card always
+// holds the same data.
+
+struct MetadataCache_Range
+{
+  uint32_t first;
+  uint32_t count;
+};
+
+struct MetadataCache_Entry
+{
+  uint32_t block;
+  uint16_t last_use;   // zero for an empty entry
+};
+
+static MetadataCache_Entry s_entries[SDCARD_METADATA_CACHE_SECTORS];
+static uint16_t s_clock;
+
+static MetadataCache_Range s_ranges[METADATA_CACHE_RANGES];
+static uint8_t s_range_count;
+
+// blocks that define the layout, writes to them make the cache rescan it
+static uint32_t s_boot_block;
+static bool s_gpt;
+static bool s_needs_scan;
+
+static uint16_t MetadataCache_Get16(const uint8_t *data)
+{
+  return data[0] | (uint16_t)data[1] << 8;
+}
+
+static uint32_t MetadataCache_Get32(const uint8_t *data)
+{
+  return data[0] | (uint16_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static inline bool MetadataCache_IsLayout(uint32_t block)
+{
+  return block == 0 || block == s_boot_block || (s_gpt && block == 1);
+}
+
+static void MetadataCache_Clear(void)
+{
+  for (uint8_t i = 0; i < SDCARD_METADATA_CACHE_SECTORS; ++i)
+    s_entries[i].last_use = 0;
+  s_clock = 0;
+}
+
+static void MetadataCache_AddRange(uint32_t first, uint32_t count)
+{
+  if (count && s_range_count < METADATA_CACHE_RANGES) {
+    s_ranges[s_range_count].first = first;
+    s_ranges[s_range_count].count = count;
+    ++s_range_count;
+  }
+}
+
+static bool MetadataCache_IsMetadata(uint32_t block)
+{
+  for (uint8_t i = 0; i < s_range_count; ++i) {
+    if (block - s_ranges[i].first < s_ranges[i].count)
+      return true;
+  }
+  return false;
+}
+
+static void MetadataCache_Use(MetadataCache_Entry *entry)
+{
+  // start over with a fresh order instead of wrapping around
+  if (++s_clock == 0) {
+    for (uint8_t i = 0; i < SDCARD_METADATA_CACHE_SECTORS; ++i) {
+      if (s_entries[i].last_use)
+        s_entries[i].last_use = 1;
+    }
+    s_clock = 2;
+  }
+  entry->last_use = s_clock;
+}
+
+// the data of an entry is in the slot of the arena with the same index
+static uint8_t *MetadataCache_Data(const MetadataCache_Entry *entry)
+{
+  return BufferArena_Lease(BUFFER_ARENA_METADATA + (entry - s_entries));
+}
+
+static MetadataCache_Entry *MetadataCache_Find(uint32_t block)
+{
+  for (uint8_t i = 0; i < SDCARD_METADATA_CACHE_SECTORS; ++i) {
+    if (s_entries[i].last_use && s_entries[i].block == block)
+      return &s_entries[i];
+  }
+  return 0;
+}
+
+static bool MetadataCache_IsBootSector(const uint8_t *data)
+{
+  return !memcmp(&data[82], "FAT32   ", 8) || !memcmp(&data[3], "EXFAT   ", 8);
+}
+
+// FAT32: the reserved sectors with the boot sector and FSInfo, the FATs and the root directory
+static void MetadataCache_ScanFat32(const uint8_t *boot)
+{
+  uint32_t sectors_per_cluster = boot[13];
+  uint32_t reserved = MetadataCache_Get16(&boot[14]);
+  uint32_t fat_sectors = boot[16] * MetadataCache_Get32(&boot[36]);
+  uint32_t root_cluster = MetadataCache_Get32(&boot[44]);
+  uint32_t data = s_boot_block + reserved + fat_sectors;
+
+  if (MetadataCache_Get16(&boot[11]) != 512 || !sectors_per_cluster || root_cluster < 2)
+    return;
+  MetadataCache_AddRange(s_boot_block, reserved);
+  MetadataCache_AddRange(s_boot_block + reserved, fat_sectors);
+  MetadataCache_AddRange(data + (root_cluster - 2) * sectors_per_cluster, sectors_per_cluster);
+}
+
+// exFAT: the main and backup boot regions, the FATs, the root directory and the allocation
+// bitmap, which is found through its entry in the root directory
+static void MetadataCache_ScanExFat(bool (*Read)(uint32_t Block, uint8_t *Buffer), uint8_t *buffer)
+{
+  uint32_t fat_offset = MetadataCache_Get32(&buffer[80]);
+  uint32_t fat_sectors = buffer[110] * MetadataCache_Get32(&buffer[84]);
+  uint32_t heap = s_boot_block + MetadataCache_Get32(&buffer[88]);
+  uint32_t root_cluster = MetadataCache_Get32(&buffer[96]);
+  uint8_t cluster_shift = buffer[109];
+
+  if (buffer[108] != 9 || cluster_shift > 16 || root_cluster < 2)
+    return;
+  uint32_t root = heap + ((root_cluster - 2) << cluster_shift);
+  MetadataCache_AddRange(s_boot_block, 24);
+  MetadataCache_AddRange(s_boot_block + fat_offset, fat_sectors);
+  MetadataCache_AddRange(root, (uint32_t)1 << cluster_shift);
+
+  if (!Read(root, buffer))
+    return;
+  for (uint16_t offset = 0; offset < 512; offset += 32) {
+    if (buffer[offset] == 0x81) {
+      uint32_t cluster = MetadataCache_Get32(&buffer[offset + 20]);
+      uint32_t length = MetadataCache_Get32(&buffer[offset + 24]);
+      if (cluster >= 2)
+        MetadataCache_AddRange(heap + ((cluster - 2) << cluster_shift), (length + 511) / 512);
+      break;
+    }
+  }
+}
+
+/** Empties the cache and forgets the layout, which is scanned again before the next transfer. Must
+ *  be called when a card becomes ready or is removed.
+ */
+void MetadataCache_Reset(void)
+{
+  MetadataCache_Clear();
+  s_range_count = 0;
+  s_needs_scan = true;
+}
+
+/** Returns \c true if the layout of the card has to be scanned with \ref MetadataCache_Scan(). */
+bool MetadataCache_NeedsScan(void)
+{
+  return s_needs_scan;
+}
+
+/** Finds the metadata of the filesystem on the card, a FAT32 or exFAT volume either without a
+ *  partition table or in the first partition of an MBR or GPT. Nothing is cached for other layouts.
+ *
+ *  \param[in] Read    Function that reads a block of the card
+ *  \param[in] Buffer  512 byte buffer for the blocks that are parsed
+ */
+void MetadataCache_Scan(bool (*Read)(uint32_t Block, uint8_t *Buffer), uint8_t *Buffer)
+{
+  MetadataCache_Reset();
+  s_needs_scan = false;
+  s_boot_block = 0;
+  s_gpt = false;
+
+  if (!Read(0, Buffer) || MetadataCache_Get16(&Buffer[510]) != 0xAA55)
+    return;
+
+  if (!MetadataCache_IsBootSector(Buffer)) {
+    // first partition of the MBR, or of the GPT behind a protective MBR
+    if (Buffer[446 + 4] == 0xEE) {
+      s_gpt = true;
+      if (!Read(1, Buffer) || memcmp(Buffer, "EFI PART", 8))
+        return;
+      uint32_t entries = MetadataCache_Get32(&Buffer[72]);
+      if (!Read(entries, Buffer))
+        return;
+      s_boot_block = MetadataCache_Get32(&Buffer[32]);
+    } else {
+      s_boot_block = MetadataCache_Get32(&Buffer[446 + 8]);
+    }
+    if (!s_boot_block || !Read(s_boot_block, Buffer) || !MetadataCache_IsBootSector(Buffer))
+      return;
+  }
+
+  if (Buffer[3] == 'E')
+    MetadataCache_ScanExFat(Read, Buffer);
+  else
+    MetadataCache_ScanFat32(Buffer);
+}
+
+/** Looks up a block in the cache.
+ *
+ *  \param[in] Block  Block number on the card
+ *
+ *  \return Pointer to the 512 bytes of the block, or a null pointer if it isn't cached
+ */
+const uint8_t *MetadataCache_Lookup(uint32_t Block)
+{
+  MetadataCache_Entry *entry = MetadataCache_Find(Block);
+  if (!entry)
+    return 0;
+  MetadataCache_Use(entry);
+  Telemetry_Add(TELEMETRY_CACHE_HITS, 1);
+  return MetadataCache_Data(entry);
+}
+
+/** Adds a block that was read from the card, if it is metadata. The least recently used metadata
+ *  block is replaced.
+ *
+ *  \param[in] Block  Block number on the card
+ *  \param[in] Data   512 bytes of the block
+ */
+void MetadataCache_Fill(uint32_t Block, const uint8_t *Data)
+{
+  if (!MetadataCache_IsMetadata(Block))
+    return;
+  Telemetry_Add(TELEMETRY_CACHE_MISSES, 1);
+
+  MetadataCache_Entry *entry = &s_entries[0];
+  for (uint8_t i = 1; i < SDCARD_METADATA_CACHE_SECTORS; ++i) {
+    if (s_entries[i].last_use < entry->last_use)
+      entry = &s_entries[i];
+  }
+  entry->block = Block;
+  memcpy(MetadataCache_Data(entry), Data, BUFFER_ARENA_SLOT_SIZE);
+  MetadataCache_Use(entry);
+}
+
+/** Updates a cached block with the data written to the card. Blocks that aren't cached yet are not
+ *  added, the host rarely reads back what it wrote, e.g. the second FAT. A write to the partition
+ *  table or the boot sector makes the layout be scanned again.
+ *
+ *  \param[in] Block  Block number on the card
+ *  \param[in] Data   512 bytes written to the block
+ */
+void MetadataCache_Update(uint32_t Block, const uint8_t *Data)
+{
+  if (MetadataCache_IsLayout(Block)) {
+    MetadataCache_Reset();
+    return;
+  }
+
+  MetadataCache_Entry *entry = MetadataCache_Find(Block);
+  if (entry)
+    memcpy(MetadataCache_Data(entry), Data, BUFFER_ARENA_SLOT_SIZE);
+}
+
+/** Removes a block whose data changed without passing through the cache, a failed write that may
+ *  have left the old or the new data or an erase. The layout is scanned again like after a write.
+ *
+ *  \param[in] Block  Block number on the card
+ */
+void MetadataCache_Invalidate(uint32_t Block)
+{
+  if (MetadataCache_IsLayout(Block)) {
+    MetadataCache_Reset();
+    return;
+  }
+
+  MetadataCache_Entry *entry = MetadataCache_Find(Block);
+  if (entry)
+    entry->last_use = 0;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef METADATACACHE_H
+#define METADATACACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "LUFAConfig.h"
+
+#if !defined(SDCARD_METADATA_CACHE_SECTORS)
+/** Number of 512 byte sectors of the filesystem metadata cache, zero to disable the cache. */
+#define SDCARD_METADATA_CACHE_SECTORS 0
+#endif
+
+/** Maximum number of block ranges that are cached: the boot region, the FATs, the first cluster
+ *  of the root directory and the exFAT allocation bitmap.
+ */
+#define METADATA_CACHE_RANGES         4
+
+#if SDCARD_METADATA_CACHE_SECTORS > 0
+void MetadataCache_Reset(void);
+
+bool MetadataCache_NeedsScan(void);
+
+void MetadataCache_Scan(bool (*Read)(uint32_t Block, uint8_t *Buffer), uint8_t *Buffer);
+
+const uint8_t *MetadataCache_Lookup(uint32_t Block);
+
+void MetadataCache_Fill(uint32_t Block, const uint8_t *Data);
+
+void MetadataCache_Update(uint32_t Block, const uint8_t *Data);
+
+void MetadataCache_Invalidate(uint32_t Block);
+#else
+static inline void MetadataCache_Reset(void) {}
+static inline bool MetadataCache_NeedsScan(void) { return false; }
+static inline void MetadataCache_Scan(bool (*)(uint32_t, uint8_t *), uint8_t *) {}
+static inline const uint8_t *MetadataCache_Lookup(uint32_t) { return 0; }
+static inline void MetadataCache_Fill(uint32_t, const uint8_t *) {}
+static inline void MetadataCache_Update(uint32_t, const uint8_t *) {}
+static inline void MetadataCache_Invalidate(uint32_t) {}
+#endif
+
+#endif // METADATACACHE_H
@@ -0,0 +1,34 @@
+#include "RamBlockDevice.h"
+
+RamBlockDevice::RamBlockDevice(uint8_t *data, uint32_t blocks)
+  : m_data(data)
+  , m_blocks(blocks)
+{}
+
+uint32_t RamBlockDevice::numBlocks()
+{
+  return m_blocks;
+}
+
+// one block per call of the sink or source, so that the count is exact if the host aborts
+uint16_t RamBlockDevice::readBlocks(uint32_t lba, uint16_t count, Sink sink)
+{
+  uint16_t blocks = 0;
+  while (blocks < count && lba + blocks < m_blocks) {
+    if (!sink(m_data + (lba + blocks) * 512, 512))
+      break;
+    ++blocks;
+  }
+  return blocks;
+}
+
+uint16_t RamBlockDevice::writeBlocks(uint32_t lba, uint16_t count, Source source)
+{
+  uint16_t blocks = 0;
+  while (blocks < count && lba + blocks < m_blocks) {
+    if (!source(m_data + (lba + blocks) * 512, 512))
+      break;
+    ++blocks;
+  }
+  return blocks;
+}
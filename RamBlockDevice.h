@@ -0,0 +1,22 @@
+#ifndef RAMBLOCKDEVICE_H
+#define RAMBLOCKDEVICE_H
+
+#include "BlockDevice.h"
+
+// Backend on a buffer in memory, the blocks go to and from the endpoints without a copy. The
+// AVR only has room for a few blocks, the host builds use it to measure the USB path against
+// the card, see host/Benchmark.cpp.
+class RamBlockDevice : public BlockDevice {
+public:
+  RamBlockDevice(uint8_t *data, uint32_t blocks);
+
+  uint32_t numBlocks() override;
+  uint16_t readBlocks(uint32_t lba, uint16_t count, Sink sink) override;
+  uint16_t writeBlocks(uint32_t lba, uint16_t count, Source source) override;
+
+private:
+  uint8_t *m_data;
+  uint32_t m_blocks;
+};
+
+#endif // RAMBLOCKDEVICE_H
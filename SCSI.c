@@ -80,6 +80,42 @@ static SCSI_Request_Sense_Response_t SenseData =
 	};
 
 
+#if defined(ENABLE_COMMAND_STATS) || defined(SDCARD_DRIVER_PROFILE)
+/** Defined if there is at least one vendor specific log page, the page table can not be empty. */
+#define SCSI_VENDOR_LOG_PAGES
+
+/** Table of the vendor specific log pages returned by the LOG SENSE command, see \ref SCSI_Log_Page_t. */
+static const SCSI_Log_Page_t LogPages[] =
+	{
+		#if defined(ENABLE_COMMAND_STATS)
+		{
+			.PageCode     = COMMAND_STATS_LOG_PAGE,
+			.PageLength   = COMMAND_STATS_PAGE_LENGTH,
+			.GetParameter = CommandStats_GetParameter,
+			.Reset        = CommandStats_Reset,
+		},
+		#endif
+		#if defined(SDCARD_DRIVER_PROFILE)
+		{
+			.PageCode     = SDCARD_PROFILE_LOG_PAGE,
+			.PageLength   = SDCARD_PROFILE_PAGE_LENGTH,
+			.GetParameter = SDCardManager_GetProfileParameter,
+			.Reset        = SDCardManager_ResetProfile,
+		},
+		#endif
+	};
+
+/** Number of entries in the \ref LogPages table. */
+#define SCSI_LOG_PAGE_COUNT  (sizeof(LogPages) / sizeof(LogPages[0]))
+#else
+#define SCSI_LOG_PAGE_COUNT  0
+#endif
+
+_Static_assert(COMMAND_STATS_PARAMETER_MAX_SIZE <= SCSI_LOG_PARAMETER_MAX_SIZE, "Log parameter too large");
+#if defined(SDCARD_DRIVER_PROFILE)
+_Static_assert(SDCARD_PROFILE_PARAMETER_SIZE <= SCSI_LOG_PARAMETER_MAX_SIZE, "Log parameter too large");
+#endif
+
 /** Main routine to process the SCSI command located in the Command Block Wrapper read from the host. This dispatches
  *  to the appropriate SCSI command handling routine if the issued command is supported by the device, else it returns
  *  a command failure due to a ILLEGAL REQUEST.
@@ -90,10 +126,22 @@ static SCSI_Request_Sense_Response_t SenseData =
  */
 bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
 {
-	bool CommandSuccess = false;
+	bool    CommandSuccess = false;
+	uint8_t Command        = MSInterfaceInfo->State.CommandBlock.SCSICommandData[0];
+
+	/* A changed medium is reported once to the host, for any command except INQUIRY and REQUEST SENSE */
+	if ((Command != SCSI_CMD_INQUIRY) && (Command != SCSI_CMD_REQUEST_SENSE) && SDCardManager_TakeMediumChanged())
+	{
+		/* Update the SENSE key to reflect the medium change */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_UNIT_ATTENTION,
+		               SCSI_ASENSE_NOT_READY_TO_READY_CHANGE,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
 
 	/* Run the appropriate SCSI command hander function based on the passed command */
-	switch (MSInterfaceInfo->State.CommandBlock.SCSICommandData[0])
+	switch (Command)
 	{
 		case SCSI_CMD_INQUIRY:
 			CommandSuccess = SCSI_Command_Inquiry(MSInterfaceInfo);
@@ -104,9 +152,15 @@ bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
 		case SCSI_CMD_READ_CAPACITY_10:
 			CommandSuccess = SCSI_Command_Read_Capacity_10(MSInterfaceInfo);
 			break;
+		case SCSI_CMD_SERVICE_ACTION_IN_16:
+			CommandSuccess = SCSI_Command_Read_Capacity_16(MSInterfaceInfo);
+			break;
 		case SCSI_CMD_SEND_DIAGNOSTIC:
 			CommandSuccess = SCSI_Command_Send_Diagnostic(MSInterfaceInfo);
 			break;
+		case SCSI_CMD_RECEIVE_DIAGNOSTIC_RESULTS:
+			CommandSuccess = SCSI_Command_Receive_Diagnostic_Results(MSInterfaceInfo);
+			break;
 		case SCSI_CMD_WRITE_10:
 			CommandSuccess = SCSI_Command_ReadWrite_10(MSInterfaceInfo, DATA_WRITE);
 			break;
@@ -116,10 +170,29 @@ bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
 		case SCSI_CMD_MODE_SENSE_6:
 			CommandSuccess = SCSI_Command_ModeSense_6(MSInterfaceInfo);
 			break;
-		case SCSI_CMD_START_STOP_UNIT:
+		case SCSI_CMD_VERIFY_10:
+			CommandSuccess = SCSI_Command_Verify_10(MSInterfaceInfo);
+			break;
+		case SCSI_CMD_LOG_SENSE:
+			CommandSuccess = SCSI_Command_Log_Sense(MSInterfaceInfo);
+			break;
+		#if defined(ENABLE_COMMAND_TRACE)
+		case SCSI_CMD_READ_COMMAND_TRACE:
+			CommandSuccess = SCSI_Command_Read_Command_Trace(MSInterfaceInfo);
+			break;
+		#endif
+		case SCSI_CMD_READ_CARD_REGISTERS:
+			CommandSuccess = SCSI_Command_Read_Card_Registers(MSInterfaceInfo);
+			break;
+		case SCSI_CMD_LOG_SELECT:
+			CommandSuccess = SCSI_Command_Log_Select(MSInterfaceInfo);
+			break;
 		case SCSI_CMD_TEST_UNIT_READY:
+			CommandSuccess = SCSI_Check_Medium_Ready();
+			MSInterfaceInfo->State.CommandBlock.DataTransferLength = 0;
+			break;
+		case SCSI_CMD_START_STOP_UNIT:
 		case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
-		case SCSI_CMD_VERIFY_10:
 			/* These commands should just succeed, no handling required */
 			CommandSuccess = true;
 			MSInterfaceInfo->State.CommandBlock.DataTransferLength = 0;
@@ -145,6 +218,12 @@ bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
 	return false;
 }
 
+/** Returns the sense key of the last processed SCSI command, \c SCSI_SENSE_KEY_GOOD if the command succeeded. */
+uint8_t SCSI_GetSenseKey(void)
+{
+	return SenseData.SenseKey;
+}
+
 /** Command processing for an issued SCSI INQUIRY command. This command returns information about the device's features
  *  and capabilities to the host.
  *
@@ -214,8 +293,12 @@ static bool SCSI_Command_Request_Sense(USB_ClassInfo_MS_Device_t* const MSInterf
  */
 static bool SCSI_Command_Read_Capacity_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
 {
-	uint32_t LastBlockAddressInLUN = (LUN_MEDIA_BLOCKS - 1);
-	uint32_t MediaBlockSize        = VIRTUAL_MEMORY_BLOCK_SIZE;
+	uint32_t LastBlockAddressInLUN = (LUN_LOGICAL_BLOCKS - 1);
+	uint32_t MediaBlockSize        = SDCARD_LOGICAL_BLOCK_SIZE;
+
+	/* The capacity is only known once a card has been initialized */
+	if (!(SCSI_Check_Medium_Ready()))
+		return false;
 
 	Endpoint_Write_Stream_BE(&LastBlockAddressInLUN, sizeof(LastBlockAddressInLUN), NULL);
 	Endpoint_Write_Stream_BE(&MediaBlockSize, sizeof(MediaBlockSize), NULL);
@@ -227,9 +310,58 @@ static bool SCSI_Command_Read_Capacity_10(USB_ClassInfo_MS_Device_t* const MSInt
 	return true;
 }
 
-/** Command processing for an issued SCSI SEND DIAGNOSTIC command. This command performs a quick check of the Dataflash ICs on the
- *  board, and indicates if they are present and functioning correctly. Only the Self-Test portion of the diagnostic command is
- *  supported.
+/** Command processing for an issued SCSI READ CAPACITY (16) command. Next to the capacity this command returns the
+ *  number of logical blocks per physical block, see \ref SDCARD_PHYSICAL_BLOCK_EXPONENT, which hosts use to align
+ *  their partitions and I/O. Other SERVICE ACTION IN (16) service actions are not supported.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Read_Capacity_16(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	uint32_t AllocationLength = SwapEndian_32(*(uint32_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[10]);
+	uint8_t  CapacityData[32] = { 0 };
+	uint16_t BytesTransferred = MIN(AllocationLength, sizeof(CapacityData));
+
+	/* Check to see if the service action is READ CAPACITY (16) */
+	if ((MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & 0x1F) != SCSI_SERVICE_ACTION_READ_CAPACITY_16)
+	{
+		/* Update the SENSE key to reflect the invalid command */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+		               SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	/* The capacity is only known once a card has been initialized */
+	if (!(SCSI_Check_Medium_Ready()))
+		return false;
+
+	/* 64-bit last logical block address and 32-bit block length, big-endian, the lowest aligned LBA is 0 */
+	uint32_t LastBlockAddressInLUN = (LUN_LOGICAL_BLOCKS - 1);
+	CapacityData[4]  = (LastBlockAddressInLUN >> 24);
+	CapacityData[5]  = (LastBlockAddressInLUN >> 16);
+	CapacityData[6]  = (LastBlockAddressInLUN >> 8);
+	CapacityData[7]  = (LastBlockAddressInLUN & 0xFF);
+	CapacityData[10] = (SDCARD_LOGICAL_BLOCK_SIZE >> 8);
+	CapacityData[13] = SDCARD_PHYSICAL_BLOCK_EXPONENT;
+
+	/* A shorter allocation length truncates the response, the rest is the residue */
+	Endpoint_Write_Stream_LE(CapacityData, BytesTransferred, NULL);
+	Endpoint_ClearIN();
+
+	/* Succeed the command and update the bytes transferred counter */
+	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= BytesTransferred;
+
+	return true;
+}
+
+/** Command processing for an issued SCSI SEND DIAGNOSTIC command. This command runs the self-test of the card, which
+ *  checks the SPI bus and times reads and writes of the card. The default self-test (SELF TEST bit) and the foreground
+ *  short self-test run a quick health check, the foreground extended self-test runs the full benchmark. The results
+ *  are returned by RECEIVE DIAGNOSTIC RESULTS, see \ref SDCARD_SELFTEST_RESULTS_PAGE.
  *
  *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
  *
@@ -237,10 +369,20 @@ static bool SCSI_Command_Read_Capacity_10(USB_ClassInfo_MS_Device_t* const MSInt
  */
 static bool SCSI_Command_Send_Diagnostic(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
 {
-	/* Check to see if the SELF TEST bit is not set */
-	if (!(MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & (1 << 2)))
+	bool     SelfTest            = (MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & (1 << 2));
+	uint8_t  SelfTestCode        = (MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] >> 5);
+	uint16_t ParameterListLength = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[3]);
+	bool     ValidSelfTest;
+
+	/* Check to see if the default self-test or a foreground self-test is requested, background self-tests are not supported */
+	if (SelfTest)
+	  ValidSelfTest = (SelfTestCode == 0);
+	else
+	  ValidSelfTest = ((SelfTestCode == SCSI_SELFTEST_FOREGROUND_SHORT) || (SelfTestCode == SCSI_SELFTEST_FOREGROUND_EXTENDED));
+
+	if (!(ValidSelfTest) || ParameterListLength)
 	{
-		/* Only self-test supported - update SENSE key and fail the command */
+		/* Only self-tests supported - update SENSE key and fail the command */
 		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
 		               SCSI_ASENSE_INVALID_FIELD_IN_CDB,
 		               SCSI_ASENSEQ_NO_QUALIFIER);
@@ -248,8 +390,11 @@ static bool SCSI_Command_Send_Diagnostic(USB_ClassInfo_MS_Device_t* const MSInte
 		return false;
 	}
 
-	/* Check to see if all attached Dataflash ICs are functional */
-	if (!(SDCardManager_CheckDataflashOperation()))
+	if (!(SCSI_Check_Medium_Ready()))
+	  return false;
+
+	/* Check to see if the card and the SPI bus are functional */
+	if (!(SDCardSelfTest_Run(SelfTestCode == SCSI_SELFTEST_FOREGROUND_EXTENDED)))
 	{
 		/* Update SENSE key with a hardware error condition and return command fail */
 		SCSI_SET_SENSE(SCSI_SENSE_KEY_HARDWARE_ERROR,
@@ -265,6 +410,68 @@ static bool SCSI_Command_Send_Diagnostic(USB_ClassInfo_MS_Device_t* const MSInte
 	return true;
 }
 
+/** Command processing for an issued SCSI RECEIVE DIAGNOSTIC RESULTS command. This command returns the list of supported
+ *  diagnostic pages or the results of the last self-test, which are also returned if no page code is given.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Receive_Diagnostic_Results(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	bool     PageCodeValid    = (MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & (1 << 0));
+	uint8_t  PageCode         = (PageCodeValid ? MSInterfaceInfo->State.CommandBlock.SCSICommandData[2] : SDCARD_SELFTEST_RESULTS_PAGE);
+	uint16_t AllocationLength = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[3]);
+	uint16_t BytesTransferred;
+	uint8_t  PageHeader[4];
+
+	PageHeader[0] = PageCode;
+	PageHeader[1] = 0x00;
+
+	if (PageCode == SCSI_DIAGNOSTIC_PAGE_SUPPORTED_PAGES)
+	{
+		const uint8_t SupportedPages[] = {SCSI_DIAGNOSTIC_PAGE_SUPPORTED_PAGES, SDCARD_SELFTEST_RESULTS_PAGE};
+
+		/* Page header followed by the list of supported page codes */
+		PageHeader[2] = 0x00;
+		PageHeader[3] = sizeof(SupportedPages);
+		BytesTransferred  = SCSI_Write_Response_Data(PageHeader, sizeof(PageHeader), AllocationLength);
+		BytesTransferred += SCSI_Write_Response_Data(SupportedPages, sizeof(SupportedPages), (AllocationLength - BytesTransferred));
+	}
+	else if (PageCode == SDCARD_SELFTEST_RESULTS_PAGE)
+	{
+		uint8_t Result[SDCARD_SELFTEST_RESULT_SIZE];
+
+		/* Page header followed by one result descriptor per test */
+		PageHeader[2] = (SDCARD_SELFTEST_PAGE_LENGTH >> 8);
+		PageHeader[3] = (SDCARD_SELFTEST_PAGE_LENGTH & 0xFF);
+		BytesTransferred = SCSI_Write_Response_Data(PageHeader, sizeof(PageHeader), AllocationLength);
+
+		for (uint8_t Index = 0; SDCardSelfTest_GetResult(Index, Result); Index++)
+		  BytesTransferred += SCSI_Write_Response_Data(Result, sizeof(Result), (AllocationLength - BytesTransferred));
+	}
+	else
+	{
+		/* Unsupported diagnostic page - update SENSE key and fail the command */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+		               SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	/* Pad out remaining bytes with 0x00 */
+	Endpoint_Null_Stream((AllocationLength - BytesTransferred), NULL);
+
+	/* Finalize the stream transfer to send the last packet */
+	Endpoint_ClearIN();
+
+	/* Succeed the command and update the bytes transferred counter */
+	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= AllocationLength;
+
+	return true;
+}
+
 /** Command processing for an issued SCSI READ (10) or WRITE (10) command. This command reads in the block start address
  *  and total number of blocks to process, then calls the appropriate low-level Dataflash routine to handle the actual
  *  reading and writing of the data.
@@ -279,6 +486,13 @@ static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfa
 {
 	uint32_t BlockAddress;
 	uint16_t TotalBlocks;
+	uint32_t CardBlockAddress;
+	uint32_t CardBlocks;
+	uint32_t CardBlocksTransferred = 0;
+
+	/* Check if a card is inserted and initialized */
+	if (!(SCSI_Check_Medium_Ready()))
+		return false;
 
 	/* Check if the disk is write protected or not */
 	if ((IsDataRead == DATA_WRITE) && DISK_READ_ONLY)
@@ -297,8 +511,8 @@ static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfa
 	/* Load in the 16-bit total blocks (SCSI uses big-endian, so have to reverse the byte order) */
 	TotalBlocks  = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[7]);
 
-	/* Check if the block address is outside the maximum allowable value for the LUN */
-	if (BlockAddress >= LUN_MEDIA_BLOCKS)
+	/* Check if the block range is outside the maximum allowable value for the LUN */
+	if ((BlockAddress >= LUN_LOGICAL_BLOCKS) || (TotalBlocks > (LUN_LOGICAL_BLOCKS - BlockAddress)))
 	{
 		/* Block address is invalid, update SENSE key and return command fail */
 		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
@@ -308,19 +522,61 @@ static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfa
 		return false;
 	}
 
+	/* Convert the logical blocks of the host to blocks of the card */
+	CardBlockAddress = (BlockAddress << SDCARD_LOGICAL_BLOCK_SHIFT);
+	CardBlocks       = ((uint32_t)TotalBlocks << SDCARD_LOGICAL_BLOCK_SHIFT);
+
 	#if (TOTAL_LUNS > 1)
 	/* Adjust the given block address to the real media address based on the selected LUN */
-	BlockAddress += ((uint32_t)MSInterfaceInfo->State.CommandBlock.LUN * LUN_MEDIA_BLOCKS);
+	CardBlockAddress += ((uint32_t)MSInterfaceInfo->State.CommandBlock.LUN * LUN_MEDIA_BLOCKS);
 	#endif
 
-	/* Determine if the packet is a READ (10) or WRITE (10) command, call appropriate function */
-	if (IsDataRead == DATA_READ)
-	  SDCardManager_ReadBlocks(MSInterfaceInfo, BlockAddress, TotalBlocks);
-	else
-	  SDCardManager_WriteBlocks(MSInterfaceInfo, BlockAddress, TotalBlocks);
+	/* Determine if the packet is a READ (10) or WRITE (10) command, call appropriate function. The card block count of
+	 * a transfer of 4 KiB logical blocks can exceed 16 bits, so it is passed on in parts */
+	while (CardBlocksTransferred < CardBlocks)
+	{
+		uint16_t PartBlocks = MIN(CardBlocks - CardBlocksTransferred, 0x8000);
+		uint16_t PartBlocksTransferred;
 
-	/* Update the bytes transferred counter and succeed the command */
-	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= ((uint32_t)TotalBlocks * VIRTUAL_MEMORY_BLOCK_SIZE);
+		if (IsDataRead == DATA_READ)
+		  PartBlocksTransferred = SDCardManager_ReadBlocks(MSInterfaceInfo, CardBlockAddress + CardBlocksTransferred, PartBlocks);
+		else
+		  PartBlocksTransferred = SDCardManager_WriteBlocks(MSInterfaceInfo, CardBlockAddress + CardBlocksTransferred, PartBlocks);
+
+		CardBlocksTransferred += PartBlocksTransferred;
+
+		if (PartBlocksTransferred != PartBlocks)
+		  break;
+	}
+
+	Telemetry_Add(((IsDataRead == DATA_READ) ? TELEMETRY_BLOCKS_READ : TELEMETRY_BLOCKS_WRITTEN), CardBlocksTransferred);
+
+	/* Update the bytes transferred counter with the blocks that were actually transferred, the rest is the residue */
+	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= (CardBlocksTransferred * VIRTUAL_MEMORY_BLOCK_SIZE);
+
+	/* Check if the transfer was aborted by an error the recovery could not handle */
+	if (CardBlocksTransferred != CardBlocks)
+	{
+		if (SDCardManager_GetMediumState() != SDCARD_MEDIUM_READY)
+		{
+			/* The card was removed or could not be re-initialized - update SENSE key and fail the command */
+			SCSI_SET_SENSE(SCSI_SENSE_KEY_NOT_READY,
+			               SCSI_ASENSE_MEDIUM_NOT_PRESENT,
+			               SCSI_ASENSEQ_NO_QUALIFIER);
+		}
+		else
+		{
+			/* Update SENSE key with a medium error for the first block that was not transferred */
+			SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+			               (IsDataRead == DATA_READ) ? SCSI_ASENSE_UNRECOVERED_READ_ERROR : SCSI_ASENSE_WRITE_ERROR,
+			               SCSI_ASENSEQ_NO_QUALIFIER);
+		}
+
+		/* Report the logical block that holds the first block of the card that was not transferred */
+		SCSI_SET_SENSE_INFORMATION(BlockAddress + (CardBlocksTransferred >> SDCARD_LOGICAL_BLOCK_SHIFT));
+
+		return false;
+	}
 
 	return true;
 }
@@ -346,3 +602,327 @@ static bool SCSI_Command_ModeSense_6(USB_ClassInfo_MS_Device_t* const MSInterfac
 
 	return true;
 }
+
+/** Command processing for an issued SCSI VERIFY (10) command. The blocks are read back on the device and the CRC16
+ *  of each block is checked, without transferring any data to the host. Only BYTCHK=0 (medium verification) is
+ *  supported. If a block fails the verification, its address is reported in the INFORMATION field of the sense data.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Verify_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	uint32_t BlockAddress;
+	uint16_t TotalBlocks;
+	uint32_t CardBlockAddress;
+	uint32_t CardBlocks;
+	uint32_t FailedBlockAddress;
+
+	/* Check if a card is inserted and initialized */
+	if (!(SCSI_Check_Medium_Ready()))
+		return false;
+
+	/* Check to see if the BYTCHK bit is set, comparing against host data is not supported */
+	if (MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & (1 << 1))
+	{
+		/* Byte compare not supported - update SENSE key and fail the command */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+		               SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	/* Load in the 32-bit block address (SCSI uses big-endian, so have to reverse the byte order) */
+	BlockAddress = SwapEndian_32(*(uint32_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[2]);
+
+	/* Load in the 16-bit total blocks (SCSI uses big-endian, so have to reverse the byte order) */
+	TotalBlocks  = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[7]);
+
+	/* Check if the block range is outside the maximum allowable value for the LUN */
+	if ((BlockAddress >= LUN_LOGICAL_BLOCKS) || (TotalBlocks > (LUN_LOGICAL_BLOCKS - BlockAddress)))
+	{
+		/* Block address is invalid, update SENSE key and return command fail */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+		               SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	/* Convert the logical blocks of the host to blocks of the card */
+	CardBlockAddress = (BlockAddress << SDCARD_LOGICAL_BLOCK_SHIFT);
+	CardBlocks       = ((uint32_t)TotalBlocks << SDCARD_LOGICAL_BLOCK_SHIFT);
+
+	#if (TOTAL_LUNS > 1)
+	/* Adjust the given block address to the real media address based on the selected LUN */
+	CardBlockAddress += ((uint32_t)MSInterfaceInfo->State.CommandBlock.LUN * LUN_MEDIA_BLOCKS);
+	#endif
+
+	/* No data phase, the verification is done on the device */
+	MSInterfaceInfo->State.CommandBlock.DataTransferLength = 0;
+
+	/* The card block count can exceed 16 bits with 4 KiB logical blocks, so the blocks are verified in parts */
+	for (uint32_t Offset = 0; Offset < CardBlocks; Offset += 0x8000)
+	{
+		if (SDCardManager_VerifyBlocks(CardBlockAddress + Offset, MIN(CardBlocks - Offset, 0x8000), &FailedBlockAddress))
+		  continue;
+
+		/* Report the logical block relative to the selected LUN */
+		FailedBlockAddress = BlockAddress + ((FailedBlockAddress - CardBlockAddress) >> SDCARD_LOGICAL_BLOCK_SHIFT);
+
+		/* Update SENSE key with a medium error and the address of the first failed block */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+		               SCSI_ASENSE_UNRECOVERED_READ_ERROR,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+		SCSI_SET_SENSE_INFORMATION(FailedBlockAddress);
+
+		return false;
+	}
+
+	return true;
+}
+
+/** Command processing for an issued SCSI LOG SENSE command. This command returns the list of supported log pages
+ *  and the vendor specific command latency statistics page.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Log_Sense(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	uint8_t  PageCode         = (MSInterfaceInfo->State.CommandBlock.SCSICommandData[2] & 0x3F);
+	uint16_t AllocationLength = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[7]);
+	uint16_t BytesTransferred;
+	uint8_t  PageHeader[4];
+
+	PageHeader[0] = PageCode;
+	PageHeader[1] = 0x00;
+
+	if (PageCode == SCSI_LOG_PAGE_SUPPORTED_PAGES)
+	{
+		/* Page header followed by the list of supported page codes */
+		PageHeader[2] = 0x00;
+		PageHeader[3] = (1 + SCSI_LOG_PAGE_COUNT);
+		BytesTransferred  = SCSI_Write_Response_Data(PageHeader, sizeof(PageHeader), AllocationLength);
+		BytesTransferred += SCSI_Write_Response_Data(&PageCode, 1, (AllocationLength - BytesTransferred));
+
+		#if defined(SCSI_VENDOR_LOG_PAGES)
+		for (uint8_t PageIndex = 0; PageIndex < SCSI_LOG_PAGE_COUNT; PageIndex++)
+		  BytesTransferred += SCSI_Write_Response_Data(&LogPages[PageIndex].PageCode, 1, (AllocationLength - BytesTransferred));
+		#endif
+	}
+	else
+	{
+		const SCSI_Log_Page_t* LogPage = NULL;
+
+		#if defined(SCSI_VENDOR_LOG_PAGES)
+		for (uint8_t PageIndex = 0; PageIndex < SCSI_LOG_PAGE_COUNT; PageIndex++)
+		{
+			if (LogPages[PageIndex].PageCode == PageCode)
+			  LogPage = &LogPages[PageIndex];
+		}
+		#endif
+
+		if (LogPage == NULL)
+		{
+			/* Unsupported log page - update SENSE key and fail the command */
+			SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+			               SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+			               SCSI_ASENSEQ_NO_QUALIFIER);
+
+			return false;
+		}
+
+		uint8_t ParameterData[SCSI_LOG_PARAMETER_MAX_SIZE];
+		uint8_t ParameterLength;
+
+		/* Page header with the length of all parameters */
+		PageHeader[2] = (LogPage->PageLength >> 8);
+		PageHeader[3] = (LogPage->PageLength & 0xFF);
+		BytesTransferred = SCSI_Write_Response_Data(PageHeader, sizeof(PageHeader), AllocationLength);
+
+		/* Parameters are built one at a time to keep the stack usage low */
+		for (uint8_t Index = 0; (ParameterLength = LogPage->GetParameter(Index, ParameterData)) != 0; Index++)
+		  BytesTransferred += SCSI_Write_Response_Data(ParameterData, ParameterLength, (AllocationLength - BytesTransferred));
+	}
+
+	/* Pad out remaining bytes with 0x00 */
+	Endpoint_Null_Stream((AllocationLength - BytesTransferred), NULL);
+
+	/* Finalize the stream transfer to send the last packet */
+	Endpoint_ClearIN();
+
+	/* Succeed the command and update the bytes transferred counter */
+	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= AllocationLength;
+
+	return true;
+}
+
+/** Writes a part of a response to the host, truncated to the remaining allocation length of the command.
+ *
+ *  \param[in] Data       Pointer to the response data to write
+ *  \param[in] Length     Length of the data in bytes
+ *  \param[in] Remaining  Remaining allocation length of the command in bytes
+ *
+ *  \return Number of bytes written to the endpoint.
+ */
+static uint16_t SCSI_Write_Response_Data(const void* Data,
+                                    const uint16_t Length,
+                                    const uint16_t Remaining)
+{
+	uint16_t BytesToWrite = MIN(Length, Remaining);
+
+	Endpoint_Write_Stream_LE(Data, BytesToWrite, NULL);
+
+	return BytesToWrite;
+}
+
+/** Command processing for an issued SCSI LOG SELECT command. Only the parameter code reset (PCR) of all log pages is
+ *  supported, which clears the command latency statistics.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Log_Select(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	/* Check to see if the PCR bit is not set or a parameter list is sent */
+	if (!(MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & (1 << 1)) ||
+	     MSInterfaceInfo->State.CommandBlock.SCSICommandData[7] ||
+	     MSInterfaceInfo->State.CommandBlock.SCSICommandData[8])
+	{
+		/* Only the parameter reset is supported - update SENSE key and fail the command */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+		               SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	/* Clear the values of all log pages */
+	#if defined(SCSI_VENDOR_LOG_PAGES)
+	for (uint8_t PageIndex = 0; PageIndex < SCSI_LOG_PAGE_COUNT; PageIndex++)
+	  LogPages[PageIndex].Reset();
+	#endif
+
+	/* Succeed the command and update the bytes transferred counter */
+	MSInterfaceInfo->State.CommandBlock.DataTransferLength = 0;
+
+	return true;
+}
+
+#if defined(ENABLE_COMMAND_TRACE)
+/** Command processing for an issued vendor specific READ COMMAND TRACE command. This command returns a
+ *  \ref CommandTrace_Header_t followed by the records of the trace ring buffer, oldest first. Records that do not
+ *  fit completely into the allocation length are not returned, and only the returned records are removed from
+ *  the ring buffer if the \ref COMMAND_TRACE_FLAG_DISCARD flag is set.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Read_Command_Trace(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	uint16_t AllocationLength = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[7]);
+	uint16_t BytesTransferred;
+	uint8_t  RecordsTransferred = 0;
+
+	CommandTrace_Header_t Header;
+	CommandTrace_Record_t Record;
+
+	CommandTrace_GetHeader(&Header);
+	BytesTransferred = SCSI_Write_Response_Data(&Header, sizeof(Header), AllocationLength);
+
+	/* Records are copied one at a time, as the ring buffer may wrap around */
+	while ((RecordsTransferred < Header.Count) && ((uint16_t)(AllocationLength - BytesTransferred) >= sizeof(Record)))
+	{
+		CommandTrace_GetRecord(RecordsTransferred++, &Record);
+		BytesTransferred += SCSI_Write_Response_Data(&Record, sizeof(Record), (AllocationLength - BytesTransferred));
+	}
+
+	/* Pad out remaining bytes with 0x00 */
+	Endpoint_Null_Stream((AllocationLength - BytesTransferred), NULL);
+
+	/* Finalize the stream transfer to send the last packet */
+	Endpoint_ClearIN();
+
+	if (MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & COMMAND_TRACE_FLAG_DISCARD)
+	  CommandTrace_Discard(RecordsTransferred);
+
+	/* Succeed the command and update the bytes transferred counter */
+	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= AllocationLength;
+
+	return true;
+}
+#endif
+
+/** Command processing for an issued vendor specific READ CARD REGISTERS command. This command returns the CSD, CID
+ *  and SD Status registers of the card, \ref SDCARD_REGISTERS_LENGTH bytes, which hold the capacity, the allocation
+ *  unit size and the erase geometry a host side formatter aligns the filesystem to.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Read_Card_Registers(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	uint16_t AllocationLength = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[7]);
+	uint16_t BytesTransferred;
+
+	if (!(SCSI_Check_Medium_Ready()))
+	  return false;
+
+	const uint8_t* Registers = SDCardManager_ReadRegisters();
+
+	if (Registers == NULL)
+	{
+		/* Update SENSE key with a hardware error condition and return command fail */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_HARDWARE_ERROR,
+		               SCSI_ASENSE_NO_ADDITIONAL_INFORMATION,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	BytesTransferred = SCSI_Write_Response_Data(Registers, SDCARD_REGISTERS_LENGTH, AllocationLength);
+
+	/* Pad out remaining bytes with 0x00 */
+	Endpoint_Null_Stream((AllocationLength - BytesTransferred), NULL);
+
+	/* Finalize the stream transfer to send the last packet */
+	Endpoint_ClearIN();
+
+	/* Succeed the command and update the bytes transferred counter */
+	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= AllocationLength;
+
+	return true;
+}
+
+/** Checks if the medium can be accessed, for TEST UNIT READY and all commands that access the medium. If no card is
+ *  inserted or the card is still being initialized, the sense data is updated with a NOT READY condition.
+ *
+ *  \return Boolean \c true if the medium is ready, \c false otherwise.
+ */
+static bool SCSI_Check_Medium_Ready(void)
+{
+	switch (SDCardManager_GetMediumState())
+	{
+		case SDCARD_MEDIUM_READY:
+			return true;
+		case SDCARD_MEDIUM_BECOMING_READY:
+			SCSI_SET_SENSE(SCSI_SENSE_KEY_NOT_READY,
+			               SCSI_ASENSE_LOGICAL_UNIT_NOT_READY,
+			               SCSI_ASENSEQ_IN_PROCESS_OF_BECOMING_READY);
+			break;
+		default:
+			SCSI_SET_SENSE(SCSI_SENSE_KEY_NOT_READY,
+			               SCSI_ASENSE_MEDIUM_NOT_PRESENT,
+			               SCSI_ASENSEQ_NO_QUALIFIER);
+			break;
+	}
+
+	return false;
+}
@@ -42,6 +42,10 @@
 
 		#include "Descriptors.h"
 		#include "SDCardManager.h"
+		#include "CommandStats.h"
+		#include "CommandTrace.h"
+		#include "SDCardSelfTest.h"
+		#include "Telemetry.h"
 
 	/* Macros: */
 		/** Macro to set the current SCSI sense data to the given key, additional sense code and additional sense qualifier. This
@@ -52,10 +56,61 @@
 		 *  \param[in] Acode  New SCSI additional sense key to set the additional sense code to
 		 *  \param[in] Aqual  New SCSI additional sense key qualifier to set the additional sense qualifier code to
 		 */
-		#define SCSI_SET_SENSE(Key, Acode, Aqual)  do { SenseData.SenseKey                 = (Key);   \
+		#define SCSI_SET_SENSE(Key, Acode, Aqual)  do { SenseData.ResponseCode             = 0x70;    \
+		                                                SenseData.SenseKey                 = (Key);   \
 		                                                SenseData.AdditionalSenseCode      = (Acode); \
 		                                                SenseData.AdditionalSenseQualifier = (Aqual); } while (0)
 
+		/** Macro to set the INFORMATION field of the current SCSI sense data to the given logical block address, and to
+		 *  mark the field as valid. This must be used after \ref SCSI_SET_SENSE(), which invalidates the field again.
+		 *
+		 *  \param[in] Address  Logical block address of the block that caused the command to fail
+		 */
+		#define SCSI_SET_SENSE_INFORMATION(Address) do { SenseData.ResponseCode   = 0xF0;                   \
+		                                                  SenseData.Information[0] = ((Address) >> 24);      \
+		                                                  SenseData.Information[1] = ((Address) >> 16);      \
+		                                                  SenseData.Information[2] = ((Address) >> 8);       \
+		                                                  SenseData.Information[3] = ((Address) & 0xFF); } while (0)
+
+		/** SCSI command code for a RECEIVE DIAGNOSTIC RESULTS command, not defined by LUFA. */
+		#define SCSI_CMD_RECEIVE_DIAGNOSTIC_RESULTS        0x1C
+
+		/** SEND DIAGNOSTIC self-test code of the foreground short self-test. */
+		#define SCSI_SELFTEST_FOREGROUND_SHORT             0x05
+
+		/** SEND DIAGNOSTIC self-test code of the foreground extended self-test. */
+		#define SCSI_SELFTEST_FOREGROUND_EXTENDED          0x06
+
+		/** RECEIVE DIAGNOSTIC RESULTS page code of the page that lists all supported diagnostic pages. */
+		#define SCSI_DIAGNOSTIC_PAGE_SUPPORTED_PAGES       0x00
+
+		/** SCSI command code for a SERVICE ACTION IN (16) command, not defined by LUFA. */
+		#define SCSI_CMD_SERVICE_ACTION_IN_16              0x9E
+
+		/** SERVICE ACTION IN (16) service action of a READ CAPACITY (16) command. */
+		#define SCSI_SERVICE_ACTION_READ_CAPACITY_16       0x10
+
+		/** SCSI command code for a LOG SELECT command, not defined by LUFA. */
+		#define SCSI_CMD_LOG_SELECT                        0x4C
+
+		/** SCSI command code for a LOG SENSE command, not defined by LUFA. */
+		#define SCSI_CMD_LOG_SENSE                         0x4D
+
+		/** LOG SENSE page code of the page that lists all supported log pages. */
+		#define SCSI_LOG_PAGE_SUPPORTED_PAGES              0x00
+
+		/** Size in bytes of the largest log parameter, including its header, of all log pages. */
+		#define SCSI_LOG_PARAMETER_MAX_SIZE                48
+
+		/** Additional sense code for a block that could not be read back from the medium, not defined by LUFA. */
+		#define SCSI_ASENSE_UNRECOVERED_READ_ERROR         0x11
+
+		/** Additional sense code for a block that could not be written to the medium, not defined by LUFA. */
+		#define SCSI_ASENSE_WRITE_ERROR                    0x0C
+
+		/** Additional sense code qualifier for a logical unit that is not ready yet, not defined by LUFA. */
+		#define SCSI_ASENSEQ_IN_PROCESS_OF_BECOMING_READY  0x01
+
 		/** Macro for the \ref SCSI_Command_ReadWrite_10() function, to indicate that data is to be read from the storage medium. */
 		#define DATA_READ           true
 
@@ -68,17 +123,49 @@
 		/** Value for the DeviceType entry in the SCSI_Inquiry_Response_t enum, indicating a CD-ROM device. */
 		#define DEVICE_TYPE_CDROM   0x05
 
+	/* Type Defines: */
+		/** Type define for a log page returned by the LOG SENSE command. The parameters of a page are built one at a
+		 *  time, so that a page never has to be held in RAM as a whole.
+		 */
+		typedef struct
+		{
+			uint8_t  PageCode;   /**< Page code of the log page */
+			uint16_t PageLength; /**< Total length in bytes of all parameters of the page */
+
+			/** Fills a buffer of \ref SCSI_LOG_PARAMETER_MAX_SIZE bytes with a parameter and returns its length, zero
+			 *  after the last parameter.
+			 */
+			uint8_t (*GetParameter)(const uint8_t Index, uint8_t* const Buffer);
+
+			/** Clears the values of the page on a LOG SELECT parameter code reset. */
+			void (*Reset)(void);
+		} SCSI_Log_Page_t;
+
 	/* Function Prototypes: */
 		bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+		uint8_t SCSI_GetSenseKey(void);
 
 		#if defined(INCLUDE_FROM_SCSI_C)
 			static bool SCSI_Command_Inquiry(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
 			static bool SCSI_Command_Request_Sense(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
 			static bool SCSI_Command_Read_Capacity_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+			static bool SCSI_Command_Read_Capacity_16(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
 			static bool SCSI_Command_Send_Diagnostic(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+			static bool SCSI_Command_Receive_Diagnostic_Results(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
 			static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 			                                      const bool IsDataRead);
 			static bool SCSI_Command_ModeSense_6(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+			static bool SCSI_Command_Verify_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+			static bool SCSI_Command_Log_Sense(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+			static bool SCSI_Command_Log_Select(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+			#if defined(ENABLE_COMMAND_TRACE)
+			static bool SCSI_Command_Read_Command_Trace(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+			#endif
+			static bool SCSI_Command_Read_Card_Registers(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+			static uint16_t SCSI_Write_Response_Data(const void* Data,
+			                                    const uint16_t Length,
+			                                    const uint16_t Remaining);
+			static bool SCSI_Check_Medium_Ready(void);
 		#endif
 
 #endif
@@ -1,33 +1,62 @@
 #include "SDCardDriver.h"
 
 #include "LUFAConfig.h"
+#include "EventLog.h"
 
-#ifdef SDCARD_DRIVER_DEBUG
-#define error(ERROR_CODE) Serial1.println(#ERROR_CODE);
+#include <string.h>
+#include <util/crc16.h>
+
+#define error(ERROR_CODE) EventLog_Add(EVENT_LOG_CARD_ERROR, ERROR_CODE, m_status, 0)
+
+#ifdef SDCARD_DRIVER_PROFILE
+static SDCardDriver::PhaseStats s_phase_stats[SDCardDriver::PHASE_COUNT];
+static unsigned long s_phase_start;
+#define profileBegin() s_phase_start = micros()
+#define profileEnd(PHASE) recordPhase(PHASE, micros() - s_phase_start)
 #else
-#define error(ERROR_CODE)
+#define profileBegin()
+#define profileEnd(PHASE)
 #endif
 
-uint8_t s_sd_raw_block[512];
-static uint32_t s_sd_raw_block_address;
+#ifdef ENABLE_TELEMETRY
+static uint32_t s_busy_us;
+#endif
 
 SDCardDriver::SDCardDriver()
   //: m_spi_settings(250000, MSBFIRST, SPI_MODE0)
-  : m_spi_settings(F_SPI, MSBFIRST, SPI_MODE0)
+  : m_type(0)
   , m_offset(0)
-  , m_type(0)
+  , m_chip_select_asserted(false)
+  , m_erase_timing()
+  , m_spi_settings(F_SPI, MSBFIRST, SPI_MODE0)
 {}
 
 bool SDCardDriver::init(uint8_t chipSelectPin) 
+{
+  // 16-bit init start time allows over a minute
+  unsigned int t0 = millis();
+  SDInitStatus status;
+
+  if (!initBegin(chipSelectPin))
+    return false;
+
+  while ((status = initPoll()) == SD_INIT_BUSY) {
+    // check for timeout
+    if ((millis() - t0) > SD_INIT_TIMEOUT) {
+      error(SD_CARD_ERROR_ACMD41);
+      return false;
+    }
+  }
+  return status == SD_INIT_DONE;
+}
+
+bool SDCardDriver::initBegin(uint8_t chipSelectPin)
 {
   m_inBlock = false;
   m_partialBlockRead = false;
   m_chip_select_pin = chipSelectPin;
+  m_type = 0;
 
-  // 16-bit init start time allows over a minute
-  unsigned int t0 = millis();
-  uint32_t arg;
-  
   // set pin modes
   pinMode(m_chip_select_pin, OUTPUT);
   digitalWrite(m_chip_select_pin, HIGH);
@@ -42,16 +71,22 @@ bool SDCardDriver::init(uint8_t chipSelectPin)
 
   chipSelectLow();
 
-  // command to go idle in SPI mode
-  while ((m_status = cardCommand(CMD0, 0)) != R1_IDLE_STATE) {
-    if ((millis() - t0) > SD_INIT_TIMEOUT) {
+  // command to go idle in SPI mode, an empty slot never answers so only
+  // retry a few times instead of waiting for the init timeout
+  for (uint8_t i = 0; (m_status = cardCommand(CMD0, 0)) != R1_IDLE_STATE; ++i) {
+    if (i >= SD_CMD0_RETRIES) {
       error(SD_CARD_ERROR_CMD0);
       goto fail;
     }
   }
 
-  // check SD version
-  if ((cardCommand(CMD8, 0x1AA) & R1_ILLEGAL_COMMAND)) {
+  // check SD version, no response at all (e.g. a card that is still busy from
+  // before the reset) must not be taken for the illegal command of a V1 card
+  if (cardCommand(CMD8, 0x1AA) & 0X80) {
+    error(SD_CARD_ERROR_CMD8);
+    goto fail;
+  }
+  if (m_status & R1_ILLEGAL_COMMAND) {
     m_type = SD_CARD_TYPE_SD1;
   } else {
     // only need last byte of r7 response
@@ -63,36 +98,95 @@ bool SDCardDriver::init(uint8_t chipSelectPin)
     }
     m_type = SD_CARD_TYPE_SD2;
   }
+  chipSelectHigh();
+  return true;
 
-  // initialize card and send host supports SDHC if SD2
-  arg = m_type == SD_CARD_TYPE_SD2 ? 0X40000000 : 0;
+fail:
+  chipSelectHigh();
+  return false;
+}
 
-  while ((m_status = cardAcmd(ACMD41, arg)) != R1_READY_STATE) {
-    // check for timeout
-    if ((millis() - t0) > SD_INIT_TIMEOUT) {
-      error(SD_CARD_ERROR_ACMD41);
-      goto fail;
-    }
+SDCardDriver::SDInitStatus SDCardDriver::initPoll(bool readOcr)
+{
+  // initialize card and send host supports SDHC if SD2
+  m_status = cardAcmd(ACMD41, m_type == SD_CARD_TYPE_SD2 ? 0X40000000 : 0);
+  if (m_status == R1_IDLE_STATE) {
+    chipSelectHigh();
+    return SD_INIT_BUSY;
   }
+  if (m_status != R1_READY_STATE) {
+    error(SD_CARD_ERROR_ACMD41);
+    goto fail;
+  }
+
+  if (readOcr && !readOCR())
+    return SD_INIT_FAILED;
+  chipSelectHigh();
+  return SD_INIT_DONE;
   
+fail:
+  chipSelectHigh();
+  return SD_INIT_FAILED;
+}
+
+bool SDCardDriver::readOCR()
+{
   // if SD2 read OCR register to check for SDHC card
-  if (m_type == SD_CARD_TYPE_SD2) {
-    if (cardCommand(CMD58, 0)) {
-      error(SD_CARD_ERROR_CMD58);
-      goto fail;
-    }
-    if ((SPI.transfer(0XFF) & 0XC0) == 0XC0)
-      m_type = SD_CARD_TYPE_SDHC;
-    // discard rest of ocr - contains allowed voltage range
-    for (uint8_t i = 0; i < 3; i++)
-      SPI.transfer(0XFF);
+  if (m_type != SD_CARD_TYPE_SD2)
+    return true;
+  if (cardCommand(CMD58, 0)) {
+    error(SD_CARD_ERROR_CMD58);
+    chipSelectHigh();
+    return false;
   }
+  if ((SPI.transfer(0XFF) & 0XC0) == 0XC0)
+    m_type = SD_CARD_TYPE_SDHC;
+  // discard rest of ocr - contains allowed voltage range
+  for (uint8_t i = 0; i < 3; i++)
+    SPI.transfer(0XFF);
   chipSelectHigh();
   return true;
-  
-fail:
+}
+
+bool SDCardDriver::readCID(void *cid)
+{
+  return readRegister(CMD10, cid);
+}
+
+bool SDCardDriver::readCSD(void *csd)
+{
+  return readRegister(CMD9, csd);
+}
+
+bool SDCardDriver::readSDStatus(void *status)
+{
+  // R2 response, the second byte follows R1
+  if (cardAcmd(ACMD13, 0)) {
+    error(SD_CARD_ERROR_READ_REG);
+    chipSelectHigh();
+    return false;
+  }
+  SPI.transfer(0xFF);
+  return readData(status, 64);
+}
+
+bool SDCardDriver::readSCR(void *scr)
+{
+  if (cardAcmd(ACMD51, 0)) {
+    error(SD_CARD_ERROR_READ_REG);
+    chipSelectHigh();
+    return false;
+  }
+  return readData(scr, 8);
+}
+
+bool SDCardDriver::isPresent()
+{
+  // R2 response, first byte is R1
+  m_status = cardCommand(CMD13, 0);
+  SPI.transfer(0xFF);
   chipSelectHigh();
-  return false;
+  return m_status == R1_READY_STATE;
 }
 
 uint32_t SDCardDriver::readCapacity()
@@ -118,6 +212,7 @@ uint32_t SDCardDriver::readCapacity()
       {
           case 7:
               b &= 0x3f;
+              // fall through
           case 8:
           case 9:
               csd_c_size <<= 8;
@@ -127,7 +222,7 @@ uint32_t SDCardDriver::readCapacity()
       if(i == 9)
       {
           ++csd_c_size;
-          capacity = csd_c_size * 512 * 1024;
+          capacity = csd_c_size << 10;
       }
     } else {
       switch(i)
@@ -153,7 +248,7 @@ uint32_t SDCardDriver::readCapacity()
               break;
           case 10:
               csd_c_size_mult |= b >> 7;
-              capacity = csd_c_size << (csd_c_size_mult + csd_read_bl_len + 2);
+              capacity = csd_c_size << (csd_c_size_mult + csd_read_bl_len + 2 - 9);
               break;
       }
     }
@@ -169,33 +264,45 @@ fail:
 
 bool SDCardDriver::readBlock(uint32_t block, uint8_t* buffer)
 {
-  uint16_t block_offset = block & 0x01ff;
-  uint32_t block_address = block - block_offset;
-  
-  if (block_offset != 0)
-    error(SD_CARD_ERROR_OFFSET);
-  
-  if (cardCommand(CMD17, m_type == SD_CARD_TYPE_SDHC ? block_address / 512 : block_address)) {
+  uint16_t crc = 0;
+
+  if (cardCommand(CMD17, cardAddress(block))) {
     error(SD_CARD_ERROR_CMD17);
     goto fail;
   }
 
   // wait for data block (start byte 0xfe)  
-  while (SPI.transfer(0xFF) != 0xfe);
+  if (!waitStartBlock())
+    goto fail;
 
-  // read data block (512 byte)
-  for (uint16_t i = 0; i < 512; ++i, ++buffer) {
+  // read data block (512 byte) and its crc16 like verifyBlocks(), the crc of
+  // the previous byte is calculated while the next byte is shifted in
+  profileBegin();
 #ifdef OPTIMIZE_SDCARD_HARDWARE_SPI
-    SPDR = 0xff;
+  SPDR = 0xff;
+  for (uint16_t i = 0; i < 511; ++i) {
     while (!(SPSR & (1 << SPIF)));
-    *buffer = SPDR;
+    uint8_t b = SPDR;
+    SPDR = 0xff;
+    buffer[i] = b;
+    crc = _crc_xmodem_update(crc, b);
+  }
+  while (!(SPSR & (1 << SPIF)));
+  buffer[511] = SPDR;
+  crc = _crc_xmodem_update(crc, buffer[511]);
 #else
-    *buffer = SPI.transfer(0xff);
-#endif
+  for (uint16_t i = 0; i < 512; ++i) {
+    buffer[i] = SPI.transfer(0xff);
+    crc = _crc_xmodem_update(crc, buffer[i]);
   }
+#endif
+  profileEnd(PHASE_DATA);
 
-  // read crc16
-  SPI.transfer16(0xffff);
+  // a corrupted block is reported as a failed read, so that it is read again
+  if (SPI.transfer16(0xffff) != crc) {
+    error(SD_CARD_ERROR_CRC);
+    goto fail;
+  }
 
   chipSelectHigh();
   return true;
@@ -207,38 +314,15 @@ fail:
 
 bool SDCardDriver::writeBlock(uint32_t block, const uint8_t *buffer)
 { 
-  uint16_t block_offset = block & 0x01ff;
-  uint32_t block_address = block - block_offset;
-  uint8_t status;
-
-  if (block_offset != 0)
-    error(SD_CARD_ERROR_OFFSET);
-  
-  if (cardCommand(CMD24, m_type == SD_CARD_TYPE_SDHC ? block_address / 512 : block_address)) {
+  if (cardCommand(CMD24, cardAddress(block))) {
     error(SD_CARD_ERROR_CMD24);
     goto fail;
   }
   
-  SPI.transfer(0xfe);
-  
-#ifdef OPTIMIZE_HARDWARE_SPI
-  for (uint16_t i = 0; i < 512; ++i, ++buffer) {
-    while (!(SPSR & (1 << SPIF)));
-    SPDR = *buffer;
-  }
-  while (!(SPSR & (1 << SPIF)));
-#else
-  SPI.transfer(buffer, 512);
-#endif
-  // write crc16
-  SPI.transfer16(0xffff);
-
-  status = SPI.transfer(0xff);
-  if ((status & 0x1F) != 0x05) {
-    error(SD_CARD_ERROR_WRITE);
+  if (!writeData(DATA_START_BLOCK, buffer))
     goto fail;
-  }
     
+  // the card is now busy programming, writeDone() reports the result
   chipSelectHigh();
   return true;
     
@@ -247,6 +331,174 @@ fail:
   return false; 
 }
 
+bool SDCardDriver::writeDone()
+{
+  chipSelectLow();
+  if (!waitNotBusy(SD_BUSY_TIMEOUT)) {
+    error(SD_CARD_ERROR_WRITE_TIMEOUT);
+    goto fail;
+  }
+
+  // R2 response, any bit set in the second byte is a programming error
+  if (cardCommand(CMD13, 0) || SPI.transfer(0xFF)) {
+    error(SD_CARD_ERROR_WRITE_PROGRAMMING);
+    goto fail;
+  }
+  chipSelectHigh();
+  return true;
+
+fail:
+  chipSelectHigh();
+  return false;
+}
+
+bool SDCardDriver::writeBusy()
+{
+  chipSelectLow();
+  bool busy = SPI.transfer(0xFF) != 0xFF;
+  chipSelectHigh();
+  return busy;
+}
+
+bool SDCardDriver::writeMultipleStart(uint32_t block, uint32_t count)
+{
+  // pre-erasing the blocks speeds up the write, a failure is not fatal
+  if (cardAcmd(ACMD23, count)) {
+    error(SD_CARD_ERROR_ACMD23);
+  }
+
+  if (cardCommand(CMD25, cardAddress(block))) {
+    error(SD_CARD_ERROR_CMD25);
+    chipSelectHigh();
+    return false;
+  }
+  return true;
+}
+
+bool SDCardDriver::writeMultipleData(const uint8_t *buffer)
+{
+  // wait until the card finished programming the previous block
+  if (!waitNotBusy(SD_BUSY_TIMEOUT)) {
+    error(SD_CARD_ERROR_WRITE_TIMEOUT);
+    goto fail;
+  }
+  if (!writeData(WRITE_MULTIPLE_TOKEN, buffer))
+    goto fail;
+  return true;
+
+fail:
+  chipSelectHigh();
+  return false;
+}
+
+bool SDCardDriver::eraseBlocks(uint32_t block, uint32_t count)
+{
+  if (cardCommand(CMD32, cardAddress(block)) || cardCommand(CMD33, cardAddress(block + count - 1)) ||
+      cardCommand(CMD38, 0)) {
+    error(SD_CARD_ERROR_ERASE);
+    goto fail;
+  }
+
+  // R1b response, the card holds the data line low until the blocks are erased
+  if (!waitNotBusy(eraseTimeout(block, count))) {
+    error(SD_CARD_ERROR_ERASE);
+    goto fail;
+  }
+  chipSelectHigh();
+  return true;
+
+fail:
+  chipSelectHigh();
+  return false;
+}
+
+bool SDCardDriver::writeMultipleStop()
+{
+  if (!waitNotBusy(SD_BUSY_TIMEOUT)) {
+    error(SD_CARD_ERROR_STOP_TRAN);
+    chipSelectHigh();
+    return false;
+  }
+  SPI.transfer(STOP_TRAN_TOKEN);
+  // skip the byte before the card signals busy
+  SPI.transfer(0xFF);
+  return writeDone();
+}
+
+bool SDCardDriver::verifyBlocks(uint32_t block, uint32_t count, uint32_t *failedBlock)
+{
+  uint16_t crc;
+
+  *failedBlock = block;
+  if (count == 0)
+    return true;
+
+  if (cardCommand(CMD18, cardAddress(block))) {
+    error(SD_CARD_ERROR_CMD18);
+    goto fail;
+  }
+
+  for (; count > 0; --count, ++block) {
+    *failedBlock = block;
+    if (!waitStartBlock()) {
+      readStop();
+      goto fail;
+    }
+
+    // compute crc16 of the data block, the crc of the previous byte is
+    // calculated while the next byte is shifted in
+    crc = 0;
+    profileBegin();
+#ifdef OPTIMIZE_SDCARD_HARDWARE_SPI
+    SPDR = 0xff;
+    for (uint16_t i = 0; i < 511; ++i) {
+      while (!(SPSR & (1 << SPIF)));
+      uint8_t b = SPDR;
+      SPDR = 0xff;
+      crc = _crc_xmodem_update(crc, b);
+    }
+    while (!(SPSR & (1 << SPIF)));
+    crc = _crc_xmodem_update(crc, SPDR);
+#else
+    for (uint16_t i = 0; i < 512; ++i)
+      crc = _crc_xmodem_update(crc, SPI.transfer(0xff));
+#endif
+    profileEnd(PHASE_DATA);
+
+    if (SPI.transfer16(0xffff) != crc) {
+      error(SD_CARD_ERROR_CRC);
+      readStop();
+      goto fail;
+    }
+  }
+
+  return readStop();
+
+fail:
+  chipSelectHigh();
+  return false;
+}
+
+uint16_t SDCardDriver::spiLoopback(uint16_t count)
+{
+  uint16_t errors = 0;
+
+  SPI.beginTransaction(m_spi_settings);
+  while (count--) {
+#ifdef OPTIMIZE_SDCARD_HARDWARE_SPI
+    SPDR = 0xff;
+    while (!(SPSR & (1 << SPIF)));
+    if (SPDR != 0xff)
+      ++errors;
+#else
+    if (SPI.transfer(0xff) != 0xff)
+      ++errors;
+#endif
+  }
+  SPI.endTransaction();
+  return errors;
+}
+
 void SDCardDriver::printBlock(uint32_t block)
 {    
   if (m_type != SD_CARD_TYPE_SDHC)
@@ -276,12 +528,52 @@ void SDCardDriver::printBlock(uint32_t block)
   // read crc16
   SPI.transfer16(0xffff);
 
-  chipSelectHigh();
-  return true;
-
 fail:
   chipSelectHigh();
-  return false;
+}
+
+void SDCardDriver::setEraseTiming(const uint8_t *timing)
+{
+  memcpy(m_erase_timing, timing, sizeof(m_erase_timing));
+}
+
+const uint8_t *SDCardDriver::eraseTiming() const
+{
+  return m_erase_timing;
+}
+
+uint32_t SDCardDriver::auBlocks(uint8_t auSize)
+{
+  // up to 4 MiB the sizes are powers of two, above they follow a table
+  if (auSize <= 9)
+    return auSize ? 32UL << (auSize - 1) : 0;
+  static const uint8_t mib[] = { 8, 12, 16, 24, 32, 64 };
+  return mib[auSize - 10] * 2048UL;
+}
+
+// busy time the card may take for an erase, ERASE_SIZE and ERASE_TIMEOUT give the time for a
+// number of AUs, a card that reports no ERASE_TIMEOUT gets 250 ms per block
+unsigned int SDCardDriver::eraseTimeout(uint32_t block, uint32_t count) const
+{
+  uint32_t au_blocks = auBlocks(m_erase_timing[0] >> 4);
+  uint16_t erase_size = (uint16_t)m_erase_timing[1] << 8 | m_erase_timing[2];
+  uint8_t erase_timeout = m_erase_timing[3] >> 2;
+  uint32_t timeout_ms;
+
+  // anything above 0xFFFF blocks or AUs is cut to the longest wait anyway
+  if (au_blocks && erase_size && erase_timeout) {
+    uint32_t aus = (block + count - 1) / au_blocks - block / au_blocks + 1;
+    if (aus > 0xFFFF)
+      aus = 0xFFFF;
+    timeout_ms = aus * (erase_timeout * 1000UL / erase_size) + (m_erase_timing[3] & 0x03) * 1000UL;
+  } else {
+    if (count > 0xFFFF)
+      count = 0xFFFF;
+    timeout_ms = count * 250;
+  }
+  if (timeout_ms < SD_ERASE_TIMEOUT)
+    return SD_ERASE_TIMEOUT;
+  return timeout_ms > 0xFFFF ? 0xFFFF : timeout_ms;
 }
 
 SDCardDriver::SDCardType SDCardDriver::type() const
@@ -289,6 +581,11 @@ SDCardDriver::SDCardType SDCardDriver::type() const
   return static_cast<SDCardType>(m_type);
 }
 
+void SDCardDriver::setType(SDCardType type)
+{
+  m_type = type;
+}
+
 void SDCardDriver::chipSelectHigh(void) 
 {
   digitalWrite(m_chip_select_pin, HIGH);
@@ -315,10 +612,15 @@ uint8_t SDCardDriver::cardCommand(uint8_t cmd, uint32_t arg)
   // select card
   chipSelectLow();
 
-  // wait up to 300 ms if busy
-  waitNotBusy(300);
+  // wait if busy, a card streaming a multi-block read is not busy and an
+  // uninitialized card may not drive the data line
+  if (cmd != CMD0 && cmd != CMD12 && !waitNotBusy(SD_BUSY_TIMEOUT)) {
+    error(SD_CARD_ERROR_BUSY_TIMEOUT);
+    return (m_status = 0xFF);
+  }
 
   // send command
+  profileBegin();
   SPI.transfer(cmd | 0x40);
 
   // send argument
@@ -333,8 +635,13 @@ uint8_t SDCardDriver::cardCommand(uint8_t cmd, uint32_t arg)
     crc = 0X87;  // correct crc for CMD8 with arg 0X1AA
   SPI.transfer(crc);
 
+  // discard stuff byte following the stop command
+  if (cmd == CMD12)
+    SPI.transfer(0xFF);
+
   // wait for response
   for (uint8_t i = 0; ((m_status = SPI.transfer(0xFF)) & 0X80) && i != 0XFF; i++);
+  profileEnd(PHASE_COMMAND);
   return m_status;
 }
 
@@ -359,17 +666,34 @@ bool SDCardDriver::waitNotBusy(unsigned int timeout_ms)
 {
   unsigned int t0 = millis();
   unsigned int d;
+  bool ready = false;
+  if (SPI.transfer(0xFF) == 0XFF)
+    return true;
+
+  // the card is busy, the busy time and phase are only taken when there is a wait anyway, a
+  // sample for every command would bury the waits of the writes
+  profileBegin();
+#ifdef ENABLE_TELEMETRY
+  unsigned long busy_start = micros();
+#endif
   do {
-    if (SPI.transfer(0xFF) == 0XFF)
-      return true;
+    if (SPI.transfer(0xFF) == 0XFF) {
+      ready = true;
+      break;
+    }
     d = millis() - t0;
   } while (d < timeout_ms);
-  return false;
+  profileEnd(PHASE_BUSY);
+#ifdef ENABLE_TELEMETRY
+  s_busy_us += micros() - busy_start;
+#endif
+  return ready;
 }
 
 bool SDCardDriver::waitStartBlock()
 {
   unsigned int t0 = millis();
+  profileBegin();
   while ((m_status = SPI.transfer(0xFF)) == 0XFF) {
     unsigned int d = millis() - t0;
     if (d > SD_READ_TIMEOUT) {
@@ -377,6 +701,7 @@ bool SDCardDriver::waitStartBlock()
       goto fail;
     }
   }
+  profileEnd(PHASE_START_TOKEN);
   if (m_status != DATA_START_BLOCK) {
     error(SD_CARD_ERROR_READ);
     goto fail;
@@ -390,15 +715,22 @@ fail:
 
 bool SDCardDriver::readRegister(uint8_t cmd, void* buf)
 {
-  uint8_t *dst = reinterpret_cast<uint8_t*>(buf);
   if (cardCommand(cmd, 0)) {
     error(SD_CARD_ERROR_READ_REG);
-    goto fail;
+    chipSelectHigh();
+    return false;
   }
+  return readData(buf, 16);
+}
+
+// reads the data block of a register after the command was sent
+bool SDCardDriver::readData(void* buf, uint8_t count)
+{
+  uint8_t *dst = reinterpret_cast<uint8_t*>(buf);
   if (!waitStartBlock())
     goto fail;
   // transfer data
-  for (uint16_t i = 0; i < 16; i++)
+  for (uint8_t i = 0; i < count; i++)
     dst[i] = SPI.transfer(0xff);
   SPI.transfer16(0xffff); // read crc16
   chipSelectHigh();
@@ -408,3 +740,99 @@ fail:
   chipSelectHigh();
   return false;
 }
+
+bool SDCardDriver::readStop()
+{
+  if (cardCommand(CMD12, 0)) {
+    error(SD_CARD_ERROR_CMD12);
+    goto fail;
+  }
+  chipSelectHigh();
+  return true;
+
+fail:
+  chipSelectHigh();
+  return false;
+}
+
+bool SDCardDriver::writeData(uint8_t token, const uint8_t *buffer)
+{
+  SPI.transfer(token);
+
+  // the buffer is left untouched so that a failed write can be retried
+  profileBegin();
+#ifdef OPTIMIZE_SDCARD_HARDWARE_SPI
+  SPDR = buffer[0];
+  for (uint16_t i = 1; i < 512; ++i) {
+    uint8_t b = buffer[i];
+    while (!(SPSR & (1 << SPIF)));
+    SPDR = b;
+  }
+  while (!(SPSR & (1 << SPIF)));
+#else
+  for (uint16_t i = 0; i < 512; ++i)
+    SPI.transfer(buffer[i]);
+#endif
+  profileEnd(PHASE_DATA);
+  // write crc16
+  SPI.transfer16(0xffff);
+
+  m_status = SPI.transfer(0xff);
+  if ((m_status & DATA_RES_MASK) != DATA_RES_ACCEPTED) {
+    error(SD_CARD_ERROR_WRITE);
+    return false;
+  }
+  return true;
+}
+
+uint32_t SDCardDriver::cardAddress(uint32_t block) const
+{
+  // standard capacity cards use byte addresses
+  return m_type == SD_CARD_TYPE_SDHC ? block : block << 9;
+}
+
+#ifdef ENABLE_TELEMETRY
+uint32_t SDCardDriver::busyTime()
+{
+  return s_busy_us;
+}
+
+void SDCardDriver::resetBusyTime()
+{
+  s_busy_us = 0;
+}
+#endif
+
+#ifdef SDCARD_DRIVER_PROFILE
+const SDCardDriver::PhaseStats &SDCardDriver::phaseStats(uint8_t phase)
+{
+  return s_phase_stats[phase];
+}
+
+void SDCardDriver::resetPhaseStats()
+{
+  memset(s_phase_stats, 0, sizeof(s_phase_stats));
+}
+
+void SDCardDriver::recordPhase(uint8_t phase, uint32_t us)
+{
+  PhaseStats &stats = s_phase_stats[phase];
+  uint32_t range = us / PHASE_BUCKET_BASE_US;
+  uint8_t bucket = 0;
+
+  // logarithmic histogram, the last bucket takes everything slower
+  while (range && bucket < PHASE_BUCKETS - 1) {
+    range >>= 1;
+    ++bucket;
+  }
+  if (stats.buckets[bucket] != 0xFFFF)
+    ++stats.buckets[bucket];
+
+  if (stats.count == 0 || us < stats.min_us)
+    stats.min_us = us;
+  if (us > stats.max_us)
+    stats.max_us = us;
+  stats.total_us += us;
+  ++stats.count;
+}
+#endif
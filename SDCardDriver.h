@@ -7,14 +7,109 @@ class SDCardDriver {
 public:
   SDCardDriver();
 
+  static unsigned int constexpr SD_INIT_TIMEOUT = 2000;
+  static unsigned int constexpr SD_READ_TIMEOUT = 300;
+  static unsigned int constexpr SD_BUSY_TIMEOUT = 500;
+
   bool init(uint8_t chipSelectPin);
 
+  // non-blocking initialization: initBegin() resets the card into SPI mode,
+  // initPoll() must then be called until it no longer returns SD_INIT_BUSY.
+  // Without readOcr a V2 card is reported as SD_CARD_TYPE_SD2 until readOCR()
+  // or setType() tells high capacity cards apart.
+  enum SDInitStatus {
+    SD_INIT_DONE = 0,
+    SD_INIT_BUSY,
+    SD_INIT_FAILED,
+  };
+  bool initBegin(uint8_t chipSelectPin);
+  SDInitStatus initPoll(bool readOcr = true);
+  bool readOCR();
+
+  // checks if an initialized card still responds (SEND_STATUS)
+  bool isPresent();
+
+  // capacity in 512 byte blocks, a byte count would overflow on cards of 4 GiB and more
   uint32_t readCapacity();
+  bool readCID(void *cid);
+  bool readCSD(void *csd);
+
+  // reads the 64 byte SD Status (ACMD13) with the AU size and the erase geometry
+  bool readSDStatus(void *status);
+
+  // reads the 8 byte SD Configuration Register (ACMD51), DATA_STAT_AFTER_ERASE tells
+  // whether erased blocks read as zeros or as ones
+  bool readSCR(void *scr);
   
+  // block is the number of the 512 byte block, not the byte address. writeBlock()
+  // returns as soon as the card accepted the data, writeDone() waits until the
+  // card finished programming and reports if the write succeeded.
   bool readBlock(uint32_t block, uint8_t *buffer);
   bool writeBlock(uint32_t block, const uint8_t *buffer);
+  bool writeDone();
+  // true while the card is still programming the block of writeBlock(), without waiting
+  bool writeBusy();
+
+  // multi-block write of count blocks starting at block number: writeMultipleStart()
+  // pre-erases the blocks and sends CMD25, writeMultipleData() sends the next block
+  // and writeMultipleStop() ends the write and waits until the card finished programming.
+  // The card stays selected in between, so no other command may be sent.
+  bool writeMultipleStart(uint32_t block, uint32_t count);
+  bool writeMultipleData(const uint8_t *buffer);
+  bool writeMultipleStop();
+
+  // erases count blocks starting at block number (CMD32, CMD33 and CMD38) and waits
+  // until the card is done. Standard capacity cards may erase whole sectors around
+  // the blocks, only high capacity cards erase exactly the given blocks.
+  bool eraseBlocks(uint32_t block, uint32_t count);
+
+  // erase timing of the card, bytes 10 to 13 of the SD Status (AU_SIZE, ERASE_SIZE,
+  // ERASE_TIMEOUT and ERASE_OFFSET). eraseBlocks() waits ERASE_TIMEOUT seconds for
+  // every ERASE_SIZE AUs it touches plus ERASE_OFFSET seconds, without them 250 ms
+  // per block like the SD specification asks, but never less than SD_ERASE_TIMEOUT.
+  void setEraseTiming(const uint8_t *timing);
+  const uint8_t *eraseTiming() const;
+
+  // size of an allocation unit in blocks from the 4 bit AU_SIZE field of the SD
+  // Status, 0 if the card doesn't give it
+  static uint32_t auBlocks(uint8_t auSize);
+
+  // verify count 512 byte blocks starting at block number (not byte address) using
+  // a multi-block read and the CRC16 of each data block, no data is transferred to
+  // the caller. On failure the number of the first bad block is stored in failedBlock.
+  bool verifyBlocks(uint32_t block, uint32_t count, uint32_t *failedBlock);
+
+  // clocks count bytes with the card deselected and returns the number of bytes
+  // that were not read back as 0xFF, the card releases MISO to its pull-up so any
+  // other value points to a wiring or level shifter fault
+  uint16_t spiLoopback(uint16_t count);
 
   void printBlock(uint32_t block);
+
+  // timing of the SPI transfer phases, only recorded if SDCARD_DRIVER_PROFILE is defined
+  enum Phase {
+    PHASE_COMMAND = 0, // command sent until the R1 response is received
+    PHASE_START_TOKEN, // wait for the data start token of a read
+    PHASE_DATA, // shifting the 512 data bytes of a read or write
+    PHASE_BUSY, // wait for the card to release the busy signal, only when it was busy
+    PHASE_COUNT,
+  };
+  static uint8_t constexpr PHASE_BUCKETS = 14;
+  static uint8_t constexpr PHASE_BUCKET_BASE_US = 8;
+  struct PhaseStats {
+    uint32_t count;
+    uint32_t total_us;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint16_t buckets[PHASE_BUCKETS]; // bucket 0 < 8 us, each following bucket twice as wide
+  };
+  static const PhaseStats &phaseStats(uint8_t phase);
+  static void resetPhaseStats();
+
+  // total time in microseconds spent waiting for the card to release the busy
+  // signal, only recorded if ENABLE_TELEMETRY is defined
+  static uint32_t busyTime();
+  static void resetBusyTime();
   
   enum SDCardType {
     SD_CARD_TYPE_SD1 = 1, // Standard capacity V1 SD card
@@ -22,6 +117,8 @@ public:
     SD_CARD_TYPE_SDHC, // High Capacity SD card
   };
   SDCardType type() const;
+  // type of a card that was identified without reading the OCR, e.g. by its CID
+  void setType(SDCardType type);
 
 private:
   void chipSelectHigh();
@@ -30,8 +127,14 @@ private:
   uint8_t cardAcmd(uint8_t cmd, uint32_t arg);
   void readEnd();
   bool waitNotBusy(unsigned int timeout_ms);
+  unsigned int eraseTimeout(uint32_t block, uint32_t count) const;
   bool waitStartBlock();
   bool readRegister(uint8_t cmd, void* buf);
+  bool readData(void* buf, uint8_t count);
+  bool readStop();
+  bool writeData(uint8_t token, const uint8_t *buffer);
+  static void recordPhase(uint8_t phase, uint32_t us);
+  uint32_t cardAddress(uint32_t block) const;
 
   uint8_t m_chip_select_pin;
   uint8_t m_status;
@@ -41,28 +144,42 @@ private:
   bool m_chip_select_asserted;
   bool m_inBlock;
   bool m_partialBlockRead;
+  uint8_t m_erase_timing[4];
   SPISettings m_spi_settings;
   
-  static unsigned int constexpr SD_INIT_TIMEOUT = 2000;
-  static unsigned int constexpr SD_READ_TIMEOUT = 300;
+  static unsigned int constexpr SD_ERASE_TIMEOUT = 1000; // lower bound of eraseTimeout()
+  static uint8_t constexpr SD_CMD0_RETRIES = 10;
 
   enum SDCardCommands {
     CMD0 = 0x00, // GO_IDLE_STATE - init card in spi mode if CS low
     CMD8 = 0x08, // SEND_IF_COND - verify SD Memory Card interface operating condition.
     CMD9 = 0x09, // SEND_CSD - read the Card Specific Data (CSD register)
     CMD10 = 0x0A, // SEND_CID - read the card identification information (CID register) 
+    CMD12 = 0x0C, // STOP_TRANSMISSION - end multiple block read sequence
+    CMD13 = 0x0D, // SEND_STATUS - read the card status register
     CMD17 = 0x11, // READ_BLOCK - read a single data block from the card
+    CMD18 = 0x12, // READ_MULTIPLE_BLOCK - read blocks from the card until CMD12
     CMD24 = 0x18, // WRITE_BLOCK - write a single data block to the card
+    CMD25 = 0x19, // WRITE_MULTIPLE_BLOCK - write blocks of data until a STOP_TRAN token is sent
+    CMD32 = 0x20, // ERASE_WR_BLK_START_ADDR - sets the address of the first block to be erased
+    CMD33 = 0x21, // ERASE_WR_BLK_END_ADDR - sets the address of the last block to be erased
+    CMD38 = 0x26, // ERASE - erases the selected blocks
     CMD55 = 0x37, // APP_CMD - escape for application specific command
     CMD58 = 0x3A, // READ_OCR - read the OCR register of a card
+    ACMD13 = 0x0D, // SD_STATUS - read the SD Status register
     ACMD23 = 0x17, // SET_WR_BLK_ERASE_COUNT - Set the number of write blocks to be pre-erased before writing
     ACMD41 = 0x29, // SD_SEND_OP_COMD - Sends host capacity support information and activates the card's initialization process
+    ACMD51 = 0x33, // SEND_SCR - read the SD Configuration Register
   };
   enum SDCardStatus {
     R1_READY_STATE = 0x00, // status for card in the ready state
     R1_IDLE_STATE = 0x01, // status for card in the idle state
     R1_ILLEGAL_COMMAND = 0x04, // status bit for illegal command
     DATA_START_BLOCK = 0xFE, // start data token for read or write single block
+    WRITE_MULTIPLE_TOKEN = 0xFC, // start data token for write multiple blocks
+    STOP_TRAN_TOKEN = 0xFD, // stop token for write multiple blocks
+    DATA_RES_MASK = 0x1F, // mask for data response tokens after a write block operation
+    DATA_RES_ACCEPTED = 0x05, // write data accepted token
   };
   
 };
@@ -1,132 +1,1024 @@
 #include "SDCardManager.h"
+#include "BufferArena.h"
+#include "EventLog.h"
+#include "MetadataCache.h"
+#include "SimMarkers.h"
+#include "Telemetry.h"
+#include "WriteLog.h"
+#include "ZeroMap.h"
 
 #include "Arduino.h"
 
+#include <avr/eeprom.h>
+#include <string.h>
+#include <util/crc16.h>
+
 SDCardDriver s_sdcard_driver;
 
 static uint32_t s_cached_total_blocks = 0;
-extern uint8_t s_sd_raw_block[512];
+static constexpr uint8_t *s_sd_raw_block = BufferArena_Lease(BUFFER_ARENA_BLOCK);
+
+static uint8_t s_chip_select_pin;
+static uint8_t s_medium_state = SDCARD_MEDIUM_NOT_PRESENT;
+static unsigned int s_state_time;
+static uint16_t s_card_id;
+static bool s_medium_changed = false;
+
+// The card behind the SPI bus, the default backend. Every block goes through the shared block
+// buffer: SDCardDriver::readBlock() checks the CRC16 of a block after all of it is in the buffer,
+// so a corrupted block is read again before any of it reaches the host, a failed write is retried
+// from the buffer, and the metadata cache and the write log see every block. Failed transfers are
+// retried and recovered within SDCARD_RECOVERY_BUDGET_MS.
+class SDCardBlockDevice : public BlockDevice {
+public:
+  uint32_t numBlocks() override;
+  uint16_t readBlocks(uint32_t lba, uint16_t count, Sink sink) override;
+  uint16_t writeBlocks(uint32_t lba, uint16_t count, Source source) override;
+};
+
+static SDCardBlockDevice s_card_device;
+static BlockDevice *s_block_device = &s_card_device;
+
+static void SDCardManager_SetMediumState(uint8_t state)
+{
+  s_medium_state = state;
+  s_state_time = millis();
+}
+
+#ifdef SDCARD_NULL_BACKEND
+// Null backend, the ceiling of the USB path: there is no card, reads return a pattern with the
+// block address in the first four bytes and writes are discarded. The data still goes through
+// the endpoint loops of SDCardManager_ReadBlocks() and SDCardManager_WriteBlocks(), only the
+// card accesses are replaced.
+static void SDCardManager_FillPattern(uint8_t *buffer)
+{
+  for (uint16_t i = 0; i < VIRTUAL_MEMORY_BLOCK_SIZE; ++i)
+    buffer[i] = i;
+}
+
+static bool SDCardManager_ReadBlock(uint32_t block, uint8_t *buffer)
+{
+  buffer[0] = block >> 24;
+  buffer[1] = block >> 16;
+  buffer[2] = block >> 8;
+  buffer[3] = block;
+  return true;
+}
+
+static bool SDCardManager_WriteBlock(uint32_t, const uint8_t *)
+{
+  return true;
+}
+
+static bool SDCardManager_WriteDone()
+{
+  return true;
+}
+
+static bool SDCardManager_EraseBlocks(uint32_t, uint32_t)
+{
+  return true;
+}
+#else
+static inline bool SDCardManager_ReadBlock(uint32_t block, uint8_t *buffer)
+{
+  return s_sdcard_driver.readBlock(block, buffer);
+}
+
+static inline bool SDCardManager_WriteBlock(uint32_t block, const uint8_t *buffer)
+{
+  return s_sdcard_driver.writeBlock(block, buffer);
+}
+
+static inline bool SDCardManager_WriteDone()
+{
+  return s_sdcard_driver.writeDone();
+}
+
+static inline bool SDCardManager_EraseBlocks(uint32_t block, uint32_t count)
+{
+  return s_sdcard_driver.eraseBlocks(block, count);
+}
+#endif
+
+#if SDCARD_ZERO_MAP_RANGES > 0
+// Zero blocks the host writes in place are erased in runs instead of written one by one, if the card
+// reads erased blocks as zeros (DATA_STAT_AFTER_ERASE of the SCR) and is a high capacity card, which
+// erases exactly the given blocks. The erased runs go into the zero map and reads of them are answered
+// without the card. The endpoint source ORs the bytes of every block together while it copies them,
+// so a zero block is found without another pass over the data.
+static bool s_erases_to_zero;
+static uint8_t s_received_bits;
+
+static void SDCardManager_ReadEraseState(void)
+{
+  uint8_t scr[8];
+  s_erases_to_zero = s_sdcard_driver.type() == SDCardDriver::SD_CARD_TYPE_SDHC && s_sdcard_driver.readSCR(scr) &&
+                     !(scr[1] & 0x80);
+
+  // the timeout of an erase grows with the AUs it touches, the block buffer is free while the card becomes ready
+  if (s_erases_to_zero && s_sdcard_driver.readSDStatus(s_sd_raw_block))
+    s_sdcard_driver.setEraseTiming(&s_sd_raw_block[10]);
+}
+
+static inline void SDCardManager_SetReceivedBits(uint8_t bits)
+{
+  s_received_bits = bits;
+}
+
+static inline bool SDCardManager_ReceivedZeroBlock(void)
+{
+  return s_erases_to_zero && !s_received_bits;
+}
+
+// the erase state of a known card is kept in its EEPROM profile
+static inline bool SDCardManager_GetEraseState(void)
+{
+  return s_erases_to_zero;
+}
+
+static inline void SDCardManager_SetEraseState(bool erases_to_zero)
+{
+  s_erases_to_zero = erases_to_zero;
+}
+#else
+static inline void SDCardManager_ReadEraseState(void) {}
+static inline bool SDCardManager_GetEraseState(void) { return false; }
+static inline void SDCardManager_SetEraseState(bool) {}
+static inline void SDCardManager_SetReceivedBits(uint8_t) {}
+static inline bool SDCardManager_ReceivedZeroBlock(void) { return false; }
+#endif
+
+// a block is only served from the zero map while its current data is in its home block
+static inline bool SDCardManager_KnownZero(uint32_t block)
+{
+  return ZeroMap_Contains(block) && WriteLog_Lookup(block) == block;
+}
+
+// reads the current data of a block, which may be in the write log
+static bool SDCardManager_ReadMapped(uint32_t block, uint8_t *buffer)
+{
+  return SDCardManager_ReadBlock(WriteLog_Lookup(block), buffer);
+}
+
+#if SDCARD_WRITE_LOG_BLOCKS > 0
+// fold step the card is still programming, the slot that was copied home or WRITE_LOG_NO_SLOT for
+// the commit of an empty log
+static bool s_fold_pending;
+static uint8_t s_fold_slot;
+
+// Restores the map of the write log of a new card from its last commit block, before the host
+// can read blocks that are only in the log.
+static bool SDCardManager_LoadLog(void)
+{
+  uint32_t au_blocks = 0;
+  s_fold_pending = false;
+  if (s_sdcard_driver.readSDStatus(s_sd_raw_block))
+    au_blocks = SDCardDriver::auBlocks(s_sd_raw_block[10] >> 4);
+
+  WriteLog_Reset(s_card_device.numBlocks() + SDCARD_WRITE_LOG_BLOCK, au_blocks);
+  for (uint8_t slot = 0; slot < SDCARD_WRITE_LOG_BLOCKS; ++slot) {
+    if (!SDCardManager_ReadBlock(WriteLog_SlotBlock(slot), s_sd_raw_block))
+      return false;
+    WriteLog_Load(slot, s_sd_raw_block);
+  }
+  return true;
+}
+
+// Starts a step of the background fold: copies one logged block back to its home block, or writes
+// the empty commit block the log starts over with once all blocks are in place. Returns as soon as
+// the card accepted the block, SDCardManager_FinishFold() takes the step as done. Uses the shared
+// block buffer, so only between the data stages.
+static bool SDCardManager_StartFold(void)
+{
+  uint8_t slot = WriteLog_NextFold();
+  if (slot != WRITE_LOG_NO_SLOT) {
+    ZeroMap_Remove(WriteLog_Home(slot), 1);
+    if (!SDCardManager_ReadBlock(WriteLog_SlotBlock(slot), s_sd_raw_block) ||
+        !SDCardManager_WriteBlock(WriteLog_Home(slot), s_sd_raw_block))
+      return false;
+  } else if (!SDCardManager_WriteBlock(WriteLog_BuildCommit(s_sd_raw_block, true), s_sd_raw_block)) {
+    return false;
+  }
+  s_fold_slot = slot;
+  s_fold_pending = true;
+  return true;
+}
+
+// true while the card is still programming the block of the last fold step
+static inline bool SDCardManager_FoldBusy(void)
+{
+  return s_fold_pending && s_sdcard_driver.writeBusy();
+}
+
+/** Waits for the fold step the card is programming and updates the write log once it succeeded.
+ *  Must be called before any other access to the card, so that no write to a logged block can
+ *  come between the copy of the block and the update of the map.
+ *
+ *  \return Boolean \c false if the fold step failed, it is then repeated later
+ */
+bool SDCardManager_FinishFold(void)
+{
+  if (!s_fold_pending)
+    return true;
+  s_fold_pending = false;
+  if (!SDCardManager_WriteDone())
+    return false;
+  if (s_fold_slot != WRITE_LOG_NO_SLOT)
+    WriteLog_Folded(s_fold_slot);
+  else
+    WriteLog_Committed(true);
+  return true;
+}
+#else
+static inline bool SDCardManager_LoadLog(void)
+{
+  return true;
+}
 
-bool SDCardManager_Init(uint8_t chipSelectPin)
+static inline bool SDCardManager_StartFold(void)
+{
+  return false;
+}
+
+static inline bool SDCardManager_FoldBusy(void)
+{
+  return false;
+}
+#endif
+
+static uint16_t SDCardManager_CardId(const uint8_t *cid)
+{
+  uint16_t card_id = 0;
+  for (uint8_t i = 0; i < 16; ++i)
+    card_id = _crc_xmodem_update(card_id, cid[i]);
+  return card_id;
+}
+
+static bool SDCardManager_ReadCardId(uint16_t *card_id)
+{
+  uint8_t cid[16];
+  if (!s_sdcard_driver.readCID(cid))
+    return false;
+  *card_id = SDCardManager_CardId(cid);
+  return true;
+}
+
+#if SDCARD_EEPROM_PROFILE
+// The type, the capacity and the erase state of the last card are kept in EEPROM, so that the same
+// card is ready after a reset or a re-insert without reading its OCR, CSD, SCR and SD Status again. The card is
+// recognized by the CRC of its CID and the product serial number in it, any other card goes through
+// the full discovery and replaces the profile. The checksum makes the sum of all bytes zero, so an
+// erased EEPROM or a profile that was cut off while it was written is never used.
+//
+// A byte takes 3.3 ms to program, so a new profile isn't written while the card becomes ready but
+// by SDCardManager_ProfileTask() between the commands, one byte whenever the EEPROM is idle. Only
+// bytes that changed are programmed, EEPROM cells take about 100000 writes.
+struct SDCardManager_Profile {
+  uint8_t version;
+  uint8_t checksum;
+  uint16_t card_id;        // CRC of the CID, see SDCardManager_CardId()
+  uint32_t blocks;         // capacity from the CSD
+  uint8_t serial[4];       // product serial number, bytes 9 to 12 of the CID
+  uint8_t type;            // SDCardDriver::SDCardType
+  uint8_t erases_to_zero;  // DATA_STAT_AFTER_ERASE of an SDHC card, see SDCardManager_ReadEraseState()
+  uint8_t erase_timing[4]; // bytes 10 to 13 of the SD Status, see SDCardDriver::setEraseTiming()
+};
+
+#define SDCARD_PROFILE_VERSION 3
+
+// profile of the last new card and the next of its bytes to compare with the EEPROM
+static SDCardManager_Profile s_profile;
+static uint8_t s_profile_byte = sizeof(SDCardManager_Profile);
+
+static uint8_t SDCardManager_ProfileSum(const SDCardManager_Profile *profile)
+{
+  const uint8_t *bytes = (const uint8_t *)profile;
+  uint8_t sum = 0;
+  for (uint8_t i = 0; i < sizeof(*profile); ++i)
+    sum += bytes[i];
+  return sum;
+}
+
+// takes the type, the capacity and the erase state from the profile if it was written for this card
+static bool SDCardManager_LoadProfile(const uint8_t *cid)
+{
+  SDCardManager_Profile profile;
+  eeprom_read_block(&profile, (const void *)SDCARD_EEPROM_PROFILE_ADDRESS, sizeof(profile));
+  if (profile.version != SDCARD_PROFILE_VERSION || SDCardManager_ProfileSum(&profile) ||
+      profile.card_id != s_card_id || memcmp(profile.serial, &cid[9], sizeof(profile.serial)) ||
+      !profile.blocks)
+    return false;
+  s_sdcard_driver.setType((SDCardDriver::SDCardType)profile.type);
+  s_cached_total_blocks = profile.blocks;
+  SDCardManager_SetEraseState(profile.erases_to_zero);
+  s_sdcard_driver.setEraseTiming(profile.erase_timing);
+  return true;
+}
+
+// the profile of a new card is only written by SDCardManager_ProfileTask()
+static void SDCardManager_StoreProfile(const uint8_t *cid)
+{
+  s_profile.version = SDCARD_PROFILE_VERSION;
+  s_profile.checksum = 0;
+  s_profile.type = s_sdcard_driver.type();
+  memcpy(s_profile.serial, &cid[9], sizeof(s_profile.serial));
+  s_profile.card_id = s_card_id;
+  s_profile.blocks = s_cached_total_blocks;
+  s_profile.erases_to_zero = SDCardManager_GetEraseState();
+  memcpy(s_profile.erase_timing, s_sdcard_driver.eraseTiming(), sizeof(s_profile.erase_timing));
+  s_profile.checksum = -SDCardManager_ProfileSum(&s_profile);
+  s_profile_byte = 0;
+}
+
+/** Writes the profile of a new card to the EEPROM, a task of the background scheduler. Every call
+ *  programs at most one changed byte and returns \c false while the EEPROM is still busy with the
+ *  last one, so the write never blocks a command. Returns \c true while there are more bytes to compare.
+ */
+bool SDCardManager_ProfileTask(void)
+{
+  if (s_profile_byte == sizeof(s_profile) || !eeprom_is_ready())
+    return false;
+  eeprom_update_byte((uint8_t *)SDCARD_EEPROM_PROFILE_ADDRESS + s_profile_byte,
+                     ((const uint8_t *)&s_profile)[s_profile_byte]);
+  ++s_profile_byte;
+  return s_profile_byte < sizeof(s_profile);
+}
+#else
+static inline bool SDCardManager_LoadProfile(const uint8_t *)
+{
+  return false;
+}
+
+static inline void SDCardManager_StoreProfile(const uint8_t *)
+{
+}
+#endif
+
+// Identifies a card after its initialization and finds its type and capacity, from the profile in
+// EEPROM if it is the same card as before or else from the OCR and the CSD. Returns the CID in cid
+// and sets known if the profile was used.
+static bool SDCardManager_Identify(uint8_t *cid, bool *known)
+{
+  if (!s_sdcard_driver.readCID(cid))
+    return false;
+  s_card_id = SDCardManager_CardId(cid);
+
+  *known = SDCardManager_LoadProfile(cid);
+  if (*known)
+    return true;
+
+  // the OCR is only left for later if there is a profile to check first
+  if (SDCARD_EEPROM_PROFILE && !s_sdcard_driver.readOCR())
+    return false;
+  s_cached_total_blocks = s_sdcard_driver.readCapacity();
+  return s_cached_total_blocks != 0;
+}
+
+/** Starts the background initialization of the card, the card is probed and initialized by
+ *  \ref SDCardManager_Task() so that USB enumeration is not delayed by the card.
+ *
+ *  \param[in] chipSelectPin  Arduino pin number of the card chip select line
+ */
+void SDCardManager_Init(uint8_t chipSelectPin)
 {
   s_sdcard_driver = SDCardDriver();
-  if (!s_sdcard_driver.init(chipSelectPin))
+  s_chip_select_pin = chipSelectPin;
+  s_cached_total_blocks = 0;
+  s_medium_state = SDCARD_MEDIUM_NOT_PRESENT;
+  s_state_time = millis() - SDCARD_PROBE_INTERVAL_MS;
+
+#ifdef SDCARD_NULL_BACKEND
+  s_cached_total_blocks = SDCARD_NULL_BACKEND_BLOCKS;
+  s_medium_changed = true;
+  SDCardManager_SetMediumState(SDCARD_MEDIUM_READY);
+#endif
+}
+
+/** Card detection state machine, must be called periodically between SCSI commands. An empty
+ *  slot is probed every \ref SDCARD_PROBE_INTERVAL_MS, a found card is initialized one ACMD41
+ *  at a time and an initialized card is checked every \ref SDCARD_PRESENCE_INTERVAL_MS so that
+ *  removed or swapped cards are noticed without a power cycle. Returns \c true while a card is being
+ *  initialized, so that the scheduler polls the card again while there is time left.
+ */
+bool SDCardManager_Task(void)
+{
+#ifdef SDCARD_NULL_BACKEND
+  return false;
+#endif
+  if (s_block_device != &s_card_device)
+    return false;
+  unsigned int elapsed = millis() - s_state_time;
+
+  switch (s_medium_state) {
+  case SDCARD_MEDIUM_NOT_PRESENT:
+    if (elapsed < SDCARD_PROBE_INTERVAL_MS)
+      break;
+    if (s_sdcard_driver.initBegin(s_chip_select_pin))
+      SDCardManager_SetMediumState(SDCARD_MEDIUM_BECOMING_READY);
+    else
+      SDCardManager_SetMediumState(SDCARD_MEDIUM_NOT_PRESENT);
+    break;
+
+  case SDCARD_MEDIUM_BECOMING_READY:
+    switch (s_sdcard_driver.initPoll(!SDCARD_EEPROM_PROFILE)) {
+    case SDCardDriver::SD_INIT_BUSY:
+      if (elapsed > SDCardDriver::SD_INIT_TIMEOUT)
+        SDCardManager_SetMediumState(SDCARD_MEDIUM_NOT_PRESENT);
+      break;
+    case SDCardDriver::SD_INIT_DONE: {
+      unsigned int found_time = s_state_time;
+      uint8_t cid[16];
+      bool known;
+      if (!SDCardManager_Identify(cid, &known) || !SDCardManager_LoadLog()) {
+        s_cached_total_blocks = 0;
+        SDCardManager_SetMediumState(SDCARD_MEDIUM_NOT_PRESENT);
+        break;
+      }
+      if (!known) {
+        SDCardManager_ReadEraseState();
+        SDCardManager_StoreProfile(cid);
+      }
+      // the host has to be told about a new medium with a UNIT ATTENTION
+      s_medium_changed = true;
+      MetadataCache_Reset();
+      ZeroMap_Reset();
+      SDCardManager_SetMediumState(SDCARD_MEDIUM_READY);
+      // the time from the probe that found the card, the timestamp of the record is the time since boot
+      EventLog_Add(EVENT_LOG_CARD_READY, known, s_state_time - found_time, s_cached_total_blocks);
+      break;
+    }
+    default:
+      SDCardManager_SetMediumState(SDCARD_MEDIUM_NOT_PRESENT);
+      break;
+    }
+    break;
+
+  case SDCARD_MEDIUM_READY:
+    // the layout is read between commands, the block buffer is free here
+    SDCardManager_FinishFold();
+    if (MetadataCache_NeedsScan())
+      MetadataCache_Scan(SDCardManager_ReadMapped, s_sd_raw_block);
+    if (elapsed < SDCARD_PRESENCE_INTERVAL_MS)
+      break;
+    if (s_sdcard_driver.isPresent()) {
+      SDCardManager_SetMediumState(SDCARD_MEDIUM_READY);
+    } else {
+      EventLog_Add(EVENT_LOG_CARD_REMOVED, 0, 0, 0);
+      MetadataCache_Reset();
+      s_cached_total_blocks = 0;
+      SDCardManager_SetMediumState(SDCARD_MEDIUM_NOT_PRESENT);
+    }
+    break;
+  }
+  return s_medium_state == SDCARD_MEDIUM_BECOMING_READY;
+}
+
+/** Folds the blocks of the write log back to their home blocks once the host stopped writing, a task
+ *  of the background scheduler. Every call either starts the copy of one block or checks if the card
+ *  finished programming it, so the scheduler looks for the next command while the card is busy.
+ *  Returns \c true while there are more blocks to fold.
+ */
+bool SDCardManager_FoldTask(void)
+{
+  if (s_medium_state != SDCARD_MEDIUM_READY || s_block_device != &s_card_device)
+    return false;
+  if (SDCardManager_FoldBusy())
+    return true;
+  if (!SDCardManager_FinishFold() || !WriteLog_WantsFold())
     return false;
-  //delay(100);
-  s_cached_total_blocks = s_sdcard_driver.readCapacity() / VIRTUAL_MEMORY_BLOCK_SIZE;
-  return (s_cached_total_blocks > 0);
+  return SDCardManager_StartFold();
+}
+
+/** Returns the state of the medium, one of the values of \ref SDCardManager_MediumState_t. */
+uint8_t SDCardManager_GetMediumState(void)
+{
+  return s_medium_state;
 }
 
+/** Returns \c true once after a card became ready, so that the SCSI layer can report a
+ *  UNIT ATTENTION condition for the changed medium to the host.
+ */
+bool SDCardManager_TakeMediumChanged(void)
+{
+  bool changed = s_medium_changed;
+  s_medium_changed = false;
+  return changed;
+}
+
+/** Returns the number of blocks visible to the host, without the reserved area at the end of the card. */
 uint32_t SDCardManager_NumBlocks(void)
 {
-  return s_cached_total_blocks;
+  return s_block_device->numBlocks();
+}
+
+/** Writes a block of the reserved area at the end of the card, which the host can't access. The
+ *  block is built in the shared block buffer, so this must only be called between SCSI commands.
+ *
+ *  \param[in] Block  Block number relative to the start of the reserved area
+ *  \param[in] Fill   Function that fills the 512 byte block buffer with the data to write
+ *
+ *  \return Boolean \c true if the block was written, \c false if no card is ready or the write failed
+ */
+bool SDCardManager_WriteReservedBlock(uint16_t Block, void (*Fill)(uint8_t *Buffer))
+{
+  if (s_medium_state != SDCARD_MEDIUM_READY || s_block_device != &s_card_device ||
+      Block >= SDCARD_RESERVED_BLOCKS || s_cached_total_blocks <= SDCARD_RESERVED_BLOCKS)
+    return false;
+
+  SDCardManager_FinishFold();
+  Fill(s_sd_raw_block);
+  if (!SDCardManager_WriteBlock(s_card_device.numBlocks() + Block, s_sd_raw_block))
+    return false;
+  return SDCardManager_WriteDone();
+}
+
+/** Reads the registers that describe the geometry of the card, so that a host side formatter can
+ *  align the filesystem to its allocation units. The registers are read into the shared block
+ *  buffer, so this must only be called between block transfers.
+ *
+ *  \return Pointer to the CSD, CID and SD Status, \ref SDCARD_REGISTERS_LENGTH bytes, or a null
+ *          pointer if no card is ready or a register could not be read
+ */
+const uint8_t *SDCardManager_ReadRegisters(void)
+{
+#ifdef SDCARD_NULL_BACKEND
+  return 0;
+#else
+  SDCardManager_FinishFold();
+  if (s_medium_state != SDCARD_MEDIUM_READY || s_block_device != &s_card_device ||
+      !s_sdcard_driver.readCSD(&s_sd_raw_block[0]) ||
+      !s_sdcard_driver.readCID(&s_sd_raw_block[16]) || !s_sdcard_driver.readSDStatus(&s_sd_raw_block[32]))
+    return 0;
+  return s_sd_raw_block;
+#endif
+}
+
+// Longest a failed block transfer takes: the wait for the card to leave busy and for its data.
+#define SDCARD_RECOVERY_ATTEMPT_MS (SDCardDriver::SD_BUSY_TIMEOUT + SDCardDriver::SD_READ_TIMEOUT)
+
+/** Recovers from a failed block transfer within the recovery budget of the current command. The
+ *  first \ref SDCARD_IO_RETRIES attempts back off for 1, 2, 4, ... ms before the block is retried,
+ *  after that the card is re-initialized once. If the card can not be re-initialized or a different
+ *  card was found, the medium is reported as not present.
+ *
+ *  \param[in] Attempt    Number of failed attempts for the current block, starting at 0
+ *  \param[in] StartTime  Value of millis() at the start of the current command
+ *
+ *  \return Boolean \c true if the block should be retried, \c false if the transfer has to be aborted
+ */
+static bool SDCardManager_Recover(uint8_t Attempt, unsigned int StartTime)
+{
+  SDCardDriver::SDInitStatus status;
+  uint16_t card_id;
+
+  // only start an attempt that can still time out within the budget
+  unsigned int elapsed = millis() - StartTime;
+  if (elapsed >= SDCARD_RECOVERY_BUDGET_MS ||
+      SDCARD_RECOVERY_BUDGET_MS - elapsed < SDCARD_RECOVERY_ATTEMPT_MS + (1 << Attempt))
+    return false;
+
+  Telemetry_Add(TELEMETRY_RETRIES, 1);
+  if (Attempt < SDCARD_IO_RETRIES) {
+    delay(1 << Attempt);
+    return true;
+  }
+  if (Attempt > SDCARD_IO_RETRIES)
+    return false;
+
+  EventLog_Add(EVENT_LOG_CARD_REINIT, 0, 0, 0);
+
+  // re-initialize the card with the remaining budget, keeping enough of it to retry the transfer
+  if (!s_sdcard_driver.initBegin(s_chip_select_pin))
+    goto removed;
+  while ((status = s_sdcard_driver.initPoll()) == SDCardDriver::SD_INIT_BUSY) {
+    elapsed = millis() - StartTime;
+    if (elapsed >= SDCARD_RECOVERY_BUDGET_MS - SDCARD_RECOVERY_ATTEMPT_MS)
+      goto removed;
+  }
+  if (status != SDCardDriver::SD_INIT_DONE)
+    goto removed;
+
+  // never continue a transfer on a card that was swapped in the meantime
+  if (!SDCardManager_ReadCardId(&card_id) || card_id != s_card_id)
+    goto removed;
+  return true;
+
+removed:
+  MetadataCache_Reset();
+  s_cached_total_blocks = 0;
+  SDCardManager_SetMediumState(SDCARD_MEDIUM_NOT_PRESENT);
+  return false;
+}
+
+/** Verifies blocks on the storage medium without transferring them over USB. The blocks are read
+ *  from the card with multi-block reads and the CRC16 of every block is checked, a block that is in
+ *  the write log is verified in its slot. A failed read is retried like in a READ command.
+ *
+ *  \param[in]  BlockAddress        Data block starting address for the verify sequence
+ *  \param[in]  TotalBlocks         Number of blocks of data to verify
+ *  \param[out] FailedBlockAddress  Address of the first block that failed verification
+ *
+ *  \return Boolean \c true if all blocks could be read with a valid CRC, \c false otherwise
+ */
+bool SDCardManager_VerifyBlocks(uint32_t BlockAddress, uint16_t TotalBlocks,
+                                uint32_t *FailedBlockAddress)
+{
+  EventLog_Add(EVENT_LOG_VERIFY, 0, TotalBlocks, BlockAddress);
+
+#ifdef SDCARD_NULL_BACKEND
+  (void)FailedBlockAddress;
+  return true;
+#else
+  // only the card has a CRC to check the blocks against
+  if (s_block_device != &s_card_device)
+    return true;
+
+  SDCardManager_FinishFold();
+  unsigned int start_time = millis();
+  uint8_t attempt = 0;
+  while (TotalBlocks > 0) {
+    // a logged block is read from its slot on its own, a run of blocks at home in one read
+    uint32_t block = WriteLog_Lookup(BlockAddress);
+    uint16_t run = 1;
+    if (block == BlockAddress) {
+      while (run < TotalBlocks && WriteLog_Lookup(BlockAddress + run) == BlockAddress + run)
+        run++;
+    }
+
+    uint32_t failed_block;
+    bool verified = s_sdcard_driver.verifyBlocks(block, run, &failed_block);
+
+    // the blocks before the failed one are not read again
+    uint16_t blocks_verified = verified ? run : failed_block - block;
+    BlockAddress += blocks_verified;
+    TotalBlocks -= blocks_verified;
+    if (blocks_verified)
+      attempt = 0;
+    if (!verified && !SDCardManager_Recover(attempt++, start_time)) {
+      *FailedBlockAddress = BlockAddress;
+      return false;
+    }
+  }
+  return true;
+#endif
+}
+
+uint32_t SDCardBlockDevice::numBlocks()
+{
+  if (s_cached_total_blocks <= SDCARD_RESERVED_BLOCKS)
+    return 0;
+  return s_cached_total_blocks - SDCARD_RESERVED_BLOCKS;
+}
+
+// Erases a run of zero blocks the host wrote in place, afterwards they are known to read as zeros.
+// The cache still holds the data from before the erase, after a failed erase the blocks are unknown.
+static bool SDCardManager_EraseZeros(uint32_t block, uint16_t count, unsigned int start_time)
+{
+  bool erased;
+  for (uint8_t attempt = 0; !(erased = SDCardManager_EraseBlocks(block, count)); ++attempt) {
+    if (!SDCardManager_Recover(attempt, start_time))
+      break;
+  }
+  for (uint16_t i = 0; i < count; ++i)
+    MetadataCache_Invalidate(block + i);
+  if (erased)
+    ZeroMap_Add(block, count);
+  return erased;
+}
+
+uint16_t SDCardBlockDevice::writeBlocks(uint32_t lba, uint16_t count, Source source)
+{
+  unsigned int start_time = millis();
+  uint16_t blocks_written = 0;
+  uint32_t first_block = lba;
+  uint32_t zero_block = lba;
+  uint16_t zero_blocks = 0;
+  bool programming = false;
+  SDCardManager_FinishFold();
+  bool logged = WriteLog_Accepts(lba, count);
+  uint32_t target = logged ? WriteLog_HeadBlock() : lba;
+
+  /* The blocks are only known to be zero again once they are erased */
+  ZeroMap_Remove(lba, count);
+
+  /* A failed transfer ends the loop, the blocks received before it are still completed and committed below */
+  while (blocks_written < count) {
+    if (!source(s_sd_raw_block, VIRTUAL_MEMORY_BLOCK_SIZE))
+      break;
+
+    /* A write in place of a logged block goes to its slot, only a block that is at home can be erased */
+    if (!logged)
+      target = WriteLog_Redirect(lba);
+
+    if (!logged && target == lba && SDCardManager_ReceivedZeroBlock()) {
+      /* Zero blocks are collected into a run that is erased at once, after the previous block was programmed */
+      if (programming && !SDCardManager_WriteDone()) {
+        MetadataCache_Invalidate(lba - 1);
+        blocks_written--;
+        programming = false;
+        break;
+      }
+      programming = false;
+      if (!zero_blocks)
+        zero_block = lba;
+      zero_blocks++;
+    } else {
+      /* A block with data ends the run of zero blocks */
+      if (zero_blocks && !SDCardManager_EraseZeros(zero_block, zero_blocks, start_time)) {
+        blocks_written -= zero_blocks;
+        zero_blocks = 0;
+        break;
+      }
+      zero_blocks = 0;
+
+      /* The previous block was programmed while this one was received, its data is gone so it can't be retried */
+      SimMarker(SIM_MARKER_SPI_WRITE_BEGIN);
+      if (programming && !SDCardManager_WriteDone()) {
+        MetadataCache_Invalidate(lba - 1);
+        blocks_written--;
+        programming = false;
+        break;
+      }
+
+      bool written;
+      for (uint8_t attempt = 0; !(written = SDCardManager_WriteBlock(target, s_sd_raw_block)); ++attempt) {
+        if (!SDCardManager_Recover(attempt, start_time))
+          break;
+      }
+      if (!written) {
+        /* The block may be partly programmed, the cache must not keep its old data */
+        MetadataCache_Invalidate(lba);
+        programming = false;
+        break;
+      }
+      SimMarker(SIM_MARKER_SPI_WRITE_END);
+      programming = true;
+      MetadataCache_Update(lba, s_sd_raw_block);
+    }
+
+    /* Increment the blocks written counter */
+    lba++;
+    target++;
+    blocks_written++;
+  }
+
+  /* Only report success once the card finished programming the last block or erasing the last run */
+  if (zero_blocks) {
+    if (!SDCardManager_EraseZeros(zero_block, zero_blocks, start_time))
+      blocks_written -= zero_blocks;
+  } else if (programming && !SDCardManager_WriteDone()) {
+    MetadataCache_Invalidate(lba - 1);
+    blocks_written--;
+  }
+
+  /* Point the write log at the new data, the write only counts once the commit block is programmed. Logged
+   * blocks without a commit are lost after the next reset, so they are reported as not written at all. */
+  if (logged && WriteLog_Commit(first_block, blocks_written)) {
+    uint32_t commit_block = WriteLog_BuildCommit(s_sd_raw_block, false);
+    if (SDCardManager_WriteBlock(commit_block, s_sd_raw_block) && SDCardManager_WriteDone()) {
+      WriteLog_Committed(false);
+    } else {
+      for (uint16_t i = 0; i < blocks_written; ++i)
+        MetadataCache_Invalidate(first_block + i);
+      blocks_written = 0;
+    }
+  }
+
+  return blocks_written;
+}
+
+uint16_t SDCardBlockDevice::readBlocks(uint32_t lba, uint16_t count, Sink sink)
+{
+  unsigned int start_time = millis();
+  uint16_t blocks_read = 0;
+  SDCardManager_FinishFold();
+
+#ifdef SDCARD_NULL_BACKEND
+  /* The block buffer is shared, the pattern is rebuilt once per command */
+  SDCardManager_FillPattern(s_sd_raw_block);
+#endif
+
+  /* The block buffer holds a zero block for blocks of the zero map */
+  bool zeros = false;
+
+  while (blocks_read < count) {
+    /* Filesystem metadata may come from the cache, erased blocks from the zero map, file data from the card */
+    const uint8_t *buffer = MetadataCache_Lookup(lba);
+    if (!buffer && SDCardManager_KnownZero(lba)) {
+      if (!zeros)
+        memset(s_sd_raw_block, 0, VIRTUAL_MEMORY_BLOCK_SIZE);
+      zeros = true;
+      buffer = s_sd_raw_block;
+    }
+    if (!buffer) {
+      SimMarker(SIM_MARKER_SPI_READ_BEGIN);
+      for (uint8_t attempt = 0; !SDCardManager_ReadMapped(lba, s_sd_raw_block); ++attempt) {
+        if (!SDCardManager_Recover(attempt, start_time))
+          return blocks_read;
+      }
+      SimMarker(SIM_MARKER_SPI_READ_END);
+      MetadataCache_Fill(lba, s_sd_raw_block);
+      buffer = s_sd_raw_block;
+      zeros = false;
+    }
+
+    if (!sink(buffer, VIRTUAL_MEMORY_BLOCK_SIZE))
+      return blocks_read;
+
+    /* Increment the blocks read counter */
+    lba++;
+    blocks_read++;
+  }
+
+  return blocks_read;
+}
+
+// state of the current transfer for the endpoint sink and source
+static USB_ClassInfo_MS_Device_t *s_transfer_interface;
+static bool s_transfer_aborted;
+
+// Sink of the backends, sends whole blocks on the pre-selected data IN endpoint.
+static bool SDCardManager_SendToHost(const uint8_t *data, uint16_t length)
+{
+  for (uint16_t offset = 0; offset < length; offset += MASS_STORAGE_IO_EPSIZE) {
+    if (!Endpoint_IsReadWriteAllowed()) {
+      Endpoint_ClearIN();
+      if (Endpoint_WaitUntilReady()) {
+        s_transfer_aborted = true;
+        return false;
+      }
+    }
+
+    SimMarker(SIM_MARKER_USB_IN_BEGIN);
+    for (uint8_t i = 0; i < MASS_STORAGE_IO_EPSIZE; ++i, ++data)
+      Endpoint_Write_8(*data);
+    SimMarker(SIM_MARKER_USB_IN_END);
+  }
+
+  /* Check if the current command is being aborted by the host */
+  if (s_transfer_interface->State.IsMassStoreReset)
+    s_transfer_aborted = true;
+  return !s_transfer_aborted;
 }
 
-bool SDCardManager_CheckDataflashOperation()
+// Source of the backends, receives whole blocks from the pre-selected data OUT endpoint.
+static bool SDCardManager_ReceiveFromHost(uint8_t *data, uint16_t length)
 {
+  uint8_t bits = 0;
+
+  for (uint16_t offset = 0; offset < length; offset += MASS_STORAGE_IO_EPSIZE) {
+    if (!Endpoint_IsReadWriteAllowed()) {
+      Endpoint_ClearOUT();
+      if (Endpoint_WaitUntilReady()) {
+        s_transfer_aborted = true;
+        return false;
+      }
+    }
+
+    SimMarker(SIM_MARKER_USB_OUT_BEGIN);
+    for (uint8_t i = 0; i < MASS_STORAGE_IO_EPSIZE; ++i, ++data) {
+      *data = Endpoint_Read_8();
+      bits |= *data;
+    }
+    SimMarker(SIM_MARKER_USB_OUT_END);
+
+    /* Check if the current command is being aborted by the host */
+    if (s_transfer_interface->State.IsMassStoreReset) {
+      s_transfer_aborted = true;
+      return false;
+    }
+  }
+  SDCardManager_SetReceivedBits(bits);
   return true;
 }
 
-/** Writes blocks (OS blocks, not Dataflash pages) to the storage medium, the board Dataflash IC(s),
- * from
- *  the pre-selected data OUT endpoint. This routine reads in OS sized blocks from the endpoint and
- * writes
- *  them to the Dataflash in Dataflash page sized blocks.
+/** Replaces the storage behind the LUN, the medium is reported as changed and ready right away.
+ *  Card detection and the reserved area of the card are only used with the card backend.
+ *
+ *  \param[in] Device  Backend for the blocks of the LUN, a null pointer selects the card
+ */
+void SDCardManager_SetBlockDevice(BlockDevice *Device)
+{
+  s_block_device = Device ? Device : &s_card_device;
+  s_medium_changed = true;
+  if (Device)
+    SDCardManager_SetMediumState(SDCARD_MEDIUM_READY);
+  else
+    SDCardManager_Init(s_chip_select_pin);
+}
+
+/** Writes blocks (OS blocks, not Dataflash pages) to the storage medium from the pre-selected data
+ *  OUT endpoint. The backend pulls the data of the blocks from the endpoint as it needs it.
  *
  *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration
  * and state
  *  \param[in] BlockAddress  Data block starting address for the write sequence
  *  \param[in] TotalBlocks   Number of blocks of data to write
+ *
+ *  \return Number of blocks that were written, less than \c TotalBlocks if the transfer failed
  */
-void SDCardManager_WriteBlocks(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo,
-                               uint32_t BlockAddress, uint16_t TotalBlocks) 
-{
-#ifdef SDCARD_DRIVER_DEBUG
-  Serial1.print("W ");
-  Serial1.print(BlockAddress);
-  Serial1.write(' ');
-  Serial1.println(TotalBlocks);
-#endif
+uint16_t SDCardManager_WriteBlocks(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo,
+                                   uint32_t BlockAddress, uint16_t TotalBlocks) 
+{
+  EventLog_Add(EVENT_LOG_WRITE, 0, TotalBlocks, BlockAddress);
 
    /* Wait until endpoint is ready before continuing */
   if (Endpoint_WaitUntilReady())
-    return;
-
-  while (TotalBlocks) {
-    uint8_t *buffer = s_sd_raw_block;
-    for (uint16_t offset = 0; offset < VIRTUAL_MEMORY_BLOCK_SIZE; offset += MASS_STORAGE_IO_EPSIZE) {
-      if (!Endpoint_IsReadWriteAllowed()) {
-        Endpoint_ClearOUT();
-        if (Endpoint_WaitUntilReady())
-          break;
-      }
-      
-      for (uint8_t i = 0; i < MASS_STORAGE_IO_EPSIZE; ++i, ++buffer)
-        *buffer = Endpoint_Read_8();
-      
-      /* Check if the current command is being aborted by the host */
-      if (MSInterfaceInfo->State.IsMassStoreReset)
-        return;
-    }
-    if (!s_sdcard_driver.writeBlock(BlockAddress * VIRTUAL_MEMORY_BLOCK_SIZE, s_sd_raw_block))
-      break;
+    return 0;
 
-    /* Decrement the blocks remaining counter */
-    BlockAddress++;
-    TotalBlocks--;
-  }
+  s_transfer_interface = MSInterfaceInfo;
+  s_transfer_aborted = false;
+  uint16_t blocks_written = s_block_device->writeBlocks(BlockAddress, TotalBlocks, SDCardManager_ReceiveFromHost);
+  WriteLog_Touch();
 
   /* If the endpoint is empty, clear it ready for the next packet from the host */
-  if (!(Endpoint_IsReadWriteAllowed()))
+  if (!s_transfer_aborted && !(Endpoint_IsReadWriteAllowed()))
       Endpoint_ClearOUT();
+
+  return blocks_written;
 }
 
-/** Reads blocks (OS blocks, not Dataflash pages) from the storage medium, the board Dataflash
- * IC(s), into
- *  the pre-selected data IN endpoint. This routine reads in Dataflash page sized blocks from the
- * Dataflash
- *  and writes them in OS sized blocks to the endpoint.
+/** Reads blocks (OS blocks, not Dataflash pages) from the storage medium into the pre-selected data
+ *  IN endpoint. The backend pushes the data of the blocks into the endpoint as it has it.
  *
  *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration
  * and state
  *  \param[in] BlockAddress  Data block starting address for the read sequence
  *  \param[in] TotalBlocks   Number of blocks of data to read
+ *
+ *  \return Number of blocks that were read, less than \c TotalBlocks if the transfer failed
  */
-void SDCardManager_ReadBlocks(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo,
-                          uint32_t BlockAddress, uint16_t TotalBlocks) 
-{
-#ifdef SDCARD_DRIVER_DEBUG
-  Serial1.print("R ");
-  Serial1.print(BlockAddress);
-  Serial1.write(' ');
-  Serial1.println(TotalBlocks);
-#endif
+uint16_t SDCardManager_ReadBlocks(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo,
+                                  uint32_t BlockAddress, uint16_t TotalBlocks) 
+{
+  EventLog_Add(EVENT_LOG_READ, 0, TotalBlocks, BlockAddress);
   
   /* Wait until endpoint is ready before continuing */
   if (Endpoint_WaitUntilReady())
-    return;
+    return 0;
 
-  while (TotalBlocks) {
-    if (!s_sdcard_driver.readBlock(BlockAddress * VIRTUAL_MEMORY_BLOCK_SIZE, s_sd_raw_block))
-      break;
-    uint8_t *buffer = s_sd_raw_block;
-    for (uint16_t offset = 0; offset < VIRTUAL_MEMORY_BLOCK_SIZE; offset += MASS_STORAGE_IO_EPSIZE) {
-      if (!Endpoint_IsReadWriteAllowed())  {
-        Endpoint_ClearIN();
-        if (Endpoint_WaitUntilReady())
-          break;
-      }
-    
-      for (uint8_t i = 0; i < MASS_STORAGE_IO_EPSIZE; ++i, ++buffer)
-        Endpoint_Write_8(*buffer);
-    }
-      
-    /* Decrement the blocks remaining counter and reset the sub block counter */
-    BlockAddress++;
-    TotalBlocks--;
+  s_transfer_interface = MSInterfaceInfo;
+  s_transfer_aborted = false;
+  uint16_t blocks_read = s_block_device->readBlocks(BlockAddress, TotalBlocks, SDCardManager_SendToHost);
+  WriteLog_Touch();
+
+  /* If the endpoint is full, send its contents to the host */
+  if (!s_transfer_aborted && !(Endpoint_IsReadWriteAllowed()))
+    Endpoint_ClearIN();
+
+  return blocks_read;
+}
+
+#ifdef SDCARD_DRIVER_PROFILE
+static_assert(SDCardDriver::PHASE_BUCKETS == SDCARD_PROFILE_BUCKETS, "SPI phase histogram size mismatch");
+static_assert(SDCardDriver::PHASE_COUNT * SDCARD_PROFILE_PARAMETER_SIZE == SDCARD_PROFILE_PAGE_LENGTH, "SPI phase log page size mismatch");
+
+static uint8_t *SDCardManager_Put32(uint8_t *buffer, uint32_t value)
+{
+  *buffer++ = value >> 24;
+  *buffer++ = value >> 16;
+  *buffer++ = value >> 8;
+  *buffer++ = value;
+  return buffer;
+}
+
+/** Fills a buffer with a LOG SENSE parameter of the SPI phase log page. There is one binary parameter
+ *  per phase of \ref SDCardDriver::Phase with the number of samples, the total, minimum and maximum
+ *  time in microseconds and the histogram bucket counts.
+ *
+ *  \param[in]  Index   Index of the parameter, equal to the phase
+ *  \param[out] Buffer  Buffer of at least \ref SDCARD_PROFILE_PARAMETER_SIZE bytes for the parameter
+ *
+ *  \return Size of the parameter in bytes, or zero if there are no more parameters
+ */
+uint8_t SDCardManager_GetProfileParameter(const uint8_t Index, uint8_t *const Buffer)
+{
+  if (Index >= SDCardDriver::PHASE_COUNT)
+    return 0;
+
+  const SDCardDriver::PhaseStats &stats = SDCardDriver::phaseStats(Index);
+  uint8_t *data = &Buffer[4];
+  data = SDCardManager_Put32(data, stats.count);
+  data = SDCardManager_Put32(data, stats.total_us);
+  data = SDCardManager_Put32(data, stats.min_us);
+  data = SDCardManager_Put32(data, stats.max_us);
+  for (uint8_t i = 0; i < SDCARD_PROFILE_BUCKETS; ++i) {
+    *data++ = stats.buckets[i] >> 8;
+    *data++ = stats.buckets[i];
   }
 
-  /* If the endpoint is empty, clear it ready for the next packet from the host */
-  if (!(Endpoint_IsReadWriteAllowed()))
-    Endpoint_ClearOUT();
+  // binary format parameter
+  Buffer[0] = 0;
+  Buffer[1] = Index;
+  Buffer[2] = 0x03;
+  Buffer[3] = SDCARD_PROFILE_PARAMETER_SIZE - 4;
+  return SDCARD_PROFILE_PARAMETER_SIZE;
 }
+
+/** Clears the SPI phase timing, used by the LOG SELECT parameter code reset. */
+void SDCardManager_ResetProfile(void)
+{
+  SDCardDriver::resetPhaseStats();
+}
+#endif
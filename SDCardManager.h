@@ -38,13 +38,17 @@
 
 #if defined(__cplusplus)
 
+#include "BlockDevice.h"
 #include "SDCardDriver.h"
 
 extern SDCardDriver s_sdcard_driver;
 
+void SDCardManager_SetBlockDevice(BlockDevice *Device);
+
 extern "C" {
 #endif
 #include "Descriptors.h"
+#include "CommandTrace.h"
 
 #define DISK_READ_ONLY              false
 #define TOTAL_LUNS                  1
@@ -53,18 +57,164 @@ extern "C" {
 
 #define LUN_MEDIA_BLOCKS            (SDCardManager_NumBlocks() / TOTAL_LUNS)    
 
-bool SDCardManager_Init(uint8_t chipSelectPin);
+#if !defined(SDCARD_LOGICAL_BLOCK_SIZE)
+/** Size in bytes of the logical blocks the host addresses, 512 or 4096. With 4096 every LBA of the host is a
+ *  transfer of 8 blocks of the card, so the host never writes less than 4 KiB. The card has to be reformatted
+ *  after this is changed.
+ */
+#define SDCARD_LOGICAL_BLOCK_SIZE   VIRTUAL_MEMORY_BLOCK_SIZE
+#endif
+
+#if (SDCARD_LOGICAL_BLOCK_SIZE == 512)
+#define SDCARD_LOGICAL_BLOCK_SHIFT  0
+#elif (SDCARD_LOGICAL_BLOCK_SIZE == 4096)
+#define SDCARD_LOGICAL_BLOCK_SHIFT  3
+#else
+#error "SDCARD_LOGICAL_BLOCK_SIZE must be 512 or 4096"
+#endif
+
+/** Number of logical blocks of a LUN as reported to the host, \ref LUN_MEDIA_BLOCKS are blocks of the card. */
+#define LUN_LOGICAL_BLOCKS          (LUN_MEDIA_BLOCKS >> SDCARD_LOGICAL_BLOCK_SHIFT)
+
+/** Logical blocks per physical block as a power of two, reported in READ CAPACITY (16) so that hosts align
+ *  their I/O to 4 KiB, the smallest unit cards program efficiently, even with 512 byte logical blocks.
+ */
+#define SDCARD_PHYSICAL_BLOCK_EXPONENT (3 - SDCARD_LOGICAL_BLOCK_SHIFT)
+
+/** Interval in milliseconds between attempts to initialize a card while the slot is empty. */
+#define SDCARD_PROBE_INTERVAL_MS    250
+
+/** Interval in milliseconds between checks that an initialized card is still inserted. */
+#define SDCARD_PRESENCE_INTERVAL_MS 500
+
+/** Number of times a failed block transfer is retried before the card is re-initialized. */
+#define SDCARD_IO_RETRIES           3
+
+/** Maximum time in milliseconds spent on retries and card re-initialization during one SCSI
+ *  command, so that the command completes well before the host's command timeout.
+ */
+#define SDCARD_RECOVERY_BUDGET_MS   2000
+
+#if !defined(SDCARD_SELFTEST_BLOCKS)
+/** Number of blocks of the scratch area the self-test writes to, zero to only run the read tests. */
+#define SDCARD_SELFTEST_BLOCKS      0
+#endif
+
+#if !defined(SDCARD_WRITE_LOG_BLOCKS)
+/** Number of blocks of the write log that small random writes are appended to, zero to write them in place. */
+#define SDCARD_WRITE_LOG_BLOCKS     0
+#endif
+
+#if !defined(SDCARD_ZERO_MAP_RANGES)
+/** Number of ranges of erased blocks that reads answer with zeros, zero to write zero blocks like any other. */
+#define SDCARD_ZERO_MAP_RANGES      0
+#endif
+
+#if !defined(SDCARD_EEPROM_PROFILE)
+/** Set to 1 to keep the type, capacity and erase state of the last card in EEPROM, the same card is then ready
+ *  without reading its OCR, CSD and SCR again.
+ */
+#define SDCARD_EEPROM_PROFILE       0
+#endif
+
+#if !defined(SDCARD_EEPROM_PROFILE_ADDRESS)
+/** EEPROM address of the card profile, it takes 14 bytes. */
+#define SDCARD_EEPROM_PROFILE_ADDRESS 0
+#endif
+
+#if defined(SDCARD_NULL_BACKEND) && !defined(SDCARD_NULL_BACKEND_BLOCKS)
+/** Size of the medium of the null backend in blocks, 1 GiB. */
+#define SDCARD_NULL_BACKEND_BLOCKS  2097152UL
+#endif
+
+/** Number of blocks at the end of the card that are reserved for the firmware and hidden from the
+ *  host. A card has to be reformatted after this is changed.
+ */
+#define SDCARD_RESERVED_BLOCKS      (COMMAND_TRACE_SPILL_BLOCKS + SDCARD_SELFTEST_BLOCKS + SDCARD_WRITE_LOG_BLOCKS)
+
+/** First block of the command trace spill area, relative to the start of the reserved area. */
+#define SDCARD_TRACE_SPILL_BLOCK    0
+
+/** First block of the self-test scratch area, relative to the start of the reserved area. */
+#define SDCARD_SELFTEST_BLOCK       (SDCARD_TRACE_SPILL_BLOCK + COMMAND_TRACE_SPILL_BLOCKS)
+
+/** First block of the write log relative to the start of the reserved area. The log takes the last
+ *  blocks of the card, so it doesn't straddle an allocation unit if its size is a power of two.
+ */
+#define SDCARD_WRITE_LOG_BLOCK      (SDCARD_SELFTEST_BLOCK + SDCARD_SELFTEST_BLOCKS)
+
+/** Enum for the state of the medium, as reported to the host through TEST UNIT READY. */
+enum SDCardManager_MediumState_t
+{
+  SDCARD_MEDIUM_NOT_PRESENT = 0, /**< No card inserted or the card failed to initialize */
+  SDCARD_MEDIUM_BECOMING_READY,  /**< A card was found and is being initialized */
+  SDCARD_MEDIUM_READY,           /**< The card is initialized and can be accessed */
+};
+
+void SDCardManager_Init(uint8_t chipSelectPin);
+
+bool SDCardManager_Task(void);
+
+bool SDCardManager_FoldTask(void);
+
+#if SDCARD_WRITE_LOG_BLOCKS > 0
+bool SDCardManager_FinishFold(void);
+#else
+static inline bool SDCardManager_FinishFold(void) { return true; }
+#endif
+
+#if SDCARD_EEPROM_PROFILE
+bool SDCardManager_ProfileTask(void);
+#else
+static inline bool SDCardManager_ProfileTask(void) { return false; }
+#endif
+
+uint8_t SDCardManager_GetMediumState(void);
+
+bool SDCardManager_TakeMediumChanged(void);
 
 uint32_t SDCardManager_NumBlocks(void);
 
-bool SDCardManager_CheckDataflashOperation();
+bool SDCardManager_WriteReservedBlock(uint16_t Block, void (*Fill)(uint8_t *Buffer));
+
+/** Vendor specific SCSI command that returns the CSD, CID and SD Status registers of the card. */
+#define SCSI_CMD_READ_CARD_REGISTERS  0xC1
+
+/** Length in bytes of the registers returned by \ref SCSI_CMD_READ_CARD_REGISTERS: the 16 byte CSD,
+ *  the 16 byte CID and the 64 byte SD Status.
+ */
+#define SDCARD_REGISTERS_LENGTH       96
+
+const uint8_t *SDCardManager_ReadRegisters(void);
+
+#if defined(SDCARD_DRIVER_PROFILE)
+/** Vendor specific LOG SENSE page code of the SPI phase timing of the card driver. */
+#define SDCARD_PROFILE_LOG_PAGE         0x31
+
+/** Number of logarithmic buckets of the SPI phase histograms. */
+#define SDCARD_PROFILE_BUCKETS          14
+
+/** Size in bytes of a SPI phase parameter including its 4 byte header. */
+#define SDCARD_PROFILE_PARAMETER_SIZE   (4 + 16 + (SDCARD_PROFILE_BUCKETS * 2))
+
+/** Total length in bytes of all parameters of the SPI phase log page, one parameter per phase. */
+#define SDCARD_PROFILE_PAGE_LENGTH      (4 * SDCARD_PROFILE_PARAMETER_SIZE)
+
+uint8_t SDCardManager_GetProfileParameter(const uint8_t Index, uint8_t* const Buffer);
+
+void SDCardManager_ResetProfile(void);
+#endif
+
+bool SDCardManager_VerifyBlocks(uint32_t BlockAddress,
+                                uint16_t TotalBlocks,
+                                uint32_t* FailedBlockAddress);
 
-void SDCardManager_WriteBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+uint16_t SDCardManager_WriteBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+                                   uint32_t BlockAddress,
+                                   uint16_t TotalBlocks);
+uint16_t SDCardManager_ReadBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
                                   uint32_t BlockAddress,
                                   uint16_t TotalBlocks);
-void SDCardManager_ReadBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
-                                 uint32_t BlockAddress,
-                                 uint16_t TotalBlocks);
 #if defined(__cplusplus)
 }
 #endif
@@ -3,25 +3,37 @@
 #include <LUFA.h>
 #include <avr/wdt.h>
 
+#include "BufferArena.h"
 #include "MassStorage.h"
 #include "SDCardManager.h"
+#include "EventLog.h"
+#include "Scheduler.h"
 
 void setup() {
   pinMode(LED_BUILTIN, OUTPUT);
+#ifdef ENABLE_EVENT_LOG
+  // before SetupHardware(), which clears the watchdog reset flag
+  EventLog_Init();
+#else
   Serial1.begin(9600);
-  Serial1.print("Init ... ");
+  Serial1.println("Init");
+#endif
 
-  if (!SDCardManager_Init(SS))
-    Serial1.println("ERR");
-  else
-    Serial1.println("OK");
-    
-  Serial1.print("Blocks: ");
-  Serial1.println(SDCardManager_NumBlocks());
+  // The static assertion in BufferArena.cpp only adds up an estimate of the static data, the linker
+  // knows its real size. Don't run with a stack that would grow into it, blink and keep the log going.
+  if (BufferArena_StackRoom() < BUFFER_ARENA_STACK_RESERVE) {
+    for (;;) {
+      EventLog_Task();
+      digitalWrite(LED_BUILTIN, (millis() >> 7) & 1);
+    }
+  }
 
+  // enumerate first, the card is initialized in the background by SDCardManager_Task()
   SetupHardware();
+  SDCardManager_Init(SS);
 }
 
 void loop() {
   ProcessHardware();
+  Scheduler_Run();
 }
@@ -0,0 +1,214 @@
+#include "SDCardSelfTest.h"
+#include "SDCardManager.h"
+#include "BufferArena.h"
+#include "EventLog.h"
+
+#include "Arduino.h"
+
+// every test transfers this many blocks, the quick self-test 1/16 of it
+#define SELFTEST_BLOCKS_PER_TEST    256
+#define SELFTEST_QUICK_SHIFT        4
+
+// transfer size of the sequential and random multi-block tests
+#define SELFTEST_SEQ_MULTI_BLOCKS   32
+#define SELFTEST_RANDOM_MULTI_BLOCKS 8
+
+#if SDCARD_SELFTEST_BLOCKS > 0
+static_assert(SDCARD_SELFTEST_BLOCKS % SELFTEST_SEQ_MULTI_BLOCKS == 0, "Self-test scratch area must be a multiple of 32 blocks");
+#endif
+
+static constexpr uint8_t *s_sd_raw_block = BufferArena_Lease(BUFFER_ARENA_BLOCK);
+
+struct SelfTestResult {
+  uint8_t status;
+  uint16_t operations;
+  uint16_t errors;
+  uint32_t total_us;
+  uint32_t min_us;
+  uint32_t max_us;
+};
+
+static SelfTestResult s_results[SDCARD_SELFTEST_COUNT];
+static bool s_has_run = false;
+static uint32_t s_random_state;
+
+static uint32_t SDCardSelfTest_Random()
+{
+  // xorshift32, seeded with a constant so that runs are comparable
+  s_random_state ^= s_random_state << 13;
+  s_random_state ^= s_random_state >> 17;
+  s_random_state ^= s_random_state << 5;
+  return s_random_state;
+}
+
+static uint8_t SDCardSelfTest_BlocksPerOperation(uint8_t test)
+{
+  switch (test) {
+  case SDCARD_SELFTEST_SEQ_READ_MULTI:
+  case SDCARD_SELFTEST_SEQ_WRITE_MULTI:
+    return SELFTEST_SEQ_MULTI_BLOCKS;
+  case SDCARD_SELFTEST_RANDOM_READ_MULTI:
+  case SDCARD_SELFTEST_RANDOM_WRITE_MULTI:
+    return SELFTEST_RANDOM_MULTI_BLOCKS;
+  default:
+    return 1;
+  }
+}
+
+/** Returns the first block of an operation of a test, reads cover the blocks visible to the host
+ *  and writes the scratch area at the end of the card.
+ */
+static uint32_t SDCardSelfTest_Address(uint8_t test, uint16_t operation, uint8_t blocks)
+{
+  bool write = test >= SDCARD_SELFTEST_SEQ_WRITE;
+  uint32_t base = write ? SDCardManager_NumBlocks() + SDCARD_SELFTEST_BLOCK : 0;
+  uint32_t size = write ? SDCARD_SELFTEST_BLOCKS : SDCardManager_NumBlocks();
+
+  switch (test) {
+  case SDCARD_SELFTEST_RANDOM_READ:
+  case SDCARD_SELFTEST_RANDOM_READ_MULTI:
+  case SDCARD_SELFTEST_RANDOM_WRITE:
+  case SDCARD_SELFTEST_RANDOM_WRITE_MULTI:
+    // aligned to the transfer size like file system clusters
+    return base + (SDCardSelfTest_Random() % (size / blocks)) * blocks;
+  default:
+    return base + ((uint32_t)operation * blocks) % size;
+  }
+}
+
+static bool SDCardSelfTest_Operation(uint8_t test, uint32_t block, uint8_t blocks)
+{
+  uint32_t failed_block;
+
+  switch (test) {
+  case SDCARD_SELFTEST_SPI:
+    return s_sdcard_driver.spiLoopback(VIRTUAL_MEMORY_BLOCK_SIZE) == 0;
+  case SDCARD_SELFTEST_SEQ_READ:
+  case SDCARD_SELFTEST_RANDOM_READ:
+    return s_sdcard_driver.readBlock(block, s_sd_raw_block);
+  case SDCARD_SELFTEST_SEQ_READ_MULTI:
+  case SDCARD_SELFTEST_RANDOM_READ_MULTI:
+    // multi-block reads go through the CRC checked verify path
+    return s_sdcard_driver.verifyBlocks(block, blocks, &failed_block);
+  case SDCARD_SELFTEST_SEQ_WRITE:
+  case SDCARD_SELFTEST_RANDOM_WRITE:
+    return s_sdcard_driver.writeBlock(block, s_sd_raw_block) && s_sdcard_driver.writeDone();
+  default:
+    if (!s_sdcard_driver.writeMultipleStart(block, blocks))
+      return false;
+    for (uint8_t i = 0; i < blocks; ++i) {
+      if (!s_sdcard_driver.writeMultipleData(s_sd_raw_block))
+        return false;
+    }
+    return s_sdcard_driver.writeMultipleStop();
+  }
+}
+
+static void SDCardSelfTest_RunTest(uint8_t test, bool extended)
+{
+  SelfTestResult &result = s_results[test];
+  uint8_t blocks = SDCardSelfTest_BlocksPerOperation(test);
+  uint16_t operations = SELFTEST_BLOCKS_PER_TEST / blocks;
+
+  memset(&result, 0, sizeof(result));
+  if (!extended && (operations >>= SELFTEST_QUICK_SHIFT) == 0)
+    operations = 1;
+
+  if (test >= SDCARD_SELFTEST_SEQ_WRITE && SDCARD_SELFTEST_BLOCKS == 0) {
+    result.status = SDCARD_SELFTEST_SKIPPED;
+    return;
+  }
+
+  for (uint16_t operation = 0; operation < operations; ++operation) {
+    uint32_t block = SDCardSelfTest_Address(test, operation, blocks);
+    uint32_t start = micros();
+    bool success = SDCardSelfTest_Operation(test, block, blocks);
+    uint32_t us = micros() - start;
+
+    if (!success)
+      ++result.errors;
+    if (result.operations == 0 || us < result.min_us)
+      result.min_us = us;
+    if (us > result.max_us)
+      result.max_us = us;
+    result.total_us += us;
+    ++result.operations;
+  }
+  result.status = result.errors ? SDCARD_SELFTEST_FAILED : SDCARD_SELFTEST_PASSED;
+}
+
+/** Runs the self-test on the initialized card: raw SPI transfers, sequential and random single and
+ *  multi-block reads of the whole card and, if \ref SDCARD_SELFTEST_BLOCKS is set, the same writes
+ *  to the scratch area. Every test is timed per operation, the results are returned with
+ *  \ref SDCardSelfTest_GetResult().
+ *
+ *  \param[in] Extended  \c true to run the full benchmark, \c false for a quick health check that
+ *                       transfers 1/16 of the data
+ *
+ *  \return Boolean \c true if all operations succeeded, \c false otherwise
+ */
+bool SDCardSelfTest_Run(bool Extended)
+{
+  bool passed = true;
+
+  s_random_state = 0x2545F491;
+  SDCardManager_FinishFold();
+
+  for (uint8_t test = 0; test < SDCARD_SELFTEST_COUNT; ++test) {
+    // pattern for the write tests, the scratch area is never read by the host
+    if (test == SDCARD_SELFTEST_SEQ_WRITE) {
+      for (uint16_t i = 0; i < VIRTUAL_MEMORY_BLOCK_SIZE; ++i)
+        s_sd_raw_block[i] = i ^ 0xA5;
+    }
+    SDCardSelfTest_RunTest(test, Extended);
+    if (s_results[test].status == SDCARD_SELFTEST_FAILED)
+      passed = false;
+
+    EventLog_Add(EVENT_LOG_SELFTEST, test, s_results[test].status, s_results[test].total_us);
+  }
+
+  s_has_run = true;
+  return passed;
+}
+
+static uint8_t *SDCardSelfTest_Put32(uint8_t *buffer, uint32_t value)
+{
+  *buffer++ = value >> 24;
+  *buffer++ = value >> 16;
+  *buffer++ = value >> 8;
+  *buffer++ = value;
+  return buffer;
+}
+
+/** Fills a buffer with the result descriptor of a test for the RECEIVE DIAGNOSTIC RESULTS page
+ *  \ref SDCARD_SELFTEST_RESULTS_PAGE: the test number, the \ref SDCardSelfTest_Status_t, the
+ *  blocks per operation, the number of operations and failed operations (16 bit) and the total,
+ *  minimum and maximum time of an operation in microseconds (32 bit), all big-endian.
+ *
+ *  \param[in]  Index   Index of the test
+ *  \param[out] Buffer  Buffer of at least \ref SDCARD_SELFTEST_RESULT_SIZE bytes for the descriptor
+ *
+ *  \return Size of the descriptor in bytes, or zero if there are no more tests
+ */
+uint8_t SDCardSelfTest_GetResult(const uint8_t Index, uint8_t *const Buffer)
+{
+  if (Index >= SDCARD_SELFTEST_COUNT)
+    return 0;
+
+  const SelfTestResult &result = s_results[Index];
+  uint8_t blocks = SDCardSelfTest_BlocksPerOperation(Index);
+  uint8_t *data = Buffer;
+
+  *data++ = Index;
+  *data++ = s_has_run ? result.status : (uint8_t)SDCARD_SELFTEST_NOT_RUN;
+  *data++ = 0;
+  *data++ = blocks;
+  *data++ = result.operations >> 8;
+  *data++ = result.operations;
+  *data++ = result.errors >> 8;
+  *data++ = result.errors;
+  data = SDCardSelfTest_Put32(data, result.total_us);
+  data = SDCardSelfTest_Put32(data, result.min_us);
+  SDCardSelfTest_Put32(data, result.max_us);
+  return SDCARD_SELFTEST_RESULT_SIZE;
+}
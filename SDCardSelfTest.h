@@ -0,0 +1,52 @@
+#ifndef SDCARDSELFTEST_H
+#define SDCARDSELFTEST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/** Vendor specific RECEIVE DIAGNOSTIC RESULTS page code of the self-test results. */
+#define SDCARD_SELFTEST_RESULTS_PAGE  0x80
+
+/** Size in bytes of the result descriptor of a single test. */
+#define SDCARD_SELFTEST_RESULT_SIZE   20
+
+/** Total length in bytes of all result descriptors of the results page. */
+#define SDCARD_SELFTEST_PAGE_LENGTH   (SDCARD_SELFTEST_COUNT * SDCARD_SELFTEST_RESULT_SIZE)
+
+/** Enum for the tests of the self-test, in the order of the result descriptors. */
+enum SDCardSelfTest_Test_t
+{
+  SDCARD_SELFTEST_SPI = 0,            /**< 512 byte SPI transfers with the card deselected */
+  SDCARD_SELFTEST_SEQ_READ,           /**< Sequential single block reads */
+  SDCARD_SELFTEST_SEQ_READ_MULTI,     /**< Sequential multi-block reads */
+  SDCARD_SELFTEST_RANDOM_READ,        /**< Random single block reads */
+  SDCARD_SELFTEST_RANDOM_READ_MULTI,  /**< Random multi-block reads */
+  SDCARD_SELFTEST_SEQ_WRITE,          /**< Sequential single block writes to the scratch area */
+  SDCARD_SELFTEST_SEQ_WRITE_MULTI,    /**< Sequential multi-block writes to the scratch area */
+  SDCARD_SELFTEST_RANDOM_WRITE,       /**< Random single block writes to the scratch area */
+  SDCARD_SELFTEST_RANDOM_WRITE_MULTI, /**< Random multi-block writes to the scratch area */
+  SDCARD_SELFTEST_COUNT,
+};
+
+/** Enum for the status of a test in its result descriptor. */
+enum SDCardSelfTest_Status_t
+{
+  SDCARD_SELFTEST_PASSED = 0, /**< All operations of the test succeeded */
+  SDCARD_SELFTEST_FAILED,     /**< At least one operation of the test failed */
+  SDCARD_SELFTEST_SKIPPED,    /**< The test needs a scratch area, see \ref SDCARD_SELFTEST_BLOCKS */
+  SDCARD_SELFTEST_NOT_RUN,    /**< No self-test was run since power up */
+};
+
+bool SDCardSelfTest_Run(bool Extended);
+
+uint8_t SDCardSelfTest_GetResult(const uint8_t Index, uint8_t *const Buffer);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // SDCARDSELFTEST_H
@@ -0,0 +1,61 @@
+#include "Scheduler.h"
+
+#include "Arduino.h"
+
+#include "MassStorage.h"
+#include "SDCardManager.h"
+#include "CommandTrace.h"
+#include "EventLog.h"
+#include "Telemetry.h"
+
+// Cooperative scheduler for the work between the SCSI commands, run from loop() after the USB
+// tasks. Every task gets a time budget per pass: it is called again as long as it reports more
+// work and the budget isn't used up, a budget of zero runs one step. Tasks can't be interrupted,
+// so a step has to be short, at most a few card blocks. Before every step the OUT endpoint of the
+// mass storage interface is checked for a new CBW and the pass ends as soon as one arrived, the
+// next pass continues with the task that was cut short so that every task gets its turn. The
+// control endpoint is only serviced between the passes, which keeps the budgets at a few ms.
+
+struct Scheduler_Entry_t
+{
+  Scheduler_Task_t Task;
+  uint16_t Budget;   // microseconds per pass
+};
+
+static const Scheduler_Entry_t s_tasks[] = {
+  { SDCardManager_Task,        2000 },
+  { SDCardManager_FoldTask,    5000 },
+  { SDCardManager_ProfileTask, 0 },
+  { CommandTrace_Task,         0 },
+  { EventLog_Task,             0 },
+  { Telemetry_Task,            0 },
+};
+
+static const uint8_t kTaskCount = sizeof(s_tasks) / sizeof(s_tasks[0]);
+
+static uint8_t s_next_task;
+
+// true if the host sent the next command, which must not wait for background work
+static bool Scheduler_HostWaiting(void)
+{
+  Endpoint_SelectEndpoint(MASS_STORAGE_OUT_EPADDR);
+  return Endpoint_IsOUTReceived();
+}
+
+/** Runs one pass over the background tasks, must be called from loop() between the SCSI commands. */
+void Scheduler_Run(void)
+{
+  for (uint8_t i = 0; i < kTaskCount; ++i) {
+    if (Scheduler_HostWaiting())
+      return;
+
+    const Scheduler_Entry_t *entry = &s_tasks[s_next_task];
+    s_next_task = (s_next_task + 1) % kTaskCount;
+
+    unsigned long start = micros();
+    while (entry->Task()) {
+      if (Scheduler_HostWaiting() || micros() - start >= entry->Budget)
+        break;
+    }
+  }
+}
@@ -0,0 +1,24 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "LUFAConfig.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/** Type define for a background task. A task does one bounded step of its work per call and
+ *  returns \c true if it has more work that could be done right away.
+ */
+typedef bool (*Scheduler_Task_t)(void);
+
+void Scheduler_Run(void);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // SCHEDULER_H
@@ -0,0 +1,30 @@
+#ifndef SIMMARKERS_H
+#define SIMMARKERS_H
+
+#include <avr/io.h>
+
+#include "LUFAConfig.h"
+
+// Markers for the cycle counting benchmark of host/AvrBench.cpp, which runs the firmware image
+// under simavr and timestamps every write to GPIOR0 with the cycle counter. A marker costs a
+// single OUT instruction, the odd values begin a phase and the following even value ends it.
+enum SimMarkers {
+  SIM_MARKER_COMMAND_BEGIN = 1,     // CALLBACK_MS_Device_SCSICommandReceived()
+  SIM_MARKER_COMMAND_END,
+  SIM_MARKER_SPI_READ_BEGIN,        // readBlock() of SDCardManager_ReadBlocks()
+  SIM_MARKER_SPI_READ_END,
+  SIM_MARKER_USB_IN_BEGIN,          // copy of a packet to the IN endpoint
+  SIM_MARKER_USB_IN_END,
+  SIM_MARKER_USB_OUT_BEGIN,         // copy of a packet from the OUT endpoint
+  SIM_MARKER_USB_OUT_END,
+  SIM_MARKER_SPI_WRITE_BEGIN,       // writeDone() and writeBlock() of SDCardManager_WriteBlocks()
+  SIM_MARKER_SPI_WRITE_END,
+};
+
+#ifdef SIMAVR_MARKERS
+#define SimMarker(MARKER) (GPIOR0 = (MARKER))
+#else
+#define SimMarker(MARKER)
+#endif
+
+#endif // SIMMARKERS_H
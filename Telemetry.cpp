@@ -0,0 +1,108 @@
+#include "Telemetry.h"
+
+#if defined(ENABLE_TELEMETRY)
+
+#include "Arduino.h"
+
+#include <string.h>
+
+#include "MassStorage.h"
+#include "SDCardManager.h"
+
+// Performance counters on the CDC-ACM interface of the composite device. The data path only adds
+// to the counters, Telemetry_Task() sends a record of all of them from loop() between the SCSI
+// commands. Nothing is sent while no program has the port open, the host asserts DTR when it opens
+// it. A record is only written into a free bank of the IN endpoint and never waits for one, so a
+// program that opened the port but doesn't read it loses records instead of stalling the mass
+// storage interface. Lost records show up as gaps in the sequence numbers, the records are
+// decoded by host/TelemetryDecoder.cpp.
+
+static_assert(sizeof(Telemetry_Record_t) == 8 + 4 * TELEMETRY_COUNTERS, "Telemetry record layout changed");
+static_assert(sizeof(Telemetry_Record_t) <= CDC_TXRX_EPSIZE, "Telemetry record must fit into one packet");
+
+uint32_t s_telemetry_counters[TELEMETRY_COUNTERS];
+
+static uint16_t s_sequence;
+static uint16_t s_interval = TELEMETRY_INTERVAL_MS;
+static unsigned int s_last_record;
+
+/** Counts a SCSI command, called for every command like \ref CommandStats_Record().
+ *
+ *  \param[in] CommandData     SCSI command block of the command
+ *  \param[in] Duration        Time of the command in microseconds
+ *  \param[in] CommandSuccess  Boolean \c true if the command succeeded
+ */
+void Telemetry_RecordCommand(const uint8_t *const CommandData, const uint32_t Duration, const bool CommandSuccess)
+{
+  ++s_telemetry_counters[TELEMETRY_COMMANDS];
+  if (!CommandSuccess)
+    ++s_telemetry_counters[TELEMETRY_FAILED];
+  if (CommandData[0] == SCSI_CMD_READ_10)
+    s_telemetry_counters[TELEMETRY_READ_US] += Duration;
+  else if (CommandData[0] == SCSI_CMD_WRITE_10)
+    s_telemetry_counters[TELEMETRY_WRITE_US] += Duration;
+}
+
+/** Sets all counters to zero. */
+void Telemetry_Reset(void)
+{
+  memset(s_telemetry_counters, 0, sizeof(s_telemetry_counters));
+  SDCardDriver::resetBusyTime();
+}
+
+static void Telemetry_ProcessCommands(void)
+{
+  int16_t command;
+
+  while ((command = CDC_Device_ReceiveByte(&Telemetry_CDC_Interface)) >= 0) {
+    if (command == TELEMETRY_COMMAND_RESET)
+      Telemetry_Reset();
+    else if (command >= '0' && command <= '9')
+      s_interval = (command - '0') * TELEMETRY_INTERVAL_STEP_MS;
+  }
+}
+
+static void Telemetry_Send(void)
+{
+  Telemetry_Record_t record;
+  const uint8_t *bytes = (const uint8_t *)&record;
+  uint8_t sum = 0;
+
+  record.Sync = TELEMETRY_SYNC;
+  record.Checksum = 0;
+  record.Sequence = s_sequence++;
+  record.Timestamp = millis();
+  memcpy(record.Counters, s_telemetry_counters, sizeof(record.Counters));
+  record.Counters[TELEMETRY_CARD_BUSY_US] = SDCardDriver::busyTime();
+  for (uint8_t i = 0; i < sizeof(record); ++i)
+    sum += bytes[i];
+  record.Checksum = -sum;
+
+  // the record is dropped if the host didn't fetch the previous one yet
+  Endpoint_SelectEndpoint(CDC_TX_EPADDR);
+  if (!Endpoint_IsINReady())
+    return;
+  for (uint8_t i = 0; i < sizeof(record); ++i)
+    Endpoint_Write_8(bytes[i]);
+  Endpoint_ClearIN();
+}
+
+/** Handles the commands of the host and sends a record when the interval elapsed, a task of the
+ *  background scheduler that never has more work within the same pass.
+ */
+bool Telemetry_Task(void)
+{
+  if (USB_DeviceState != DEVICE_STATE_Configured)
+    return false;
+
+  Telemetry_ProcessCommands();
+
+  if (!(Telemetry_CDC_Interface.State.ControlLineStates.HostToDevice & CDC_CONTROL_LINE_OUT_DTR) || !s_interval ||
+      (unsigned int)(millis() - s_last_record) < s_interval)
+    return false;
+  s_last_record = millis();
+  Telemetry_Send();
+  return false;
+}
+
+#endif
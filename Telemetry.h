@@ -0,0 +1,84 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+// The record layout is also used by the host side decoder in host/TelemetryDecoder.cpp, so this
+// header must not depend on LUFA, Arduino or AVR headers.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "LUFAConfig.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/** First byte of every telemetry record, the decoder resynchronizes on it. */
+#define TELEMETRY_SYNC            0xE7
+
+#if !defined(TELEMETRY_INTERVAL_MS)
+/** Interval in milliseconds between telemetry records after power up. */
+#define TELEMETRY_INTERVAL_MS     1000
+#endif
+
+/** Unit in milliseconds of the interval set by the digits '1' to '9' on the telemetry port. */
+#define TELEMETRY_INTERVAL_STEP_MS 250
+
+/** Command byte on the telemetry port that resets all counters, digits set the interval and '0' pauses the stream. */
+#define TELEMETRY_COMMAND_RESET   'r'
+
+/** Enum for the counters of a telemetry record. All of them count from the last reset and wrap around. */
+enum Telemetry_Counter_t
+{
+  TELEMETRY_COMMANDS = 0,   /**< SCSI commands */
+  TELEMETRY_FAILED,         /**< SCSI commands that failed */
+  TELEMETRY_BLOCKS_READ,    /**< Card blocks sent to the host */
+  TELEMETRY_BLOCKS_WRITTEN, /**< Card blocks written by the host */
+  TELEMETRY_READ_US,        /**< Time of the READ (10) commands in microseconds */
+  TELEMETRY_WRITE_US,       /**< Time of the WRITE (10) commands in microseconds */
+  TELEMETRY_CARD_BUSY_US,   /**< Time spent waiting for the card to finish programming in microseconds */
+  TELEMETRY_CACHE_HITS,     /**< Metadata blocks read from the metadata cache */
+  TELEMETRY_CACHE_MISSES,   /**< Metadata blocks read from the card */
+  TELEMETRY_LOG_FULL,       /**< Small writes that went in place because the write log was full */
+  TELEMETRY_RETRIES,        /**< Failed card transfers that were retried */
+  TELEMETRY_COUNTERS,
+};
+
+/** Type define for a telemetry record as it is sent on the CDC port. All values are little-endian. */
+typedef struct
+{
+  uint8_t  Sync;                          /**< Always \ref TELEMETRY_SYNC */
+  uint8_t  Checksum;                      /**< Makes the sum of all bytes of the record zero */
+  uint16_t Sequence;                      /**< Counts all records since boot including the dropped ones */
+  uint32_t Timestamp;                     /**< Value of millis() when the record was sent */
+  uint32_t Counters[TELEMETRY_COUNTERS];  /**< \ref Telemetry_Counter_t */
+} Telemetry_Record_t;
+
+#if defined(ENABLE_TELEMETRY)
+extern uint32_t s_telemetry_counters[TELEMETRY_COUNTERS];
+
+/** Adds to a counter, cheap enough for the data path. */
+static inline void Telemetry_Add(const uint8_t Counter, const uint32_t Value)
+{
+  s_telemetry_counters[Counter] += Value;
+}
+
+void Telemetry_RecordCommand(const uint8_t *const CommandData, const uint32_t Duration, const bool CommandSuccess);
+void Telemetry_Reset(void);
+bool Telemetry_Task(void);
+#else
+static inline void Telemetry_Add(const uint8_t Counter, const uint32_t Value) { (void)Counter; (void)Value; }
+static inline void Telemetry_RecordCommand(const uint8_t *const CommandData, const uint32_t Duration,
+                                           const bool CommandSuccess)
+{
+  (void)CommandData; (void)Duration; (void)CommandSuccess;
+}
+static inline void Telemetry_Reset(void) {}
+static inline bool Telemetry_Task(void) { return false; }
+#endif
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // TELEMETRY_H
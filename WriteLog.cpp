@@ -0,0 +1,304 @@
+#include "WriteLog.h"
+
+#if SDCARD_WRITE_LOG_BLOCKS > 0
+
+#include "Arduino.h"
+#include "Telemetry.h"
+
+#include <string.h>
+#include <util/crc16.h>
+
+// Write log for small random writes. A cheap card programs a block outside of its open allocation
+// units with a read-modify-write of a whole AU, so scattered single block writes take tens of
+// milliseconds each. Writes of up to SDCARD_WRITE_LOG_MAX_BLOCKS that don't continue the previous
+// write are appended to the log at the end of the card instead, followed by a commit block with
+// the home block of every slot of the log. Writes into the allocation unit that was written in place
+// last aren't logged, the card has it open and programs them without a read-modify-write, which is
+// cheaper than a logged block with its commit block. Reads of logged blocks are redirected to their slot.
+// When the host is idle the live slots are copied back to their home blocks in block order, so
+// that blocks of the same AU are written together, and the log starts over with an empty commit.
+// While the log is full, writes go in place and are never held up by folding. A write in place of a
+// logged block replaces the data in its slot instead of the home block, so the map on the card
+// stays valid and doesn't need a commit block.
+//
+// The commit block with the highest sequence number is the state of the log after power up. Slots
+// are only reused after the log started over, so the data of the last commit is never overwritten,
+// a write that was interrupted before its commit is lost like an interrupted write in place.
+
+#if defined(SDCARD_NULL_BACKEND)
+#error "The write log needs a card, disable SDCARD_NULL_BACKEND"
+#endif
+
+static_assert(SDCARD_WRITE_LOG_BLOCKS <= 125, "The commit block holds at most 125 slots");
+static_assert(SDCARD_WRITE_LOG_BLOCKS >= 2 * (SDCARD_WRITE_LOG_MAX_BLOCKS + 1), "Write log too small for the largest logged write");
+
+#define WRITE_LOG_FREE       0xFFFFFFFFUL
+#define WRITE_LOG_MAGIC      0x4C574453UL  // "SDWL"
+
+// commit block: magic, sequence, slot, home blocks of all slots, CRC16 of the bytes before it
+#define WRITE_LOG_SEQUENCE   4
+#define WRITE_LOG_SLOT       8
+#define WRITE_LOG_MAP        12
+#define WRITE_LOG_CRC        510
+
+// home block of every slot, WRITE_LOG_FREE for unused, overwritten and commit slots
+static uint32_t s_map[SDCARD_WRITE_LOG_BLOCKS];
+static uint8_t s_folded[(SDCARD_WRITE_LOG_BLOCKS + 7) / 8];
+static uint32_t s_first_block;
+static uint32_t s_sequence;
+static uint8_t s_head;
+
+static uint32_t s_next_sequential;
+static uint32_t s_au_blocks;
+static uint32_t s_open_au;
+static uint32_t s_fold_cursor;
+static unsigned int s_last_access;
+
+static void WriteLog_Put32(uint8_t *buffer, uint32_t value)
+{
+  buffer[0] = value;
+  buffer[1] = value >> 8;
+  buffer[2] = value >> 16;
+  buffer[3] = value >> 24;
+}
+
+static uint32_t WriteLog_Get32(const uint8_t *buffer)
+{
+  return buffer[0] | (uint16_t)buffer[1] << 8 | (uint32_t)buffer[2] << 16 | (uint32_t)buffer[3] << 24;
+}
+
+static uint16_t WriteLog_Crc(const uint8_t *data)
+{
+  uint16_t crc = 0;
+  for (uint16_t i = 0; i < WRITE_LOG_CRC; ++i)
+    crc = _crc_xmodem_update(crc, data[i]);
+  return crc;
+}
+
+static void WriteLog_Clear(void)
+{
+  for (uint8_t slot = 0; slot < SDCARD_WRITE_LOG_BLOCKS; ++slot)
+    s_map[slot] = WRITE_LOG_FREE;
+  memset(s_folded, 0, sizeof(s_folded));
+  s_fold_cursor = 0;
+}
+
+static bool WriteLog_IsFolded(uint8_t slot)
+{
+  return s_folded[slot / 8] & (1 << (slot % 8));
+}
+
+/** Forgets the log of the previous card, must be called before the slots of a new card are loaded.
+ *
+ *  \param[in] FirstBlock  Block number of the first slot of the log on the card
+ *  \param[in] AuBlocks    Size of an allocation unit of the card in blocks, 0 if it is not known
+ */
+void WriteLog_Reset(uint32_t FirstBlock, uint32_t AuBlocks)
+{
+  WriteLog_Clear();
+  s_first_block = FirstBlock;
+  s_sequence = 0;
+  s_head = 0;
+  s_next_sequential = WRITE_LOG_FREE;
+  s_au_blocks = AuBlocks;
+  s_open_au = WRITE_LOG_FREE;
+}
+
+// remembers the allocation unit of a block written in place, the card keeps it open
+static void WriteLog_WrittenInPlace(uint32_t block)
+{
+  if (s_au_blocks)
+    s_open_au = block / s_au_blocks;
+}
+
+/** Takes over the map of a commit block, if it is newer than the ones loaded before. Every slot of
+ *  the log has to be passed after \ref WriteLog_Reset().
+ *
+ *  \param[in] Slot  Slot of the log the block was read from
+ *  \param[in] Data  512 bytes of the slot
+ */
+void WriteLog_Load(uint8_t Slot, const uint8_t *Data)
+{
+  uint32_t sequence = WriteLog_Get32(&Data[WRITE_LOG_SEQUENCE]);
+
+  if (WriteLog_Get32(Data) != WRITE_LOG_MAGIC || Data[WRITE_LOG_SLOT] != Slot || sequence <= s_sequence ||
+      (Data[WRITE_LOG_CRC] | Data[WRITE_LOG_CRC + 1] << 8) != WriteLog_Crc(Data))
+    return;
+
+  WriteLog_Clear();
+  for (uint8_t slot = 0; slot < Slot; ++slot)
+    s_map[slot] = WriteLog_Get32(&Data[WRITE_LOG_MAP + 4 * slot]);
+  s_sequence = sequence;
+  s_head = Slot + 1;
+}
+
+/** Returns the block that holds the current data of a block, its slot if it was logged. */
+uint32_t WriteLog_Lookup(uint32_t Block)
+{
+  for (uint8_t slot = 0; slot < s_head; ++slot) {
+    if (s_map[slot] == Block)
+      return s_first_block + slot;
+  }
+  return Block;
+}
+
+/** Decides whether a write goes to the log, small writes that don't continue the previous write and
+ *  are outside of the allocation unit written last do as long as the log has room for them and their
+ *  commit block.
+ *
+ *  \param[in] Block  First block of the write
+ *  \param[in] Count  Number of blocks of the write
+ *
+ *  \return Boolean \c true if the write is appended to the log, \c false if it is written in place
+ */
+bool WriteLog_Accepts(uint32_t Block, uint16_t Count)
+{
+  bool logged = Count <= SDCARD_WRITE_LOG_MAX_BLOCKS && Block != s_next_sequential &&
+                !(s_au_blocks && Block / s_au_blocks == s_open_au);
+
+  if (logged && s_head + Count + 1 > SDCARD_WRITE_LOG_BLOCKS) {
+    Telemetry_Add(TELEMETRY_LOG_FULL, 1);
+    logged = false;
+  }
+  if (!logged)
+    WriteLog_WrittenInPlace(Block);
+  s_next_sequential = Block + Count;
+  return logged;
+}
+
+/** Restarts the idle time before the log is folded back, called after every read and write of the
+ *  host. Folding moves the card to other allocation units and keeps it busy, so it waits until the
+ *  host stopped accessing the card.
+ */
+void WriteLog_Touch(void)
+{
+  s_last_access = millis();
+}
+
+/** Returns the block a write in place of a block goes to. The data of a logged block is replaced in
+ *  its slot, which has to be folded back again if it already was.
+ */
+uint32_t WriteLog_Redirect(uint32_t Block)
+{
+  for (uint8_t slot = 0; slot < s_head; ++slot) {
+    if (s_map[slot] == Block) {
+      s_folded[slot / 8] &= ~(1 << (slot % 8));
+      return s_first_block + slot;
+    }
+  }
+  return Block;
+}
+
+/** Returns the block number of the next free slot, where a logged write is written to. */
+uint32_t WriteLog_HeadBlock(void)
+{
+  return s_first_block + s_head;
+}
+
+/** Updates the map after the blocks of a logged write were programmed. Older slots of the same blocks
+ *  are dropped, the blocks are mapped to the slots from the head of the log.
+ *
+ *  \param[in] Block  First block of the write
+ *  \param[in] Count  Number of blocks that were written
+ *
+ *  \return Boolean \c true if the map changed and a commit block has to be written
+ */
+bool WriteLog_Commit(uint32_t Block, uint16_t Count)
+{
+  if (!Count)
+    return false;
+
+  for (uint8_t slot = 0; slot < s_head; ++slot) {
+    if (s_map[slot] - Block < Count)
+      s_map[slot] = WRITE_LOG_FREE;
+  }
+  for (uint16_t i = 0; i < Count; ++i, ++s_head) {
+    s_map[s_head] = Block + i;
+    s_folded[s_head / 8] &= ~(1 << (s_head % 8));
+  }
+  return true;
+}
+
+/** Builds the commit block of the current map, or of an empty log that starts over if all blocks
+ *  were folded back.
+ *
+ *  \param[out] Buffer  512 byte buffer for the commit block
+ *  \param[in]  Wrap    Boolean \c true for the commit of an empty log in the first slot
+ *
+ *  \return Block number the commit block has to be written to
+ */
+uint32_t WriteLog_BuildCommit(uint8_t *Buffer, bool Wrap)
+{
+  uint8_t commit_slot = Wrap ? 0 : s_head;
+
+  memset(Buffer, 0, 512);
+  WriteLog_Put32(Buffer, WRITE_LOG_MAGIC);
+  WriteLog_Put32(&Buffer[WRITE_LOG_SEQUENCE], s_sequence + 1);
+  Buffer[WRITE_LOG_SLOT] = commit_slot;
+  for (uint8_t slot = 0; slot < commit_slot; ++slot)
+    WriteLog_Put32(&Buffer[WRITE_LOG_MAP + 4 * slot], s_map[slot]);
+
+  uint16_t crc = WriteLog_Crc(Buffer);
+  Buffer[WRITE_LOG_CRC] = crc;
+  Buffer[WRITE_LOG_CRC + 1] = crc >> 8;
+  return s_first_block + commit_slot;
+}
+
+/** Takes the commit block built by \ref WriteLog_BuildCommit() as written. */
+void WriteLog_Committed(bool Wrap)
+{
+  ++s_sequence;
+  if (Wrap) {
+    WriteLog_Clear();
+    s_head = 1;
+  } else {
+    ++s_head;
+  }
+}
+
+/** Returns \c true if the host was idle long enough to fold the log back in the background. */
+bool WriteLog_WantsFold(void)
+{
+  return s_head > 1 && (unsigned int)(millis() - s_last_access) >= SDCARD_WRITE_LOG_IDLE_MS;
+}
+
+/** Returns the next slot to copy back to its home block, or \ref WRITE_LOG_NO_SLOT if all slots
+ *  are in place and the log can start over. Slots are folded in the order of their home blocks.
+ */
+uint8_t WriteLog_NextFold(void)
+{
+  uint8_t next = WRITE_LOG_NO_SLOT;
+  uint8_t lowest = WRITE_LOG_NO_SLOT;
+
+  for (uint8_t slot = 0; slot < s_head; ++slot) {
+    if (s_map[slot] == WRITE_LOG_FREE || WriteLog_IsFolded(slot))
+      continue;
+    if (s_map[slot] >= s_fold_cursor && (next == WRITE_LOG_NO_SLOT || s_map[slot] < s_map[next]))
+      next = slot;
+    if (lowest == WRITE_LOG_NO_SLOT || s_map[slot] < s_map[lowest])
+      lowest = slot;
+  }
+  return next != WRITE_LOG_NO_SLOT ? next : lowest;
+}
+
+/** Returns the block number of a slot of the log. */
+uint32_t WriteLog_SlotBlock(uint8_t Slot)
+{
+  return s_first_block + Slot;
+}
+
+/** Returns the home block of the data in a slot of the log. */
+uint32_t WriteLog_Home(uint8_t Slot)
+{
+  return s_map[Slot];
+}
+
+/** Marks a slot as copied back, it still serves reads until the log starts over. */
+void WriteLog_Folded(uint8_t Slot)
+{
+  s_folded[Slot / 8] |= 1 << (Slot % 8);
+  s_fold_cursor = s_map[Slot] + 1;
+  WriteLog_WrittenInPlace(s_map[Slot]);
+}
+
+#endif
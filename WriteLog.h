@@ -0,0 +1,64 @@
+#ifndef WRITELOG_H
+#define WRITELOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "SDCardManager.h"
+
+#if !defined(SDCARD_WRITE_LOG_MAX_BLOCKS)
+/** Largest write in blocks that goes to the write log, larger writes are written in place. */
+#define SDCARD_WRITE_LOG_MAX_BLOCKS   8
+#endif
+
+#if !defined(SDCARD_WRITE_LOG_IDLE_MS)
+/** Time in milliseconds without reads or writes after which the log is folded back in the background. */
+#define SDCARD_WRITE_LOG_IDLE_MS      50
+#endif
+
+/** Returned by \ref WriteLog_NextFold() when all blocks of the log are in place. */
+#define WRITE_LOG_NO_SLOT             0xFF
+
+#if SDCARD_WRITE_LOG_BLOCKS > 0
+void WriteLog_Reset(uint32_t FirstBlock, uint32_t AuBlocks);
+
+void WriteLog_Load(uint8_t Slot, const uint8_t *Data);
+
+uint32_t WriteLog_Lookup(uint32_t Block);
+
+bool WriteLog_Accepts(uint32_t Block, uint16_t Count);
+
+void WriteLog_Touch(void);
+
+uint32_t WriteLog_Redirect(uint32_t Block);
+
+uint32_t WriteLog_HeadBlock(void);
+
+bool WriteLog_Commit(uint32_t Block, uint16_t Count);
+
+uint32_t WriteLog_BuildCommit(uint8_t *Buffer, bool Wrap);
+
+void WriteLog_Committed(bool Wrap);
+
+bool WriteLog_WantsFold(void);
+
+uint8_t WriteLog_NextFold(void);
+
+uint32_t WriteLog_SlotBlock(uint8_t Slot);
+
+uint32_t WriteLog_Home(uint8_t Slot);
+
+void WriteLog_Folded(uint8_t Slot);
+#else
+static inline uint32_t WriteLog_Lookup(uint32_t Block) { return Block; }
+static inline bool WriteLog_Accepts(uint32_t, uint16_t) { return false; }
+static inline void WriteLog_Touch(void) {}
+static inline uint32_t WriteLog_Redirect(uint32_t Block) { return Block; }
+static inline uint32_t WriteLog_HeadBlock(void) { return 0; }
+static inline bool WriteLog_Commit(uint32_t, uint16_t) { return false; }
+static inline uint32_t WriteLog_BuildCommit(uint8_t *, bool) { return 0; }
+static inline void WriteLog_Committed(bool) {}
+static inline bool WriteLog_WantsFold(void) { return false; }
+#endif
+
+#endif // WRITELOG_H
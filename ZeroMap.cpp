@@ -0,0 +1,97 @@
+#include "ZeroMap.h"
+
+#if SDCARD_ZERO_MAP_RANGES > 0
+
+#if defined(SDCARD_NULL_BACKEND)
+#error "The zero map needs a card, disable SDCARD_NULL_BACKEND"
+#endif
+
+// Map of the home blocks that are known to read as zeros, because they were erased after the host
+// wrote zeros to them. The ranges are disjoint and never adjacent, adjacent ranges are merged. The
+// map is only a shortcut for the reads, the blocks are zero on the card, so a range that doesn't fit
+// anymore is simply forgotten. A block that is in the write log is not in the map.
+
+static uint32_t s_first[SDCARD_ZERO_MAP_RANGES];
+static uint32_t s_count[SDCARD_ZERO_MAP_RANGES];
+
+// puts a range into a free entry or in place of the smallest one, if that is smaller than the range
+static void ZeroMap_Store(uint32_t first, uint32_t count)
+{
+  uint8_t smallest = 0;
+
+  for (uint8_t i = 0; i < SDCARD_ZERO_MAP_RANGES; ++i) {
+    if (s_count[i] < s_count[smallest])
+      smallest = i;
+  }
+  if (s_count[smallest] < count) {
+    s_first[smallest] = first;
+    s_count[smallest] = count;
+  }
+}
+
+/** Forgets all ranges, for a new card. */
+void ZeroMap_Reset(void)
+{
+  for (uint8_t i = 0; i < SDCARD_ZERO_MAP_RANGES; ++i)
+    s_count[i] = 0;
+}
+
+/** Returns \c true if a block is known to read as zeros. */
+bool ZeroMap_Contains(uint32_t Block)
+{
+  for (uint8_t i = 0; i < SDCARD_ZERO_MAP_RANGES; ++i) {
+    if (Block - s_first[i] < s_count[i])
+      return true;
+  }
+  return false;
+}
+
+/** Adds blocks that were erased to zeros, the ranges they overlap or touch are merged into one.
+ *
+ *  \param[in] Block  First block of the range
+ *  \param[in] Count  Number of blocks of the range
+ */
+void ZeroMap_Add(uint32_t Block, uint32_t Count)
+{
+  uint32_t end = Block + Count;
+
+  for (uint8_t i = 0; i < SDCARD_ZERO_MAP_RANGES; ++i) {
+    if (!s_count[i] || s_first[i] > end || s_first[i] + s_count[i] < Block)
+      continue;
+    if (s_first[i] < Block)
+      Block = s_first[i];
+    if (s_first[i] + s_count[i] > end)
+      end = s_first[i] + s_count[i];
+    s_count[i] = 0;
+  }
+  ZeroMap_Store(Block, end - Block);
+}
+
+/** Removes blocks that are about to be written, a range that is cut in two keeps the lower part in
+ *  its entry and the upper part takes a free entry if there is one.
+ *
+ *  \param[in] Block  First block of the range
+ *  \param[in] Count  Number of blocks of the range
+ */
+void ZeroMap_Remove(uint32_t Block, uint32_t Count)
+{
+  uint32_t end = Block + Count;
+
+  for (uint8_t i = 0; i < SDCARD_ZERO_MAP_RANGES; ++i) {
+    uint32_t range_end = s_first[i] + s_count[i];
+    if (!s_count[i] || s_first[i] >= end || range_end <= Block)
+      continue;
+    if (s_first[i] < Block) {
+      s_count[i] = Block - s_first[i];
+      if (range_end > end)
+        ZeroMap_Store(end, range_end - end);
+    } else if (range_end > end) {
+      s_count[i] = range_end - end;
+      s_first[i] = end;
+    } else {
+      s_count[i] = 0;
+    }
+  }
+}
+
+#endif
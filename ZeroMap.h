@@ -0,0 +1,24 @@
+#ifndef ZEROMAP_H
+#define ZEROMAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "SDCardManager.h"
+
+#if SDCARD_ZERO_MAP_RANGES > 0
+void ZeroMap_Reset(void);
+
+bool ZeroMap_Contains(uint32_t Block);
+
+void ZeroMap_Add(uint32_t Block, uint32_t Count);
+
+void ZeroMap_Remove(uint32_t Block, uint32_t Count);
+#else
+static inline void ZeroMap_Reset(void) {}
+static inline bool ZeroMap_Contains(uint32_t) { return false; }
+static inline void ZeroMap_Add(uint32_t, uint32_t) {}
+static inline void ZeroMap_Remove(uint32_t, uint32_t) {}
+#endif
+
+#endif // ZEROMAP_H
@@ -0,0 +1,505 @@
+// Runs the real firmware image under simavr and counts CPU cycles. The simulated ATmega32U4 has
+// the SD card model on its SPI peripheral and this program is the USB host: it enumerates the
+// device through the USB controller of simavr and sends Bulk-Only Transport commands. The
+// firmware has to be built with SIMAVR_MARKERS, its GPIOR0 writes (SimMarkers.h) are
+// timestamped with the cycle counter to get the cycles of every SCSI command and of the SPI and
+// FIFO phases of a block.
+//
+//   arduino-cli compile --fqbn arduino:avr:micro --build-property build.extra_flags=-DSIMAVR_MARKERS
+//     --output-dir build ..
+//   make avrbench
+//   ./avrbench build/SDCardReaderLUFA.ino.elf --count 256 --transfer 8
+//
+// Stack usage is measured by painting the RAM between the end of .bss and RAMEND before the
+// firmware starts. The exit code is non-zero if a command failed or the data read back differs.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gelf.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <avr_ioport.h>
+#include <avr_spi.h>
+#include <avr_usb.h>
+
+#include "SDCardModel.h"
+
+#include "../SimMarkers.h"
+
+static const char *const MCU = "atmega32u4";
+static const uint32_t FREQUENCY = 16000000;
+
+// GPIOR0 in the data space of the ATmega32U4
+static const avr_io_addr_t GPIOR0_ADDRESS = 0x3E;
+// chip select of the card, SS is PB0 on the Arduino Micro
+static const char CHIP_SELECT_PORT = 'B';
+static const int CHIP_SELECT_BIT = 0;
+
+static const uint8_t IN_ENDPOINT = 3;
+static const uint8_t OUT_ENDPOINT = 4;
+static const uint32_t ENDPOINT_SIZE = 64;
+
+static const uint8_t STACK_PAINT = 0xC5;
+
+// host polling interval while the device NAKs, and the time after which a transfer fails
+static const uint64_t POLL_CYCLES = 64;
+static const uint64_t TIMEOUT_CYCLES = 2ull * FREQUENCY;
+
+static avr_t *s_avr;
+static SDCardModel *s_card;
+static avr_irq_t *s_spi_input;
+static bool s_attached;
+
+struct Phase {
+  uint64_t begin;
+  bool open;
+  uint64_t cycles;
+  uint64_t count;
+};
+static Phase s_phases[SIM_MARKER_SPI_WRITE_END / 2];
+
+struct CommandCycles {
+  uint64_t count;
+  uint64_t cycles;
+  uint64_t min;
+  uint64_t max;
+};
+static std::map<uint8_t, CommandCycles> s_commands;
+static uint8_t s_opcode;
+
+static uint64_t nowNs()
+{
+  return s_avr->cycle * 1000000000ull / FREQUENCY;
+}
+
+static void spiOutput(avr_irq_t *, uint32_t value, void *)
+{
+  avr_raise_irq(s_spi_input, s_card->transfer((uint8_t)value, nowNs()));
+}
+
+static void chipSelect(avr_irq_t *, uint32_t value, void *)
+{
+  s_card->select(!value);
+}
+
+static void usbAttach(avr_irq_t *, uint32_t value, void *)
+{
+  s_attached = value;
+}
+
+static void markerWrite(avr_t *avr, avr_io_addr_t addr, uint8_t value, void *)
+{
+  avr->data[addr] = value;
+  if (!value || value > SIM_MARKER_SPI_WRITE_END)
+    return;
+
+  Phase &phase = s_phases[(value - 1) / 2];
+  if (value & 1) {
+    phase.begin = avr->cycle;
+    phase.open = true;
+    return;
+  }
+  // a phase left by an error path has no end marker, it's restarted by the next begin
+  if (!phase.open)
+    return;
+  phase.open = false;
+  uint64_t cycles = avr->cycle - phase.begin;
+  phase.cycles += cycles;
+  ++phase.count;
+
+  if (value == SIM_MARKER_COMMAND_END) {
+    CommandCycles &command = s_commands[s_opcode];
+    command.min = command.count ? (cycles < command.min ? cycles : command.min) : cycles;
+    command.max = cycles > command.max ? cycles : command.max;
+    command.cycles += cycles;
+    ++command.count;
+  }
+}
+
+static const Phase &phase(SimMarkers begin)
+{
+  return s_phases[(begin - 1) / 2];
+}
+
+static void resetStats()
+{
+  memset(s_phases, 0, sizeof(s_phases));
+  s_commands.clear();
+}
+
+// runs the CPU for at least the given number of cycles, false if the firmware crashed
+static bool runCycles(uint64_t cycles)
+{
+  avr_cycle_count_t end = s_avr->cycle + cycles;
+  while (s_avr->cycle < end) {
+    int state = avr_run(s_avr);
+    if (state == cpu_Done || state == cpu_Crashed)
+      return false;
+  }
+  return true;
+}
+
+// bus time of a full speed packet
+static uint64_t packetCycles(uint32_t length)
+{
+  return (length + 16) * 8 * 83ull * FREQUENCY / 1000000000ull;
+}
+
+// Retries a transfer of the USB controller until the device stops NAKing. Returns
+// AVR_IOCTL_USB_OK or AVR_IOCTL_USB_STALL, or -1 on a timeout.
+static int usbTransfer(uint32_t request, uint8_t endpoint, uint8_t *data, uint32_t *length)
+{
+  uint64_t deadline = s_avr->cycle + TIMEOUT_CYCLES;
+  for (;;) {
+    struct avr_io_usb io;
+    io.pipe = endpoint;
+    io.sz = *length;
+    io.buf = data;
+    int result = avr_ioctl(s_avr, request, &io);
+    if (result != AVR_IOCTL_USB_NAK) {
+      *length = io.sz;
+      if (result == AVR_IOCTL_USB_OK && !runCycles(packetCycles(io.sz)))
+        return -1;
+      return result;
+    }
+    if (s_avr->cycle > deadline || !runCycles(POLL_CYCLES))
+      return -1;
+  }
+}
+
+// a control request without data stage
+static bool controlRequest(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index)
+{
+  uint8_t setup[8] = { requestType, request, (uint8_t)value, (uint8_t)(value >> 8),
+                       (uint8_t)index, (uint8_t)(index >> 8), 0, 0 };
+  uint32_t length = sizeof(setup);
+  if (usbTransfer(AVR_IOCTL_USB_SETUP, 0, setup, &length) != AVR_IOCTL_USB_OK)
+    return false;
+  uint8_t status[ENDPOINT_SIZE];
+  length = sizeof(status);
+  return usbTransfer(AVR_IOCTL_USB_READ, 0, status, &length) == AVR_IOCTL_USB_OK && !length;
+}
+
+static bool clearHalt(uint8_t endpointAddress)
+{
+  return controlRequest(0x02, 0x01, 0, endpointAddress);
+}
+
+static bool enumerate()
+{
+  avr_ioctl(s_avr, AVR_IOCTL_USB_VBUS, (void *)1);
+  for (uint64_t waited = 0; !s_attached; waited += 16000) {
+    if (waited > TIMEOUT_CYCLES || !runCycles(16000))
+      return false;
+  }
+  avr_ioctl(s_avr, AVR_IOCTL_USB_RESET, nullptr);
+  return runCycles(16000) && controlRequest(0x00, 0x05, 1, 0) && controlRequest(0x00, 0x09, 1, 0);
+}
+
+enum Status {
+  STATUS_PASSED = 0,
+  STATUS_FAILED = 1,
+  STATUS_PHASE_ERROR = 2,
+  STATUS_TRANSPORT_ERROR,
+};
+
+static bool receiveStatus(uint8_t *csw)
+{
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    uint32_t length = ENDPOINT_SIZE;
+    int result = usbTransfer(AVR_IOCTL_USB_READ, IN_ENDPOINT, csw, &length);
+    if (result == AVR_IOCTL_USB_OK)
+      return length == 13;
+    if (result != AVR_IOCTL_USB_STALL || !clearHalt(0x80 | IN_ENDPOINT))
+      return false;
+  }
+  return false;
+}
+
+// runs a Bulk-Only Transport command with a data stage of length bytes
+static Status command(const uint8_t *cdb, uint8_t cdbLength, bool dataIn, uint8_t *data, uint32_t length)
+{
+  static uint32_t tag;
+  uint8_t cbw[31] = { 'U', 'S', 'B', 'C' };
+  ++tag;
+  memcpy(&cbw[4], &tag, 4);
+  memcpy(&cbw[8], &length, 4);
+  cbw[12] = dataIn ? 0x80 : 0x00;
+  cbw[14] = cdbLength;
+  memcpy(&cbw[15], cdb, cdbLength);
+
+  s_opcode = cdb[0];
+  uint32_t size = sizeof(cbw);
+  if (usbTransfer(AVR_IOCTL_USB_WRITE, OUT_ENDPOINT, cbw, &size) != AVR_IOCTL_USB_OK)
+    return STATUS_TRANSPORT_ERROR;
+
+  for (uint32_t offset = 0; offset < length;) {
+    uint8_t packet[ENDPOINT_SIZE];
+    size = length - offset < ENDPOINT_SIZE ? length - offset : ENDPOINT_SIZE;
+    int result;
+    if (dataIn) {
+      result = usbTransfer(AVR_IOCTL_USB_READ, IN_ENDPOINT, packet, &size);
+      if (result == AVR_IOCTL_USB_OK)
+        memcpy(data + offset, packet, size > length - offset ? length - offset : size);
+    } else {
+      memcpy(packet, data + offset, size);
+      result = usbTransfer(AVR_IOCTL_USB_WRITE, OUT_ENDPOINT, packet, &size);
+    }
+    if (result == AVR_IOCTL_USB_STALL) {
+      if (!clearHalt(dataIn ? 0x80 | IN_ENDPOINT : OUT_ENDPOINT))
+        return STATUS_TRANSPORT_ERROR;
+      break;
+    }
+    if (result != AVR_IOCTL_USB_OK)
+      return STATUS_TRANSPORT_ERROR;
+    offset += size;
+    if (dataIn && size < ENDPOINT_SIZE)
+      break;
+  }
+
+  uint8_t csw[ENDPOINT_SIZE];
+  if (!receiveStatus(csw) || memcmp(csw, "USBS", 4) || memcmp(&csw[4], &tag, 4) || csw[12] > STATUS_PHASE_ERROR)
+    return STATUS_TRANSPORT_ERROR;
+  return (Status)csw[12];
+}
+
+static Status blockCommand(uint8_t opcode, uint32_t block, uint16_t count, bool dataIn, uint8_t *data)
+{
+  uint8_t cdb[10] = { opcode, 0, (uint8_t)(block >> 24), (uint8_t)(block >> 16), (uint8_t)(block >> 8),
+                      (uint8_t)block, 0, (uint8_t)(count >> 8), (uint8_t)count, 0 };
+  return command(cdb, sizeof(cdb), dataIn, data, data ? count * 512u : 0);
+}
+
+static void fillPattern(uint32_t block, uint8_t *data)
+{
+  for (uint16_t i = 0; i < 512; ++i)
+    data[i] = (uint8_t)(block * 7 + i);
+}
+
+static bool waitForMedium()
+{
+  static const uint8_t test_unit_ready[6] = { 0x00 };
+  static const uint8_t request_sense[6] = { 0x03, 0, 0, 0, 18, 0 };
+  uint8_t sense[18];
+  for (int i = 0; i < 200; ++i) {
+    Status status = command(test_unit_ready, sizeof(test_unit_ready), false, nullptr, 0);
+    if (status == STATUS_PASSED)
+      return true;
+    if (status != STATUS_FAILED ||
+        command(request_sense, sizeof(request_sense), true, sense, sizeof(sense)) != STATUS_PASSED ||
+        !runCycles(FREQUENCY / 100))
+      return false;
+  }
+  return false;
+}
+
+static bool readSymbols(const char *path, std::map<std::string, uint32_t> *symbols)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || elf_version(EV_CURRENT) == EV_NONE)
+    return false;
+  Elf *elf = elf_begin(fd, ELF_C_READ, nullptr);
+  Elf_Scn *section = nullptr;
+  while (elf && (section = elf_nextscn(elf, section))) {
+    GElf_Shdr header;
+    if (!gelf_getshdr(section, &header) || header.sh_type != SHT_SYMTAB || !header.sh_entsize)
+      continue;
+    Elf_Data *data = elf_getdata(section, nullptr);
+    for (size_t i = 0; data && i < header.sh_size / header.sh_entsize; ++i) {
+      GElf_Sym symbol;
+      const char *name;
+      if (gelf_getsym(data, i, &symbol) && (name = elf_strptr(elf, header.sh_link, symbol.st_name)) && *name)
+        (*symbols)[name] = symbol.st_value;
+    }
+  }
+  bool found = elf != nullptr;
+  elf_end(elf);
+  close(fd);
+  return found;
+}
+
+static const char *commandName(uint8_t opcode)
+{
+  switch (opcode) {
+    case 0x00: return "TEST UNIT READY";
+    case 0x03: return "REQUEST SENSE";
+    case 0x12: return "INQUIRY";
+    case 0x1A: return "MODE SENSE (6)";
+    case 0x25: return "READ CAPACITY (10)";
+    case 0x28: return "READ (10)";
+    case 0x2A: return "WRITE (10)";
+    case 0x2F: return "VERIFY (10)";
+    default:   return "other";
+  }
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr,
+          "Usage: %s FIRMWARE.elf [options]\n"
+          "  --profile NAME      latency profile of the card: ideal, class10, class4, worn, cheap (default ideal)\n"
+          "  --blocks N          card size in 512 byte blocks (default 7744512)\n"
+          "  --count N           blocks written and read back (default 256)\n"
+          "  --transfer N        blocks per READ (10) and WRITE (10) command (default 8)\n",
+          program);
+}
+
+int main(int argc, char **argv)
+{
+  const SDCardProfile *profile = SDCardProfile::find("ideal");
+  uint32_t blocks = 7744512;
+  uint32_t count = 256;
+  uint32_t transfer = 8;
+
+  if (argc < 2 || argc % 2) {
+    usage(argv[0]);
+    return 2;
+  }
+  const char *path = argv[1];
+  for (int i = 2; i + 1 < argc; i += 2) {
+    const char *arg = argv[i];
+    const char *value = argv[i + 1];
+    if (!strcmp(arg, "--profile")) {
+      if (!(profile = SDCardProfile::find(value))) {
+        fprintf(stderr, "Unknown profile %s\n", value);
+        return 2;
+      }
+    } else if (!strcmp(arg, "--blocks")) {
+      blocks = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--count")) {
+      count = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--transfer")) {
+      transfer = strtoul(value, nullptr, 0);
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (!count || !transfer || transfer > 0xFFFF) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  elf_firmware_t firmware;
+  memset(&firmware, 0, sizeof(firmware));
+  std::map<std::string, uint32_t> symbols;
+  if (elf_read_firmware(path, &firmware) || !readSymbols(path, &symbols)) {
+    fprintf(stderr, "Can't load %s\n", path);
+    return 1;
+  }
+  // the sketch has no .mmcu section
+  strcpy(firmware.mmcu, MCU);
+  firmware.frequency = FREQUENCY;
+  if (!(s_avr = avr_make_mcu_by_name(MCU))) {
+    fprintf(stderr, "simavr doesn't support the %s\n", MCU);
+    return 1;
+  }
+  avr_init(s_avr);
+  avr_load_firmware(s_avr, &firmware);
+
+  // data addresses have the offset 0x800000 in the ELF file
+  uint16_t data_start = symbols.count("__data_start") ? symbols["__data_start"] & 0xFFFF : 0x100;
+  uint16_t heap_start = symbols.count("__heap_start") ? symbols["__heap_start"] & 0xFFFF : 0;
+  if (!heap_start) {
+    fprintf(stderr, "%s has no __heap_start symbol\n", path);
+    return 1;
+  }
+  for (uint32_t address = heap_start; address <= s_avr->ramend; ++address)
+    s_avr->data[address] = STACK_PAINT;
+
+  SDCardModel card(blocks);
+  card.setProfile(*profile);
+  s_card = &card;
+
+  s_spi_input = avr_io_getirq(s_avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_INPUT);
+  avr_irq_register_notify(avr_io_getirq(s_avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_OUTPUT), spiOutput, nullptr);
+  avr_irq_register_notify(avr_io_getirq(s_avr, AVR_IOCTL_IOPORT_GETIRQ(CHIP_SELECT_PORT), CHIP_SELECT_BIT),
+                          chipSelect, nullptr);
+  avr_irq_register_notify(avr_io_getirq(s_avr, AVR_IOCTL_USB_GETIRQ(), USB_IRQ_ATTACH), usbAttach, nullptr);
+  avr_register_io_write(s_avr, GPIOR0_ADDRESS, markerWrite, nullptr);
+
+  if (!enumerate()) {
+    fprintf(stderr, "Enumeration failed after %llu cycles\n", (unsigned long long)s_avr->cycle);
+    return 1;
+  }
+  if (!waitForMedium()) {
+    fprintf(stderr, "Medium not ready after %llu cycles\n", (unsigned long long)s_avr->cycle);
+    return 1;
+  }
+  printf("%-20s %12llu cycles, profile %s\n", "medium ready", (unsigned long long)s_avr->cycle, profile->name);
+  if (!phase(SIM_MARKER_COMMAND_BEGIN).count) {
+    fprintf(stderr, "No markers, the firmware has to be built with SIMAVR_MARKERS\n");
+    return 1;
+  }
+  resetStats();
+
+  static const uint8_t inquiry[6] = { 0x12, 0, 0, 0, 36, 0 };
+  static const uint8_t read_capacity[10] = { 0x25 };
+  static const uint8_t mode_sense[6] = { 0x1A, 0, 0x3F, 0, 192, 0 };
+  uint8_t response[192];
+  bool passed = command(inquiry, sizeof(inquiry), true, response, 36) == STATUS_PASSED &&
+                command(read_capacity, sizeof(read_capacity), true, response, 8) == STATUS_PASSED &&
+                command(mode_sense, sizeof(mode_sense), true, response, 192) == STATUS_PASSED;
+
+  std::vector<uint8_t> data(transfer * 512);
+  uint64_t write_start = s_avr->cycle;
+  for (uint32_t block = 0; block < count && passed; block += transfer) {
+    uint16_t n = count - block < transfer ? count - block : transfer;
+    for (uint16_t i = 0; i < n; ++i)
+      fillPattern(block + i, &data[i * 512]);
+    passed = blockCommand(0x2A, block, n, false, data.data()) == STATUS_PASSED;
+  }
+  uint64_t write_cycles = s_avr->cycle - write_start;
+
+  uint64_t read_start = s_avr->cycle;
+  uint8_t expected[512];
+  for (uint32_t block = 0; block < count && passed; block += transfer) {
+    uint16_t n = count - block < transfer ? count - block : transfer;
+    passed = blockCommand(0x28, block, n, true, data.data()) == STATUS_PASSED;
+    for (uint16_t i = 0; i < n && passed; ++i) {
+      fillPattern(block + i, expected);
+      passed = !memcmp(expected, &data[i * 512], 512);
+    }
+  }
+  uint64_t read_cycles = s_avr->cycle - read_start;
+  passed = passed && blockCommand(0x2F, 0, count < 0xFFFF ? count : 0xFFFF, false, nullptr) == STATUS_PASSED;
+
+  const Phase &spi_read = phase(SIM_MARKER_SPI_READ_BEGIN);
+  const Phase &usb_in = phase(SIM_MARKER_USB_IN_BEGIN);
+  const Phase &usb_out = phase(SIM_MARKER_USB_OUT_BEGIN);
+  const Phase &spi_write = phase(SIM_MARKER_SPI_WRITE_BEGIN);
+  double blocks_read = spi_read.count ? spi_read.count : 1;
+  double blocks_written = spi_write.count ? spi_write.count : 1;
+  printf("%-20s %9.0f SPI %9.0f FIFO %9.0f total %9.0f end to end cycles per block\n", "read",
+         spi_read.cycles / blocks_read, usb_in.cycles / blocks_read, (spi_read.cycles + usb_in.cycles) / blocks_read,
+         read_cycles / (double)count);
+  printf("%-20s %9.0f SPI %9.0f FIFO %9.0f total %9.0f end to end cycles per block\n", "write",
+         spi_write.cycles / blocks_written, usb_out.cycles / blocks_written,
+         (spi_write.cycles + usb_out.cycles) / blocks_written, write_cycles / (double)count);
+
+  printf("\n%-20s %8s %12s %12s %12s\n", "command", "count", "avg cycles", "min", "max");
+  for (const auto &entry : s_commands) {
+    const CommandCycles &cycles = entry.second;
+    printf("%-20s %8llu %12.0f %12llu %12llu\n", commandName(entry.first), (unsigned long long)cycles.count,
+           (double)cycles.cycles / cycles.count, (unsigned long long)cycles.min, (unsigned long long)cycles.max);
+  }
+
+  uint32_t stack_low = heap_start;
+  while (stack_low <= s_avr->ramend && s_avr->data[stack_low] == STACK_PAINT)
+    ++stack_low;
+  printf("\n%-20s %5u bytes .data and .bss, %u bytes stack high-water, %u bytes never used\n", "RAM",
+         heap_start - data_start, s_avr->ramend + 1 - stack_low, stack_low - heap_start);
+
+  if (!passed)
+    printf("A command failed or the data read back differs\n");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,696 @@
+// Benchmark of the firmware's SCSI stack on the host, built like mssim from the real SCSI.c and
+// SDCardManager.cpp on the endpoint and card models. Runs fio style workloads or replays captured
+// command traces, and reports throughput, IOPS, command latency percentiles from the CBW to the
+// CSW, SPI bytes clocked per payload byte and modeled CPU cycles per block. All times are virtual,
+// so the numbers are reproducible and can be compared against a stored baseline:
+//
+//   make benchmark
+//   ./benchmark --baseline benchmark-baseline.json     fails if a workload regressed by more than 5%
+//   ./benchmark --save benchmark-baseline.json         updates the baseline after an intended change
+//   ./benchmark --replay trace.bin                     replays a READ COMMAND TRACE dump
+//   ./benchmark --workload seq-read-4k,fat-copy
+//   ./benchmark --backend ram                          the same workloads on another backend, see BlockDevice.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+
+#include "BulkOnlyHost.h"
+#include "FileBlockDevice.h"
+#include "HostArduino.h"
+#include "HostFirmware.h"
+#include "HostUSB.h"
+#include "SDCardModel.h"
+#include "TraceFile.h"
+
+#include "../MetadataCache.h"
+#include "../RamBlockDevice.h"
+#include "../SDCardManager.h"
+
+static const uint16_t MAX_TRANSFER_BLOCKS = 128;
+
+enum Pattern {
+  PATTERN_SEQUENTIAL,
+  PATTERN_RANDOM,
+  PATTERN_FAT,    // file copies onto a FAT32 volume: data clusters with directory, FAT and FSInfo updates
+  PATTERN_ZERO,   // sequential zero blocks like a formatter or a preallocated file writes them, reads read them back
+};
+
+struct Workload {
+  const char *name;
+  Pattern pattern;
+  uint8_t read_percent;
+  uint16_t transfer;      // blocks per command
+  uint16_t think_ms;      // idle time of the host after every command
+};
+
+static const Workload s_workloads[] = {
+  { "seq-read-512",  PATTERN_SEQUENTIAL, 100,   1,  0 },
+  { "seq-read-4k",   PATTERN_SEQUENTIAL, 100,   8,  0 },
+  { "seq-read-64k",  PATTERN_SEQUENTIAL, 100, 128,  0 },
+  { "seq-write-512", PATTERN_SEQUENTIAL,   0,   1,  0 },
+  { "seq-write-4k",  PATTERN_SEQUENTIAL,   0,   8,  0 },
+  { "seq-write-64k", PATTERN_SEQUENTIAL,   0, 128,  0 },
+  { "rand-read-4k",  PATTERN_RANDOM,     100,   8,  0 },
+  { "rand-write-4k", PATTERN_RANDOM,       0,   8,  0 },
+  { "rand-rw70-4k",  PATTERN_RANDOM,      70,   8,  0 },
+  { "fat-copy",      PATTERN_FAT,          0,   0,  0 },
+  { "logger-512",    PATTERN_RANDOM,       0,   1, 20 },   // a data logger, scattered records with pauses
+  { "logger-slow-512", PATTERN_RANDOM,     0,   1, 100 },  // the same with pauses long enough to fold a write log
+  { "zero-fill-64k", PATTERN_ZERO,         0, 128,  0 },
+  { "zero-read-64k", PATTERN_ZERO,       100, 128,  0 },
+};
+
+struct Result {
+  std::string name;
+  uint64_t commands;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t ns;            // without the idle time of the host
+  uint64_t spi_bytes;
+  uint64_t fifo_accesses;
+  std::vector<uint64_t> latencies_ns;
+
+  double seconds() const { return ns / 1e9; }
+  double mbPerSecond() const { return ns ? bytes / 1e6 / seconds() : 0; }
+  double iops() const { return ns ? commands / seconds() : 0; }
+  double spiPerByte() const { return bytes ? (double)spi_bytes / bytes : 0; }
+  double fifoPerByte() const { return bytes ? (double)fifo_accesses / bytes : 0; }
+  double cyclesPerBlock() const { return bytes ? ns * (F_CPU / 1e9) / (bytes / 512.0) : 0; }
+
+  double percentileUs(double fraction) const
+  {
+    if (latencies_ns.empty())
+      return 0;
+    std::vector<uint64_t> sorted(latencies_ns);
+    size_t index = std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()));
+    std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    return sorted[index] / 1e3;
+  }
+};
+
+class Runner {
+public:
+  Runner(BulkOnlyHost &host, uint32_t capacity) : m_host(host), m_capacity(capacity), m_buffer(MAX_TRANSFER_BLOCKS * 512) {}
+
+  void begin(const std::string &name)
+  {
+    m_result = Result();
+    m_result.name = name;
+    m_start_ns = HostArduino_Now();
+    m_idle_ns = 0;
+    m_late_ns = 0;
+    m_start_spi = HostArduino_SpiBytes();
+    HostUSB_ResetCounters();
+  }
+
+  Result end()
+  {
+    const HostUSB_Counters &usb = HostUSB_GetCounters();
+    m_result.ns = HostArduino_Now() - m_start_ns - m_idle_ns;
+    m_result.spi_bytes = HostArduino_SpiBytes() - m_start_spi;
+    m_result.fifo_accesses = usb.fifo_reads + usb.fifo_writes;
+    return m_result;
+  }
+
+  // READ (10) or WRITE (10), written blocks are tagged with their address unless they are zeros
+  void transfer(bool read, uint32_t block, uint16_t count, bool zeros = false)
+  {
+    if (count > MAX_TRANSFER_BLOCKS || block >= m_capacity)
+      return;
+    count = std::min<uint32_t>(count, m_capacity - block);
+    BulkOnlyHost::Status status;
+    if (read) {
+      status = m_host.read10(block, count, m_buffer.data());
+    } else {
+      for (uint16_t i = 0; i < count; ++i)
+        memset(&m_buffer[i * 512], zeros ? 0 : (uint8_t)(block + i), 512);
+      status = m_host.write10(block, count, m_buffer.data());
+    }
+    record(status, (uint32_t)count * 512);
+  }
+
+  void command(const uint8_t *cdb, uint8_t length, uint16_t allocation)
+  {
+    record(m_host.command(cdb, length, allocation > 0, m_buffer.data(), allocation), 0);
+  }
+
+  void verify(uint32_t block, uint16_t count)
+  {
+    if (block >= m_capacity)
+      return;
+    record(m_host.verify10(block, std::min<uint32_t>(count, m_capacity - block)), 0);
+  }
+
+  // the host thinks, the firmware loop keeps running and may use the time in the background. A
+  // background step that runs past the idle time holds up the next command, which the host would
+  // have sent by then, so the rest counts as part of that command.
+  void idle(uint16_t ms)
+  {
+    uint64_t start_ns = HostArduino_Now();
+    while (HostArduino_Now() - start_ns < ms * 1000000ULL) {
+      HostFirmware_Loop();
+      delay(1);
+    }
+    m_idle_ns += ms * 1000000ULL;
+    m_late_ns = HostArduino_Now() - start_ns - ms * 1000000ULL;
+  }
+
+  uint32_t capacity() const { return m_capacity; }
+
+private:
+  void record(BulkOnlyHost::Status status, uint32_t bytes)
+  {
+    ++m_result.commands;
+    if (status == BulkOnlyHost::STATUS_PASSED)
+      m_result.bytes += bytes;
+    else
+      ++m_result.errors;
+    m_result.latencies_ns.push_back(m_host.lastDuration() + m_late_ns);
+    m_late_ns = 0;
+  }
+
+  BulkOnlyHost &m_host;
+  uint32_t m_capacity;
+  std::vector<uint8_t> m_buffer;
+  Result m_result;
+  uint64_t m_start_ns;
+  uint64_t m_idle_ns;
+  uint64_t m_late_ns;      // time the last idle() ran over
+  uint64_t m_start_spi;
+};
+
+static uint32_t s_random_state = 0x2545F491;
+
+static uint32_t nextRandom()
+{
+  s_random_state ^= s_random_state << 13;
+  s_random_state ^= s_random_state >> 17;
+  s_random_state ^= s_random_state << 5;
+  return s_random_state;
+}
+
+static void runPattern(Runner &runner, const Workload &workload, uint64_t bytes, uint32_t region)
+{
+  uint32_t blocks = bytes / 512;
+  uint32_t slots = region / workload.transfer;
+
+  for (uint32_t done = 0; done < blocks; done += workload.transfer) {
+    bool read = nextRandom() % 100 < workload.read_percent;
+    uint32_t block = workload.pattern != PATTERN_RANDOM ? done % region
+                                                        : (nextRandom() % slots) * workload.transfer;
+    runner.transfer(read, block, workload.transfer, workload.pattern == PATTERN_ZERO);
+    if (workload.think_ms)
+      runner.idle(workload.think_ms);
+  }
+}
+
+// A FAT32 volume with 4 KiB clusters as a formatter creates it: 32 reserved sectors with the
+// FSInfo sector at 1, two FATs of 1024 sectors and the root directory in the first data cluster.
+static const uint32_t FAT_FSINFO = 1, FAT_FIRST = 32, FAT_SECTORS = 1024, FAT_CLUSTER_BLOCKS = 8;
+
+// Writes the boot sector of the volume to block 0 without a partition table, so that the
+// firmware finds the layout, see MetadataCache.cpp. Not part of the measured workload.
+static bool formatFat32(BulkOnlyHost &host)
+{
+  uint8_t boot[512] = { 0xEB, 0x58, 0x90, 'M', 'S', 'W', 'I', 'N', '4', '.', '1' };
+  boot[11] = 512 & 0xFF;
+  boot[12] = 512 >> 8;
+  boot[13] = FAT_CLUSTER_BLOCKS;
+  boot[14] = FAT_FIRST;
+  boot[16] = 2;
+  boot[21] = 0xF8;
+  boot[36] = FAT_SECTORS & 0xFF;
+  boot[37] = FAT_SECTORS >> 8;
+  boot[44] = 2;
+  boot[48] = FAT_FSINFO;
+  boot[50] = 6;
+  boot[66] = 0x29;
+  memcpy(&boot[82], "FAT32   ", 8);
+  boot[510] = 0x55;
+  boot[511] = 0xAA;
+  return host.write10(0, 1, boot) == BulkOnlyHost::STATUS_PASSED;
+}
+
+// Every file copy reads the directory and the FAT, writes the data clusters in up to 64 KiB
+// commands, updates both FATs and the directory entry and every few files the FSInfo sector.
+static void runFatCopy(Runner &runner, uint64_t bytes)
+{
+  const uint32_t data = FAT_FIRST + 2 * FAT_SECTORS;
+  uint32_t next_cluster = 3;   // cluster 2 holds the root directory
+  uint32_t written = 0;
+
+  for (uint32_t file = 0; (uint64_t)written * 512 < bytes; ++file) {
+    uint32_t clusters = 1 + nextRandom() % 16;
+    uint32_t directory = data + file / 16 % FAT_CLUSTER_BLOCKS;
+    uint32_t fat_block = FAT_FIRST + next_cluster / 128;
+
+    runner.transfer(true, directory, 1);
+    runner.transfer(true, fat_block, 1);
+    for (uint32_t block = 0; block < clusters * FAT_CLUSTER_BLOCKS; block += MAX_TRANSFER_BLOCKS) {
+      uint16_t count = std::min<uint32_t>(MAX_TRANSFER_BLOCKS, clusters * FAT_CLUSTER_BLOCKS - block);
+      runner.transfer(false, data + (next_cluster - 2) * FAT_CLUSTER_BLOCKS + block, count);
+      written += count;
+    }
+    runner.transfer(false, fat_block, 1);
+    runner.transfer(false, fat_block + FAT_SECTORS, 1);
+    runner.transfer(false, directory, 1);
+    written += 3;
+    if (file % 8 == 7) {
+      runner.transfer(false, FAT_FSINFO, 1);
+      ++written;
+    }
+    next_cluster += clusters;
+  }
+}
+
+// Replays the commands of a trace in sequence order. Addresses beyond the capacity of the model
+// wrap around, commands that need more than the trace records are replayed with typical
+// parameters, vendor specific commands are skipped. With timing the gaps between commands are
+// kept, the firmware loop runs while the host is idle.
+static void runReplay(Runner &runner, const std::map<uint32_t, CommandTrace_Record_t> &records, bool timing,
+                      uint64_t *skipped)
+{
+  uint64_t start_ns = HostArduino_Now();
+  uint64_t trace_us = 0;
+  uint32_t previous_timestamp = records.empty() ? 0 : records.begin()->second.Timestamp;
+
+  for (const auto &entry : records) {
+    const CommandTrace_Record_t &record = entry.second;
+    trace_us += (uint32_t)(record.Timestamp - previous_timestamp);
+    previous_timestamp = record.Timestamp;
+    while (timing && HostArduino_Now() - start_ns < trace_us * 1000) {
+      HostFirmware_Loop();
+      delay(1);
+    }
+
+    uint8_t cdb[10] = { record.Opcode };
+    uint32_t block = runner.capacity() ? record.BlockAddress % runner.capacity() : 0;
+    switch (record.Opcode) {
+    case SCSI_CMD_READ_10:
+    case SCSI_CMD_WRITE_10:
+      for (uint32_t done = 0; done < record.TotalBlocks; done += MAX_TRANSFER_BLOCKS) {
+        uint16_t count = std::min<uint32_t>(MAX_TRANSFER_BLOCKS, record.TotalBlocks - done);
+        runner.transfer(record.Opcode == SCSI_CMD_READ_10, (block + done) % runner.capacity(), count);
+      }
+      break;
+    case SCSI_CMD_VERIFY_10:
+      runner.verify(block, record.TotalBlocks);
+      break;
+    case SCSI_CMD_TEST_UNIT_READY:
+    case SCSI_CMD_START_STOP_UNIT:
+    case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+      runner.command(cdb, 6, 0);
+      break;
+    case SCSI_CMD_REQUEST_SENSE:
+      cdb[4] = 18;
+      runner.command(cdb, 6, 18);
+      break;
+    case SCSI_CMD_INQUIRY:
+      cdb[4] = 36;
+      runner.command(cdb, 6, 36);
+      break;
+    case SCSI_CMD_MODE_SENSE_6:
+      cdb[2] = 0x3F;
+      cdb[4] = 192;
+      runner.command(cdb, 6, 192);
+      break;
+    case SCSI_CMD_READ_CAPACITY_10:
+      runner.command(cdb, 10, 8);
+      break;
+    default:
+      ++*skipped;
+      break;
+    }
+  }
+}
+
+// Minimal JSON reader for the result files, flattens all values to paths like "workloads.seq-read-4k.mb_per_s"
+class JsonReader {
+public:
+  explicit JsonReader(const std::string &text) : m_text(text), m_pos(0) {}
+
+  bool parse(std::map<std::string, std::string> &values)
+  {
+    return value("", values) && (skipSpace(), m_pos == m_text.size());
+  }
+
+private:
+  void skipSpace()
+  {
+    while (m_pos < m_text.size() && strchr(" \t\r\n", m_text[m_pos]))
+      ++m_pos;
+  }
+
+  bool string(std::string *out)
+  {
+    if (m_text[m_pos] != '"')
+      return false;
+    size_t end = m_text.find('"', m_pos + 1);
+    if (end == std::string::npos)
+      return false;
+    *out = m_text.substr(m_pos + 1, end - m_pos - 1);
+    m_pos = end + 1;
+    return true;
+  }
+
+  bool value(const std::string &path, std::map<std::string, std::string> &values)
+  {
+    skipSpace();
+    if (m_pos >= m_text.size())
+      return false;
+
+    if (m_text[m_pos] == '{') {
+      ++m_pos;
+      skipSpace();
+      if (m_text[m_pos] == '}')
+        return ++m_pos, true;
+      for (;;) {
+        std::string key;
+        skipSpace();
+        if (!string(&key))
+          return false;
+        skipSpace();
+        if (m_text[m_pos++] != ':' || !value(path.empty() ? key : path + "." + key, values))
+          return false;
+        skipSpace();
+        if (m_text[m_pos] == ',') {
+          ++m_pos;
+          continue;
+        }
+        return m_text[m_pos++] == '}';
+      }
+    }
+
+    std::string text;
+    if (m_text[m_pos] == '"') {
+      if (!string(&text))
+        return false;
+    } else {
+      size_t end = m_text.find_first_of(",}] \t\r\n", m_pos);
+      text = m_text.substr(m_pos, end - m_pos);
+      m_pos = end == std::string::npos ? m_text.size() : end;
+      if (text.empty())
+        return false;
+    }
+    values[path] = text;
+    return true;
+  }
+
+  const std::string &m_text;
+  size_t m_pos;
+};
+
+static bool readBaseline(const char *path, std::map<std::string, std::string> &values)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror(path);
+    return false;
+  }
+  std::string text;
+  char chunk[4096];
+  size_t length;
+  while ((length = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    text.append(chunk, length);
+  fclose(file);
+
+  if (!JsonReader(text).parse(values)) {
+    fprintf(stderr, "%s: invalid JSON\n", path);
+    return false;
+  }
+  return true;
+}
+
+static bool writeResults(const char *path, const std::string &settings, const std::vector<Result> &results)
+{
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    perror(path);
+    return false;
+  }
+  fprintf(file, "{\n  \"settings\": \"%s\",\n  \"workloads\": {\n", settings.c_str());
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result &result = results[i];
+    fprintf(file,
+            "    \"%s\": {\n"
+            "      \"mb_per_s\": %.4f,\n"
+            "      \"iops\": %.2f,\n"
+            "      \"p50_us\": %.1f,\n"
+            "      \"p90_us\": %.1f,\n"
+            "      \"p99_us\": %.1f,\n"
+            "      \"max_us\": %.1f,\n"
+            "      \"spi_bytes_per_byte\": %.4f,\n"
+            "      \"fifo_accesses_per_byte\": %.4f,\n"
+            "      \"cycles_per_block\": %.0f,\n"
+            "      \"commands\": %llu,\n"
+            "      \"errors\": %llu\n"
+            "    }%s\n",
+            result.name.c_str(), result.mbPerSecond(), result.iops(), result.percentileUs(0.5),
+            result.percentileUs(0.9), result.percentileUs(0.99), result.percentileUs(1.0), result.spiPerByte(),
+            result.fifoPerByte(), result.cyclesPerBlock(), (unsigned long long)result.commands,
+            (unsigned long long)result.errors, i + 1 < results.size() ? "," : "");
+  }
+  fprintf(file, "  }\n}\n");
+  return fclose(file) == 0;
+}
+
+// waits for the card initialization in the background, the first command after it reports the medium change
+static bool waitForMedium(BulkOnlyHost &host)
+{
+  uint8_t sense_key;
+  for (int i = 0; i < 200; ++i) {
+    BulkOnlyHost::Status status = host.testUnitReady();
+    if (status == BulkOnlyHost::STATUS_PASSED)
+      return true;
+    if (status != BulkOnlyHost::STATUS_FAILED || host.requestSense(&sense_key) != BulkOnlyHost::STATUS_PASSED)
+      return false;
+    delay(10);
+  }
+  return false;
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --workload A,B,...  workloads to run (default all, or none with --replay), --list shows them\n"
+          "  --replay FILE       replay a READ COMMAND TRACE dump, repeat for more files\n"
+          "  --replay-spill FILE replay an image of the trace spill area\n"
+          "  --replay-timing     keep the gaps between the commands of the trace\n"
+          "  --size KIB          data transferred by every workload (default 1024)\n"
+          "  --region BLOCKS     blocks addressed by the workloads (default 131072)\n"
+          "  --profile NAME      card latency profile: ideal, class10, class4, worn, cheap (default class10)\n"
+          "  --banks N           banks of the data endpoints, 1 or 2 (default 1 like the firmware)\n"
+          "  --backend NAME      storage behind the LUN: card, ram or file:IMAGE (default card)\n"
+          "  --baseline FILE     compare against the results of an earlier run\n"
+          "  --threshold PCT     throughput regression that fails the run (default 5)\n"
+          "  --save FILE         write the results as JSON, to be used as a baseline\n",
+          program);
+}
+
+int main(int argc, char **argv)
+{
+  const SDCardProfile *profile = SDCardProfile::find("class10");
+  std::vector<std::string> selected;
+  std::map<uint32_t, CommandTrace_Record_t> trace;
+  bool replay = false, replay_timing = false;
+  const char *baseline = nullptr, *save = nullptr, *backend = "card";
+  uint64_t size_kib = 1024;
+  uint32_t region = 131072, banks = 1;
+  double threshold = 5;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (!strcmp(arg, "--list")) {
+      for (const Workload &workload : s_workloads)
+        printf("%s\n", workload.name);
+      return 0;
+    }
+    if (!strcmp(arg, "--replay-timing")) {
+      replay_timing = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 2;
+    }
+    const char *value = argv[++i];
+    if (!strcmp(arg, "--workload")) {
+      for (const char *name = value; *name;) {
+        size_t length = strcspn(name, ",");
+        selected.push_back(std::string(name, length));
+        name += length + (name[length] == ',');
+      }
+    } else if (!strcmp(arg, "--replay") || !strcmp(arg, "--replay-spill")) {
+      if (!readTraceFile(value, !strcmp(arg, "--replay-spill"), trace))
+        return 1;
+      replay = true;
+    } else if (!strcmp(arg, "--size")) {
+      size_kib = strtoull(value, nullptr, 0);
+    } else if (!strcmp(arg, "--region")) {
+      region = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--profile")) {
+      if (!(profile = SDCardProfile::find(value))) {
+        fprintf(stderr, "Unknown profile %s\n", value);
+        return 2;
+      }
+    } else if (!strcmp(arg, "--banks")) {
+      banks = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--backend")) {
+      backend = value;
+    } else if (!strcmp(arg, "--baseline")) {
+      baseline = value;
+    } else if (!strcmp(arg, "--threshold")) {
+      threshold = strtod(value, nullptr);
+    } else if (!strcmp(arg, "--save")) {
+      save = value;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (banks < 1 || banks > 2 || region < MAX_TRANSFER_BLOCKS ||
+      (strcmp(backend, "card") && strcmp(backend, "ram") && strncmp(backend, "file:", 5))) {
+    usage(argv[0]);
+    return 2;
+  }
+  if (selected.empty() && !replay) {
+    for (const Workload &workload : s_workloads)
+      selected.push_back(workload.name);
+  }
+
+  // the settings are stored with the results, a baseline is only comparable with the same settings
+  char settings[128];
+  snprintf(settings, sizeof(settings), "profile=%s size=%llu region=%u banks=%u", profile->name,
+           (unsigned long long)size_kib, region, banks);
+#ifdef SDCARD_NULL_BACKEND
+  // benchmark-null, the card model is attached but never accessed
+  strncat(settings, " backend=null", sizeof(settings) - strlen(settings) - 1);
+#endif
+  if (strcmp(backend, "card")) {
+    // without the path of the image, so that copies of the image can be compared
+    snprintf(settings + strlen(settings), sizeof(settings) - strlen(settings), " backend=%.4s", backend);
+  }
+#if SDCARD_METADATA_CACHE_SECTORS > 0
+  snprintf(settings + strlen(settings), sizeof(settings) - strlen(settings), " metadata-cache=%u",
+           SDCARD_METADATA_CACHE_SECTORS);
+#endif
+
+  std::map<std::string, std::string> base;
+  if (baseline) {
+    if (!readBaseline(baseline, base))
+      return 1;
+    if (base["settings"] != settings) {
+      fprintf(stderr, "%s: baseline settings \"%s\" differ from \"%s\"\n", baseline, base["settings"].c_str(), settings);
+      return 1;
+    }
+  }
+
+  // the workloads and trace replays address 512 byte blocks
+  if (SDCARD_LOGICAL_BLOCK_SIZE != 512) {
+    fprintf(stderr, "The benchmark needs 512 byte logical blocks, SDCARD_LOGICAL_BLOCK_SIZE is %u\n",
+            SDCARD_LOGICAL_BLOCK_SIZE);
+    return 2;
+  }
+
+  SDCardModel card(7744512);
+  card.setProfile(*profile);
+  HostArduino_AttachCard(&card, SS);
+
+  BulkOnlyHost host(HostFirmware_Loop);
+  HostFirmware_Setup(banks, banks);
+
+  // the ram backend only holds the blocks the workloads address
+  std::vector<uint8_t> ram(strcmp(backend, "ram") ? 0 : (size_t)region * 512);
+  RamBlockDevice ram_device(ram.data(), ram.size() / 512);
+  FileBlockDevice file_device;
+  if (!ram.empty()) {
+    SDCardManager_SetBlockDevice(&ram_device);
+  } else if (!strncmp(backend, "file:", 5)) {
+    if (!file_device.open(backend + 5))
+      return 1;
+    SDCardManager_SetBlockDevice(&file_device);
+  }
+
+  uint32_t capacity = 0;
+  if (!waitForMedium(host) || host.readCapacity(&capacity) != BulkOnlyHost::STATUS_PASSED) {
+    fprintf(stderr, "Medium not ready: %s\n", host.error());
+    return 1;
+  }
+  region = std::min(region, capacity);
+
+  Runner runner(host, capacity);
+  std::vector<Result> results;
+  for (const std::string &name : selected) {
+    const Workload *workload = nullptr;
+    for (const Workload &candidate : s_workloads) {
+      if (name == candidate.name)
+        workload = &candidate;
+    }
+    if (!workload) {
+      fprintf(stderr, "Unknown workload %s, see --list\n", name.c_str());
+      return 2;
+    }
+
+    s_random_state = 0x2545F491;
+    if (workload->pattern == PATTERN_FAT && !formatFat32(host)) {
+      fprintf(stderr, "Writing the FAT32 boot sector failed: %s\n", host.error());
+      return 1;
+    }
+    runner.begin(name);
+    if (workload->pattern == PATTERN_FAT)
+      runFatCopy(runner, size_kib * 1024);
+    else
+      runPattern(runner, *workload, size_kib * 1024, region);
+    results.push_back(runner.end());
+  }
+  if (replay) {
+    uint64_t skipped = 0;
+    runner.begin("replay");
+    runReplay(runner, trace, replay_timing, &skipped);
+    results.push_back(runner.end());
+    if (skipped)
+      printf("Replay: %llu commands skipped\n", (unsigned long long)skipped);
+  }
+
+  printf("%s\n", settings);
+  printf("%-16s %8s %8s %9s %9s %9s %6s %6s %8s %s\n", "workload", "MB/s", "IOPS", "p50 us", "p99 us", "max us",
+         "SPI/B", "FIFO/B", "cyc/blk", baseline ? "   vs baseline" : "");
+
+  bool passed = true;
+  for (const Result &result : results) {
+    printf("%-16s %8.3f %8.1f %9.1f %9.1f %9.1f %6.3f %6.3f %8.0f", result.name.c_str(), result.mbPerSecond(),
+           result.iops(), result.percentileUs(0.5), result.percentileUs(0.99), result.percentileUs(1.0),
+           result.spiPerByte(), result.fifoPerByte(), result.cyclesPerBlock());
+    if (baseline) {
+      auto entry = base.find("workloads." + result.name + ".mb_per_s");
+      if (entry == base.end()) {
+        printf("   new");
+      } else {
+        double reference = strtod(entry->second.c_str(), nullptr);
+        double change = reference > 0 ? 100.0 * (result.mbPerSecond() - reference) / reference : 0;
+        bool regressed = change < -threshold;
+        printf("   %+6.1f%%%s", change, regressed ? " REGRESSION" : "");
+        passed = passed && !regressed;
+      }
+    }
+    if (result.errors) {
+      printf("   %llu errors", (unsigned long long)result.errors);
+      // failed commands of a replayed trace may have failed on the device as well
+      passed = passed && result.name == "replay";
+    }
+    printf("\n");
+  }
+
+  if (save && !writeResults(save, settings, results))
+    return 1;
+  return passed ? 0 : 1;
+}
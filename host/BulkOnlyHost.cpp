@@ -0,0 +1,199 @@
+#include "BulkOnlyHost.h"
+#include "HostArduino.h"
+#include "HostUSB.h"
+
+#include <string.h>
+
+static const uint32_t CBW_SIGNATURE = 0x43425355;
+static const uint32_t CSW_SIGNATURE = 0x53425355;
+static const uint8_t CBW_LENGTH = 31;
+static const uint8_t CSW_LENGTH = 13;
+static const uint16_t PACKET_SIZE = 64;
+
+// hosts give up on a command after a few seconds and reset the device
+static const uint64_t COMMAND_TIMEOUT_NS = 20000000000ULL;
+
+static void put32(uint8_t *buffer, uint32_t value)
+{
+  buffer[0] = value;
+  buffer[1] = value >> 8;
+  buffer[2] = value >> 16;
+  buffer[3] = value >> 24;
+}
+
+static uint32_t get32(const uint8_t *buffer)
+{
+  return buffer[0] | (uint32_t)buffer[1] << 8 | (uint32_t)buffer[2] << 16 | (uint32_t)buffer[3] << 24;
+}
+
+BulkOnlyHost::BulkOnlyHost(void (*deviceLoop)())
+  : m_deviceLoop(deviceLoop)
+  , m_tag(0)
+  , m_error("")
+  , m_last_duration_ns(0)
+  , m_block_size(512)
+{}
+
+BulkOnlyHost::Status BulkOnlyHost::command(const uint8_t *cdb, uint8_t cdbLength, bool dataIn, uint8_t *data,
+                                           uint32_t length, uint32_t *residue, uint8_t lun)
+{
+  uint8_t cbw[CBW_LENGTH] = {};
+  uint64_t start = HostArduino_Now();
+  uint32_t received = 0;
+  bool data_done = !dataIn || !length;
+  HostUSB_Packet packet;
+
+  if (cdbLength == 0 || cdbLength > 16)
+    return transportError("invalid CDB length");
+
+  put32(&cbw[0], CBW_SIGNATURE);
+  put32(&cbw[4], ++m_tag);
+  put32(&cbw[8], length);
+  cbw[12] = (dataIn && length) ? 0x80 : 0x00;
+  cbw[13] = lun;
+  cbw[14] = cdbLength;
+  memcpy(&cbw[15], cdb, cdbLength);
+
+  HostUSB_SendOut(cbw, sizeof(cbw));
+  if (!dataIn && length)
+    HostUSB_SendOut(data, length);
+
+  while (HostArduino_Now() - start < COMMAND_TIMEOUT_NS) {
+    m_deviceLoop();
+
+    while (HostUSB_ReceiveIn(&packet)) {
+      if (packet.stall) {
+        // a STALL ends the data stage, on the status stage the host clears the halt and retries
+        data_done = true;
+        continue;
+      }
+
+      if (!data_done) {
+        if (received + packet.data.size() > length)
+          return transportError("device sent more data than requested");
+        memcpy(data + received, packet.data.data(), packet.data.size());
+        received += packet.data.size();
+        data_done = received == length || packet.data.size() < PACKET_SIZE;
+        continue;
+      }
+
+      const uint8_t *csw = packet.data.data();
+      if (packet.data.size() != CSW_LENGTH || get32(&csw[0]) != CSW_SIGNATURE)
+        return transportError("invalid CSW");
+      if (get32(&csw[4]) != m_tag)
+        return transportError("CSW tag mismatch");
+      if (csw[12] > STATUS_PHASE_ERROR)
+        return transportError("invalid CSW status");
+      if (get32(&csw[8]) > length)
+        return transportError("CSW residue larger than the transfer");
+      if (HostUSB_NextOutTime())
+        return transportError("device ended the data stage before the host sent all data");
+
+      if (residue)
+        *residue = get32(&csw[8]);
+
+      HostUSB_WaitBusIdle();
+      m_last_duration_ns = HostArduino_Now() - start;
+      if (csw[12] == STATUS_PHASE_ERROR)
+        reset();
+      return (Status)csw[12];
+    }
+
+    // nothing to do until the next packet arrives, or the firmware waits for something else
+    uint64_t next = HostUSB_NextOutTime();
+    if (next > HostArduino_Now())
+      HostArduino_Advance(next - HostArduino_Now());
+    else
+      HostArduino_Advance(1000000);
+  }
+  return transportError("no CSW");
+}
+
+BulkOnlyHost::Status BulkOnlyHost::transportError(const char *error)
+{
+  m_error = error;
+  reset();
+  return STATUS_TRANSPORT_ERROR;
+}
+
+void BulkOnlyHost::reset()
+{
+  HostUSB_MassStorageReset();
+  m_deviceLoop();
+  HostUSB_Flush();
+}
+
+BulkOnlyHost::Status BulkOnlyHost::testUnitReady()
+{
+  const uint8_t cdb[6] = { 0x00 };
+  return command(cdb, sizeof(cdb), false, nullptr, 0);
+}
+
+BulkOnlyHost::Status BulkOnlyHost::requestSense(uint8_t *senseKey, uint8_t *asc, uint8_t *ascq)
+{
+  const uint8_t cdb[6] = { 0x03, 0, 0, 0, 18, 0 };
+  uint8_t sense[18] = {};
+  Status status = command(cdb, sizeof(cdb), true, sense, sizeof(sense));
+  *senseKey = sense[2] & 0x0F;
+  if (asc)
+    *asc = sense[12];
+  if (ascq)
+    *ascq = sense[13];
+  return status;
+}
+
+BulkOnlyHost::Status BulkOnlyHost::readCapacity(uint32_t *blocks)
+{
+  const uint8_t cdb[10] = { 0x25 };
+  uint8_t capacity[8] = {};
+  Status status = command(cdb, sizeof(cdb), true, capacity, sizeof(capacity));
+  *blocks = ((uint32_t)capacity[0] << 24 | (uint32_t)capacity[1] << 16 | (uint32_t)capacity[2] << 8 | capacity[3]) + 1;
+  return status;
+}
+
+BulkOnlyHost::Status BulkOnlyHost::readCapacity16(uint64_t *blocks, uint32_t *blockSize, uint8_t *physicalExponent)
+{
+  const uint8_t cdb[16] = { 0x9E, 0x10, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 32 };
+  uint8_t capacity[32] = {};
+  Status status = command(cdb, sizeof(cdb), true, capacity, sizeof(capacity));
+  *blocks = 0;
+  for (uint8_t i = 0; i < 8; ++i)
+    *blocks = *blocks << 8 | capacity[i];
+  ++*blocks;
+  *blockSize = (uint32_t)capacity[8] << 24 | (uint32_t)capacity[9] << 16 | (uint32_t)capacity[10] << 8 | capacity[11];
+  *physicalExponent = capacity[13] & 0x0F;
+  return status;
+}
+
+static void buildCdb10(uint8_t *cdb, uint8_t opcode, uint32_t block, uint16_t count)
+{
+  memset(cdb, 0, 10);
+  cdb[0] = opcode;
+  cdb[2] = block >> 24;
+  cdb[3] = block >> 16;
+  cdb[4] = block >> 8;
+  cdb[5] = block;
+  cdb[7] = count >> 8;
+  cdb[8] = count;
+}
+
+BulkOnlyHost::Status BulkOnlyHost::read10(uint32_t block, uint16_t count, uint8_t *data)
+{
+  uint8_t cdb[10];
+  buildCdb10(cdb, 0x28, block, count);
+  return command(cdb, sizeof(cdb), true, data, count * m_block_size);
+}
+
+BulkOnlyHost::Status BulkOnlyHost::write10(uint32_t block, uint16_t count, const uint8_t *data)
+{
+  uint8_t cdb[10];
+  buildCdb10(cdb, 0x2A, block, count);
+  return command(cdb, sizeof(cdb), false, const_cast<uint8_t *>(data), count * m_block_size);
+}
+
+BulkOnlyHost::Status BulkOnlyHost::verify10(uint32_t block, uint16_t count)
+{
+  uint8_t cdb[10];
+  buildCdb10(cdb, 0x2F, block, count);
+  return command(cdb, sizeof(cdb), false, nullptr, 0);
+}
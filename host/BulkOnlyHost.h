@@ -0,0 +1,58 @@
+#ifndef BULKONLYHOST_H
+#define BULKONLYHOST_H
+
+#include <stdint.h>
+
+// Host side of the USB Mass Storage Bulk-Only Transport, talks to the firmware through the
+// endpoint shim of HostUSB.cpp. Every command sends a CBW and the data of an OUT transfer, runs
+// the firmware loop until the CSW arrives and checks the CSW and the data stage like a host
+// driver does. A transport error is recovered with a Bulk-Only Mass Storage Reset.
+class BulkOnlyHost {
+public:
+  enum Status {
+    STATUS_PASSED = 0,         // CSW status of the command
+    STATUS_FAILED = 1,
+    STATUS_PHASE_ERROR = 2,
+    STATUS_TRANSPORT_ERROR,    // invalid or missing CSW, the device was reset
+  };
+
+  // the firmware loop, runs one pass of the sketch's loop()
+  explicit BulkOnlyHost(void (*deviceLoop)());
+
+  // Runs a command. dataIn selects the direction of a data stage of length bytes, data holds the
+  // data to send or receives the data of the device. The residue of the CSW is stored in residue.
+  Status command(const uint8_t *cdb, uint8_t cdbLength, bool dataIn, uint8_t *data, uint32_t length,
+                 uint32_t *residue = nullptr, uint8_t lun = 0);
+
+  // common commands, the block size is 512 bytes unless it is changed with setBlockSize()
+  Status testUnitReady();
+  Status requestSense(uint8_t *senseKey, uint8_t *asc = nullptr, uint8_t *ascq = nullptr);
+  Status readCapacity(uint32_t *blocks);
+  Status readCapacity16(uint64_t *blocks, uint32_t *blockSize, uint8_t *physicalExponent);
+  Status read10(uint32_t block, uint16_t count, uint8_t *data);
+  Status write10(uint32_t block, uint16_t count, const uint8_t *data);
+  Status verify10(uint32_t block, uint16_t count);
+
+  void setBlockSize(uint32_t blockSize) { m_block_size = blockSize; }
+
+  // Bulk-Only Mass Storage Reset, followed by clearing the halt of both endpoints
+  void reset();
+
+  // description of the last transport error
+  const char *error() const { return m_error; }
+
+  // virtual time the last command took from the CBW to the CSW
+  uint64_t lastDuration() const { return m_last_duration_ns; }
+
+private:
+  bool runUntilStatus(uint8_t *csw);
+  Status transportError(const char *error);
+
+  void (*m_deviceLoop)();
+  uint32_t m_tag;
+  const char *m_error;
+  uint64_t m_last_duration_ns;
+  uint32_t m_block_size;
+};
+
+#endif // BULKONLYHOST_H
@@ -0,0 +1,192 @@
+/** \file
+ *
+ *  Host side decoder of the binary event log, see EventLog.h. Reads the bytes the firmware sent on Serial1,
+ *  finds the records by their sync byte and checksum, so a capture may start in the middle of a record, and
+ *  prints one line per event. Events dropped on the device and records lost on the serial line show up as
+ *  gaps in the sequence numbers, the device reports its drops in separate records, so the summary at the end
+ *  tells both apart.
+ *
+ *  Build with:  make EventDecoder
+ *
+ *  Capture and decode the log of a card reader on a USB serial adapter:
+ *    stty -F /dev/ttyUSB0 115200 raw
+ *    cat /dev/ttyUSB0 | ./EventDecoder
+ *
+ *  Decode a capture file and only print the summary:
+ *    ./EventDecoder -q events.bin
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../EventLog.h"
+
+namespace {
+
+const char *const kCardErrors[SD_CARD_ERROR_COUNT] = {
+  "none", "CMD0", "CMD8", "ACMD41", "CMD58", "CMD12", "CMD17", "CMD18", "CMD24", "CMD25", "ACMD23",
+  "READ_REG", "READ", "READ_TIMEOUT", "CRC", "WRITE", "WRITE_TIMEOUT", "WRITE_PROGRAMMING", "STOP_TRAN",
+  "BUSY_TIMEOUT", "ERASE",
+};
+
+const char *const kEvents[EVENT_LOG_EVENT_COUNT] = {
+  "boot", "dropped", "card error", "card ready", "card removed", "card reinit", "read", "write", "verify",
+  "self-test",
+};
+
+struct Summary
+{
+  uint64_t records = 0;
+  uint64_t events[EVENT_LOG_EVENT_COUNT] = {};
+  uint64_t dropped = 0;         // reported by EVENT_LOG_DROPPED records
+  uint64_t gaps = 0;            // events missing in the sequence numbers, dropped or lost on the serial line
+  uint64_t skipped_bytes = 0;   // bytes that were not part of a valid record
+};
+
+bool isRecord(const uint8_t *bytes)
+{
+  uint8_t sum = 0;
+  for (size_t i = 0; i < sizeof(EventLog_Record_t); ++i)
+    sum += bytes[i];
+  return bytes[0] == EVENT_LOG_SYNC && !sum && bytes[2] < EVENT_LOG_EVENT_COUNT;
+}
+
+EventLog_Record_t decode(const uint8_t *bytes)
+{
+  EventLog_Record_t record;
+  record.Sync      = bytes[0];
+  record.Checksum  = bytes[1];
+  record.Event     = bytes[2];
+  record.Code      = bytes[3];
+  record.Sequence  = bytes[4] | bytes[5] << 8;
+  record.Count     = bytes[6] | bytes[7] << 8;
+  record.Timestamp = bytes[8] | bytes[9] << 8 | bytes[10] << 16 | (uint32_t)bytes[11] << 24;
+  record.Argument  = bytes[12] | bytes[13] << 8 | bytes[14] << 16 | (uint32_t)bytes[15] << 24;
+  return record;
+}
+
+void print(const EventLog_Record_t &record, uint64_t time_us)
+{
+  std::printf("%12.3f ms %5u  %-13s", time_us / 1e3, record.Sequence, kEvents[record.Event]);
+  switch (record.Event) {
+  case EVENT_LOG_BOOT:
+    std::printf(" MCUSR 0x%02X, %u bytes for the stack, %u records buffered", record.Code, record.Count,
+                record.Argument);
+    break;
+  case EVENT_LOG_DROPPED:
+    std::printf(" %u events, %u since boot", record.Count, record.Argument);
+    break;
+  case EVENT_LOG_CARD_ERROR:
+    std::printf(" %s, response 0x%02X",
+                record.Code < SD_CARD_ERROR_COUNT ? kCardErrors[record.Code] : "unknown", record.Count);
+    break;
+  case EVENT_LOG_CARD_READY:
+    std::printf(" %u blocks, ready after %u ms%s", record.Argument, record.Count, record.Code ? " from the profile" : "");
+    break;
+  case EVENT_LOG_READ:
+  case EVENT_LOG_WRITE:
+  case EVENT_LOG_VERIFY:
+    std::printf(" block %u, %u blocks", record.Argument, record.Count);
+    break;
+  case EVENT_LOG_SELFTEST:
+    std::printf(" test %u, status %u, %u us", record.Code, record.Count, record.Argument);
+    break;
+  }
+  std::printf("\n");
+}
+
+void usage(const char *program)
+{
+  std::fprintf(stderr, "Usage: %s [-q] [FILE]\n  -q  only print the summary\n  reads stdin without FILE\n", program);
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  bool quiet = false;
+  const char *path = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "-q")) {
+      quiet = true;
+    } else if (argv[i][0] == '-' || path) {
+      usage(argv[0]);
+      return 2;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  std::FILE *file = path ? std::fopen(path, "rb") : stdin;
+  if (!file) {
+    std::perror(path);
+    return 1;
+  }
+
+  Summary summary;
+  std::vector<uint8_t> buffer;
+  bool synchronized = false;
+  uint16_t next_sequence = 0;
+  uint32_t last_timestamp = 0;
+  uint64_t time_us = 0;
+  uint8_t chunk[4096];
+  ssize_t length;
+
+  // the log is decoded while it is read, so that a live capture from stdin is printed as it arrives
+  while ((length = read(fileno(file), chunk, sizeof(chunk))) > 0) {
+    buffer.insert(buffer.end(), chunk, chunk + length);
+    size_t offset = 0;
+    while (buffer.size() - offset >= sizeof(EventLog_Record_t)) {
+      if (!isRecord(&buffer[offset])) {
+        ++offset;
+        ++summary.skipped_bytes;
+        continue;
+      }
+      EventLog_Record_t record = decode(&buffer[offset]);
+      offset += sizeof(EventLog_Record_t);
+
+      if (record.Event == EVENT_LOG_BOOT)
+        synchronized = false;
+      if (!synchronized) {
+        time_us = record.Timestamp;
+      } else {
+        uint16_t gap = record.Sequence - next_sequence;
+        if (gap && !quiet)
+          std::printf("%12s %5s  %u events missing\n", "", "", gap);
+        summary.gaps += gap;
+        time_us += (uint32_t)(record.Timestamp - last_timestamp);
+      }
+      if (record.Event == EVENT_LOG_DROPPED)
+        summary.dropped += record.Count;
+      synchronized = true;
+      next_sequence = record.Sequence + 1;
+      last_timestamp = record.Timestamp;
+
+      ++summary.records;
+      ++summary.events[record.Event];
+      if (!quiet)
+        print(record, time_us);
+    }
+    buffer.erase(buffer.begin(), buffer.begin() + offset);
+    std::fflush(stdout);
+  }
+  summary.skipped_bytes += buffer.size();
+  if (path)
+    std::fclose(file);
+
+  std::printf("\n%llu records", (unsigned long long)summary.records);
+  for (unsigned event = 0; event < EVENT_LOG_EVENT_COUNT; ++event) {
+    if (summary.events[event])
+      std::printf(", %llu %s", (unsigned long long)summary.events[event], kEvents[event]);
+  }
+  std::printf("\n%llu events dropped on the device, %llu more missing (lost on the line or drops not reported yet), "
+              "%llu bytes skipped\n",
+              (unsigned long long)summary.dropped,
+              (unsigned long long)(summary.gaps > summary.dropped ? summary.gaps - summary.dropped : 0),
+              (unsigned long long)summary.skipped_bytes);
+  return summary.records ? 0 : 1;
+}
@@ -0,0 +1,389 @@
+// Runs the firmware's SCSI stack against the SD card model with scripted card faults, see
+// SDCardFaults.h, and reports how the firmware recovers from them: the commands that failed, the
+// latency of the host's I/O including its retries, the time from a fault until the commands pass
+// again and the blocks that don't hold the data the host wrote or read.
+//
+//   make faultsim
+//   ./faultsim                                            runs all scenarios
+//   ./faultsim --scenario stuck-busy,remove-write
+//   ./faultsim --fault busy,at=10,ms=800 --fault flip,at=40 --workload read
+//
+// A scenario writes a pattern to a region of the card without faults, arms the faults and then
+// writes the next pattern to the region or reads it back, and at last reads the whole region
+// without faults. Like a host driver the host retries a failed command after REQUEST SENSE for up
+// to 5 s. The exit code is non-zero if an I/O never passed, a command took longer than the
+// recovery budget, a block written with a passed command doesn't hold its data or a passed read
+// returned wrong data.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+
+#include "BulkOnlyHost.h"
+#include "HostArduino.h"
+#include "HostFirmware.h"
+#include "HostUSB.h"
+#include "SDCardFaults.h"
+#include "SDCardModel.h"
+
+#include "../SDCardManager.h"
+
+static const uint32_t kBlockSize = SDCARD_LOGICAL_BLOCK_SIZE;
+
+// time the host keeps retrying an I/O, and waits between the retries
+static const uint64_t IO_TIMEOUT_NS = 5000000000ull;
+static const uint16_t RETRY_DELAY_MS = 10;
+
+struct Scenario {
+  const char *name;
+  const char *faults;     // rules of SDCardFaults separated by ';'
+  bool write;
+};
+
+// the faults fire on the 100th event after the region was prepared, well inside the workload
+static const Scenario s_scenarios[] = {
+  { "gc-stall",      "busy,at=16,every=128,ms=250",  true  },   // below the busy timeout of the driver
+  { "stuck-busy",    "busy,at=100,ms=2000",          true  },
+  { "crc-write",     "crc-write,at=100,count=2",     true  },
+  { "flip-write",    "flip,at=100",                  true  },
+  { "remove-write",  "remove,at=100,ms=300",         true  },
+  { "late-token",    "token,at=16,every=128,ms=200", false },   // below the read timeout of the driver
+  { "missing-token", "token,at=100",                 false },
+  { "crc-read",      "crc-read,at=100",              false },
+  { "flip-read",     "flip,at=100",                  false },
+  { "remove-read",   "remove,at=100,ms=300",         false },
+};
+
+struct Result {
+  std::string name;
+  bool write;
+  uint32_t faults;
+  uint32_t ios;
+  uint32_t failed;        // commands that failed, each I/O is retried until it passes
+  uint32_t lost;          // I/Os that didn't pass within IO_TIMEOUT_NS
+  std::vector<uint64_t> latencies_ns;
+  uint64_t recover_ns;    // longest time from a fault until the end of the next passed command
+  uint64_t command_ns;    // longest single command, passed or not, bounded by SDCARD_RECOVERY_BUDGET_MS
+  uint32_t corrupt;       // blocks that don't hold the data of a passed write
+  uint32_t bad_reads;     // blocks of passed reads with wrong data
+
+  double percentileMs(double fraction) const
+  {
+    if (latencies_ns.empty())
+      return 0;
+    std::vector<uint64_t> sorted(latencies_ns);
+    size_t index = std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()));
+    std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    return sorted[index] / 1e6;
+  }
+
+  bool passed() const
+  {
+    return !lost && !corrupt && !bad_reads && command_ns <= SDCARD_RECOVERY_BUDGET_MS * 1000000ull;
+  }
+};
+
+static void fillPattern(uint32_t block, uint8_t generation, uint8_t *data)
+{
+  for (uint16_t i = 0; i < kBlockSize; ++i)
+    data[i] = (uint8_t)(block * 7 + i + i / 512 + generation * 0x3D);
+}
+
+static bool checkPattern(uint32_t block, uint8_t generation, const uint8_t *data)
+{
+  uint8_t expected[kBlockSize];
+  fillPattern(block, generation, expected);
+  return !memcmp(expected, data, sizeof(expected));
+}
+
+// the host waits, the firmware loop keeps running and notices a card that comes back
+static void idle(uint16_t ms)
+{
+  uint64_t end = HostArduino_Now() + ms * 1000000ull;
+  while (HostArduino_Now() < end) {
+    HostFirmware_Loop();
+    delay(1);
+  }
+}
+
+class Runner {
+public:
+  Runner(BulkOnlyHost &host, SDCardModel &card, uint32_t region, uint16_t transfer)
+    : m_host(host), m_card(card), m_region(region), m_transfer(transfer), m_generation(0),
+      m_buffer(transfer * kBlockSize)
+  {}
+
+  Result run(const char *name, const std::vector<std::string> &rules, bool write)
+  {
+    Result result = Result();
+    result.name = name;
+    result.write = write;
+
+    SDCardFaults faults;
+    for (const std::string &rule : rules)
+      faults.add(rule.c_str());
+
+    // the region holds the previous pattern, written without faults
+    uint8_t previous = ++m_generation;
+    transferRegion(true, previous, nullptr);
+
+    uint8_t next = write ? ++m_generation : previous;
+    std::vector<bool> written(m_region, false);
+    m_card.setFaults(&faults);
+    faults.arm(true);
+    m_passed_ns.clear();
+    for (uint32_t block = 0; block < m_region; block += m_transfer) {
+      uint16_t count = std::min<uint32_t>(m_transfer, m_region - block);
+      if (!io(write, block, count, next, &result))
+        continue;
+      for (uint16_t i = 0; i < count; ++i) {
+        if (write)
+          written[block + i] = true;
+        else if (!checkPattern(block + i, next, &m_buffer[i * kBlockSize]))
+          ++result.bad_reads;
+      }
+    }
+    faults.arm(false);
+    m_card.setFaults(nullptr);
+
+    result.faults = faults.times().size();
+    for (uint64_t fault_ns : faults.times()) {
+      auto passed = std::lower_bound(m_passed_ns.begin(), m_passed_ns.end(), fault_ns);
+      uint64_t recover_ns = passed != m_passed_ns.end() ? *passed - fault_ns : UINT64_MAX;
+      result.recover_ns = std::max(result.recover_ns, recover_ns);
+    }
+
+    // a card that was pulled for good comes back for the check
+    if (!m_card.inserted())
+      m_card.setInserted(true);
+    Result check = Result();
+    transferRegion(false, next, &check);
+    result.lost += check.lost;
+    for (uint32_t block = 0; block < m_region; ++block) {
+      const uint8_t *data = &m_region_data[block * kBlockSize];
+      if (written[block] ? !checkPattern(block, next, data) :
+                           !checkPattern(block, previous, data) && !checkPattern(block, next, data))
+        ++result.corrupt;
+    }
+    return result;
+  }
+
+private:
+  // one READ (10) or WRITE (10) of the host with its retries, returns true if it passed
+  bool io(bool write, uint32_t block, uint16_t count, uint8_t generation, Result *result)
+  {
+    uint64_t start_ns = HostArduino_Now();
+    BulkOnlyHost::Status status;
+    uint8_t sense_key;
+
+    if (write) {
+      for (uint16_t i = 0; i < count; ++i)
+        fillPattern(block + i, generation, &m_buffer[i * kBlockSize]);
+    }
+    ++result->ios;
+    for (;;) {
+      status = write ? m_host.write10(block, count, m_buffer.data()) : m_host.read10(block, count, m_buffer.data());
+      result->command_ns = std::max(result->command_ns, m_host.lastDuration());
+      if (status == BulkOnlyHost::STATUS_PASSED)
+        break;
+      ++result->failed;
+      if (status == BulkOnlyHost::STATUS_FAILED)
+        m_host.requestSense(&sense_key);
+      if (HostArduino_Now() - start_ns >= IO_TIMEOUT_NS) {
+        ++result->lost;
+        return false;
+      }
+      idle(RETRY_DELAY_MS);
+    }
+    m_passed_ns.push_back(HostArduino_Now());
+    result->latencies_ns.push_back(HostArduino_Now() - start_ns);
+    return true;
+  }
+
+  // writes a pattern to the whole region, or reads the region into m_region_data
+  void transferRegion(bool write, uint8_t generation, Result *result)
+  {
+    Result ignored = Result();
+    m_region_data.resize(m_region * kBlockSize);
+    for (uint32_t block = 0; block < m_region; block += m_transfer) {
+      uint16_t count = std::min<uint32_t>(m_transfer, m_region - block);
+      if (io(write, block, count, generation, result ? result : &ignored) && !write)
+        memcpy(&m_region_data[block * kBlockSize], m_buffer.data(), count * kBlockSize);
+    }
+  }
+
+  BulkOnlyHost &m_host;
+  SDCardModel &m_card;
+  uint32_t m_region;
+  uint16_t m_transfer;
+  uint8_t m_generation;
+  std::vector<uint8_t> m_buffer;
+  std::vector<uint8_t> m_region_data;
+  std::vector<uint64_t> m_passed_ns;    // end of every passed command of the workload
+};
+
+static void report(const Result &result)
+{
+  char recover[16];
+  if (!result.faults)
+    snprintf(recover, sizeof(recover), "-");
+  else if (result.recover_ns == UINT64_MAX)
+    snprintf(recover, sizeof(recover), "never");
+  else
+    snprintf(recover, sizeof(recover), "%.1f", result.recover_ns / 1e6);
+  printf("%-14s %-5s %6u %6u %6u %6u %9.1f %9.1f %10s %7.1f %7u %9u  %s\n", result.name.c_str(),
+         result.write ? "write" : "read", result.faults, result.ios, result.failed, result.lost,
+         result.percentileMs(0.5), result.percentileMs(1.0), recover, result.command_ns / 1e6, result.corrupt, result.bad_reads,
+         result.passed() ? "ok" : "FAILED");
+}
+
+static std::vector<std::string> split(const char *list, char separator)
+{
+  std::vector<std::string> items;
+  std::string item;
+  for (const char *c = list; ; ++c) {
+    if (!*c || *c == separator) {
+      if (!item.empty())
+        items.push_back(item);
+      item.clear();
+      if (!*c)
+        break;
+    } else {
+      item += *c;
+    }
+  }
+  return items;
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --profile NAME      latency profile: ideal, class10, class4, worn, cheap (default class10)\n"
+          "  --scenario A,B,...  scenarios to run (default all), --scenario list shows them\n"
+          "  --fault RULE        runs a scenario with the rule instead, repeat it for more rules, see SDCardFaults.h\n"
+          "  --workload NAME     workload of --fault: write or read (default write)\n"
+          "  --region N          blocks the workload transfers (default 512)\n"
+          "  --transfer N        blocks per READ (10) and WRITE (10) command (default 8)\n"
+          "  --serial FILE       write the bytes sent on Serial1, the event log, to a file\n",
+          program);
+}
+
+int main(int argc, char **argv)
+{
+  const SDCardProfile *profile = SDCardProfile::find("class10");
+  std::vector<std::string> selected;
+  std::vector<std::string> rules;
+  bool write = true;
+  uint32_t region = 512;
+  uint32_t transfer = 8;
+  FILE *serial = nullptr;
+
+  for (int i = 1; i < argc; i += 2) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (!value) {
+      usage(argv[0]);
+      return 2;
+    }
+    if (!strcmp(arg, "--profile")) {
+      if (!(profile = SDCardProfile::find(value))) {
+        fprintf(stderr, "Unknown profile %s\n", value);
+        return 2;
+      }
+    } else if (!strcmp(arg, "--scenario")) {
+      if (!strcmp(value, "list")) {
+        for (const Scenario &scenario : s_scenarios)
+          printf("%-14s %-5s %s\n", scenario.name, scenario.write ? "write" : "read", scenario.faults);
+        return 0;
+      }
+      selected = split(value, ',');
+    } else if (!strcmp(arg, "--fault")) {
+      SDCardFaults check;
+      if (!check.add(value)) {
+        fprintf(stderr, "Invalid fault %s\n", value);
+        return 2;
+      }
+      rules.push_back(value);
+    } else if (!strcmp(arg, "--workload")) {
+      if (strcmp(value, "write") && strcmp(value, "read")) {
+        usage(argv[0]);
+        return 2;
+      }
+      write = !strcmp(value, "write");
+    } else if (!strcmp(arg, "--region")) {
+      region = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--transfer")) {
+      transfer = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--serial")) {
+      if (!(serial = fopen(value, "wb"))) {
+        perror(value);
+        return 1;
+      }
+      HostArduino_SetSerialOutput(serial);
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (!region || !transfer || transfer > 128 / (kBlockSize / 512)) {
+    usage(argv[0]);
+    return 2;
+  }
+  for (const std::string &name : selected) {
+    if (std::none_of(std::begin(s_scenarios), std::end(s_scenarios),
+                     [&](const Scenario &scenario) { return name == scenario.name; })) {
+      fprintf(stderr, "Unknown scenario %s\n", name.c_str());
+      return 2;
+    }
+  }
+
+  SDCardModel card(7744512);
+  card.setProfile(*profile);
+  HostArduino_AttachCard(&card, SS);
+
+  BulkOnlyHost host(HostFirmware_Loop);
+  host.setBlockSize(kBlockSize);
+  HostFirmware_Setup();
+
+  uint32_t capacity = 0;
+  uint8_t sense_key;
+  for (int i = 0; i < 200 && host.testUnitReady() != BulkOnlyHost::STATUS_PASSED; ++i) {
+    host.requestSense(&sense_key);
+    delay(10);
+  }
+  if (host.readCapacity(&capacity) != BulkOnlyHost::STATUS_PASSED || capacity < region) {
+    fprintf(stderr, "Medium not ready: %s\n", host.error());
+    return 1;
+  }
+
+  Runner runner(host, card, region, transfer);
+  std::vector<Result> results;
+  if (!rules.empty()) {
+    results.push_back(runner.run("scripted", rules, write));
+  } else {
+    for (const Scenario &scenario : s_scenarios) {
+      if (selected.empty() || std::find(selected.begin(), selected.end(), scenario.name) != selected.end())
+        results.push_back(runner.run(scenario.name, split(scenario.faults, ';'), scenario.write));
+    }
+  }
+
+  bool passed = true;
+  printf("profile %s, %u blocks in commands of %u, latency of the host I/O with its retries\n", profile->name,
+         region, transfer);
+  printf("%-14s %-5s %6s %6s %6s %6s %9s %9s %10s %7s %7s %9s\n", "scenario", "", "faults", "I/Os", "failed", "lost",
+         "p50 ms", "max ms", "recover ms", "cmd ms", "corrupt", "bad reads");
+  for (const Result &result : results) {
+    report(result);
+    passed = passed && result.passed();
+  }
+  if (serial)
+    fclose(serial);
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+/** \file
+ *
+ *  Backend of the host builds on a disk image file.
+ */
+
+#include "FileBlockDevice.h"
+
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+FileBlockDevice::~FileBlockDevice()
+{
+  if (m_fd >= 0)
+    close(m_fd);
+}
+
+bool FileBlockDevice::open(const char *path)
+{
+  struct stat status;
+  int fd = ::open(path, O_RDWR);
+  if (fd < 0 || fstat(fd, &status) < 0) {
+    std::perror(path);
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  if (m_fd >= 0)
+    close(m_fd);
+  m_fd = fd;
+  m_blocks = status.st_size / sizeof(m_buffer);
+  return true;
+}
+
+uint32_t FileBlockDevice::numBlocks()
+{
+  return m_blocks;
+}
+
+uint16_t FileBlockDevice::readBlocks(uint32_t lba, uint16_t count, Sink sink)
+{
+  uint16_t blocks = 0;
+  for (; blocks < count && lba + blocks < m_blocks; ++blocks) {
+    off_t offset = (off_t)(lba + blocks) * sizeof(m_buffer);
+    if (pread(m_fd, m_buffer, sizeof(m_buffer), offset) != (ssize_t)sizeof(m_buffer) ||
+        !sink(m_buffer, sizeof(m_buffer)))
+      break;
+  }
+  return blocks;
+}
+
+uint16_t FileBlockDevice::writeBlocks(uint32_t lba, uint16_t count, Source source)
+{
+  uint16_t blocks = 0;
+  for (; blocks < count && lba + blocks < m_blocks; ++blocks) {
+    off_t offset = (off_t)(lba + blocks) * sizeof(m_buffer);
+    if (!source(m_buffer, sizeof(m_buffer)) ||
+        pwrite(m_fd, m_buffer, sizeof(m_buffer), offset) != (ssize_t)sizeof(m_buffer))
+      break;
+  }
+  return blocks;
+}
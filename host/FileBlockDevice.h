@@ -0,0 +1,32 @@
+/** \file
+ *
+ *  Backend of the host builds on a disk image file, see BlockDevice.h.
+ */
+
+#ifndef FILEBLOCKDEVICE_H
+#define FILEBLOCKDEVICE_H
+
+#include "../BlockDevice.h"
+
+/** Blocks of an image file, e.g. a dump of a card, read and written with pread() and pwrite() through a
+ *  block buffer like the card backend. Only whole blocks of the file are visible.
+ */
+class FileBlockDevice : public BlockDevice
+{
+public:
+  ~FileBlockDevice();
+
+  /** Opens the image for reading and writing, returns \c false with an error message if that failed. */
+  bool open(const char *path);
+
+  uint32_t numBlocks() override;
+  uint16_t readBlocks(uint32_t lba, uint16_t count, Sink sink) override;
+  uint16_t writeBlocks(uint32_t lba, uint16_t count, Source source) override;
+
+private:
+  int m_fd = -1;
+  uint32_t m_blocks = 0;
+  uint8_t m_buffer[512];
+};
+
+#endif // FILEBLOCKDEVICE_H
@@ -0,0 +1,207 @@
+#include "HostArduino.h"
+#include "SDCardModel.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <avr/eeprom.h>
+
+SPIClass SPI;
+HostSpiDataRegister SPDR;
+HostSpiStatusRegister SPSR;
+HostSerial Serial1;
+uint8_t MCUSR;
+
+static uint64_t s_now_ns;
+static SDCardModel *s_card;
+static uint8_t s_chip_select_pin = 0xFF;
+static uint64_t s_spi_byte_ns = 1000;
+static uint64_t s_spi_overhead_ns = 250;
+static uint64_t s_spi_bytes;
+
+// transmit buffer of Serial1, the Arduino core keeps one byte of it free
+static const uint64_t SERIAL_BUFFER_SIZE = 63;
+static FILE *s_serial_output;
+static uint64_t s_serial_byte_ns;
+static uint64_t s_serial_idle_ns;
+
+// erased EEPROM, only written by the firmware and kept for the lifetime of the process
+static uint8_t s_eeprom[E2END + 1];
+static bool s_eeprom_erased;
+static uint64_t s_eeprom_busy_until_ns;
+static const uint64_t EEPROM_WRITE_NS = 3300000;
+
+uint64_t HostArduino_Now()
+{
+  return s_now_ns;
+}
+
+void HostArduino_Advance(uint64_t ns)
+{
+  s_now_ns += ns;
+}
+
+void HostArduino_AttachCard(SDCardModel *card, uint8_t chipSelectPin)
+{
+  s_card = card;
+  s_chip_select_pin = chipSelectPin;
+}
+
+uint64_t HostArduino_SpiBytes()
+{
+  return s_spi_bytes;
+}
+
+void HostArduino_SetSpiOverhead(uint64_t ns)
+{
+  s_spi_overhead_ns = ns;
+}
+
+void HostArduino_SetSerialOutput(FILE *file)
+{
+  s_serial_output = file;
+}
+
+unsigned long millis(void)
+{
+  return s_now_ns / 1000000;
+}
+
+unsigned long micros(void)
+{
+  return s_now_ns / 1000;
+}
+
+void delay(unsigned long ms)
+{
+  s_now_ns += (uint64_t)ms * 1000000;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  s_now_ns += (uint64_t)us * 1000;
+}
+
+void pinMode(uint8_t, uint8_t)
+{
+}
+
+// the first access finds the EEPROM erased, every access waits for a running write
+static void waitEeprom()
+{
+  if (!s_eeprom_erased) {
+    memset(s_eeprom, 0xFF, sizeof(s_eeprom));
+    s_eeprom_erased = true;
+  }
+  if (s_now_ns < s_eeprom_busy_until_ns)
+    s_now_ns = s_eeprom_busy_until_ns;
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+  waitEeprom();
+  memcpy(dst, &s_eeprom[(uintptr_t)src], n);
+}
+
+void eeprom_update_byte(uint8_t *dst, uint8_t value)
+{
+  waitEeprom();
+  uint8_t &cell = s_eeprom[(uintptr_t)dst];
+  if (cell != value) {
+    cell = value;
+    s_eeprom_busy_until_ns = s_now_ns + EEPROM_WRITE_NS;
+  }
+}
+
+int eeprom_is_ready(void)
+{
+  return s_now_ns >= s_eeprom_busy_until_ns;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+  if (s_card && pin == s_chip_select_pin)
+    s_card->select(value == LOW);
+}
+
+void SPIClass::beginTransaction(const SPISettings &settings)
+{
+  // the AVR SPI clock is at most F_CPU / 2
+  uint32_t clock = settings.clock() < F_CPU / 2 ? settings.clock() : F_CPU / 2;
+  s_spi_byte_ns = 8000000000ULL / clock;
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+  s_now_ns += s_spi_byte_ns + s_spi_overhead_ns;
+  ++s_spi_bytes;
+  return s_card ? s_card->transfer(data, s_now_ns) : 0xFF;
+}
+
+uint16_t SPIClass::transfer16(uint16_t data)
+{
+  uint16_t high = transfer(data >> 8);
+  return high << 8 | transfer(data & 0xFF);
+}
+
+HostSpiDataRegister &HostSpiDataRegister::operator=(uint8_t value)
+{
+  m_received = SPI.transfer(value);
+  return *this;
+}
+
+void HostSerial::begin(unsigned long baud)
+{
+  // 8N1, ten bits per byte
+  s_serial_byte_ns = 10000000000ULL / baud;
+  s_serial_idle_ns = s_now_ns;
+}
+
+size_t HostSerial::print(const char *text)
+{
+  return write((const uint8_t *)text, strlen(text));
+}
+
+size_t HostSerial::print(long value, int base)
+{
+  char text[24];
+  snprintf(text, sizeof(text), base == HEX ? "%lX" : "%ld", value);
+  return print(text);
+}
+
+size_t HostSerial::print(unsigned long value, int base)
+{
+  char text[24];
+  snprintf(text, sizeof(text), base == HEX ? "%lX" : "%lu", value);
+  return print(text);
+}
+
+int HostSerial::availableForWrite()
+{
+  if (!s_serial_byte_ns || s_serial_idle_ns <= s_now_ns)
+    return SERIAL_BUFFER_SIZE;
+  uint64_t pending = (s_serial_idle_ns - s_now_ns + s_serial_byte_ns - 1) / s_serial_byte_ns;
+  return pending < SERIAL_BUFFER_SIZE ? SERIAL_BUFFER_SIZE - pending : 0;
+}
+
+size_t HostSerial::write(uint8_t c)
+{
+  if (s_serial_byte_ns) {
+    // like the Arduino core, a full buffer blocks until the UART sent a byte
+    if (!availableForWrite())
+      s_now_ns = s_serial_idle_ns - SERIAL_BUFFER_SIZE * s_serial_byte_ns + s_serial_byte_ns;
+    s_serial_idle_ns = (s_serial_idle_ns > s_now_ns ? s_serial_idle_ns : s_now_ns) + s_serial_byte_ns;
+  }
+  if (s_serial_output)
+    fputc(c, s_serial_output);
+  return 1;
+}
+
+size_t HostSerial::write(const uint8_t *data, size_t length)
+{
+  for (size_t i = 0; i < length; ++i)
+    write(data[i]);
+  return length;
+}
@@ -0,0 +1,26 @@
+#ifndef HOSTARDUINO_H
+#define HOSTARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+class SDCardModel;
+
+// Virtual time of the host build. The clock only advances with SPI transfers, delay() and
+// HostArduino_Advance(), so that timings don't depend on the speed of the host.
+uint64_t HostArduino_Now();
+void HostArduino_Advance(uint64_t ns);
+
+// Connects the card model to the SPI bus, the card is selected while chipSelectPin is low
+void HostArduino_AttachCard(SDCardModel *card, uint8_t chipSelectPin);
+
+// Number of bytes clocked on the SPI bus
+uint64_t HostArduino_SpiBytes();
+
+// Time a byte takes on the bus in addition to the SPI clock, for the code around the transfer
+void HostArduino_SetSpiOverhead(uint64_t ns);
+
+// File that receives the bytes sent on Serial1, nullptr to discard them
+void HostArduino_SetSerialOutput(FILE *file);
+
+#endif // HOSTARDUINO_H
@@ -0,0 +1,29 @@
+#include "HostFirmware.h"
+
+// MassStorage.h includes the card driver within extern "C", like the sketch the C++ headers have to come first
+#include <Arduino.h>
+#include <SPI.h>
+
+#include "../MassStorage.h"
+#include "../SDCardManager.h"
+#include "../EventLog.h"
+#include "../Scheduler.h"
+
+extern "C" USB_ClassInfo_MS_Device_t Disk_MS_Interface;
+
+void HostFirmware_Setup(uint8_t inBanks, uint8_t outBanks)
+{
+  // the AVR supports double banked endpoints, the firmware uses single banks
+  Disk_MS_Interface.Config.DataINEndpoint.Banks = inBanks;
+  Disk_MS_Interface.Config.DataOUTEndpoint.Banks = outBanks;
+
+  EventLog_Init();
+  SetupHardware();
+  SDCardManager_Init(SS);
+}
+
+void HostFirmware_Loop()
+{
+  ProcessHardware();
+  Scheduler_Run();
+}
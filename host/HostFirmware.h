@@ -0,0 +1,11 @@
+#ifndef HOSTFIRMWARE_H
+#define HOSTFIRMWARE_H
+
+#include <stdint.h>
+
+// setup() and loop() of SDCardReaderLUFA.ino for the host build. The card has to be attached
+// to the SPI bus with HostArduino_AttachCard() before the setup.
+void HostFirmware_Setup(uint8_t inBanks = 1, uint8_t outBanks = 1);
+void HostFirmware_Loop();
+
+#endif // HOSTFIRMWARE_H
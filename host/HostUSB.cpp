@@ -0,0 +1,695 @@
+#include "HostUSB.h"
+#include "HostArduino.h"
+
+#include <string.h>
+
+#include <deque>
+
+// MassStorage.h includes the card driver within extern "C", like the sketch the C++ headers have to come first
+#include <Arduino.h>
+#include <SPI.h>
+
+#include "../MassStorage.h"
+
+// full speed bulk transfers: 12 Mbit/s, a packet costs its data and about 16 bytes of token,
+// handshake, CRC and inter-packet gaps, which gives the usual 19 packets of 64 bytes per frame
+static const uint64_t USB_BIT_NS = 1000 / 12;
+static const uint32_t USB_PACKET_OVERHEAD = 16;
+
+struct HostEndpoint {
+  uint8_t address;
+  uint16_t size;
+  uint8_t banks;
+  bool halted;
+
+  // OUT: packets received into the banks, the front bank is read by the firmware
+  struct Bank {
+    std::vector<uint8_t> data;
+    uint64_t ready_ns;
+  };
+  std::deque<Bank> received;
+  uint16_t read_offset;
+
+  // IN: the bank filled by the firmware and the completion times of the banks on the bus
+  std::vector<uint8_t> fill;
+  std::deque<uint64_t> sending;
+};
+
+static HostEndpoint s_endpoints[ENDPOINT_TOTAL_ENDPOINTS];
+static HostEndpoint *s_selected = &s_endpoints[0];
+static USB_ClassInfo_MS_Device_t *s_interface;
+static USB_ClassInfo_CDC_Device_t *s_serial;
+static bool s_configured;
+
+volatile uint8_t USB_DeviceState;
+
+static HostUSB_Counters s_counters;
+static uint64_t s_fifo_byte_ns = 250;
+static uint64_t s_bus_free_ns;
+
+static std::deque<std::vector<uint8_t> > s_host_out;
+static std::deque<HostUSB_Packet> s_host_in;
+
+// packets of the data endpoints of the CDC interface
+static std::deque<std::vector<uint8_t> > s_serial_out;
+static std::deque<std::vector<uint8_t> > s_serial_in;
+
+static uint64_t HostUSB_PacketTime(uint32_t length)
+{
+  return (length + USB_PACKET_OVERHEAD) * 8 * USB_BIT_NS;
+}
+
+// the packet goes on the bus once the bus is free, returns the time the transfer is done
+static uint64_t HostUSB_Transfer(uint32_t length)
+{
+  uint64_t start = HostArduino_Now() > s_bus_free_ns ? HostArduino_Now() : s_bus_free_ns;
+  s_bus_free_ns = start + HostUSB_PacketTime(length);
+  return s_bus_free_ns;
+}
+
+static HostEndpoint *HostUSB_Endpoint(uint8_t address)
+{
+  return &s_endpoints[(address & ENDPOINT_EPNUM_MASK) % ENDPOINT_TOTAL_ENDPOINTS];
+}
+
+static bool HostUSB_IsIN(const HostEndpoint *endpoint)
+{
+  return endpoint->address & ENDPOINT_DIR_IN;
+}
+
+static bool HostUSB_IsSerial(const HostEndpoint *endpoint)
+{
+  return s_serial && (endpoint->address == s_serial->Config.DataINEndpoint.Address ||
+                      endpoint->address == s_serial->Config.DataOUTEndpoint.Address);
+}
+
+// moves packets of the host into the free banks of the OUT endpoint
+static void HostUSB_FillOutBanks(HostEndpoint *endpoint)
+{
+  std::deque<std::vector<uint8_t> > &host_out = HostUSB_IsSerial(endpoint) ? s_serial_out : s_host_out;
+
+  while (!endpoint->halted && endpoint->received.size() < endpoint->banks && !host_out.empty()) {
+    HostEndpoint::Bank bank;
+    bank.data.swap(host_out.front());
+    host_out.pop_front();
+    bank.ready_ns = HostUSB_Transfer(bank.data.size());
+    endpoint->received.push_back(bank);
+    ++s_counters.packets_out;
+  }
+}
+
+// releases the banks of the IN endpoint that were sent by now
+static void HostUSB_CompleteInBanks(HostEndpoint *endpoint)
+{
+  while (!endpoint->sending.empty() && endpoint->sending.front() <= HostArduino_Now())
+    endpoint->sending.pop_front();
+}
+
+static bool HostUSB_IsOUTReceived(HostEndpoint *endpoint)
+{
+  HostUSB_FillOutBanks(endpoint);
+  return !endpoint->received.empty() && endpoint->received.front().ready_ns <= HostArduino_Now();
+}
+
+static bool HostUSB_IsINReady(HostEndpoint *endpoint)
+{
+  HostUSB_CompleteInBanks(endpoint);
+  return endpoint->sending.size() < endpoint->banks;
+}
+
+// the FIFO of the selected bank can be accessed, as the RWAL bit of the AVR
+static bool HostUSB_IsReadWriteAllowed(HostEndpoint *endpoint)
+{
+  if (HostUSB_IsIN(endpoint))
+    return HostUSB_IsINReady(endpoint) && endpoint->fill.size() < endpoint->size;
+  return HostUSB_IsOUTReceived(endpoint) && endpoint->read_offset < endpoint->received.front().data.size();
+}
+
+static void HostUSB_Fifo()
+{
+  HostArduino_Advance(s_fifo_byte_ns);
+}
+
+void HostUSB_Disconnect()
+{
+  for (HostEndpoint &endpoint : s_endpoints)
+    endpoint = HostEndpoint();
+  s_selected = &s_endpoints[0];
+  s_interface = nullptr;
+  s_serial = nullptr;
+  s_configured = false;
+  USB_DeviceState = DEVICE_STATE_Unattached;
+  s_bus_free_ns = 0;
+  s_serial_out.clear();
+  s_serial_in.clear();
+  HostUSB_Flush();
+}
+
+void HostUSB_SetFifoOverhead(uint64_t ns)
+{
+  s_fifo_byte_ns = ns;
+}
+
+const HostUSB_Counters &HostUSB_GetCounters()
+{
+  return s_counters;
+}
+
+void HostUSB_ResetCounters()
+{
+  s_counters = HostUSB_Counters();
+}
+
+void HostUSB_SendOut(const uint8_t *data, uint32_t length)
+{
+  uint16_t size = s_interface ? s_interface->Config.DataOUTEndpoint.Size : 64;
+
+  // a transfer that is a multiple of the packet size has no zero length packet in BOT
+  for (uint32_t offset = 0; offset < length; offset += size) {
+    uint32_t packet = length - offset < size ? length - offset : size;
+    s_host_out.push_back(std::vector<uint8_t>(data + offset, data + offset + packet));
+  }
+  if (s_interface)
+    HostUSB_FillOutBanks(HostUSB_Endpoint(s_interface->Config.DataOUTEndpoint.Address));
+}
+
+bool HostUSB_ReceiveIn(HostUSB_Packet *packet)
+{
+  if (s_host_in.empty())
+    return false;
+  *packet = s_host_in.front();
+  s_host_in.pop_front();
+  return true;
+}
+
+uint64_t HostUSB_NextOutTime()
+{
+  if (!s_interface)
+    return 0;
+  HostEndpoint *endpoint = HostUSB_Endpoint(s_interface->Config.DataOUTEndpoint.Address);
+  HostUSB_FillOutBanks(endpoint);
+  return endpoint->received.empty() ? 0 : endpoint->received.front().ready_ns;
+}
+
+void HostUSB_WaitBusIdle()
+{
+  if (s_bus_free_ns > HostArduino_Now())
+    HostArduino_Advance(s_bus_free_ns - HostArduino_Now());
+}
+
+void HostUSB_Flush()
+{
+  s_host_out.clear();
+  s_host_in.clear();
+}
+
+void HostUSB_MassStorageReset()
+{
+  HostUSB_Flush();
+  if (s_interface)
+    MS_Device_ProcessControlRequest(s_interface);
+}
+
+uint8_t HostUSB_GetMaxLUN()
+{
+  return s_interface ? s_interface->Config.TotalLUNs - 1 : 0;
+}
+
+void HostUSB_OpenSerial(bool open)
+{
+  // the SET_LINE_CODING and SET_CONTROL_LINE_STATE requests of a terminal program
+  if (s_serial) {
+    s_serial->State.LineEncoding.BaudRateBPS = 115200;
+    s_serial->State.LineEncoding.DataBits = 8;
+    s_serial->State.ControlLineStates.HostToDevice = open ? CDC_CONTROL_LINE_OUT_DTR | CDC_CONTROL_LINE_OUT_RTS : 0;
+  }
+}
+
+void HostUSB_SendSerial(const uint8_t *data, uint32_t length)
+{
+  uint16_t size = s_serial ? s_serial->Config.DataOUTEndpoint.Size : 64;
+
+  for (uint32_t offset = 0; offset < length; offset += size) {
+    uint32_t packet = length - offset < size ? length - offset : size;
+    s_serial_out.push_back(std::vector<uint8_t>(data + offset, data + offset + packet));
+  }
+}
+
+bool HostUSB_ReceiveSerial(std::vector<uint8_t> *packet)
+{
+  if (s_serial_in.empty())
+    return false;
+  packet->swap(s_serial_in.front());
+  s_serial_in.pop_front();
+  return true;
+}
+
+// Endpoint_ConfigureEndpointTable() of the class drivers
+static bool HostUSB_ConfigureEndpoint(const USB_Endpoint_Table_t *table)
+{
+  HostEndpoint *endpoint = HostUSB_Endpoint(table->Address);
+  if (!table->Address || table->Size > 64 || !table->Banks || table->Banks > 2)
+    return false;
+  *endpoint = HostEndpoint();
+  endpoint->address = table->Address;
+  endpoint->size = table->Size;
+  endpoint->banks = table->Banks;
+  return true;
+}
+
+// USB device
+
+void USB_Init(void)
+{
+  // the host enumerates the device right away
+  HostUSB_Disconnect();
+  s_configured = true;
+  USB_DeviceState = DEVICE_STATE_Configured;
+  EVENT_USB_Device_Connect();
+  EVENT_USB_Device_ConfigurationChanged();
+}
+
+void USB_USBTask(void)
+{
+}
+
+// Mass Storage class driver, follows MassStorageClassDevice.c of LUFA
+
+bool MS_Device_ConfigureEndpoints(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo)
+{
+  memset(&MSInterfaceInfo->State, 0x00, sizeof(MSInterfaceInfo->State));
+  s_interface = MSInterfaceInfo;
+  return HostUSB_ConfigureEndpoint(&MSInterfaceInfo->Config.DataINEndpoint) &&
+         HostUSB_ConfigureEndpoint(&MSInterfaceInfo->Config.DataOUTEndpoint);
+}
+
+void MS_Device_ProcessControlRequest(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo)
+{
+  // only the Mass Storage Reset has an effect on the device
+  MSInterfaceInfo->State.IsMassStoreReset = true;
+}
+
+static bool MS_Device_ReadInCommandBlock(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo)
+{
+  uint16_t BytesProcessed;
+
+  Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataOUTEndpoint.Address);
+
+  BytesProcessed = 0;
+  while (Endpoint_Read_Stream_LE(&MSInterfaceInfo->State.CommandBlock, (sizeof(MS_CommandBlockWrapper_t) - 16),
+                                 &BytesProcessed) == ENDPOINT_RWSTREAM_IncompleteTransfer) {
+    if (MSInterfaceInfo->State.IsMassStoreReset)
+      return false;
+  }
+
+  if ((MSInterfaceInfo->State.CommandBlock.Signature != CPU_TO_LE32(MS_CBW_SIGNATURE)) ||
+      (MSInterfaceInfo->State.CommandBlock.LUN >= MSInterfaceInfo->Config.TotalLUNs) ||
+      (MSInterfaceInfo->State.CommandBlock.Flags & 0x1F) ||
+      (MSInterfaceInfo->State.CommandBlock.SCSICommandLength == 0) ||
+      (MSInterfaceInfo->State.CommandBlock.SCSICommandLength > 16)) {
+    Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataOUTEndpoint.Address);
+    Endpoint_StallTransaction();
+    Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataINEndpoint.Address);
+    Endpoint_StallTransaction();
+    return false;
+  }
+
+  BytesProcessed = 0;
+  while (Endpoint_Read_Stream_LE(&MSInterfaceInfo->State.CommandBlock.SCSICommandData,
+                                 MSInterfaceInfo->State.CommandBlock.SCSICommandLength,
+                                 &BytesProcessed) == ENDPOINT_RWSTREAM_IncompleteTransfer) {
+    if (MSInterfaceInfo->State.IsMassStoreReset)
+      return false;
+  }
+
+  Endpoint_ClearOUT();
+  return true;
+}
+
+static void MS_Device_ReturnCommandStatus(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo)
+{
+  Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataOUTEndpoint.Address);
+  while (Endpoint_IsStalled()) {
+    if (MSInterfaceInfo->State.IsMassStoreReset)
+      return;
+  }
+
+  Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataINEndpoint.Address);
+  while (Endpoint_IsStalled()) {
+    if (MSInterfaceInfo->State.IsMassStoreReset)
+      return;
+  }
+
+  uint16_t BytesProcessed = 0;
+  while (Endpoint_Write_Stream_LE(&MSInterfaceInfo->State.CommandStatus, sizeof(MS_CommandStatusWrapper_t),
+                                  &BytesProcessed) == ENDPOINT_RWSTREAM_IncompleteTransfer) {
+    if (MSInterfaceInfo->State.IsMassStoreReset)
+      return;
+  }
+
+  Endpoint_ClearIN();
+}
+
+void MS_Device_USBTask(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo)
+{
+  if (!s_configured)
+    return;
+
+  Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataOUTEndpoint.Address);
+
+  if (Endpoint_IsOUTReceived()) {
+    if (MS_Device_ReadInCommandBlock(MSInterfaceInfo)) {
+      if (MSInterfaceInfo->State.CommandBlock.Flags & MS_COMMAND_DIR_DATA_IN)
+        Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataINEndpoint.Address);
+
+      bool SCSICommandResult = CALLBACK_MS_Device_SCSICommandReceived(MSInterfaceInfo);
+
+      MSInterfaceInfo->State.CommandStatus.Status = (SCSICommandResult) ? MS_SCSI_COMMAND_Pass : MS_SCSI_COMMAND_Fail;
+      MSInterfaceInfo->State.CommandStatus.Signature = CPU_TO_LE32(MS_CSW_SIGNATURE);
+      MSInterfaceInfo->State.CommandStatus.Tag = MSInterfaceInfo->State.CommandBlock.Tag;
+      MSInterfaceInfo->State.CommandStatus.DataTransferResidue = MSInterfaceInfo->State.CommandBlock.DataTransferLength;
+
+      if (!(SCSICommandResult) && (le32_to_cpu(MSInterfaceInfo->State.CommandStatus.DataTransferResidue)))
+        Endpoint_StallTransaction();
+
+      MS_Device_ReturnCommandStatus(MSInterfaceInfo);
+    }
+  }
+
+  if (MSInterfaceInfo->State.IsMassStoreReset) {
+    Endpoint_ResetEndpoint(MSInterfaceInfo->Config.DataOUTEndpoint.Address);
+    Endpoint_ResetEndpoint(MSInterfaceInfo->Config.DataINEndpoint.Address);
+
+    Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataOUTEndpoint.Address);
+    Endpoint_ClearStall();
+    Endpoint_ResetDataToggle();
+    Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataINEndpoint.Address);
+    Endpoint_ClearStall();
+    Endpoint_ResetDataToggle();
+
+    MSInterfaceInfo->State.IsMassStoreReset = false;
+  }
+}
+
+// CDC class driver, follows CDCClassDevice.c of LUFA
+
+bool CDC_Device_ConfigureEndpoints(USB_ClassInfo_CDC_Device_t *const CDCInterfaceInfo)
+{
+  memset(&CDCInterfaceInfo->State, 0x00, sizeof(CDCInterfaceInfo->State));
+  s_serial = CDCInterfaceInfo;
+  return HostUSB_ConfigureEndpoint(&CDCInterfaceInfo->Config.DataINEndpoint) &&
+         HostUSB_ConfigureEndpoint(&CDCInterfaceInfo->Config.DataOUTEndpoint) &&
+         HostUSB_ConfigureEndpoint(&CDCInterfaceInfo->Config.NotificationEndpoint);
+}
+
+void CDC_Device_ProcessControlRequest(USB_ClassInfo_CDC_Device_t *const)
+{
+  // the line coding and control line state are set by HostUSB_OpenSerial()
+}
+
+int16_t CDC_Device_ReceiveByte(USB_ClassInfo_CDC_Device_t *const CDCInterfaceInfo)
+{
+  if (USB_DeviceState != DEVICE_STATE_Configured || !CDCInterfaceInfo->State.LineEncoding.BaudRateBPS)
+    return -1;
+
+  int16_t ReceivedByte = -1;
+
+  Endpoint_SelectEndpoint(CDCInterfaceInfo->Config.DataOUTEndpoint.Address);
+
+  if (Endpoint_IsOUTReceived()) {
+    if (Endpoint_BytesInEndpoint())
+      ReceivedByte = Endpoint_Read_8();
+
+    if (!Endpoint_BytesInEndpoint())
+      Endpoint_ClearOUT();
+  }
+  return ReceivedByte;
+}
+
+// endpoints
+
+void Endpoint_SelectEndpoint(uint8_t Address)
+{
+  s_selected = HostUSB_Endpoint(Address);
+}
+
+uint8_t Endpoint_GetCurrentEndpoint(void)
+{
+  return s_selected->address;
+}
+
+uint16_t Endpoint_BytesInEndpoint(void)
+{
+  if (HostUSB_IsIN(s_selected))
+    return s_selected->fill.size();
+  if (s_selected->received.empty() || s_selected->received.front().ready_ns > HostArduino_Now())
+    return 0;
+  return s_selected->received.front().data.size() - s_selected->read_offset;
+}
+
+bool Endpoint_IsOUTReceived(void)
+{
+  ++s_counters.ready_checks;
+  return HostUSB_IsOUTReceived(s_selected);
+}
+
+bool Endpoint_IsINReady(void)
+{
+  ++s_counters.ready_checks;
+  return HostUSB_IsINReady(s_selected);
+}
+
+bool Endpoint_IsReadWriteAllowed(void)
+{
+  ++s_counters.ready_checks;
+  return HostUSB_IsReadWriteAllowed(s_selected);
+}
+
+uint8_t Endpoint_WaitUntilReady(void)
+{
+  uint64_t ready_ns;
+
+  if (s_selected->halted)
+    return ENDPOINT_READYWAIT_EndpointStalled;
+
+  if (HostUSB_IsIN(s_selected)) {
+    HostUSB_CompleteInBanks(s_selected);
+    if (s_selected->sending.size() < s_selected->banks)
+      return ENDPOINT_READYWAIT_NoError;
+    ready_ns = s_selected->sending.front();
+  } else {
+    HostUSB_FillOutBanks(s_selected);
+    if (s_selected->received.empty()) {
+      // the host has nothing more to send, LUFA gives up after USB_STREAM_TIMEOUT_MS
+      ++s_counters.timeouts;
+      HostArduino_Advance((uint64_t)USB_STREAM_TIMEOUT_MS * 1000000);
+      return ENDPOINT_READYWAIT_Timeout;
+    }
+    ready_ns = s_selected->received.front().ready_ns;
+  }
+
+  if (ready_ns > HostArduino_Now()) {
+    ++s_counters.ready_waits;
+    s_counters.wait_ns += ready_ns - HostArduino_Now();
+    HostArduino_Advance(ready_ns - HostArduino_Now());
+  }
+  if (HostUSB_IsIN(s_selected))
+    HostUSB_CompleteInBanks(s_selected);
+  return ENDPOINT_READYWAIT_NoError;
+}
+
+void Endpoint_ClearOUT(void)
+{
+  // clearing an empty endpoint has no effect
+  if (!HostUSB_IsOUTReceived(s_selected))
+    return;
+  ++s_counters.clear_out;
+  s_selected->received.pop_front();
+  s_selected->read_offset = 0;
+  HostUSB_FillOutBanks(s_selected);
+}
+
+void Endpoint_ClearIN(void)
+{
+  if (!HostUSB_IsINReady(s_selected)) {
+    ++s_counters.invalid_accesses;
+    return;
+  }
+
+  HostUSB_Packet packet;
+  packet.data.swap(s_selected->fill);
+  packet.stall = false;
+
+  ++s_counters.clear_in;
+  ++s_counters.packets_in;
+  if (packet.data.size() < s_selected->size)
+    ++s_counters.short_packets_in;
+  s_selected->sending.push_back(HostUSB_Transfer(packet.data.size()));
+  if (HostUSB_IsSerial(s_selected))
+    s_serial_in.push_back(packet.data);
+  else
+    s_host_in.push_back(packet);
+}
+
+void Endpoint_StallTransaction(void)
+{
+  ++s_counters.stalls;
+  s_selected->halted = true;
+
+  if (HostUSB_IsIN(s_selected)) {
+    // the host gets a STALL handshake instead of the next packet
+    HostUSB_Packet packet;
+    packet.stall = true;
+    s_host_in.push_back(packet);
+  } else {
+    // the host stops the data stage, the packets it didn't send yet are dropped
+    s_host_out.clear();
+  }
+}
+
+void Endpoint_ClearStall(void)
+{
+  s_selected->halted = false;
+}
+
+bool Endpoint_IsStalled(void)
+{
+  // the host noticed the STALL handshake and clears the halt with CLEAR_FEATURE
+  if (!s_selected->halted)
+    return false;
+  s_selected->halted = false;
+  return true;
+}
+
+void Endpoint_ResetEndpoint(uint8_t Address)
+{
+  HostEndpoint *endpoint = HostUSB_Endpoint(Address);
+  endpoint->received.clear();
+  endpoint->read_offset = 0;
+  endpoint->fill.clear();
+  endpoint->sending.clear();
+}
+
+void Endpoint_ResetDataToggle(void)
+{
+}
+
+uint8_t Endpoint_Read_8(void)
+{
+  ++s_counters.fifo_reads;
+  HostUSB_Fifo();
+  if (HostUSB_IsIN(s_selected) || !HostUSB_IsReadWriteAllowed(s_selected)) {
+    ++s_counters.invalid_accesses;
+    return 0;
+  }
+  return s_selected->received.front().data[s_selected->read_offset++];
+}
+
+void Endpoint_Write_8(uint8_t Data)
+{
+  ++s_counters.fifo_writes;
+  HostUSB_Fifo();
+  if (!HostUSB_IsIN(s_selected) || !HostUSB_IsReadWriteAllowed(s_selected)) {
+    ++s_counters.invalid_accesses;
+    return;
+  }
+  s_selected->fill.push_back(Data);
+}
+
+void Endpoint_Write_16_LE(uint16_t Data)
+{
+  Endpoint_Write_8(Data & 0xFF);
+  Endpoint_Write_8(Data >> 8);
+}
+
+void Endpoint_Write_16_BE(uint16_t Data)
+{
+  Endpoint_Write_8(Data >> 8);
+  Endpoint_Write_8(Data & 0xFF);
+}
+
+void Endpoint_Write_32_LE(uint32_t Data)
+{
+  Endpoint_Write_16_LE(Data & 0xFFFF);
+  Endpoint_Write_16_LE(Data >> 16);
+}
+
+void Endpoint_Write_32_BE(uint32_t Data)
+{
+  Endpoint_Write_16_BE(Data >> 16);
+  Endpoint_Write_16_BE(Data & 0xFFFF);
+}
+
+// Stream functions, follow the templates of LUFA: a full or empty bank is cleared, with a
+// BytesProcessed pointer the function returns after each bank so the caller can check for resets.
+
+static uint8_t Endpoint_Stream(uint8_t *Data, int Step, bool Read, bool Discard, uint16_t Length,
+                               uint16_t *const BytesProcessed)
+{
+  uint16_t BytesInTransfer = 0;
+  uint8_t ErrorCode;
+
+  ++s_counters.stream_calls;
+  if ((ErrorCode = Endpoint_WaitUntilReady()))
+    return ErrorCode;
+
+  if (BytesProcessed != NULL) {
+    Length -= *BytesProcessed;
+    if (Data)
+      Data += *BytesProcessed * Step;
+  }
+
+  while (Length) {
+    if (!Endpoint_IsReadWriteAllowed()) {
+      if (Read)
+        Endpoint_ClearOUT();
+      else
+        Endpoint_ClearIN();
+
+      if (BytesProcessed != NULL) {
+        *BytesProcessed += BytesInTransfer;
+        return ENDPOINT_RWSTREAM_IncompleteTransfer;
+      }
+      if ((ErrorCode = Endpoint_WaitUntilReady()))
+        return ErrorCode;
+    } else {
+      if (Read) {
+        uint8_t Byte = Endpoint_Read_8();
+        if (!Discard)
+          *Data = Byte;
+      } else {
+        Endpoint_Write_8(Data ? *Data : 0);
+      }
+      if (Data)
+        Data += Step;
+      Length--;
+      BytesInTransfer++;
+    }
+  }
+  return ENDPOINT_RWSTREAM_NoError;
+}
+
+uint8_t Endpoint_Write_Stream_LE(const void *const Buffer, uint16_t Length, uint16_t *const BytesProcessed)
+{
+  return Endpoint_Stream((uint8_t *)Buffer, 1, false, false, Length, BytesProcessed);
+}
+
+uint8_t Endpoint_Write_Stream_BE(const void *const Buffer, uint16_t Length, uint16_t *const BytesProcessed)
+{
+  return Endpoint_Stream((uint8_t *)Buffer + (Length - 1), -1, false, false, Length, BytesProcessed);
+}
+
+uint8_t Endpoint_Read_Stream_LE(void *const Buffer, uint16_t Length, uint16_t *const BytesProcessed)
+{
+  return Endpoint_Stream((uint8_t *)Buffer, 1, true, false, Length, BytesProcessed);
+}
+
+uint8_t Endpoint_Null_Stream(uint16_t Length, uint16_t *const BytesProcessed)
+{
+  return Endpoint_Stream(nullptr, 1, false, false, Length, BytesProcessed);
+}
+
+uint8_t Endpoint_Discard_Stream(uint16_t Length, uint16_t *const BytesProcessed)
+{
+  return Endpoint_Stream(nullptr, 1, true, true, Length, BytesProcessed);
+}
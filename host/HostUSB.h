@@ -0,0 +1,71 @@
+#ifndef HOSTUSB_H
+#define HOSTUSB_H
+
+#include <stdint.h>
+
+#include <vector>
+
+// Counters of the endpoint shim. The FIFO counters include the bytes moved by the stream
+// functions, so the per-byte copy loops of the firmware show up here.
+struct HostUSB_Counters {
+  uint64_t fifo_reads;        // Endpoint_Read_8()
+  uint64_t fifo_writes;       // Endpoint_Write_8()
+  uint64_t stream_calls;      // Endpoint_*_Stream_*()
+  uint64_t ready_checks;      // Endpoint_IsReadWriteAllowed(), Endpoint_IsOUTReceived(), Endpoint_IsINReady()
+  uint64_t clear_out;         // banks released by Endpoint_ClearOUT()
+  uint64_t clear_in;          // banks handed to the bus by Endpoint_ClearIN()
+  uint64_t packets_out;       // packets received from the host
+  uint64_t packets_in;        // packets sent to the host
+  uint64_t short_packets_in;  // packets sent with less than the endpoint size
+  uint64_t ready_waits;       // Endpoint_WaitUntilReady() calls that waited for a bank
+  uint64_t wait_ns;           // time spent waiting for a bank
+  uint64_t timeouts;          // Endpoint_WaitUntilReady() timeouts, the host had no more data
+  uint64_t stalls;            // Endpoint_StallTransaction()
+  uint64_t invalid_accesses;  // FIFO accesses without a bank, the data is lost like on the AVR
+};
+
+// A packet the device sent on its IN endpoint, or the STALL handshake the host got instead
+struct HostUSB_Packet {
+  std::vector<uint8_t> data;
+  bool stall;
+};
+
+// Device side: enumerates the device when the firmware calls USB_Init(). Bulk transfers take the
+// time of a full speed packet on the bus, the bus is shared by both directions. The IN and OUT
+// endpoints have the number of banks set in the endpoint configuration of the class driver.
+void HostUSB_Disconnect();
+
+// CPU time of a FIFO byte access, default 250 ns
+void HostUSB_SetFifoOverhead(uint64_t ns);
+
+const HostUSB_Counters &HostUSB_GetCounters();
+void HostUSB_ResetCounters();
+
+// Host side: queues a bulk OUT transfer, which is split into packets of the endpoint size. The
+// packets are sent whenever the device frees a bank.
+void HostUSB_SendOut(const uint8_t *data, uint32_t length);
+
+// Host side: takes the next packet the device sent to the IN endpoint
+bool HostUSB_ReceiveIn(HostUSB_Packet *packet);
+
+// Host side: time of the next OUT packet the device hasn't received yet, 0 if there is none
+uint64_t HostUSB_NextOutTime();
+
+// Host side: waits until the packets on the bus are transferred
+void HostUSB_WaitBusIdle();
+
+// Host side: drops all queued packets in both directions
+void HostUSB_Flush();
+
+// Host side: the class specific Bulk-Only Mass Storage Reset and Get Max LUN requests
+void HostUSB_MassStorageReset();
+uint8_t HostUSB_GetMaxLUN();
+
+// Host side: the CDC port of the telemetry, a terminal program opens the port by setting the line
+// coding and DTR. Data sent to the port is split into packets of the endpoint size, the packets the
+// device sent are taken one by one.
+void HostUSB_OpenSerial(bool open);
+void HostUSB_SendSerial(const uint8_t *data, uint32_t length);
+bool HostUSB_ReceiveSerial(std::vector<uint8_t> *packet);
+
+#endif // HOSTUSB_H
@@ -0,0 +1,441 @@
+// Runs the firmware's SCSI and block transfer code against the SD card model over the Bulk-Only
+// Transport and reports the throughput in virtual time and the endpoint FIFO operations per block.
+//
+//   make mssim
+//   ./mssim --profile class10 --count 1024 --transfer 8
+//
+// The data read back is checked, the exit code is non-zero if a command failed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <Arduino.h>
+
+#include "BulkOnlyHost.h"
+#include "HostArduino.h"
+#include "HostFirmware.h"
+#include "HostUSB.h"
+#include "SDCardModel.h"
+
+#include "../SDCardManager.h"
+#include "../Telemetry.h"
+
+// the tests address logical blocks, 4 KiB if the firmware is built with SDCARD_LOGICAL_BLOCK_SIZE 4096
+static const uint32_t kBlockSize = SDCARD_LOGICAL_BLOCK_SIZE;
+
+static void fillPattern(uint32_t block, uint8_t *data)
+{
+  for (uint16_t i = 0; i < kBlockSize; ++i)
+    data[i] = (uint8_t)(block * 7 + i + i / 512);
+}
+
+static bool checkPattern(uint32_t block, const uint8_t *data)
+{
+  uint8_t expected[kBlockSize];
+  fillPattern(block, expected);
+  return !memcmp(expected, data, sizeof(expected));
+}
+
+static uint32_t randomBlock(uint32_t range)
+{
+  static uint32_t state = 0x2545F491;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state % range;
+}
+
+struct Result {
+  const char *name;
+  uint32_t blocks;
+  uint32_t commands;
+  uint64_t ns;
+  HostUSB_Counters usb;
+  bool passed;
+};
+
+static Result begin(const char *name)
+{
+  Result result = { name, 0, 0, HostArduino_Now(), HostUSB_Counters(), true };
+  HostUSB_ResetCounters();
+  return result;
+}
+
+static void end(Result *result)
+{
+  result->ns = HostArduino_Now() - result->ns;
+  result->usb = HostUSB_GetCounters();
+}
+
+static void report(const Result &result)
+{
+  double seconds = result.ns / 1e9;
+  double blocks = result.blocks ? result.blocks : 1;
+  printf("%-20s %7u blocks %10.3f ms %8.1f KiB/s %7.1f us/cmd  %s\n", result.name, result.blocks, seconds * 1e3,
+         seconds > 0 ? result.blocks * (kBlockSize / 1024.0) / seconds : 0.0,
+         result.commands ? result.ns / 1e3 / result.commands : 0.0, result.passed ? "ok" : "FAILED");
+  printf("%-20s FIFO %.0f rd %.0f wr, %.1f ready checks, %.1f packets, %.1f waits %.1f us per block\n", "",
+         result.usb.fifo_reads / blocks, result.usb.fifo_writes / blocks, result.usb.ready_checks / blocks,
+         (result.usb.packets_in + result.usb.packets_out) / blocks, result.usb.ready_waits / blocks,
+         result.usb.wait_ns / 1e3 / blocks);
+  if (result.usb.invalid_accesses || result.usb.timeouts)
+    printf("%-20s %llu invalid FIFO accesses, %llu timeouts\n", "",
+           (unsigned long long)result.usb.invalid_accesses, (unsigned long long)result.usb.timeouts);
+}
+
+static Result writeSequential(BulkOnlyHost &host, uint32_t count, uint16_t transfer)
+{
+  Result result = begin("write sequential");
+  std::vector<uint8_t> data(transfer * kBlockSize);
+  for (uint32_t block = 0; block < count && result.passed; block += transfer) {
+    uint16_t blocks = count - block < transfer ? count - block : transfer;
+    for (uint16_t i = 0; i < blocks; ++i)
+      fillPattern(block + i, &data[i * kBlockSize]);
+    result.passed = host.write10(block, blocks, data.data()) == BulkOnlyHost::STATUS_PASSED;
+    result.blocks += blocks;
+    ++result.commands;
+  }
+  end(&result);
+  return result;
+}
+
+static Result readSequential(BulkOnlyHost &host, uint32_t count, uint16_t transfer)
+{
+  Result result = begin("read sequential");
+  std::vector<uint8_t> data(transfer * kBlockSize);
+  for (uint32_t block = 0; block < count && result.passed; block += transfer) {
+    uint16_t blocks = count - block < transfer ? count - block : transfer;
+    result.passed = host.read10(block, blocks, data.data()) == BulkOnlyHost::STATUS_PASSED;
+    for (uint16_t i = 0; i < blocks && result.passed; ++i)
+      result.passed = checkPattern(block + i, &data[i * kBlockSize]);
+    result.blocks += blocks;
+    ++result.commands;
+  }
+  end(&result);
+  return result;
+}
+
+static Result readRandom(BulkOnlyHost &host, uint32_t count, uint32_t range)
+{
+  Result result = begin("read random");
+  uint8_t data[kBlockSize];
+  for (uint32_t i = 0; i < count && result.passed; ++i) {
+    uint32_t block = randomBlock(range);
+    result.passed = host.read10(block, 1, data) == BulkOnlyHost::STATUS_PASSED && checkPattern(block, data);
+    ++result.blocks;
+    ++result.commands;
+  }
+  end(&result);
+  return result;
+}
+
+static Result verify(BulkOnlyHost &host, uint32_t count)
+{
+  Result result = begin("verify");
+  for (uint32_t block = 0; block < count && result.passed; block += 128) {
+    uint16_t blocks = count - block < 128 ? count - block : 128;
+    result.passed = host.verify10(block, blocks) == BulkOnlyHost::STATUS_PASSED;
+    result.blocks += blocks;
+    ++result.commands;
+  }
+  end(&result);
+  return result;
+}
+
+// a read past the end of the medium has to fail with ILLEGAL REQUEST and the whole transfer as residue
+static Result readOutOfRange(BulkOnlyHost &host, uint32_t capacity)
+{
+  Result result = begin("read out of range");
+  uint8_t data[2 * kBlockSize];
+  uint8_t sense_key = 0;
+  uint32_t residue = 0;
+  uint8_t cdb[10] = { 0x28, 0, (uint8_t)(capacity >> 24), (uint8_t)(capacity >> 16), (uint8_t)(capacity >> 8),
+                      (uint8_t)capacity, 0, 0, 2, 0 };
+  result.passed = host.command(cdb, sizeof(cdb), true, data, sizeof(data), &residue) == BulkOnlyHost::STATUS_FAILED &&
+                  residue == sizeof(data) && host.requestSense(&sense_key) == BulkOnlyHost::STATUS_PASSED &&
+                  sense_key == SCSI_SENSE_KEY_ILLEGAL_REQUEST;
+  result.commands = 2;
+  end(&result);
+  return result;
+}
+
+// the vendor command 0xC1 returns the CSD, CID and SD Status, the capacity in the CSD has to match the card
+static Result readRegisters(BulkOnlyHost &host, const SDCardModel &card, FILE *output)
+{
+  Result result = begin("read registers");
+  uint8_t registers[SDCARD_REGISTERS_LENGTH];
+  uint8_t cdb[10] = { SCSI_CMD_READ_CARD_REGISTERS, 0, 0, 0, 0, 0, 0, 0, sizeof(registers), 0 };
+  result.passed = host.command(cdb, sizeof(cdb), true, registers, sizeof(registers), nullptr) ==
+                  BulkOnlyHost::STATUS_PASSED;
+  if (result.passed) {
+    uint32_t c_size = (registers[7] & 0x3F) << 16 | registers[8] << 8 | registers[9];
+    result.passed = registers[0] >> 6 == 1 && (c_size + 1) * 1024 == (card.blocks() & ~1023u) &&
+                    registers[32 + 10] >> 4;
+  }
+  if (result.passed && output)
+    result.passed = fwrite(registers, sizeof(registers), 1, output) == 1;
+  result.commands = 1;
+  end(&result);
+  return result;
+}
+
+// READ CAPACITY (16) reports the same capacity as READ CAPACITY (10) and 4 KiB physical blocks
+static Result readCapacity16(BulkOnlyHost &host, uint32_t capacity)
+{
+  Result result = begin("read capacity 16");
+  uint64_t blocks = 0;
+  uint32_t block_size = 0;
+  uint8_t exponent = 0;
+  result.passed = host.readCapacity16(&blocks, &block_size, &exponent) == BulkOnlyHost::STATUS_PASSED &&
+                  blocks == capacity && block_size == kBlockSize && (block_size << exponent) == 4096;
+  result.commands = 1;
+  end(&result);
+  return result;
+}
+
+#if defined(ENABLE_TELEMETRY)
+// runs the device for a telemetry interval and returns the records it sent on the CDC port
+static std::vector<Telemetry_Record_t> receiveTelemetry()
+{
+  std::vector<Telemetry_Record_t> records;
+  std::vector<uint8_t> packet;
+  uint64_t end = HostArduino_Now() + (TELEMETRY_INTERVAL_MS + 10) * 1000000ull;
+
+  while (HostArduino_Now() < end) {
+    HostFirmware_Loop();
+    delay(1);
+  }
+  while (HostUSB_ReceiveSerial(&packet)) {
+    Telemetry_Record_t record;
+    uint8_t sum = 0;
+    for (uint8_t byte : packet)
+      sum += byte;
+    if (packet.size() != sizeof(record) || packet[0] != TELEMETRY_SYNC || sum)
+      return std::vector<Telemetry_Record_t>();
+    memcpy(&record, packet.data(), sizeof(record));
+    records.push_back(record);
+  }
+  return records;
+}
+
+// nothing is sent while the port is closed, after a reset the counters only hold the reads that followed
+static Result telemetry(BulkOnlyHost &host, uint32_t count, uint16_t transfer)
+{
+  Result result = begin("telemetry");
+  const uint8_t reset = TELEMETRY_COMMAND_RESET;
+  std::vector<uint8_t> data(transfer * kBlockSize);
+
+  HostUSB_OpenSerial(false);
+  result.passed = receiveTelemetry().empty();
+  HostUSB_OpenSerial(true);
+  HostUSB_SendSerial(&reset, 1);
+  result.passed = result.passed && !receiveTelemetry().empty();
+
+  for (uint32_t block = 0; block < count && result.passed; block += transfer) {
+    uint16_t blocks = count - block < transfer ? count - block : transfer;
+    result.passed = host.read10(block, blocks, data.data()) == BulkOnlyHost::STATUS_PASSED;
+    result.blocks += blocks;
+    ++result.commands;
+  }
+  std::vector<Telemetry_Record_t> records = receiveTelemetry();
+  result.passed = result.passed && !records.empty() && records.back().Counters[TELEMETRY_COMMANDS] == result.commands &&
+                  records.back().Counters[TELEMETRY_BLOCKS_READ] == result.blocks * (kBlockSize / 512) &&
+                  records.back().Counters[TELEMETRY_BLOCKS_WRITTEN] == 0 && records.back().Counters[TELEMETRY_READ_US];
+  HostUSB_OpenSerial(false);
+  end(&result);
+  return result;
+}
+#endif
+
+// waits for the card initialization in the background, the first command after it reports the medium change
+static bool waitForMedium(BulkOnlyHost &host)
+{
+  uint8_t sense_key;
+  for (int i = 0; i < 200; ++i) {
+    BulkOnlyHost::Status status = host.testUnitReady();
+    if (status == BulkOnlyHost::STATUS_PASSED)
+      return true;
+    if (status != BulkOnlyHost::STATUS_FAILED || host.requestSense(&sense_key) != BulkOnlyHost::STATUS_PASSED)
+      return false;
+    delay(10);
+  }
+  return false;
+}
+
+// runs the firmware until the medium reaches a state, the virtual clock is advanced while it waits for a probe
+static bool runUntilMediumState(uint8_t state, uint64_t timeout_ns)
+{
+  uint64_t end = HostArduino_Now() + timeout_ns;
+  while (SDCardManager_GetMediumState() != state) {
+    if (HostArduino_Now() >= end)
+      return false;
+    HostFirmware_Loop();
+    HostArduino_Advance(1000);
+  }
+  return true;
+}
+
+// pulls the card until the firmware notices and inserts it again, optionally as a different card. The time
+// from the probe that finds the card until it is ready is measured in the firmware's loop, so that it isn't
+// rounded to the polling of the host, with SDCARD_EEPROM_PROFILE the same card skips the OCR, the CSD and the SCR.
+static Result reinsert(BulkOnlyHost &host, SDCardModel &card, uint32_t capacity, const char *name, uint32_t serial)
+{
+  card.setInserted(false);
+  bool removed = runUntilMediumState(SDCARD_MEDIUM_NOT_PRESENT, 2000000000ull);
+  card.setSerialNumber(serial);
+  card.setInserted(true);
+  bool found = removed && runUntilMediumState(SDCARD_MEDIUM_BECOMING_READY, 1000000000ull);
+
+  Result result = begin(name);
+  result.passed = found && runUntilMediumState(SDCARD_MEDIUM_READY, 3000000000ull);
+  end(&result);
+  // the loop only polled the endpoints, there was no transfer
+  result.usb = HostUSB_Counters();
+
+  // the host sees the new medium as a UNIT ATTENTION, the capacity doesn't change
+  uint32_t blocks = 0;
+  result.passed = result.passed && waitForMedium(host) &&
+                  host.readCapacity(&blocks) == BulkOnlyHost::STATUS_PASSED && blocks == capacity;
+  return result;
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --profile NAME      latency profile: ideal, class10, class4, worn, cheap (default class10)\n"
+          "  --image FILE        use an image file as card data instead of memory\n"
+          "  --blocks N          card size in 512 byte blocks (default 7744512)\n"
+          "  --count N           blocks transferred by every test (default 1024)\n"
+          "  --transfer N        blocks per READ (10) and WRITE (10) command (default 8)\n"
+          "  --banks N           banks of the data endpoints, 1 or 2 (default 1 like the firmware)\n"
+          "  --spi-overhead-ns N CPU time per SPI byte in addition to the SPI clock (default 250)\n"
+          "  --fifo-overhead-ns N CPU time per endpoint FIFO byte (default 250)\n"
+          "  --serial FILE       write the bytes sent on Serial1, the event log, to a file\n"
+          "  --registers FILE    write the CSD, CID and SD Status read with the vendor command 0xC1 to a file\n",
+          program);
+}
+
+int main(int argc, char **argv)
+{
+  const SDCardProfile *profile = SDCardProfile::find("class10");
+  const char *image = nullptr;
+  uint32_t blocks = 7744512;
+  uint32_t count = 1024;
+  uint32_t transfer = 8;
+  uint32_t banks = 1;
+  FILE *serial = nullptr;
+  FILE *registers = nullptr;
+
+  for (int i = 1; i < argc; i += 2) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (!value) {
+      usage(argv[0]);
+      return 2;
+    }
+    if (!strcmp(arg, "--profile")) {
+      if (!(profile = SDCardProfile::find(value))) {
+        fprintf(stderr, "Unknown profile %s\n", value);
+        return 2;
+      }
+    } else if (!strcmp(arg, "--image")) {
+      image = value;
+    } else if (!strcmp(arg, "--blocks")) {
+      blocks = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--count")) {
+      count = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--transfer")) {
+      transfer = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--banks")) {
+      banks = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--spi-overhead-ns")) {
+      HostArduino_SetSpiOverhead(strtoull(value, nullptr, 0));
+    } else if (!strcmp(arg, "--fifo-overhead-ns")) {
+      HostUSB_SetFifoOverhead(strtoull(value, nullptr, 0));
+    } else if (!strcmp(arg, "--serial")) {
+      if (!(serial = fopen(value, "wb"))) {
+        perror(value);
+        return 1;
+      }
+      HostArduino_SetSerialOutput(serial);
+    } else if (!strcmp(arg, "--registers")) {
+      if (!(registers = fopen(value, "wb"))) {
+        perror(value);
+        return 1;
+      }
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (!transfer || transfer > 0xFFFF || banks < 1 || banks > 2) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  SDCardModel card(blocks);
+  if (image && !card.openImage(image)) {
+    perror(image);
+    return 1;
+  }
+  card.setProfile(*profile);
+  HostArduino_AttachCard(&card, SS);
+
+  BulkOnlyHost host(HostFirmware_Loop);
+  host.setBlockSize(kBlockSize);
+  HostFirmware_Setup(banks, banks);
+
+  uint64_t start = HostArduino_Now();
+  if (!waitForMedium(host)) {
+    fprintf(stderr, "Medium not ready: %s\n", host.error());
+    return 1;
+  }
+  printf("%-20s %10.3f ms, profile %s, %u banks\n", "medium ready", (HostArduino_Now() - start) / 1e6,
+         profile->name, banks);
+
+  uint32_t capacity = 0;
+  if (host.readCapacity(&capacity) != BulkOnlyHost::STATUS_PASSED) {
+    fprintf(stderr, "READ CAPACITY failed: %s\n", host.error());
+    return 1;
+  }
+  if (capacity != ((card.blocks() & ~1023u) - SDCARD_RESERVED_BLOCKS) / (kBlockSize / 512)) {
+    fprintf(stderr, "Capacity mismatch: device %u blocks, card %u blocks\n", capacity, card.blocks());
+    return 1;
+  }
+  if (capacity < count) {
+    fprintf(stderr, "The card needs at least %u blocks\n", count);
+    return 1;
+  }
+
+  Result results[] = {
+    writeSequential(host, count, transfer),
+    readSequential(host, count, transfer),
+    verify(host, count),
+    readRandom(host, count / 4, count),
+    readOutOfRange(host, capacity),
+    readCapacity16(host, capacity),
+    readRegisters(host, card, registers),
+#if defined(ENABLE_TELEMETRY)
+    telemetry(host, count, transfer),
+#endif
+    reinsert(host, card, capacity, "reinsert same card", 0x12345678),
+    reinsert(host, card, capacity, "insert other card", 0x87654321),
+  };
+
+  bool passed = true;
+  for (const Result &result : results) {
+    report(result);
+    passed = passed && result.passed;
+  }
+  if (!passed && *host.error())
+    printf("Last transport error: %s\n", host.error());
+  if (serial)
+    fclose(serial);
+  if (registers)
+    fclose(registers);
+  return passed ? 0 : 1;
+}
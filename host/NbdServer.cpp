@@ -0,0 +1,534 @@
+// Serves the firmware's SCSI stack as Network Block Devices, so that standard Linux tools can put
+// far more load on the command engine than a full speed USB link allows. Every device instance is
+// a process with its own copy of the firmware, the card model and the endpoint model: the
+// firmware keeps its state in statics like on the AVR, so the instances can't share a process.
+// An NBD request is split into READ (10) and WRITE (10) commands that go through BulkOnlyHost,
+// MS_Device_USBTask(), SCSI_DecodeSCSICommand() and SDCardManager like the commands of a USB host.
+//
+//   make nbdserver
+//   ./nbdserver --devices 4 --port 10809           instances on 127.0.0.1:10809 to 10812
+//   ./nbdserver --unix /tmp/sdreader --image card.img
+//
+//   nbd-client -b 512 127.0.0.1 10809 /dev/nbd0   or   nbd-client -b 512 -unix /tmp/sdreader /dev/nbd0
+//   fio --filename=/dev/nbd0 --direct=1 --rw=randrw --bs=4k --iodepth=16 --runtime=600 --name=soak
+//
+// An instance serves one client at a time and keeps its data between the connections. Requests
+// have to be aligned to the logical block size of the firmware, which is announced to clients
+// that ask for it. A summary of every connection is printed when the client disconnects.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <Arduino.h>
+
+#include "BulkOnlyHost.h"
+#include "HostArduino.h"
+#include "HostFirmware.h"
+#include "SDCardModel.h"
+
+#include "../SDCardManager.h"
+
+namespace {
+
+// fixed newstyle handshake and simple replies of the NBD protocol
+const uint64_t kNbdMagic = 0x4e42444d41474943ULL;      // "NBDMAGIC"
+const uint64_t kOptionMagic = 0x49484156454f5054ULL;   // "IHAVEOPT"
+const uint64_t kOptionReplyMagic = 0x3e889045565a9ULL;
+const uint32_t kRequestMagic = 0x25609513;
+const uint32_t kReplyMagic = 0x67446698;
+
+const uint16_t kFlagFixedNewstyle = 1 << 0;
+const uint16_t kFlagNoZeroes = 1 << 1;
+
+const uint16_t kTransmissionHasFlags = 1 << 0;
+const uint16_t kTransmissionSendFlush = 1 << 2;
+
+enum Option {
+  OPT_EXPORT_NAME = 1,
+  OPT_ABORT = 2,
+  OPT_LIST = 3,
+  OPT_INFO = 6,
+  OPT_GO = 7,
+};
+
+enum OptionReply {
+  REP_ACK = 1,
+  REP_SERVER = 2,
+  REP_INFO = 3,
+  REP_ERR_UNSUP = 0x80000001,
+};
+
+enum Info {
+  INFO_EXPORT = 0,
+  INFO_BLOCK_SIZE = 3,
+};
+
+enum Command {
+  CMD_READ = 0,
+  CMD_WRITE = 1,
+  CMD_DISC = 2,
+  CMD_FLUSH = 3,
+};
+
+// largest request that is accepted, the kernel client sends at most 32 MiB
+const uint32_t kMaxRequest = 32 << 20;
+
+// logical blocks per SCSI command
+const uint16_t kMaxTransfer = 128;
+
+struct Instance {
+  uint64_t size;            // bytes
+  uint32_t block_size;      // logical block size of the firmware
+};
+
+struct Summary {
+  uint64_t requests = 0;
+  uint64_t bytes_read = 0;
+  uint64_t bytes_written = 0;
+  uint64_t errors = 0;
+  uint64_t transport_errors = 0;
+};
+
+bool readAll(int fd, void *data, size_t length)
+{
+  uint8_t *bytes = static_cast<uint8_t *>(data);
+  while (length) {
+    ssize_t done = read(fd, bytes, length);
+    if (done <= 0) {
+      if (done < 0 && errno == EINTR)
+        continue;
+      return false;
+    }
+    bytes += done;
+    length -= done;
+  }
+  return true;
+}
+
+bool writeAll(int fd, const void *data, size_t length)
+{
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  while (length) {
+    ssize_t done = write(fd, bytes, length);
+    if (done <= 0) {
+      if (done < 0 && errno == EINTR)
+        continue;
+      return false;
+    }
+    bytes += done;
+    length -= done;
+  }
+  return true;
+}
+
+// the protocol is big-endian
+void put16(std::vector<uint8_t> &out, uint16_t value)
+{
+  out.push_back(value >> 8);
+  out.push_back(value);
+}
+
+void put32(std::vector<uint8_t> &out, uint32_t value)
+{
+  put16(out, value >> 16);
+  put16(out, value);
+}
+
+void put64(std::vector<uint8_t> &out, uint64_t value)
+{
+  put32(out, value >> 32);
+  put32(out, value);
+}
+
+uint16_t get16(const uint8_t *bytes)
+{
+  return bytes[0] << 8 | bytes[1];
+}
+
+uint32_t get32(const uint8_t *bytes)
+{
+  return (uint32_t)get16(bytes) << 16 | get16(bytes + 2);
+}
+
+uint64_t get64(const uint8_t *bytes)
+{
+  return (uint64_t)get32(bytes) << 32 | get32(bytes + 4);
+}
+
+bool sendOptionReply(int fd, uint32_t option, uint32_t type, const std::vector<uint8_t> &data)
+{
+  std::vector<uint8_t> reply;
+  put64(reply, kOptionReplyMagic);
+  put32(reply, option);
+  put32(reply, type);
+  put32(reply, data.size());
+  reply.insert(reply.end(), data.begin(), data.end());
+  return writeAll(fd, reply.data(), reply.size());
+}
+
+// Negotiates the export, there is only one per instance and its name is ignored. Returns true when
+// the client entered the transmission phase.
+bool negotiate(int fd, const Instance &instance)
+{
+  std::vector<uint8_t> hello;
+  put64(hello, kNbdMagic);
+  put64(hello, kOptionMagic);
+  put16(hello, kFlagFixedNewstyle | kFlagNoZeroes);
+  uint8_t client_flags[4];
+  if (!writeAll(fd, hello.data(), hello.size()) || !readAll(fd, client_flags, sizeof(client_flags)))
+    return false;
+  bool no_zeroes = get32(client_flags) & kFlagNoZeroes;
+  const uint16_t transmission_flags = kTransmissionHasFlags | kTransmissionSendFlush;
+
+  for (;;) {
+    uint8_t header[16];
+    if (!readAll(fd, header, sizeof(header)) || get64(header) != kOptionMagic)
+      return false;
+    uint32_t option = get32(header + 8);
+    uint32_t length = get32(header + 12);
+    if (length > 4096)
+      return false;
+    std::vector<uint8_t> data(length);
+    if (!readAll(fd, data.data(), length))
+      return false;
+
+    std::vector<uint8_t> reply;
+    switch (option) {
+    case OPT_EXPORT_NAME:
+      put64(reply, instance.size);
+      put16(reply, transmission_flags);
+      if (!no_zeroes)
+        reply.resize(reply.size() + 124);
+      return writeAll(fd, reply.data(), reply.size());
+
+    case OPT_ABORT:
+      sendOptionReply(fd, option, REP_ACK, reply);
+      return false;
+
+    case OPT_LIST:
+      put32(reply, 0);
+      if (!sendOptionReply(fd, option, REP_SERVER, reply) || !sendOptionReply(fd, option, REP_ACK, {}))
+        return false;
+      break;
+
+    case OPT_INFO:
+    case OPT_GO:
+      put16(reply, INFO_EXPORT);
+      put64(reply, instance.size);
+      put16(reply, transmission_flags);
+      if (!sendOptionReply(fd, option, REP_INFO, reply))
+        return false;
+      reply.clear();
+      put16(reply, INFO_BLOCK_SIZE);
+      put32(reply, instance.block_size);
+      put32(reply, 4096 > instance.block_size ? 4096 : instance.block_size);
+      put32(reply, kMaxRequest);
+      if (!sendOptionReply(fd, option, REP_INFO, reply) || !sendOptionReply(fd, option, REP_ACK, {}))
+        return false;
+      if (option == OPT_GO)
+        return true;
+      break;
+
+    default:
+      if (!sendOptionReply(fd, option, REP_ERR_UNSUP, reply))
+        return false;
+      break;
+    }
+  }
+}
+
+// Runs a read or write of whole logical blocks as SCSI commands, returns an errno value for the reply
+uint32_t transfer(BulkOnlyHost &host, const Instance &instance, bool write, uint64_t offset, uint32_t length,
+                  uint8_t *data, Summary &summary)
+{
+  if (offset % instance.block_size || length % instance.block_size)
+    return EINVAL;
+  if (offset > instance.size || length > instance.size - offset)
+    return ENOSPC;
+
+  uint32_t block = offset / instance.block_size;
+  uint32_t blocks = length / instance.block_size;
+  while (blocks) {
+    uint16_t count = blocks < kMaxTransfer ? blocks : kMaxTransfer;
+    BulkOnlyHost::Status status = write ? host.write10(block, count, data) : host.read10(block, count, data);
+    if (status != BulkOnlyHost::STATUS_PASSED) {
+      if (status == BulkOnlyHost::STATUS_TRANSPORT_ERROR)
+        ++summary.transport_errors;
+      return EIO;
+    }
+    block += count;
+    blocks -= count;
+    data += count * instance.block_size;
+  }
+  return 0;
+}
+
+void serve(int fd, BulkOnlyHost &host, const Instance &instance, Summary &summary)
+{
+  std::vector<uint8_t> data;
+
+  for (;;) {
+    uint8_t request[28];
+    if (!readAll(fd, request, sizeof(request)) || get32(request) != kRequestMagic)
+      return;
+    uint16_t type = get16(request + 6);
+    uint64_t handle = get64(request + 8);
+    uint64_t offset = get64(request + 16);
+    uint32_t length = get32(request + 24);
+    uint32_t error = 0;
+
+    if (type == CMD_DISC)
+      return;
+    if ((type == CMD_READ || type == CMD_WRITE) && length > kMaxRequest)
+      return;
+    ++summary.requests;
+
+    switch (type) {
+    case CMD_READ:
+      data.resize(length);
+      error = transfer(host, instance, false, offset, length, data.data(), summary);
+      if (!error)
+        summary.bytes_read += length;
+      break;
+    case CMD_WRITE:
+      // the data follows the request even if the write is refused
+      data.resize(length);
+      if (!readAll(fd, data.data(), length))
+        return;
+      error = transfer(host, instance, true, offset, length, data.data(), summary);
+      if (!error)
+        summary.bytes_written += length;
+      break;
+    case CMD_FLUSH:
+      // a write is on the card when its CSW arrives, there is no write cache to flush
+      break;
+    default:
+      error = EINVAL;
+      break;
+    }
+    if (error)
+      ++summary.errors;
+
+    std::vector<uint8_t> reply;
+    put32(reply, kReplyMagic);
+    put32(reply, error);
+    put64(reply, handle);
+    if (type == CMD_READ && !error)
+      reply.insert(reply.end(), data.begin(), data.end());
+    if (!writeAll(fd, reply.data(), reply.size()))
+      return;
+  }
+}
+
+// waits for the card initialization in the background, the first command after it reports the medium change
+bool waitForMedium(BulkOnlyHost &host)
+{
+  uint8_t sense_key;
+  for (int i = 0; i < 200; ++i) {
+    BulkOnlyHost::Status status = host.testUnitReady();
+    if (status == BulkOnlyHost::STATUS_PASSED)
+      return true;
+    if (status != BulkOnlyHost::STATUS_FAILED || host.requestSense(&sense_key) != BulkOnlyHost::STATUS_PASSED)
+      return false;
+    delay(10);
+  }
+  return false;
+}
+
+int listenOn(const std::string &unix_path, uint16_t port)
+{
+  int fd;
+  if (!unix_path.empty()) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (unix_path.size() >= sizeof(address.sun_path)) {
+      fprintf(stderr, "%s: path too long\n", unix_path.c_str());
+      return -1;
+    }
+    strcpy(address.sun_path, unix_path.c_str());
+    unlink(unix_path.c_str());
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 1) < 0) {
+      perror(unix_path.c_str());
+      return -1;
+    }
+  } else {
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int reuse = 1;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+        bind(fd, (sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 1) < 0) {
+      fprintf(stderr, "port %u: %s\n", port, strerror(errno));
+      return -1;
+    }
+  }
+  return fd;
+}
+
+// one device instance, runs in its own process
+int runInstance(unsigned index, int listen_fd, const SDCardProfile &profile, uint32_t blocks, const char *image,
+                const std::string &name)
+{
+  SDCardModel card(blocks);
+  card.setProfile(profile);
+  card.setSerialNumber(index + 1);
+  if (image && !card.openImage(image)) {
+    perror(image);
+    return 1;
+  }
+  HostArduino_AttachCard(&card, SS);
+
+  BulkOnlyHost host(HostFirmware_Loop);
+  HostFirmware_Setup();
+
+  uint64_t logical_blocks;
+  uint32_t block_size;
+  uint8_t exponent;
+  if (!waitForMedium(host) ||
+      host.readCapacity16(&logical_blocks, &block_size, &exponent) != BulkOnlyHost::STATUS_PASSED) {
+    fprintf(stderr, "%s: medium not ready: %s\n", name.c_str(), host.error());
+    return 1;
+  }
+  host.setBlockSize(block_size);
+  Instance instance = { logical_blocks * block_size, block_size };
+  fprintf(stderr, "%s: %llu blocks of %u bytes\n", name.c_str(), (unsigned long long)logical_blocks, block_size);
+
+  for (;;) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("accept");
+      return 1;
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    Summary summary;
+    if (negotiate(fd, instance))
+      serve(fd, host, instance, summary);
+    close(fd);
+    fprintf(stderr, "%s: %llu requests, %.1f MiB read, %.1f MiB written, %llu errors, %llu transport errors\n",
+            name.c_str(), (unsigned long long)summary.requests, summary.bytes_read / 1048576.0,
+            summary.bytes_written / 1048576.0, (unsigned long long)summary.errors,
+            (unsigned long long)summary.transport_errors);
+  }
+}
+
+void usage(const char *program)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --devices N        number of device instances (default 1, or one per --image)\n"
+          "  --port N           TCP port on 127.0.0.1 of the first instance, the others follow (default 10809)\n"
+          "  --unix PATH        listen on a Unix socket instead, PATH.N for more than one instance\n"
+          "  --image FILE       card data of the next instance, repeat for more instances\n"
+          "  --blocks N         size of the cards without an image in 512 byte blocks (default 7744512)\n"
+          "  --profile NAME     card latency profile: ideal, class10, class4, worn, cheap (default class10)\n",
+          program);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  const SDCardProfile *profile = SDCardProfile::find("class10");
+  std::vector<const char *> images;
+  std::string unix_path;
+  unsigned devices = 0;
+  unsigned long port = 10809;
+  uint32_t blocks = 7744512;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 2;
+    }
+    const char *value = argv[++i];
+    if (!strcmp(arg, "--devices")) {
+      devices = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--port")) {
+      port = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--unix")) {
+      unix_path = value;
+    } else if (!strcmp(arg, "--image")) {
+      images.push_back(value);
+    } else if (!strcmp(arg, "--blocks")) {
+      blocks = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--profile")) {
+      if (!(profile = SDCardProfile::find(value))) {
+        fprintf(stderr, "Unknown profile %s\n", value);
+        return 2;
+      }
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (!devices)
+    devices = images.empty() ? 1 : images.size();
+  if (devices < images.size() || port + devices > 65536) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  // the sockets are bound before the instances start, so that clients can connect right away
+  std::vector<int> sockets;
+  std::vector<std::string> names;
+  for (unsigned i = 0; i < devices; ++i) {
+    std::string path = unix_path.empty() || devices == 1 ? unix_path : unix_path + "." + std::to_string(i);
+    int fd = listenOn(path, port + i);
+    if (fd < 0)
+      return 1;
+    sockets.push_back(fd);
+    names.push_back(path.empty() ? "127.0.0.1:" + std::to_string(port + i) : path);
+  }
+
+  // a client that disconnects in the middle of a reply must not kill the instance
+  signal(SIGPIPE, SIG_IGN);
+
+  std::vector<pid_t> children;
+  for (unsigned i = 0; i < devices; ++i) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      break;
+    }
+    if (!pid) {
+      // the instances end with the server
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      return runInstance(i, sockets[i], *profile, blocks, i < images.size() ? images[i] : nullptr, names[i]);
+    }
+    children.push_back(pid);
+  }
+
+  // the server runs until it is interrupted or an instance failed, the others are stopped then
+  int status = 0;
+  pid_t failed = wait(&status);
+  for (pid_t pid : children) {
+    if (pid != failed)
+      kill(pid, SIGTERM);
+  }
+  while (wait(nullptr) > 0)
+    ;
+  return failed > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
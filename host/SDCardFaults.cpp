@@ -0,0 +1,100 @@
+#include "SDCardFaults.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char *const s_names[SDCardFaults::FAULT_KINDS] = {
+  "busy", "token", "crc-read", "crc-write", "flip", "remove",
+};
+
+SDCardFaults::SDCardFaults()
+  : m_armed(false)
+  , m_events()
+{}
+
+const char *SDCardFaults::name(Kind kind)
+{
+  return kind < FAULT_KINDS ? s_names[kind] : "?";
+}
+
+bool SDCardFaults::add(const char *spec)
+{
+  // defaults: once on the first event, a second of busy time, the idle bit of R1
+  Rule rule = { FAULT_KINDS, 1, 1, 0, 1000000000ull, 0x01 };
+  size_t length = strcspn(spec, ",");
+
+  for (uint8_t kind = 0; kind < FAULT_KINDS; ++kind) {
+    if (strlen(s_names[kind]) == length && !strncmp(spec, s_names[kind], length))
+      rule.kind = (Kind)kind;
+  }
+  if (rule.kind == FAULT_KINDS)
+    return false;
+  if (rule.kind == FAULT_TOKEN || rule.kind == FAULT_REMOVE)
+    rule.ns = 0;
+
+  for (spec += length; *spec == ','; ) {
+    const char *key = ++spec;
+    const char *value = strchr(key, '=');
+    char *end;
+    if (!value)
+      return false;
+    unsigned long long number = strtoull(++value, &end, 0);
+    if (end == value || (*end && *end != ','))
+      return false;
+
+    length = value - 1 - key;
+    if (length == 2 && !strncmp(key, "at", 2) && number)
+      rule.at = number;
+    else if (length == 5 && !strncmp(key, "count", 5) && number)
+      rule.count = number;
+    else if (length == 5 && !strncmp(key, "every", 5))
+      rule.every = number;
+    else if (length == 2 && !strncmp(key, "ms", 2))
+      rule.ns = number * 1000000ull;
+    else if (length == 4 && !strncmp(key, "mask", 4) && number <= 0xFF)
+      rule.mask = number;
+    else
+      return false;
+    spec = end;
+  }
+  if (*spec || (rule.every && rule.every < rule.count))
+    return false;
+  m_rules.push_back(rule);
+  return true;
+}
+
+void SDCardFaults::clear()
+{
+  m_rules.clear();
+  m_armed = false;
+}
+
+void SDCardFaults::arm(bool armed)
+{
+  if (armed && !m_armed) {
+    memset(m_events, 0, sizeof(m_events));
+    m_times.clear();
+  }
+  m_armed = armed;
+}
+
+const SDCardFaults::Rule *SDCardFaults::fire(Kind kind, uint64_t now_ns)
+{
+  if (!m_armed)
+    return nullptr;
+
+  uint64_t event = ++m_events[kind];
+  for (const Rule &rule : m_rules) {
+    if (rule.kind != kind || event < rule.at)
+      continue;
+    uint64_t offset = event - rule.at;
+    if (rule.every)
+      offset %= rule.every;
+    if (offset >= rule.count)
+      continue;
+
+    m_times.push_back(now_ns);
+    return &rule;
+  }
+  return nullptr;
+}
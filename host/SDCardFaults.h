@@ -0,0 +1,71 @@
+#ifndef SDCARDFAULTS_H
+#define SDCARDFAULTS_H
+
+#include <stdint.h>
+
+#include <vector>
+
+// Scripted faults of the SD card model at the SPI bus. A rule names the kind of fault and the
+// events it fires on, the model asks the rules at the point of the bus transfer where the fault
+// shows up. Rules are written as "KIND[,at=N][,count=N][,every=N][,ms=N][,mask=N]":
+//
+//   busy       the card stays busy for ms after a written block (stuck busy, garbage collection)
+//   token      the data start token of a read block comes ms late, never with ms=0
+//   crc-read   a bit of a read block is flipped, its CRC is that of the original data
+//   crc-write  a written block is rejected with a CRC error data response
+//   flip       the R1 response of a command is XORed with mask, by default the idle bit 0x01
+//   remove     the card is pulled in the middle of a data block and inserted again ms later,
+//              it stays out with ms=0
+//
+// A rule fires on the events at, at+1, ... at+count-1 of its kind, counted from 1 since the faults
+// were armed, and again every "every" events if that is not 0. The events are the written blocks for
+// busy and crc-write, the read blocks for token and crc-read, the commands for flip and the data
+// blocks in either direction for remove.
+class SDCardFaults {
+public:
+  enum Kind {
+    FAULT_BUSY,
+    FAULT_TOKEN,
+    FAULT_CRC_READ,
+    FAULT_CRC_WRITE,
+    FAULT_FLIP,
+    FAULT_REMOVE,
+    FAULT_KINDS,
+  };
+
+  struct Rule {
+    Kind kind;
+    uint32_t at;
+    uint32_t count;
+    uint32_t every;
+    uint64_t ns;
+    uint8_t mask;
+  };
+
+  SDCardFaults();
+
+  // adds a rule, returns false if it can't be parsed
+  bool add(const char *spec);
+  void clear();
+
+  // events are only counted and faults only fire while the faults are armed, arming them starts
+  // the counts and the statistics over
+  void arm(bool armed);
+  bool armed() const { return m_armed; }
+
+  // called by the card model for every event of a kind, returns the rule that fires or nullptr
+  const Rule *fire(Kind kind, uint64_t now_ns);
+
+  // virtual times the faults fired at since they were armed
+  const std::vector<uint64_t> &times() const { return m_times; }
+
+  static const char *name(Kind kind);
+
+private:
+  std::vector<Rule> m_rules;
+  bool m_armed;
+  uint64_t m_events[FAULT_KINDS];
+  std::vector<uint64_t> m_times;
+};
+
+#endif // SDCARDFAULTS_H
@@ -0,0 +1,527 @@
+#include "SDCardModel.h"
+
+#include <string.h>
+
+#include <util/crc16.h>
+
+#include "SDCardFaults.h"
+
+// the latencies are rough figures of real cards, measured on the card reader with SDCARD_DRIVER_PROFILE,
+// except "cheap", a card that programs a write outside of its open AUs with a read-modify-write
+// of the whole 4 MiB AU like many no-name cards
+const SDCardProfile SDCardProfile::s_profiles[] = {
+  // name       init        token      busy        gc   gc stall    AU    AU switch
+  { "ideal",            0,        0,         0,    0,          0,    0,          0 },
+  { "class10",  100000000,   250000,    700000,  256,   50000000,    0,          0 },
+  { "class4",   300000000,   800000,   2000000,   64,  150000000,    0,          0 },
+  { "worn",     500000000,  1500000,   4000000,   16,  250000000,    0,          0 },
+  { "cheap",    200000000,   500000,   1000000,    0,          0, 8192,   30000000 },
+  { nullptr, 0, 0, 0, 0, 0, 0, 0 },
+};
+
+const SDCardProfile *SDCardProfile::find(const char *name)
+{
+  for (const SDCardProfile *profile = s_profiles; profile->name; ++profile) {
+    if (!strcmp(profile->name, name))
+      return profile;
+  }
+  return nullptr;
+}
+
+enum {
+  R1_IDLE_STATE = 0x01,
+  R1_ILLEGAL_COMMAND = 0x04,
+  R1_ADDRESS_ERROR = 0x20,
+  DATA_START_BLOCK = 0xFE,
+  WRITE_MULTIPLE_TOKEN = 0xFC,
+  STOP_TRAN_TOKEN = 0xFD,
+  DATA_RES_ACCEPTED = 0x05,
+  DATA_RES_CRC_ERROR = 0x0B,
+};
+
+SDCardModel::SDCardModel(uint32_t blocks, bool high_capacity)
+  : m_blocks(blocks)
+  , m_high_capacity(high_capacity)
+  , m_serial(0x12345678)
+  , m_erased_byte(0x00)
+  , m_profile(SDCardProfile::s_profiles[0])
+  , m_counters()
+  , m_faults(nullptr)
+  , m_image(nullptr)
+  , m_inserted(true)
+  , m_selected(false)
+  , m_idle(true)
+  , m_app_command(false)
+  , m_ready_ns(0)
+  , m_state(STATE_COMMAND)
+  , m_frame_length(0)
+  , m_busy_until_ns(0)
+  , m_response_mask(0)
+  , m_block_offset(0)
+  , m_block_length(0)
+  , m_block_ready_ns(0)
+  , m_block_address(0)
+  , m_multiple(false)
+  , m_writes_since_gc(0)
+  , m_erase_first(UINT32_MAX)
+  , m_erase_last(UINT32_MAX)
+  , m_open_au{ UINT32_MAX, UINT32_MAX }
+  , m_remove_offset(UINT16_MAX)
+  , m_reinsert_ns(0)
+{}
+
+SDCardModel::~SDCardModel()
+{
+  if (m_image)
+    fclose(m_image);
+}
+
+bool SDCardModel::openImage(const char *path)
+{
+  FILE *image = fopen(path, "r+b");
+  if (!image || fseeko(image, 0, SEEK_END)) {
+    if (image)
+      fclose(image);
+    return false;
+  }
+  if (m_image)
+    fclose(m_image);
+  m_image = image;
+  m_blocks = ftello(image) / 512;
+  m_memory.clear();
+  return true;
+}
+
+void SDCardModel::setInserted(bool inserted)
+{
+  // a removed card loses its state and has to be initialized again
+  m_inserted = inserted;
+  m_idle = true;
+  m_app_command = false;
+  m_state = STATE_COMMAND;
+  m_frame_length = 0;
+  m_out.clear();
+  m_remove_offset = UINT16_MAX;
+  m_reinsert_ns = 0;
+}
+
+void SDCardModel::readData(uint32_t block, uint8_t *data)
+{
+  if (m_image) {
+    if (fseeko(m_image, (off_t)block * 512, SEEK_SET) || fread(data, 512, 1, m_image) != 1)
+      memset(data, 0, 512);
+    return;
+  }
+  auto it = m_memory.find(block);
+  if (it == m_memory.end())
+    memset(data, 0, 512);
+  else
+    memcpy(data, it->second.data(), 512);
+}
+
+void SDCardModel::writeData(uint32_t block, const uint8_t *data)
+{
+  if (m_image) {
+    if (!fseeko(m_image, (off_t)block * 512, SEEK_SET))
+      fwrite(data, 512, 1, m_image);
+    return;
+  }
+  m_memory[block].assign(data, data + 512);
+}
+
+void SDCardModel::select(bool selected)
+{
+  m_selected = selected;
+  m_frame_length = 0;
+}
+
+uint8_t SDCardModel::transfer(uint8_t in, uint64_t now_ns)
+{
+  // a card pulled by a fault is inserted again after the scripted time
+  if (!m_inserted && m_reinsert_ns && now_ns >= m_reinsert_ns)
+    setInserted(true);
+
+  // a deselected or missing card leaves MISO to the pull-up
+  if (!m_inserted || !m_selected)
+    return 0xFF;
+
+  switch (m_state) {
+  case STATE_WRITE_DATA:
+    if (m_block_offset == m_remove_offset) {
+      pull();
+      return 0xFF;
+    }
+    m_block[m_block_offset++] = in;
+    if (m_block_offset == 512 + 2)
+      endWrite(now_ns);
+    return 0xFF;
+
+  case STATE_WRITE_TOKEN:
+    if (in == (m_multiple ? WRITE_MULTIPLE_TOKEN : DATA_START_BLOCK)) {
+      m_state = STATE_WRITE_DATA;
+      m_block_offset = 0;
+      startDataBlock(now_ns);
+      return 0xFF;
+    }
+    if (in == STOP_TRAN_TOKEN && m_multiple) {
+      // one byte before the card signals busy
+      m_state = STATE_COMMAND;
+      m_out.push_back(0xFF);
+      return 0xFF;
+    }
+    // a command aborts the write
+    // fall through
+  default:
+    if (m_frame_length || (in & 0xC0) == 0x40) {
+      m_frame[m_frame_length++] = in;
+      if (m_frame_length == sizeof(m_frame)) {
+        m_frame_length = 0;
+        command(m_frame[0] & 0x3F, (uint32_t)m_frame[1] << 24 | (uint32_t)m_frame[2] << 16 |
+                (uint32_t)m_frame[3] << 8 | m_frame[4], now_ns);
+      }
+    }
+    break;
+  }
+
+  if (!m_out.empty()) {
+    uint8_t out = m_out.front();
+    m_out.pop_front();
+    return out;
+  }
+  if (now_ns < m_busy_until_ns)
+    return 0x00;
+  if (m_state != STATE_READ || now_ns < m_block_ready_ns)
+    return 0xFF;
+  if (m_block_offset == m_remove_offset) {
+    pull();
+    return 0xFF;
+  }
+
+  uint8_t out = m_block[m_block_offset++];
+  if (m_block_offset == m_block_length) {
+    if (m_multiple && m_block_address + 1 < m_blocks)
+      loadBlock(m_block_address + 1, now_ns);
+    else
+      m_state = STATE_COMMAND;
+  }
+  return out;
+}
+
+void SDCardModel::command(uint8_t cmd, uint32_t arg, uint64_t now_ns)
+{
+  bool app_command = m_app_command;
+  uint32_t block;
+
+  ++m_counters.commands;
+  m_app_command = false;
+  m_out.clear();
+  m_remove_offset = UINT16_MAX;
+
+  const SDCardFaults::Rule *flip = m_faults ? m_faults->fire(SDCardFaults::FAULT_FLIP, now_ns) : nullptr;
+  m_response_mask = flip ? flip->mask : 0;
+
+  // CMD12 stops a multi-block read, any other command aborts a transfer
+  if (cmd == 12) {
+    m_out.push_back(0xFF); // stuff byte
+    respond(m_state == STATE_READ ? 0x00 : R1_ILLEGAL_COMMAND);
+    m_state = STATE_COMMAND;
+    return;
+  }
+  m_state = STATE_COMMAND;
+
+  if (app_command) {
+    switch (cmd) {
+    case 41: // SD_SEND_OP_COND
+      if (m_idle && now_ns >= m_ready_ns)
+        m_idle = false;
+      respond(r1());
+      return;
+    case 23: // SET_WR_BLK_ERASE_COUNT
+      respond(r1());
+      return;
+    case 13: // SD_STATUS, R2 and a 64 byte data block
+    case 51: // SEND_SCR, R1 and an 8 byte data block
+      respond(r1());
+      if (cmd == 13)
+        m_out.push_back(0x00);
+      buildRegister(cmd);
+      m_state = STATE_READ;
+      m_multiple = false;
+      m_block_offset = 0;
+      m_block_ready_ns = now_ns + m_profile.token_ns;
+      return;
+    }
+    respond(r1() | R1_ILLEGAL_COMMAND);
+    return;
+  }
+
+  switch (cmd) {
+  case 0: // GO_IDLE_STATE
+    m_idle = true;
+    m_ready_ns = now_ns + m_profile.init_ns;
+    respond(R1_IDLE_STATE);
+    break;
+  case 8: // SEND_IF_COND, R7 echoes the voltage and the check pattern
+    respond(r1());
+    m_out.push_back(0x00);
+    m_out.push_back(0x00);
+    m_out.push_back(arg >> 8 & 0x0F);
+    m_out.push_back(arg & 0xFF);
+    break;
+  case 9: // SEND_CSD
+  case 10: // SEND_CID
+    respond(r1());
+    buildRegister(cmd);
+    m_state = STATE_READ;
+    m_multiple = false;
+    m_block_offset = 0;
+    m_block_ready_ns = now_ns + m_profile.token_ns;
+    break;
+  case 13: // SEND_STATUS, R2
+    respond(r1());
+    m_out.push_back(0x00);
+    break;
+  case 17: // READ_SINGLE_BLOCK
+  case 18: // READ_MULTIPLE_BLOCK
+    if (m_idle) {
+      respond(r1() | R1_ILLEGAL_COMMAND);
+    } else if (!validAddress(arg, &block)) {
+      respond(R1_ADDRESS_ERROR);
+    } else {
+      respond(0x00);
+      m_multiple = cmd == 18;
+      loadBlock(block, now_ns);
+    }
+    break;
+  case 24: // WRITE_BLOCK
+  case 25: // WRITE_MULTIPLE_BLOCK
+    if (m_idle) {
+      respond(r1() | R1_ILLEGAL_COMMAND);
+    } else if (!validAddress(arg, &block)) {
+      respond(R1_ADDRESS_ERROR);
+    } else {
+      respond(0x00);
+      m_multiple = cmd == 25;
+      m_block_address = block;
+      m_state = STATE_WRITE_TOKEN;
+    }
+    break;
+  case 32: // ERASE_WR_BLK_START_ADDR
+  case 33: // ERASE_WR_BLK_END_ADDR
+    if (m_idle) {
+      respond(r1() | R1_ILLEGAL_COMMAND);
+    } else if (!validAddress(arg, &block)) {
+      respond(R1_ADDRESS_ERROR);
+    } else {
+      respond(0x00);
+      if (cmd == 32)
+        m_erase_first = block;
+      else
+        m_erase_last = block;
+    }
+    break;
+  case 38: // ERASE, R1b
+    if (m_idle || m_erase_first > m_erase_last || m_erase_last >= m_blocks) {
+      respond(r1() | R1_ILLEGAL_COMMAND);
+    } else {
+      respond(0x00);
+      erase(now_ns);
+    }
+    m_erase_first = m_erase_last = UINT32_MAX;
+    break;
+  case 55: // APP_CMD
+    m_app_command = true;
+    respond(r1());
+    break;
+  case 58: // READ_OCR, R3 with the power up status and the card capacity status
+    respond(r1());
+    m_out.push_back(m_idle ? 0x00 : (m_high_capacity ? 0xC0 : 0x80));
+    m_out.push_back(0xFF);
+    m_out.push_back(0x80);
+    m_out.push_back(0x00);
+    break;
+  default:
+    respond(r1() | R1_ILLEGAL_COMMAND);
+    break;
+  }
+}
+
+void SDCardModel::loadBlock(uint32_t block, uint64_t now_ns)
+{
+  uint16_t crc = 0;
+
+  m_block[0] = DATA_START_BLOCK;
+  readData(block, &m_block[1]);
+  for (uint16_t i = 1; i <= 512; ++i)
+    crc = _crc_xmodem_update(crc, m_block[i]);
+  m_block[513] = crc >> 8;
+  m_block[514] = crc & 0xFF;
+
+  m_state = STATE_READ;
+  m_block_address = block;
+  m_block_offset = 0;
+  m_block_length = 515;
+  m_block_ready_ns = now_ns + m_profile.token_ns;
+  ++m_counters.blocks_read;
+
+  if (m_faults) {
+    // the CRC was taken before the bit flipped, as if it flipped on the bus
+    if (m_faults->fire(SDCardFaults::FAULT_CRC_READ, now_ns))
+      m_block[1 + block % 512] ^= 0x10;
+    const SDCardFaults::Rule *late = m_faults->fire(SDCardFaults::FAULT_TOKEN, now_ns);
+    if (late)
+      m_block_ready_ns = late->ns ? m_block_ready_ns + late->ns : UINT64_MAX;
+  }
+  startDataBlock(now_ns);
+}
+
+void SDCardModel::endWrite(uint64_t now_ns)
+{
+  uint64_t busy_ns = m_profile.busy_ns;
+
+  // the CRC is not checked, the driver doesn't enable CRCs, but a fault can reject the block
+  // like a CRC mismatch. A multiple block write then waits for the stop token.
+  if (m_faults && m_faults->fire(SDCardFaults::FAULT_CRC_WRITE, now_ns)) {
+    m_out.push_back(DATA_RES_CRC_ERROR);
+    m_state = m_multiple ? STATE_WRITE_TOKEN : STATE_COMMAND;
+    return;
+  }
+  writeData(m_block_address, m_block);
+  ++m_counters.blocks_written;
+
+  if (m_profile.gc_interval && ++m_writes_since_gc >= m_profile.gc_interval) {
+    m_writes_since_gc = 0;
+    busy_ns += m_profile.gc_stall_ns;
+    ++m_counters.gc_stalls;
+  }
+
+  if (m_profile.au_blocks) {
+    uint32_t au = m_block_address / m_profile.au_blocks;
+    if (au != m_open_au[0]) {
+      if (au != m_open_au[1]) {
+        busy_ns += m_profile.au_switch_ns;
+        ++m_counters.au_switches;
+      }
+      m_open_au[1] = m_open_au[0];
+      m_open_au[0] = au;
+    }
+  }
+
+  const SDCardFaults::Rule *stall = m_faults ? m_faults->fire(SDCardFaults::FAULT_BUSY, now_ns) : nullptr;
+  if (stall)
+    busy_ns += stall->ns;
+
+  m_out.push_back(DATA_RES_ACCEPTED);
+  m_busy_until_ns = now_ns + busy_ns;
+
+  if (m_multiple && m_block_address + 1 < m_blocks) {
+    ++m_block_address;
+    m_state = STATE_WRITE_TOKEN;
+  } else {
+    m_state = STATE_COMMAND;
+  }
+}
+
+void SDCardModel::erase(uint64_t now_ns)
+{
+  uint8_t erased[512];
+
+  // the card only marks the blocks as erased, which takes about as long as programming a block
+  memset(erased, m_erased_byte, sizeof(erased));
+  for (uint32_t block = m_erase_first; block <= m_erase_last; ++block) {
+    if (m_image || m_erased_byte)
+      writeData(block, erased);
+    else
+      m_memory.erase(block);
+  }
+  m_counters.blocks_erased += m_erase_last - m_erase_first + 1;
+  m_busy_until_ns = now_ns + m_profile.busy_ns;
+}
+
+void SDCardModel::startDataBlock(uint64_t now_ns)
+{
+  // a card pulled by a fault drops off in the middle of the data bytes
+  const SDCardFaults::Rule *remove = m_faults ? m_faults->fire(SDCardFaults::FAULT_REMOVE, now_ns) : nullptr;
+  m_remove_offset = remove ? 256 : UINT16_MAX;
+  m_reinsert_ns = remove && remove->ns ? now_ns + remove->ns : 0;
+}
+
+void SDCardModel::pull()
+{
+  uint64_t reinsert_ns = m_reinsert_ns;
+  setInserted(false);
+  m_reinsert_ns = reinsert_ns;
+}
+
+bool SDCardModel::validAddress(uint32_t arg, uint32_t *block) const
+{
+  // standard capacity cards use byte addresses
+  if (!m_high_capacity) {
+    if (arg & 0x1FF)
+      return false;
+    arg >>= 9;
+  }
+  *block = arg;
+  return arg < m_blocks;
+}
+
+void SDCardModel::buildRegister(uint8_t cmd)
+{
+  uint8_t *reg = &m_block[1];
+  uint8_t length = cmd == 13 ? 64 : cmd == 51 ? 8 : 16;
+  uint16_t crc = 0;
+
+  memset(reg, 0, length);
+  if (cmd == 13) {
+    // SD Status: speed class 10, AU_SIZE and one AU per erase with 1 s timeout. AU_SIZE is
+    // 16 KiB << (code - 1) up to 4 MiB, which is also reported for cards that don't model AUs
+    uint32_t au_blocks = m_profile.au_blocks ? m_profile.au_blocks : 8192;
+    uint8_t au_code = 1;
+    while (au_code < 9 && (32u << (au_code - 1)) < au_blocks)
+      ++au_code;
+    reg[8] = 0x04;
+    reg[10] = au_code << 4;
+    reg[12] = 0x01;
+    reg[13] = 0x01 << 2;
+  } else if (cmd == 51) {
+    // SCR: version 1.0, SD spec 2.0, DATA_STAT_AFTER_ERASE, bus widths 1 and 4
+    reg[0] = 0x02;
+    reg[1] = (m_erased_byte ? 0x80 : 0x00) | 0x05;
+  } else if (cmd == 10) {
+    // CID: manufacturer, OEM "SD", product "SIMUL", revision 1.0, serial number
+    reg[0] = 0x03;
+    memcpy(&reg[1], "SDSIMUL", 7);
+    reg[8] = 0x10;
+    reg[9] = m_serial >> 24;
+    reg[10] = m_serial >> 16;
+    reg[11] = m_serial >> 8;
+    reg[12] = m_serial;
+    reg[14] = 0x01;
+  } else if (m_high_capacity) {
+    // CSD version 2.0, capacity (C_SIZE + 1) * 512 KiB
+    uint32_t c_size = m_blocks / 1024 - 1;
+    reg[0] = 0x40;
+    reg[5] = 0x59;
+    reg[7] = (c_size >> 16) & 0x3F;
+    reg[8] = c_size >> 8;
+    reg[9] = c_size;
+  } else {
+    // CSD version 1.0 with 512 byte blocks and C_SIZE_MULT 7, capacity (C_SIZE + 1) * 256 KiB
+    uint32_t c_size = m_blocks / 512 - 1;
+    reg[5] = 0x59;
+    reg[6] = (c_size >> 10) & 0x03;
+    reg[7] = c_size >> 2;
+    reg[8] = (c_size & 0x03) << 6;
+    reg[9] = 0x03;
+    reg[10] = 0x80;
+  }
+  if (cmd == 9 || cmd == 10)
+    reg[15] = 0x01;
+
+  m_block[0] = DATA_START_BLOCK;
+  for (uint8_t i = 0; i < length; ++i)
+    crc = _crc_xmodem_update(crc, reg[i]);
+  m_block[length + 1] = crc >> 8;
+  m_block[length + 2] = crc & 0xFF;
+  m_block_length = length + 3;
+}
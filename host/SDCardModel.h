@@ -0,0 +1,134 @@
+#ifndef SDCARDMODEL_H
+#define SDCARDMODEL_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+class SDCardFaults;
+
+// Latencies of a card model, all times in nanoseconds of the virtual clock.
+struct SDCardProfile {
+  const char *name;
+  uint64_t init_ns;        // from CMD0 until ACMD41 reports the card as ready
+  uint64_t token_ns;       // from a read command or the end of a block until the data start token
+  uint64_t busy_ns;        // programming time of a written block
+  uint32_t gc_interval;    // every gc_interval written blocks the card stalls, 0 for never
+  uint64_t gc_stall_ns;    // additional busy time of a garbage collection stall
+  uint32_t au_blocks;      // size of an allocation unit, 0 if writes don't depend on the address
+  uint64_t au_switch_ns;   // additional busy time of a write outside of the open allocation units
+
+  static const SDCardProfile *find(const char *name);
+  static const SDCardProfile s_profiles[];
+};
+
+// Model of an SD card in SPI mode, driven one byte at a time by the SPI shim. Implements
+// CMD0/8/9/10/12/13/17/18/24/25/32/33/38/55/58 and ACMD13/23/41/51 with byte or block addressing.
+// The data is kept in memory, or in an image file if one is opened. Scripted faults, see
+// SDCardFaults.h, change the bytes the card sends at the point where they show up on the bus.
+class SDCardModel {
+public:
+  explicit SDCardModel(uint32_t blocks, bool high_capacity = true);
+  ~SDCardModel();
+
+  // uses an image file as the card data, the size of the card is taken from the file
+  bool openImage(const char *path);
+
+  void setProfile(const SDCardProfile &profile) { m_profile = profile; }
+  const SDCardProfile &profile() const { return m_profile; }
+  void setSerialNumber(uint32_t serial) { m_serial = serial; }
+  // byte that erased blocks read as, 0x00 or 0xFF, reported in DATA_STAT_AFTER_ERASE of the SCR
+  void setErasedByte(uint8_t value) { m_erased_byte = value; }
+  void setInserted(bool inserted);
+  bool inserted() const { return m_inserted; }
+  void setFaults(SDCardFaults *faults) { m_faults = faults; }
+
+  uint32_t blocks() const { return m_blocks; }
+  void readData(uint32_t block, uint8_t *data);
+  void writeData(uint32_t block, const uint8_t *data);
+
+  // SPI bus interface
+  void select(bool selected);
+  uint8_t transfer(uint8_t in, uint64_t now_ns);
+
+  struct Counters {
+    uint64_t commands;
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+    uint64_t blocks_erased;
+    uint64_t gc_stalls;
+    uint64_t au_switches;
+  };
+  const Counters &counters() const { return m_counters; }
+
+private:
+  enum State {
+    STATE_COMMAND,      // waiting for a command
+    STATE_READ,         // streaming data blocks of CMD17/CMD18
+    STATE_WRITE_TOKEN,  // waiting for the data token of CMD24/CMD25
+    STATE_WRITE_DATA,   // receiving a data block and its CRC
+  };
+
+  void command(uint8_t cmd, uint32_t arg, uint64_t now_ns);
+  void respond(uint8_t r1) { m_out.push_back(0xFF); m_out.push_back(r1 ^ m_response_mask); }
+  void startRead(uint32_t block, uint64_t now_ns);
+  void loadBlock(uint32_t block, uint64_t now_ns);
+  void endWrite(uint64_t now_ns);
+  void erase(uint64_t now_ns);
+  void startDataBlock(uint64_t now_ns);
+  void pull();
+  bool validAddress(uint32_t arg, uint32_t *block) const;
+  void buildRegister(uint8_t cmd);
+  uint8_t r1() const { return m_idle ? 0x01 : 0x00; }
+
+  uint32_t m_blocks;
+  bool m_high_capacity;
+  uint32_t m_serial;
+  uint8_t m_erased_byte;
+  SDCardProfile m_profile;
+  Counters m_counters;
+  SDCardFaults *m_faults;
+
+  std::unordered_map<uint32_t, std::vector<uint8_t> > m_memory;
+  FILE *m_image;
+
+  bool m_inserted;
+  bool m_selected;
+  bool m_idle;
+  bool m_app_command;
+  uint64_t m_ready_ns;      // end of the initialization after CMD0
+
+  State m_state;
+  uint8_t m_frame[6];
+  uint8_t m_frame_length;
+  std::deque<uint8_t> m_out;
+  uint64_t m_busy_until_ns;
+  uint8_t m_response_mask;   // bits of the R1 response flipped by a fault
+
+  // data block transfer, token + 512 bytes + CRC
+  uint8_t m_block[515];
+  uint16_t m_block_offset;
+  uint16_t m_block_length;
+  uint64_t m_block_ready_ns;
+  uint32_t m_block_address;
+  bool m_multiple;
+  uint32_t m_writes_since_gc;
+
+  // blocks selected by CMD32 and CMD33 for CMD38
+  uint32_t m_erase_first;
+  uint32_t m_erase_last;
+
+  // the card keeps the two most recently written allocation units open, most recent first
+  uint32_t m_open_au[2];
+
+  // a card pulled by a fault drops off the bus at this offset of the data block and comes back
+  // at m_reinsert_ns, never if it is 0
+  uint16_t m_remove_offset;
+  uint64_t m_reinsert_ns;
+};
+
+#endif // SDCARDMODEL_H
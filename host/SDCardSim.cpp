@@ -0,0 +1,235 @@
+// Runs the card driver against the SD card model and reports the throughput in virtual time.
+//
+//   make sdsim
+//   ./sdsim --profile class10 --count 2048
+//
+// Every test checks the data it reads back, the exit code is non-zero if a transfer failed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <Arduino.h>
+
+#include "../SDCardDriver.h"
+#include "HostArduino.h"
+#include "SDCardModel.h"
+
+static SDCardDriver s_driver;
+static SDCardModel *s_card;
+static uint8_t s_buffer[512];
+
+static void fillPattern(uint32_t block, uint8_t *data)
+{
+  for (uint16_t i = 0; i < 512; ++i)
+    data[i] = (uint8_t)(block * 7 + i);
+}
+
+static bool checkPattern(uint32_t block, const uint8_t *data)
+{
+  uint8_t expected[512];
+  fillPattern(block, expected);
+  return !memcmp(expected, data, sizeof(expected));
+}
+
+static uint32_t randomBlock(uint32_t range)
+{
+  static uint32_t state = 0x2545F491;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state % range;
+}
+
+struct Result {
+  const char *name;
+  uint32_t blocks;
+  uint64_t ns;
+  bool passed;
+};
+
+static void report(const Result &result)
+{
+  double seconds = result.ns / 1e9;
+  printf("%-24s %8u blocks %10.3f ms %9.1f KiB/s  %s\n", result.name, result.blocks, seconds * 1e3,
+         seconds > 0 ? result.blocks / 2.0 / seconds : 0.0, result.passed ? "ok" : "FAILED");
+}
+
+static Result writeSequential(uint32_t count)
+{
+  Result result = { "write single", count, HostArduino_Now(), true };
+  for (uint32_t block = 0; block < count && result.passed; ++block) {
+    fillPattern(block, s_buffer);
+    result.passed = s_driver.writeBlock(block, s_buffer) && s_driver.writeDone();
+  }
+  result.ns = HostArduino_Now() - result.ns;
+  return result;
+}
+
+static Result writeMultiple(uint32_t first, uint32_t count)
+{
+  Result result = { "write multiple", count, HostArduino_Now(), s_driver.writeMultipleStart(first, count) };
+  for (uint32_t block = first; block < first + count && result.passed; ++block) {
+    fillPattern(block, s_buffer);
+    result.passed = s_driver.writeMultipleData(s_buffer);
+  }
+  result.passed = result.passed && s_driver.writeMultipleStop();
+  result.ns = HostArduino_Now() - result.ns;
+  return result;
+}
+
+static Result readSequential(uint32_t count)
+{
+  Result result = { "read single", count, HostArduino_Now(), true };
+  for (uint32_t block = 0; block < count && result.passed; ++block)
+    result.passed = s_driver.readBlock(block, s_buffer) && checkPattern(block, s_buffer);
+  result.ns = HostArduino_Now() - result.ns;
+  return result;
+}
+
+static Result readRandom(uint32_t count, uint32_t range)
+{
+  Result result = { "read random", count, HostArduino_Now(), true };
+  for (uint32_t i = 0; i < count && result.passed; ++i) {
+    uint32_t block = randomBlock(range);
+    result.passed = s_driver.readBlock(block, s_buffer) && checkPattern(block, s_buffer);
+  }
+  result.ns = HostArduino_Now() - result.ns;
+  return result;
+}
+
+static Result verifyMultiple(uint32_t count)
+{
+  uint32_t failed_block;
+  Result result = { "verify multiple", count, HostArduino_Now(), s_driver.verifyBlocks(0, count, &failed_block) };
+  result.ns = HostArduino_Now() - result.ns;
+  return result;
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --profile NAME      latency profile: ideal, class10, class4, worn, cheap (default class10)\n"
+          "  --image FILE        use an image file as card data instead of memory\n"
+          "  --blocks N          card size in 512 byte blocks (default 7744512)\n"
+          "  --sdsc              standard capacity card with byte addresses\n"
+          "  --count N           blocks transferred by every test (default 1024)\n"
+          "  --token-us N        override the delay of the data start token\n"
+          "  --busy-us N         override the programming time of a block\n"
+          "  --gc-interval N     override the number of written blocks between stalls\n"
+          "  --gc-stall-us N     override the duration of a stall\n"
+          "  --spi-overhead-ns N CPU time per SPI byte in addition to the SPI clock (default 250)\n",
+          program);
+}
+
+int main(int argc, char **argv)
+{
+  const SDCardProfile *profile = SDCardProfile::find("class10");
+  SDCardProfile overrides;
+  const char *image = nullptr;
+  uint32_t blocks = 7744512;
+  uint32_t count = 1024;
+  bool high_capacity = true;
+  long long token_us = -1, busy_us = -1, gc_interval = -1, gc_stall_us = -1;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (!strcmp(arg, "--sdsc")) {
+      high_capacity = false;
+      continue;
+    }
+    if (!value) {
+      usage(argv[0]);
+      return 2;
+    }
+    ++i;
+    if (!strcmp(arg, "--profile")) {
+      if (!(profile = SDCardProfile::find(value))) {
+        fprintf(stderr, "Unknown profile %s\n", value);
+        return 2;
+      }
+    } else if (!strcmp(arg, "--image")) {
+      image = value;
+    } else if (!strcmp(arg, "--blocks")) {
+      blocks = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--count")) {
+      count = strtoul(value, nullptr, 0);
+    } else if (!strcmp(arg, "--token-us")) {
+      token_us = strtoll(value, nullptr, 0);
+    } else if (!strcmp(arg, "--busy-us")) {
+      busy_us = strtoll(value, nullptr, 0);
+    } else if (!strcmp(arg, "--gc-interval")) {
+      gc_interval = strtoll(value, nullptr, 0);
+    } else if (!strcmp(arg, "--gc-stall-us")) {
+      gc_stall_us = strtoll(value, nullptr, 0);
+    } else if (!strcmp(arg, "--spi-overhead-ns")) {
+      HostArduino_SetSpiOverhead(strtoull(value, nullptr, 0));
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  overrides = *profile;
+  if (token_us >= 0)
+    overrides.token_ns = token_us * 1000;
+  if (busy_us >= 0)
+    overrides.busy_ns = busy_us * 1000;
+  if (gc_interval >= 0)
+    overrides.gc_interval = gc_interval;
+  if (gc_stall_us >= 0)
+    overrides.gc_stall_ns = gc_stall_us * 1000;
+
+  SDCardModel card(blocks, high_capacity);
+  if (image && !card.openImage(image)) {
+    perror(image);
+    return 1;
+  }
+  if (card.blocks() < 2 * count) {
+    fprintf(stderr, "The card needs at least %u blocks\n", 2 * count);
+    return 1;
+  }
+  card.setProfile(overrides);
+  s_card = &card;
+  HostArduino_AttachCard(&card, SS);
+
+  printf("Profile %s: token %llu us, busy %llu us, stall %llu us every %u blocks\n", overrides.name,
+         (unsigned long long)overrides.token_ns / 1000, (unsigned long long)overrides.busy_ns / 1000,
+         (unsigned long long)overrides.gc_stall_ns / 1000, overrides.gc_interval);
+
+  uint64_t start = HostArduino_Now();
+  if (!s_driver.init(SS)) {
+    fprintf(stderr, "Card initialization failed\n");
+    return 1;
+  }
+  printf("%-24s %10.3f ms, type %d\n", "init", (HostArduino_Now() - start) / 1e6, s_driver.type());
+
+  uint32_t capacity_blocks = s_driver.readCapacity();
+  if (capacity_blocks != (card.blocks() & (high_capacity ? ~1023u : ~511u))) {
+    fprintf(stderr, "Capacity mismatch: driver %u blocks, card %u blocks\n", capacity_blocks, card.blocks());
+    return 1;
+  }
+
+  Result results[] = {
+    writeSequential(count),
+    writeMultiple(count, count),
+    readSequential(2 * count),
+    verifyMultiple(2 * count),
+    readRandom(count, 2 * count),
+  };
+
+  bool passed = true;
+  for (const Result &result : results) {
+    report(result);
+    passed = passed && result.passed;
+  }
+
+  const SDCardModel::Counters &counters = s_card->counters();
+  printf("Card: %llu commands, %llu blocks read, %llu blocks written, %llu stalls, %llu AU switches\n",
+         (unsigned long long)counters.commands, (unsigned long long)counters.blocks_read,
+         (unsigned long long)counters.blocks_written, (unsigned long long)counters.gc_stalls,
+         (unsigned long long)counters.au_switches);
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,497 @@
+/** \file
+ *
+ *  Host side formatter that aligns the file system to the allocation units (AU) of the card. A card erases and
+ *  programs whole AUs, a FAT sector or a cluster that straddles two of them makes every update touch both, and
+ *  the data region starting in the middle of an AU makes every aligned write of the host unaligned on the card.
+ *  The layout follows the SD Association's file system specification: an MBR in the first AU, the partition
+ *  starts at the second AU, FAT32 moves the end of its reserved sectors so that the first cluster starts on an
+ *  AU boundary, exFAT starts the FAT and the cluster heap on AU boundaries. The clusters are 32 KiB (FAT32) or
+ *  128 KiB (exFAT above 32 GiB), so they never cross an AU either.
+ *
+ *  The AU size is taken from the SD Status of the card, which the firmware returns together with the CSD and
+ *  the CID with the vendor specific command 0xC1, see SDCardManager_ReadRegisters(). The partition covers the
+ *  medium as the host sees it, without the blocks the firmware reserves at the end of the card. Firmware built
+ *  with SDCARD_LOGICAL_BLOCK_SIZE 4096 needs --sector-size 4096, the file system sectors are the logical blocks.
+ *
+ *  Build with:  make SDFormat
+ *
+ *  Read the registers of the card reader and format it with FAT32, or exFAT above 32 GiB:
+ *    sg_raw -r 96 -o registers.bin /dev/sdX c1 00 00 00 00 00 00 00 60 00
+ *    ./SDFormat --registers registers.bin /dev/sdX
+ *
+ *  Format an image file for a card with 4 MiB AUs:
+ *    truncate -s 1G card.img && ./SDFormat --au-size 4096 --label LOGGER card.img
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+// logical sector size of the device, 4096 for firmware built with SDCARD_LOGICAL_BLOCK_SIZE 4096
+uint32_t s_sector_size = 512;
+
+// SDCARD_REGISTERS_LENGTH, the 16 byte CSD, the 16 byte CID and the 64 byte SD Status
+const uint32_t kRegistersLength = 96;
+
+// AU_SIZE of the SD Status in KiB, the codes above 4 MiB are only defined for SDXC cards
+const uint32_t kAuSizes[16] = {
+  0, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 12288, 16384, 24576, 32768, 65536,
+};
+
+struct Geometry
+{
+  uint64_t card_bytes = 0;    // capacity in the CSD, 0 if unknown
+  uint32_t au_kib = 0;
+  uint32_t erase_aus = 0;     // AUs erased in one ERASE_TIMEOUT, 0 if not supported
+};
+
+struct Layout
+{
+  bool exfat;
+  uint32_t start;             // first sector of the partition
+  uint32_t sectors;           // sectors of the partition
+  uint32_t reserved;          // FAT32: reserved sectors, exFAT: FatOffset
+  uint32_t fat_sectors;
+  uint32_t data;              // first sector of cluster 2, relative to the partition
+  uint32_t cluster_sectors;
+  uint32_t clusters;
+};
+
+void put16(uint8_t *data, uint16_t value)
+{
+  data[0] = value;
+  data[1] = value >> 8;
+}
+
+void put32(uint8_t *data, uint32_t value)
+{
+  put16(data, value);
+  put16(data + 2, value >> 16);
+}
+
+void put64(uint8_t *data, uint64_t value)
+{
+  put32(data, value);
+  put32(data + 4, value >> 32);
+}
+
+uint32_t roundUp(uint32_t value, uint32_t unit)
+{
+  return (value + unit - 1) / unit * unit;
+}
+
+class Device
+{
+public:
+  explicit Device(int fd) : m_fd(fd) {}
+
+  bool write(uint64_t sector, const void *data, size_t length)
+  {
+    if (pwrite(m_fd, data, length, sector * s_sector_size) != (ssize_t)length) {
+      std::perror("write");
+      return false;
+    }
+    return true;
+  }
+
+  // zeroes a range of sectors, a FAT of a large card takes tens of MiB
+  bool zero(uint64_t sector, uint64_t count)
+  {
+    static const std::vector<uint8_t> zeros(65536);
+    uint32_t sectors = zeros.size() / s_sector_size;
+    while (count) {
+      uint64_t chunk = count < sectors ? count : sectors;
+      if (!write(sector, zeros.data(), chunk * s_sector_size))
+        return false;
+      sector += chunk;
+      count -= chunk;
+    }
+    return true;
+  }
+
+private:
+  int m_fd;
+};
+
+// the capacity in the CSD, the AU size and the erase size in the SD Status
+bool parseRegisters(const uint8_t *registers, Geometry *geometry)
+{
+  const uint8_t *csd = registers;
+  const uint8_t *status = registers + 32;
+
+  switch (csd[0] >> 6) {
+  case 0: {
+    uint32_t c_size = (csd[6] & 0x03) << 10 | csd[7] << 2 | csd[8] >> 6;
+    uint8_t c_size_mult = (csd[9] & 0x03) << 1 | csd[10] >> 7;
+    uint8_t read_bl_len = csd[5] & 0x0F;
+    geometry->card_bytes = (uint64_t)(c_size + 1) << (c_size_mult + 2 + read_bl_len);
+    break;
+  }
+  case 1:
+    geometry->card_bytes = ((uint64_t)((csd[7] & 0x3F) << 16 | csd[8] << 8 | csd[9]) + 1) << 19;
+    break;
+  default:
+    std::fprintf(stderr, "Unknown CSD structure version %u\n", csd[0] >> 6);
+    return false;
+  }
+  geometry->au_kib = kAuSizes[status[10] >> 4];
+  geometry->erase_aus = status[11] << 8 | status[12];
+  return true;
+}
+
+// FAT32 with 32 KiB clusters, smaller ones on cards below 2 GiB so that there are enough clusters for FAT32.
+// The FATs follow the reserved sectors, which are extended so that the data region starts on an AU boundary.
+bool planFat32(uint32_t au, Layout *layout)
+{
+  layout->exfat = false;
+  for (layout->cluster_sectors = 32768 / s_sector_size; layout->cluster_sectors; layout->cluster_sectors /= 2) {
+    // the FAT is sized for the clusters of the whole partition, it can only get smaller
+    uint32_t clusters = (layout->sectors - 32) / layout->cluster_sectors;
+    layout->fat_sectors = roundUp((clusters + 2) * 4, s_sector_size) / s_sector_size;
+    layout->reserved = roundUp(layout->start + 32 + 2 * layout->fat_sectors, au) - layout->start -
+                       2 * layout->fat_sectors;
+    layout->data = layout->reserved + 2 * layout->fat_sectors;
+    if (layout->reserved > 0xFFFF || layout->data >= layout->sectors)
+      return false;
+    layout->clusters = (layout->sectors - layout->data) / layout->cluster_sectors;
+    if (layout->clusters >= 65525)
+      return true;
+  }
+  return false;
+}
+
+// exFAT with one FAT, the FAT starts at the second AU of the partition and the cluster heap at the next AU
+// boundary after it. The boot regions take 24 sectors, the rest of the first AU is unused.
+bool planExFat(uint32_t au, Layout *layout)
+{
+  uint64_t size = (uint64_t)layout->sectors * s_sector_size;
+  uint32_t cluster_bytes = size >= (32ull << 30) ? 131072 : (size >= (256ull << 20) ? 32768 : 4096);
+
+  layout->exfat = true;
+  layout->cluster_sectors = cluster_bytes / s_sector_size;
+  layout->reserved = roundUp(layout->start + 24, au) - layout->start;
+  layout->fat_sectors = roundUp(((layout->sectors - layout->reserved) / layout->cluster_sectors + 2) * 4,
+                                s_sector_size) / s_sector_size;
+  layout->data = roundUp(layout->start + layout->reserved + layout->fat_sectors, au) - layout->start;
+  if (layout->data >= layout->sectors)
+    return false;
+  layout->clusters = (layout->sectors - layout->data) / layout->cluster_sectors;
+  return layout->clusters >= 16;
+}
+
+void writeMbr(uint8_t *sector, const Layout &layout, uint32_t disk_id)
+{
+  uint8_t *entry = &sector[446];
+
+  memset(sector, 0, s_sector_size);
+  put32(&sector[440], disk_id);
+  // CHS addresses are out of range, the partition is only described by its LBA
+  entry[1] = 0xFE;
+  entry[2] = 0xFF;
+  entry[3] = 0xFF;
+  entry[4] = layout.exfat ? 0x07 : 0x0C;
+  entry[5] = 0xFE;
+  entry[6] = 0xFF;
+  entry[7] = 0xFF;
+  put32(&entry[8], layout.start);
+  put32(&entry[12], layout.sectors);
+  put16(&sector[510], 0xAA55);
+}
+
+bool formatFat32(Device &device, const Layout &layout, const char *label, uint32_t serial)
+{
+  std::vector<uint8_t> boot(3 * s_sector_size);
+  uint8_t *bpb = &boot[0];
+  uint8_t *fsinfo = &boot[s_sector_size];
+  char volume_label[11];
+
+  memset(volume_label, ' ', sizeof(volume_label));
+  memcpy(volume_label, label ? label : "NO NAME", strlen(label ? label : "NO NAME"));
+
+  memcpy(bpb, "\xEB\x58\x90" "SDFORMAT", 11);
+  put16(&bpb[11], s_sector_size);
+  bpb[13] = layout.cluster_sectors;
+  put16(&bpb[14], layout.reserved);
+  bpb[16] = 2;
+  bpb[21] = 0xF8;
+  put16(&bpb[24], 63);
+  put16(&bpb[26], 255);
+  put32(&bpb[28], layout.start);
+  put32(&bpb[32], layout.sectors);
+  put32(&bpb[36], layout.fat_sectors);
+  put32(&bpb[44], 2);
+  put16(&bpb[48], 1);
+  put16(&bpb[50], 6);
+  bpb[64] = 0x80;
+  bpb[66] = 0x29;
+  put32(&bpb[67], serial);
+  memcpy(&bpb[71], volume_label, sizeof(volume_label));
+  memcpy(&bpb[82], "FAT32   ", 8);
+  put16(&bpb[510], 0xAA55);
+
+  // FSInfo, the root directory takes cluster 2
+  put32(&fsinfo[0], 0x41615252);
+  put32(&fsinfo[484], 0x61417272);
+  put32(&fsinfo[488], layout.clusters - 1);
+  put32(&fsinfo[492], 3);
+  put32(&fsinfo[508], 0xAA550000);
+  put32(&boot[2 * s_sector_size + 508], 0xAA550000);
+
+  uint8_t fat[12];
+  put32(&fat[0], 0x0FFFFFF8);
+  put32(&fat[4], 0x0FFFFFFF);
+  put32(&fat[8], 0x0FFFFFFF);
+
+  uint8_t root[32] = {};
+  memcpy(root, volume_label, sizeof(volume_label));
+  root[11] = 0x08;
+
+  uint64_t start = layout.start;
+  return device.zero(start, layout.data + layout.cluster_sectors) &&
+         device.write(start, boot.data(), boot.size()) && device.write(start + 6, boot.data(), boot.size()) &&
+         device.write(start + layout.reserved, fat, sizeof(fat)) &&
+         device.write(start + layout.reserved + layout.fat_sectors, fat, sizeof(fat)) &&
+         (!label || device.write(start + layout.data, root, sizeof(root)));
+}
+
+uint32_t exFatChecksum(uint32_t checksum, const uint8_t *data, size_t length)
+{
+  for (size_t i = 0; i < length; ++i)
+    checksum = (checksum >> 1 | checksum << 31) + data[i];
+  return checksum;
+}
+
+// the compressed up-case table: identity below 'a', 'a'..'z' to 'A'..'Z' and identity for the rest
+std::vector<uint8_t> upcaseTable()
+{
+  std::vector<uint8_t> table;
+  auto add = [&table](uint16_t value) { table.push_back(value); table.push_back(value >> 8); };
+
+  add(0xFFFF);
+  add('a');
+  for (uint16_t c = 'a'; c <= 'z'; ++c)
+    add(c - 'a' + 'A');
+  add(0xFFFF);
+  add(0x10000 - 'z' - 1);
+  return table;
+}
+
+bool formatExFat(Device &device, const Layout &layout, const char *label, uint32_t serial)
+{
+  uint32_t cluster_bytes = layout.cluster_sectors * s_sector_size;
+  std::vector<uint8_t> upcase = upcaseTable();
+
+  // the allocation bitmap, the up-case table and the root directory in the first clusters of the heap
+  uint32_t bitmap_bytes = (layout.clusters + 7) / 8;
+  uint32_t bitmap_clusters = roundUp(bitmap_bytes, cluster_bytes) / cluster_bytes;
+  uint32_t upcase_cluster = 2 + bitmap_clusters;
+  uint32_t root_cluster = upcase_cluster + 1;
+  uint32_t used = bitmap_clusters + 2;
+
+  std::vector<uint8_t> region(12 * s_sector_size);
+  uint8_t *boot = &region[0];
+  memcpy(boot, "\xEB\x76\x90" "EXFAT   ", 11);
+  put64(&boot[64], layout.start);
+  put64(&boot[72], layout.sectors);
+  put32(&boot[80], layout.reserved);
+  put32(&boot[84], layout.fat_sectors);
+  put32(&boot[88], layout.data);
+  put32(&boot[92], layout.clusters);
+  put32(&boot[96], root_cluster);
+  put32(&boot[100], serial);
+  put16(&boot[104], 0x0100);
+  for (uint32_t bytes = s_sector_size; bytes > 1; bytes /= 2)
+    ++boot[108];
+  for (uint32_t sectors = layout.cluster_sectors; sectors > 1; sectors /= 2)
+    ++boot[109];
+  boot[110] = 1;
+  boot[111] = 0x80;
+  boot[112] = (uint64_t)used * 100 / layout.clusters;
+  put16(&boot[510], 0xAA55);
+  for (int i = 1; i <= 8; ++i)
+    put32(&region[(i + 1) * s_sector_size - 4], 0xAA550000);
+
+  // the checksum of the boot region skips VolumeFlags and PercentInUse
+  uint32_t checksum = 0;
+  for (uint32_t i = 0; i < 11 * s_sector_size; ++i) {
+    if (i != 106 && i != 107 && i != 112)
+      checksum = exFatChecksum(checksum, &region[i], 1);
+  }
+  for (uint32_t i = 0; i < s_sector_size; i += 4)
+    put32(&region[11 * s_sector_size + i], checksum);
+
+  std::vector<uint8_t> fat((2 + used) * 4);
+  put32(&fat[0], 0xFFFFFFF8);
+  put32(&fat[4], 0xFFFFFFFF);
+  for (uint32_t cluster = 2; cluster < upcase_cluster; ++cluster)
+    put32(&fat[cluster * 4], cluster + 1 < upcase_cluster ? cluster + 1 : 0xFFFFFFFF);
+  put32(&fat[upcase_cluster * 4], 0xFFFFFFFF);
+  put32(&fat[root_cluster * 4], 0xFFFFFFFF);
+
+  std::vector<uint8_t> bitmap((used + 7) / 8);
+  for (uint32_t i = 0; i < used; ++i)
+    bitmap[i / 8] |= 1 << (i % 8);
+
+  // volume label, allocation bitmap and up-case table entries
+  uint8_t root[3 * 32] = {};
+  root[0] = label ? 0x83 : 0x03;
+  for (uint8_t i = 0; label && label[i] && i < 11; ++i) {
+    root[1] = i + 1;
+    put16(&root[2 + 2 * i], (uint8_t)label[i]);
+  }
+  root[32] = 0x81;
+  put32(&root[32 + 20], 2);
+  put64(&root[32 + 24], bitmap_bytes);
+  root[64] = 0x82;
+  put32(&root[64 + 4], exFatChecksum(0, upcase.data(), upcase.size()));
+  put32(&root[64 + 20], upcase_cluster);
+  put64(&root[64 + 24], upcase.size());
+
+  uint64_t start = layout.start;
+  uint64_t heap = start + layout.data;
+  return device.zero(start, layout.reserved) && device.zero(start + layout.reserved, layout.fat_sectors) &&
+         device.zero(heap, (uint64_t)used * layout.cluster_sectors) &&
+         device.write(start, region.data(), region.size()) && device.write(start + 12, region.data(), region.size()) &&
+         device.write(start + layout.reserved, fat.data(), fat.size()) &&
+         device.write(heap, bitmap.data(), bitmap.size()) &&
+         device.write(heap + (upcase_cluster - 2) * layout.cluster_sectors, upcase.data(), upcase.size()) &&
+         device.write(heap + (root_cluster - 2) * layout.cluster_sectors, root, sizeof(root));
+}
+
+void usage(const char *program)
+{
+  std::fprintf(stderr,
+               "Usage: %s [options] DEVICE|IMAGE\n"
+               "  --registers FILE  CSD, CID and SD Status returned by the vendor command 0xC1\n"
+               "  --au-size KIB     allocation unit size instead of the one in the SD Status\n"
+               "  --fat32, --exfat  file system (default FAT32 up to 32 GiB, exFAT above)\n"
+               "  --label NAME      volume label, up to 11 characters\n"
+               "  --sector-size N   logical sector size of the device, 512 or 4096 (default 512)\n"
+               "  -n                only print the layout\n",
+               program);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  const char *registers_path = nullptr;
+  const char *label = nullptr;
+  const char *path = nullptr;
+  uint32_t au_kib = 0;
+  int exfat = -1;
+  bool dry_run = false;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (!strcmp(arg, "--registers") && value) {
+      registers_path = argv[++i];
+    } else if (!strcmp(arg, "--au-size") && value) {
+      au_kib = strtoul(argv[++i], nullptr, 0);
+    } else if (!strcmp(arg, "--sector-size") && value) {
+      s_sector_size = strtoul(argv[++i], nullptr, 0);
+    } else if (!strcmp(arg, "--label") && value && strlen(value) <= 11) {
+      label = argv[++i];
+    } else if (!strcmp(arg, "--fat32") || !strcmp(arg, "--exfat")) {
+      exfat = arg[2] == 'e';
+    } else if (!strcmp(arg, "-n")) {
+      dry_run = true;
+    } else if (arg[0] != '-' && !path) {
+      path = arg;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (!path || (!registers_path && !au_kib) || (au_kib & (au_kib - 1)) ||
+      (s_sector_size != 512 && s_sector_size != 4096)) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  Geometry geometry;
+  if (registers_path) {
+    uint8_t registers[kRegistersLength];
+    FILE *file = std::fopen(registers_path, "rb");
+    if (!file) {
+      std::perror(registers_path);
+      return 1;
+    }
+    size_t length = std::fread(registers, 1, sizeof(registers), file);
+    std::fclose(file);
+    if (length != sizeof(registers)) {
+      std::fprintf(stderr, "%s: expected %u bytes of registers\n", registers_path, kRegistersLength);
+      return 1;
+    }
+    if (!parseRegisters(registers, &geometry))
+      return 1;
+    std::printf("card: %.2f GiB, AU %u KiB, %u AUs per erase\n", geometry.card_bytes / 1073741824.0,
+                geometry.au_kib, geometry.erase_aus);
+  }
+  if (au_kib)
+    geometry.au_kib = au_kib;
+  if (!geometry.au_kib) {
+    std::fprintf(stderr, "The card doesn't report its AU size, use --au-size\n");
+    return 1;
+  }
+
+  int fd = open(path, dry_run ? O_RDONLY : O_RDWR);
+  off_t size = fd < 0 ? -1 : lseek(fd, 0, SEEK_END);
+  if (size < 0) {
+    std::perror(path);
+    return 1;
+  }
+  if (geometry.card_bytes && (uint64_t)size > geometry.card_bytes) {
+    std::fprintf(stderr, "%s is larger than the card in the registers\n", path);
+    return 1;
+  }
+  if ((uint64_t)size / s_sector_size > 0xFFFFFFFFull) {
+    std::fprintf(stderr, "%s is too large for an MBR\n", path);
+    return 1;
+  }
+
+  // the first AU only holds the MBR, the partition ends at the end of the medium
+  uint32_t au = geometry.au_kib * 1024 / s_sector_size;
+  Layout layout;
+  layout.start = au;
+  layout.sectors = size / s_sector_size > au ? size / s_sector_size - au : 0;
+  if (exfat < 0)
+    exfat = (uint64_t)size > (32ull << 30);
+  if (layout.sectors < 2 * au || !(exfat ? planExFat(au, &layout) : planFat32(au, &layout))) {
+    std::fprintf(stderr, "%s is too small for %s with %u KiB AUs\n", path, exfat ? "exFAT" : "FAT32",
+                 geometry.au_kib);
+    return 1;
+  }
+
+  std::printf("%s: %s, partition at sector %u, %u sectors\n", path, exfat ? "exFAT" : "FAT32", layout.start,
+              layout.sectors);
+  std::printf("  FAT at sector %u, %u sectors%s\n", layout.start + layout.reserved, layout.fat_sectors,
+              exfat ? "" : " x 2");
+  std::printf("  cluster 2 at sector %u, %u clusters of %u bytes\n", layout.start + layout.data, layout.clusters,
+              layout.cluster_sectors * s_sector_size);
+  if (dry_run)
+    return 0;
+
+  // volume serial number and disk signature from the time like other formatters
+  uint32_t serial = time(nullptr);
+  std::vector<uint8_t> mbr(s_sector_size);
+  Device device(fd);
+  writeMbr(mbr.data(), layout, serial);
+  bool done = device.zero(0, au) && device.write(0, mbr.data(), mbr.size()) &&
+              (exfat ? formatExFat(device, layout, label, serial) : formatFat32(device, layout, label, serial));
+  if (fsync(fd) && done) {
+    std::perror(path);
+    done = false;
+  }
+  close(fd);
+  return done ? 0 : 1;
+}
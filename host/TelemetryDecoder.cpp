@@ -0,0 +1,173 @@
+/** \file
+ *
+ *  Host side decoder of the telemetry records, see Telemetry.h. Reads the bytes the firmware sent on the CDC port
+ *  of the composite device, finds the records by their sync byte and checksum and prints one line per record with
+ *  the rates since the previous one. Records the device dropped because nobody read the port in time show up as
+ *  gaps in the sequence numbers.
+ *
+ *  Build with:  make TelemetryDecoder
+ *
+ *  Decode the live telemetry of a card reader, opening the port sets DTR which starts the stream:
+ *    stty -F /dev/ttyACM0 raw
+ *    ./TelemetryDecoder /dev/ttyACM0
+ *
+ *  Reset the counters, or send a record every 250 ms ('1' to '9' in steps of 250 ms, '0' pauses):
+ *    printf r > /dev/ttyACM0
+ *    printf 1 > /dev/ttyACM0
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../Telemetry.h"
+
+namespace {
+
+const char *const kCounters[TELEMETRY_COUNTERS] = {
+  "commands", "failed", "blocks read", "blocks written", "read us", "write us", "card busy us", "cache hits",
+  "cache misses", "log stalls", "retries",
+};
+
+struct Summary
+{
+  uint64_t records = 0;
+  uint64_t gaps = 0;            // records missing in the sequence numbers, dropped on the device
+  uint64_t skipped_bytes = 0;   // bytes that were not part of a valid record
+};
+
+uint32_t get32(const uint8_t *bytes)
+{
+  return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+bool isRecord(const uint8_t *bytes)
+{
+  uint8_t sum = 0;
+  for (size_t i = 0; i < sizeof(Telemetry_Record_t); ++i)
+    sum += bytes[i];
+  return bytes[0] == TELEMETRY_SYNC && !sum;
+}
+
+Telemetry_Record_t decode(const uint8_t *bytes)
+{
+  Telemetry_Record_t record;
+  record.Sync      = bytes[0];
+  record.Checksum  = bytes[1];
+  record.Sequence  = bytes[2] | bytes[3] << 8;
+  record.Timestamp = get32(&bytes[4]);
+  for (unsigned counter = 0; counter < TELEMETRY_COUNTERS; ++counter)
+    record.Counters[counter] = get32(&bytes[8 + 4 * counter]);
+  return record;
+}
+
+double perSecond(uint32_t delta, uint32_t ms)
+{
+  return ms ? delta * 1000.0 / ms : 0.0;
+}
+
+// the rates are taken over the time since the previous record, or since the reset of the counters
+void print(const Telemetry_Record_t &record, const Telemetry_Record_t &previous, bool reset)
+{
+  uint32_t delta[TELEMETRY_COUNTERS];
+  uint32_t ms = record.Timestamp - previous.Timestamp;
+
+  for (unsigned counter = 0; counter < TELEMETRY_COUNTERS; ++counter)
+    delta[counter] = record.Counters[counter] - (reset ? 0 : previous.Counters[counter]);
+
+  uint32_t lookups = delta[TELEMETRY_CACHE_HITS] + delta[TELEMETRY_CACHE_MISSES];
+  std::printf("%10.3f s %5u%s  %5.0f cmd/s  read %7.1f KiB/s  write %7.1f KiB/s  busy %5.1f%%  cache %5.1f%%"
+              "  %u failed  %u log full  %u retries\n",
+              record.Timestamp / 1e3, record.Sequence, reset ? " reset" : "      ",
+              perSecond(delta[TELEMETRY_COMMANDS], ms),
+              perSecond(delta[TELEMETRY_BLOCKS_READ], ms) / 2, perSecond(delta[TELEMETRY_BLOCKS_WRITTEN], ms) / 2,
+              ms ? delta[TELEMETRY_CARD_BUSY_US] / (ms * 10.0) : 0.0,
+              lookups ? delta[TELEMETRY_CACHE_HITS] * 100.0 / lookups : 0.0,
+              delta[TELEMETRY_FAILED], delta[TELEMETRY_LOG_FULL], delta[TELEMETRY_RETRIES]);
+}
+
+void usage(const char *program)
+{
+  std::fprintf(stderr, "Usage: %s [-q] [FILE]\n  -q  only print the summary\n  reads stdin without FILE\n", program);
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  bool quiet = false;
+  const char *path = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "-q")) {
+      quiet = true;
+    } else if (argv[i][0] == '-' || path) {
+      usage(argv[0]);
+      return 2;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  std::FILE *file = path ? std::fopen(path, "rb") : stdin;
+  if (!file) {
+    std::perror(path);
+    return 1;
+  }
+
+  Summary summary;
+  std::vector<uint8_t> buffer;
+  bool synchronized = false;
+  Telemetry_Record_t previous = {};
+  uint8_t chunk[4096];
+  ssize_t length;
+
+  // the records are decoded while they are read, so that the live telemetry is printed as it arrives
+  while ((length = read(fileno(file), chunk, sizeof(chunk))) > 0) {
+    buffer.insert(buffer.end(), chunk, chunk + length);
+    size_t offset = 0;
+    while (buffer.size() - offset >= sizeof(Telemetry_Record_t)) {
+      if (!isRecord(&buffer[offset])) {
+        ++offset;
+        ++summary.skipped_bytes;
+        continue;
+      }
+      Telemetry_Record_t record = decode(&buffer[offset]);
+      offset += sizeof(Telemetry_Record_t);
+
+      if (synchronized) {
+        uint16_t gap = record.Sequence - previous.Sequence - 1;
+        if (gap && !quiet)
+          std::printf("%12s %5s  %u records dropped\n", "", "", gap);
+        summary.gaps += gap;
+      }
+
+      // the command counter only goes down when the counters were reset, the first record is
+      // compared to the counters at power up
+      bool reset = record.Counters[TELEMETRY_COMMANDS] < previous.Counters[TELEMETRY_COMMANDS];
+      if (!quiet)
+        print(record, previous, reset);
+      synchronized = true;
+      previous = record;
+      ++summary.records;
+    }
+    buffer.erase(buffer.begin(), buffer.begin() + offset);
+    std::fflush(stdout);
+  }
+  summary.skipped_bytes += buffer.size();
+  if (path)
+    std::fclose(file);
+
+  std::printf("\n%llu records, %llu dropped on the device, %llu bytes skipped\n",
+              (unsigned long long)summary.records, (unsigned long long)summary.gaps,
+              (unsigned long long)summary.skipped_bytes);
+  if (synchronized) {
+    std::printf("totals:");
+    for (unsigned counter = 0; counter < TELEMETRY_COUNTERS; ++counter)
+      std::printf("%s %u %s", counter ? "," : "", previous.Counters[counter], kCounters[counter]);
+    std::printf("\n");
+  }
+  return summary.records ? 0 : 1;
+}
@@ -0,0 +1,265 @@
+/** \file
+ *
+ *  Host side decoder of the SCSI command trace, see CommandTrace.h. Reads the data returned by the vendor
+ *  specific READ COMMAND TRACE command or an image of the trace spill area of a card, merges all records by
+ *  their sequence number and prints the command mix, transfer sizes, sequentiality, reuse distances and
+ *  latencies of the trace.
+ *
+ *  Build with:  make TraceDecoder
+ *
+ *  Read the trace of a card reader at /dev/sdX with sg3_utils and decode it:
+ *    sg_raw -r 4096 -o trace.bin /dev/sdX c0 00 00 00 00 00 00 10 00 00
+ *    ./TraceDecoder trace.bin
+ *
+ *  Decode the spill area of a card, COMMAND_TRACE_SPILL_BLOCKS blocks at the end of the card:
+ *    dd if=/dev/sdX of=spill.bin bs=512 skip=$((CARD_BLOCKS - 64)) count=64
+ *    ./TraceDecoder -s spill.bin
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "TraceFile.h"
+
+namespace {
+
+const unsigned kBuckets = 20;
+
+struct Access
+{
+  uint64_t time_us;        // unwrapped start time
+  CommandTrace_Record_t record;
+};
+
+const char *opcodeName(uint8_t opcode)
+{
+  switch (opcode) {
+  case 0x00: return "TEST UNIT READY";
+  case 0x03: return "REQUEST SENSE";
+  case 0x12: return "INQUIRY";
+  case 0x1A: return "MODE SENSE (6)";
+  case 0x1B: return "START STOP UNIT";
+  case 0x1D: return "SEND DIAGNOSTIC";
+  case 0x1E: return "PREVENT ALLOW MEDIUM REMOVAL";
+  case 0x23: return "READ FORMAT CAPACITIES";
+  case 0x25: return "READ CAPACITY (10)";
+  case 0x28: return "READ (10)";
+  case 0x2A: return "WRITE (10)";
+  case 0x2F: return "VERIFY (10)";
+  case 0x35: return "SYNCHRONIZE CACHE (10)";
+  case 0x4C: return "LOG SELECT";
+  case 0x4D: return "LOG SENSE";
+  case 0x5A: return "MODE SENSE (10)";
+  case SCSI_CMD_READ_COMMAND_TRACE: return "READ COMMAND TRACE";
+  default: return "unknown";
+  }
+}
+
+bool isTransfer(uint8_t opcode)
+{
+  return opcode == 0x28 || opcode == 0x2A;
+}
+
+/** Index of the smallest power of two bucket that holds a value, the last bucket holds all larger values. */
+unsigned bucketOf(uint64_t value)
+{
+  unsigned bucket = 0;
+  while ((1ULL << bucket) < value && bucket < kBuckets - 1)
+    ++bucket;
+  return bucket;
+}
+
+void printHistogram(const char *title, const char *unit, const uint64_t (&buckets)[kBuckets], uint64_t total)
+{
+  std::printf("%s\n", title);
+  for (unsigned i = 0; i < kBuckets; ++i) {
+    if (!buckets[i])
+      continue;
+    std::printf("  %s %8llu %-6s %10llu  %5.1f%%\n", (i < kBuckets - 1) ? "<=" : "> ",
+                (unsigned long long)(1ULL << (i < kBuckets - 1 ? i : i - 1)), unit,
+                (unsigned long long)buckets[i], 100.0 * buckets[i] / total);
+  }
+}
+
+uint64_t percentile(std::vector<uint32_t> &values, double fraction)
+{
+  if (values.empty())
+    return 0;
+  size_t index = std::min(values.size() - 1, (size_t)(fraction * values.size()));
+  std::nth_element(values.begin(), values.begin() + index, values.end());
+  return values[index];
+}
+
+/** Fenwick tree over the access times, marks the most recent access of every block so that the
+ *  number of distinct blocks accessed since a given time can be counted in O(log n).
+ */
+class Fenwick
+{
+public:
+  explicit Fenwick(size_t size) : m_tree(size + 1, 0) {}
+
+  void add(size_t index, int value)
+  {
+    for (++index; index < m_tree.size(); index += index & (0 - index))
+      m_tree[index] += value;
+  }
+
+  int64_t sum(size_t index) const // sum of [0, index)
+  {
+    int64_t total = 0;
+    for (; index > 0; index -= index & (0 - index))
+      total += m_tree[index];
+    return total;
+  }
+
+private:
+  std::vector<int64_t> m_tree;
+};
+
+void analyze(const std::map<uint32_t, CommandTrace_Record_t> &records)
+{
+  std::vector<Access> accesses;
+  uint64_t lost = 0;
+  uint32_t previous_sequence = records.begin()->first;
+  uint32_t previous_timestamp = records.begin()->second.Timestamp;
+  uint64_t time_us = 0;
+
+  // unwrap the 32 bit microsecond timestamps, which overflow every 71 minutes
+  for (const auto &entry : records) {
+    lost += entry.first - previous_sequence - (accesses.empty() ? 0 : 1);
+    time_us += (uint32_t)(entry.second.Timestamp - previous_timestamp);
+    accesses.push_back(Access{time_us, entry.second});
+    previous_sequence = entry.first;
+    previous_timestamp = entry.second.Timestamp;
+  }
+
+  std::printf("Records:          %zu (sequence %u to %u, %llu lost)\n", accesses.size(), records.begin()->first,
+              records.rbegin()->first, (unsigned long long)lost);
+  std::printf("Duration:         %.3f s\n\n", accesses.back().time_us / 1e6);
+
+  // command mix and latency
+  std::map<uint8_t, std::vector<uint32_t> > latencies;
+  std::map<uint8_t, unsigned> failures;
+  for (const Access &access : accesses) {
+    latencies[access.record.Opcode].push_back(access.record.Duration);
+    if (access.record.Status & COMMAND_TRACE_STATUS_FAILED)
+      ++failures[access.record.Opcode];
+  }
+  std::printf("%-30s %8s %7s %10s %10s %10s\n", "Command", "Count", "Failed", "p50 us", "p99 us", "max us");
+  for (auto &entry : latencies) {
+    std::vector<uint32_t> &values = entry.second;
+    std::printf("%02X %-27s %8zu %7u %10llu %10llu %10u\n", entry.first, opcodeName(entry.first), values.size(),
+                failures[entry.first], (unsigned long long)percentile(values, 0.5),
+                (unsigned long long)percentile(values, 0.99), *std::max_element(values.begin(), values.end()));
+  }
+  std::printf("\n");
+
+  // transfer sizes and sequentiality of READ (10) and WRITE (10)
+  uint64_t size_buckets[kBuckets] = {};
+  uint64_t transfers = 0, blocks = 0, sequential = 0, sequential_same = 0, runs = 0;
+  uint64_t next_block = UINT64_MAX;
+  uint8_t previous_opcode = 0;
+  for (const Access &access : accesses) {
+    const CommandTrace_Record_t &record = access.record;
+    if (!isTransfer(record.Opcode) || !record.TotalBlocks)
+      continue;
+    ++transfers;
+    blocks += record.TotalBlocks;
+    ++size_buckets[bucketOf(record.TotalBlocks)];
+    if (record.BlockAddress == next_block) {
+      ++sequential;
+      if (record.Opcode == previous_opcode)
+        ++sequential_same;
+    } else {
+      ++runs;
+    }
+    next_block = (uint64_t)record.BlockAddress + record.TotalBlocks;
+    previous_opcode = record.Opcode;
+  }
+  if (!transfers) {
+    std::printf("No READ (10) or WRITE (10) commands in the trace\n");
+    return;
+  }
+
+  printHistogram("Transfer size:", "blocks", size_buckets, transfers);
+  std::printf("Average:          %.1f blocks\n\n", (double)blocks / transfers);
+  std::printf("Sequential:       %.1f%% of transfers continue the previous one (%.1f%% in the same direction)\n",
+              100.0 * sequential / transfers, 100.0 * sequential_same / transfers);
+  std::printf("Sequential runs:  %llu, %.1f transfers and %.1f blocks per run\n\n", (unsigned long long)runs,
+              (double)transfers / runs, (double)blocks / runs);
+
+  // reuse distance: number of distinct blocks accessed between two accesses of the same block
+  uint64_t reuse_buckets[kBuckets] = {};
+  uint64_t cold = 0, reuses = 0;
+  Fenwick recent(blocks);
+  std::unordered_map<uint32_t, size_t> last_access;
+  size_t now = 0;
+  for (const Access &access : accesses) {
+    const CommandTrace_Record_t &record = access.record;
+    if (!isTransfer(record.Opcode))
+      continue;
+    for (uint32_t block = record.BlockAddress; block != record.BlockAddress + record.TotalBlocks; ++block, ++now) {
+      auto last = last_access.find(block);
+      if (last == last_access.end()) {
+        ++cold;
+        last_access[block] = now;
+      } else {
+        ++reuses;
+        ++reuse_buckets[bucketOf(recent.sum(now) - recent.sum(last->second + 1))];
+        recent.add(last->second, -1);
+        last->second = now;
+      }
+      recent.add(now, 1);
+    }
+  }
+  std::printf("Distinct blocks:  %llu of %llu accessed (%.1f%% reused)\n", (unsigned long long)cold,
+              (unsigned long long)blocks, 100.0 * reuses / blocks);
+  if (reuses)
+    printHistogram("Reuse distance:", "blocks", reuse_buckets, reuses);
+}
+
+void usage(const char *program)
+{
+  std::fprintf(stderr,
+               "Usage: %s [-s] FILE...\n"
+               "Decodes SCSI command traces, the data of the READ COMMAND TRACE (0xC0) command or with -s\n"
+               "images of the trace spill area of a card. Records of all files are merged.\n",
+               program);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  std::map<uint32_t, CommandTrace_Record_t> records;
+  bool spill = false;
+  int files = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "-s")) {
+      spill = true;
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 2;
+    } else {
+      if (!readTraceFile(argv[i], spill, records))
+        return 1;
+      ++files;
+    }
+  }
+  if (!files) {
+    usage(argv[0]);
+    return 2;
+  }
+  if (records.empty()) {
+    std::fprintf(stderr, "The trace is empty\n");
+    return 1;
+  }
+
+  analyze(records);
+  return 0;
+}
@@ -0,0 +1,68 @@
+/** \file
+ *
+ *  Reader of SCSI command trace files, shared by the trace decoder and the benchmark.
+ */
+
+#include "TraceFile.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static_assert(sizeof(CommandTrace_Record_t) == 16, "Trace record layout changed");
+static_assert(sizeof(CommandTrace_Header_t) == 16, "Trace header layout changed");
+
+namespace {
+
+const unsigned kSpillBlockSize = 512;
+
+} // namespace
+
+bool readTraceFile(const char *path, bool spill, std::map<uint32_t, CommandTrace_Record_t> &records)
+{
+  FILE *file = std::fopen(path, "rb");
+  if (!file) {
+    std::perror(path);
+    return false;
+  }
+
+  std::vector<uint8_t> data;
+  uint8_t chunk[4096];
+  size_t length;
+  while ((length = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+    data.insert(data.end(), chunk, chunk + length);
+  std::fclose(file);
+
+  size_t offset = 0;
+  unsigned chunks = 0;
+  while (offset + sizeof(CommandTrace_Header_t) <= data.size()) {
+    CommandTrace_Header_t header;
+    std::memcpy(&header, &data[offset], sizeof(header));
+
+    // unused spill blocks are skipped, a dump ends at the first invalid header
+    if (header.Magic != COMMAND_TRACE_MAGIC) {
+      if (!spill)
+        break;
+      offset += kSpillBlockSize;
+      continue;
+    }
+    if (header.Version != COMMAND_TRACE_VERSION || header.RecordSize != sizeof(CommandTrace_Record_t)) {
+      std::fprintf(stderr, "%s: unsupported trace version %u\n", path, header.Version);
+      return false;
+    }
+
+    size_t records_offset = offset + sizeof(header);
+    for (uint16_t i = 0; i < header.Count && records_offset + sizeof(CommandTrace_Record_t) <= data.size(); ++i) {
+      CommandTrace_Record_t record;
+      std::memcpy(&record, &data[records_offset], sizeof(record));
+      records[header.Sequence + i] = record;
+      records_offset += sizeof(record);
+    }
+    ++chunks;
+    offset = spill ? offset + kSpillBlockSize : records_offset;
+  }
+
+  if (!chunks)
+    std::fprintf(stderr, "%s: no trace found\n", path);
+  return chunks > 0;
+}
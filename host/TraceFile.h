@@ -0,0 +1,19 @@
+/** \file
+ *
+ *  Reader of the SCSI command trace, see CommandTrace.h.
+ */
+
+#ifndef TRACEFILE_H
+#define TRACEFILE_H
+
+#include <cstdint>
+#include <map>
+
+#include "../CommandTrace.h"
+
+/** Reads all trace chunks of a file into the map of records by sequence number. With \c spill the file is an
+ *  image of the trace spill area of a card, otherwise the data returned by the READ COMMAND TRACE command.
+ */
+bool readTraceFile(const char *path, bool spill, std::map<uint32_t, CommandTrace_Record_t> &records);
+
+#endif // TRACEFILE_H
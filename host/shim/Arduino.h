@@ -0,0 +1,61 @@
+// Host replacement of the Arduino core for the parts used by the firmware. Time is virtual: it
+// only advances with SPI transfers and delay(), see HostArduino.cpp.
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <avr/io.h>
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT  0x0
+#define OUTPUT 0x1
+
+#define DEC 10
+#define HEX 16
+
+#define LED_BUILTIN 13
+#define SS          17
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+
+#if defined(__cplusplus)
+}
+
+// Serial1 is a UART with the 64 byte transmit buffer of the Arduino core, sent at the baud rate
+// in virtual time. The output is discarded unless HostArduino_SetSerialOutput() set a file.
+class HostSerial {
+public:
+  void begin(unsigned long baud);
+  size_t print(const char *text);
+  size_t print(long value, int base = DEC);
+  size_t print(unsigned long value, int base = DEC);
+  size_t print(int value, int base = DEC) { return print((long)value, base); }
+  size_t print(unsigned int value, int base = DEC) { return print((unsigned long)value, base); }
+  size_t print(unsigned char value, int base = DEC) { return print((unsigned long)value, base); }
+  template <class T> size_t println(T value) { return print(value) + println(); }
+  template <class T> size_t println(T value, int base) { return print(value, base) + println(); }
+  size_t println() { return write('\n'); }
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *data, size_t length);
+  int availableForWrite();
+};
+extern HostSerial Serial1;
+#endif
+
+#endif // HOST_ARDUINO_H
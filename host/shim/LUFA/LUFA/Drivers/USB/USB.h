@@ -0,0 +1,386 @@
+// Host replacement of the parts of the LUFA USB stack used by the firmware: the Mass Storage class
+// driver types and SCSI definitions, the CDC class driver of the telemetry port and the endpoint API. The endpoints are modeled as 64 byte
+// FIFOs with banks and the class driver task runs the Bulk-Only Transport, see HostUSB.cpp.
+
+#ifndef HOST_LUFA_USB_H
+#define HOST_LUFA_USB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define ATTR_PACKED                 __attribute__((packed))
+#define ATTR_WARN_UNUSED_RESULT     __attribute__((warn_unused_result))
+#define ATTR_NON_NULL_PTR_ARG(...)  __attribute__((nonnull(__VA_ARGS__)))
+
+#if !defined(MIN)
+#define MIN(x, y)                   (((x) < (y)) ? (x) : (y))
+#endif
+#if !defined(MAX)
+#define MAX(x, y)                   (((x) > (y)) ? (x) : (y))
+#endif
+
+// the host is little endian like the AVR
+#define SwapEndian_16(x)            __builtin_bswap16(x)
+#define SwapEndian_32(x)            __builtin_bswap32(x)
+#define CPU_TO_LE32(x)              (x)
+#define le32_to_cpu(x)              (x)
+
+#define ENDPOINT_DIR_MASK           0x80
+#define ENDPOINT_DIR_IN             0x80
+#define ENDPOINT_DIR_OUT            0x00
+#define ENDPOINT_EPNUM_MASK         0x0F
+#define ENDPOINT_TOTAL_ENDPOINTS    7
+
+#define EP_TYPE_BULK                0x02
+#define EP_TYPE_INTERRUPT           0x03
+
+#define USB_STREAM_TIMEOUT_MS       100
+
+enum Endpoint_WaitUntilReady_ErrorCodes_t
+{
+  ENDPOINT_READYWAIT_NoError = 0,
+  ENDPOINT_READYWAIT_EndpointStalled = 1,
+  ENDPOINT_READYWAIT_DeviceDisconnected = 2,
+  ENDPOINT_READYWAIT_BusSuspended = 3,
+  ENDPOINT_READYWAIT_Timeout = 4,
+};
+
+enum Endpoint_Stream_RW_ErrorCodes_t
+{
+  ENDPOINT_RWSTREAM_NoError = 0,
+  ENDPOINT_RWSTREAM_EndpointStalled = 1,
+  ENDPOINT_RWSTREAM_DeviceDisconnected = 2,
+  ENDPOINT_RWSTREAM_BusSuspended = 3,
+  ENDPOINT_RWSTREAM_Timeout = 4,
+  ENDPOINT_RWSTREAM_IncompleteTransfer = 5,
+};
+
+// Mass Storage class, MassStorageClassCommon.h
+#define MS_CBW_SIGNATURE            0x43425355UL
+#define MS_CSW_SIGNATURE            0x53425355UL
+#define MS_COMMAND_DIR_DATA_OUT     (0 << 7)
+#define MS_COMMAND_DIR_DATA_IN      (1 << 7)
+
+#define SCSI_CMD_INQUIRY                               0x12
+#define SCSI_CMD_REQUEST_SENSE                         0x03
+#define SCSI_CMD_TEST_UNIT_READY                       0x00
+#define SCSI_CMD_READ_CAPACITY_10                      0x25
+#define SCSI_CMD_START_STOP_UNIT                       0x1B
+#define SCSI_CMD_SEND_DIAGNOSTIC                       0x1D
+#define SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL          0x1E
+#define SCSI_CMD_WRITE_10                              0x2A
+#define SCSI_CMD_READ_10                               0x28
+#define SCSI_CMD_WRITE_6                               0x0A
+#define SCSI_CMD_READ_6                                0x08
+#define SCSI_CMD_VERIFY_10                             0x2F
+#define SCSI_CMD_MODE_SENSE_6                          0x1A
+#define SCSI_CMD_MODE_SENSE_10                         0x5A
+
+#define SCSI_SENSE_KEY_GOOD                            0x00
+#define SCSI_SENSE_KEY_RECOVERED_ERROR                 0x01
+#define SCSI_SENSE_KEY_NOT_READY                       0x02
+#define SCSI_SENSE_KEY_MEDIUM_ERROR                    0x03
+#define SCSI_SENSE_KEY_HARDWARE_ERROR                  0x04
+#define SCSI_SENSE_KEY_ILLEGAL_REQUEST                 0x05
+#define SCSI_SENSE_KEY_UNIT_ATTENTION                  0x06
+#define SCSI_SENSE_KEY_DATA_PROTECT                    0x07
+#define SCSI_SENSE_KEY_BLANK_CHECK                     0x08
+#define SCSI_SENSE_KEY_VENDOR_SPECIFIC                 0x09
+#define SCSI_SENSE_KEY_COPY_ABORTED                    0x0A
+#define SCSI_SENSE_KEY_ABORTED_COMMAND                 0x0B
+#define SCSI_SENSE_KEY_VOLUME_OVERFLOW                 0x0D
+#define SCSI_SENSE_KEY_MISCOMPARE                      0x0E
+
+#define SCSI_ASENSE_NO_ADDITIONAL_INFORMATION          0x00
+#define SCSI_ASENSE_LOGICAL_UNIT_NOT_READY             0x04
+#define SCSI_ASENSE_INVALID_FIELD_IN_CDB               0x24
+#define SCSI_ASENSE_NOT_READY_TO_READY_CHANGE          0x28
+#define SCSI_ASENSE_WRITE_PROTECTED                    0x27
+#define SCSI_ASENSE_FORMAT_ERROR                       0x31
+#define SCSI_ASENSE_INVALID_COMMAND                    0x20
+#define SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE 0x21
+#define SCSI_ASENSE_MEDIUM_NOT_PRESENT                 0x3A
+
+#define SCSI_ASENSEQ_NO_QUALIFIER                      0x00
+#define SCSI_ASENSEQ_FORMAT_COMMAND_FAILED             0x01
+#define SCSI_ASENSEQ_INITIALIZING_COMMAND_REQUIRED     0x02
+#define SCSI_ASENSEQ_OPERATION_IN_PROGRESS             0x07
+
+enum MS_CommandStatusCodes_t
+{
+  MS_SCSI_COMMAND_Pass = 0,
+  MS_SCSI_COMMAND_Fail = 1,
+  MS_SCSI_COMMAND_PhaseError = 2,
+};
+
+typedef struct
+{
+  uint8_t Address;
+  uint16_t Size;
+  uint8_t Type;
+  uint8_t Banks;
+} USB_Endpoint_Table_t;
+
+typedef struct
+{
+  uint32_t Signature;
+  uint32_t Tag;
+  uint32_t DataTransferLength;
+  uint8_t Flags;
+  uint8_t LUN;
+  uint8_t SCSICommandLength;
+  uint8_t SCSICommandData[16];
+} ATTR_PACKED MS_CommandBlockWrapper_t;
+
+typedef struct
+{
+  uint32_t Signature;
+  uint32_t Tag;
+  uint32_t DataTransferResidue;
+  uint8_t Status;
+} ATTR_PACKED MS_CommandStatusWrapper_t;
+
+typedef struct
+{
+  uint8_t ResponseCode;
+
+  uint8_t SegmentNumber;
+
+  unsigned SenseKey : 4;
+  unsigned Reserved : 1;
+  unsigned ILI : 1;
+  unsigned EOM : 1;
+  unsigned FileMark : 1;
+
+  uint8_t Information[4];
+  uint8_t AdditionalLength;
+  uint8_t CmdSpecificInformation[4];
+  uint8_t AdditionalSenseCode;
+  uint8_t AdditionalSenseQualifier;
+  uint8_t FieldReplaceableUnitCode;
+  uint8_t SenseKeySpecific[3];
+} ATTR_PACKED SCSI_Request_Sense_Response_t;
+
+typedef struct
+{
+  unsigned DeviceType : 5;
+  unsigned PeripheralQualifier : 3;
+
+  unsigned Reserved : 7;
+  unsigned Removable : 1;
+
+  uint8_t Version;
+
+  unsigned ResponseDataFormat : 4;
+  unsigned Reserved2 : 1;
+  unsigned NormACA : 1;
+  unsigned TrmTsk : 1;
+  unsigned AERC : 1;
+
+  uint8_t AdditionalLength;
+  uint8_t Reserved3[2];
+
+  unsigned SoftReset : 1;
+  unsigned CmdQue : 1;
+  unsigned Reserved4 : 1;
+  unsigned Linked : 1;
+  unsigned Sync : 1;
+  unsigned WideBus16Bit : 1;
+  unsigned WideBus32Bit : 1;
+  unsigned RelAddr : 1;
+
+  uint8_t VendorID[8];
+  uint8_t ProductID[16];
+  uint8_t RevisionID[4];
+} ATTR_PACKED SCSI_Inquiry_Response_t;
+
+typedef struct
+{
+  struct
+  {
+    uint8_t InterfaceNumber;
+    USB_Endpoint_Table_t DataINEndpoint;
+    USB_Endpoint_Table_t DataOUTEndpoint;
+    uint8_t TotalLUNs;
+  } Config;
+  struct
+  {
+    MS_CommandBlockWrapper_t CommandBlock;
+    MS_CommandStatusWrapper_t CommandStatus;
+    volatile bool IsMassStoreReset;
+  } State;
+} USB_ClassInfo_MS_Device_t;
+
+// CDC class, CDCClassCommon.h
+#define CDC_CONTROL_LINE_OUT_DTR    (1 << 0)
+#define CDC_CONTROL_LINE_OUT_RTS    (1 << 1)
+
+typedef struct
+{
+  uint32_t BaudRateBPS;
+  uint8_t CharFormat;
+  uint8_t ParityType;
+  uint8_t DataBits;
+} ATTR_PACKED CDC_LineEncoding_t;
+
+typedef struct
+{
+  struct
+  {
+    uint8_t ControlInterfaceNumber;
+    USB_Endpoint_Table_t DataINEndpoint;
+    USB_Endpoint_Table_t DataOUTEndpoint;
+    USB_Endpoint_Table_t NotificationEndpoint;
+  } Config;
+  struct
+  {
+    struct
+    {
+      uint16_t HostToDevice;
+      uint16_t DeviceToHost;
+    } ControlLineStates;
+    CDC_LineEncoding_t LineEncoding;
+  } State;
+} USB_ClassInfo_CDC_Device_t;
+
+// descriptor types, only needed for the declarations in Descriptors.h
+typedef struct
+{
+  uint8_t Size;
+  uint8_t Type;
+} ATTR_PACKED USB_Descriptor_Header_t;
+
+typedef struct
+{
+  USB_Descriptor_Header_t Header;
+  uint16_t TotalConfigurationSize;
+  uint8_t TotalInterfaces;
+  uint8_t ConfigurationNumber;
+  uint8_t ConfigurationStrIndex;
+  uint8_t ConfigAttributes;
+  uint8_t MaxPowerConsumption;
+} ATTR_PACKED USB_Descriptor_Configuration_Header_t;
+
+typedef struct
+{
+  USB_Descriptor_Header_t Header;
+  uint8_t InterfaceNumber;
+  uint8_t AlternateSetting;
+  uint8_t TotalEndpoints;
+  uint8_t Class;
+  uint8_t SubClass;
+  uint8_t Protocol;
+  uint8_t InterfaceStrIndex;
+} ATTR_PACKED USB_Descriptor_Interface_t;
+
+typedef struct
+{
+  USB_Descriptor_Header_t Header;
+  uint8_t EndpointAddress;
+  uint8_t Attributes;
+  uint16_t EndpointSize;
+  uint8_t PollingIntervalMS;
+} ATTR_PACKED USB_Descriptor_Endpoint_t;
+
+typedef struct
+{
+  USB_Descriptor_Header_t Header;
+  uint8_t FirstInterfaceIndex;
+  uint8_t TotalInterfaces;
+  uint8_t Class;
+  uint8_t SubClass;
+  uint8_t Protocol;
+  uint8_t IADStrIndex;
+} ATTR_PACKED USB_Descriptor_Interface_Association_t;
+
+typedef struct
+{
+  USB_Descriptor_Header_t Header;
+  uint8_t Subtype;
+  uint16_t CDCSpecification;
+} ATTR_PACKED USB_CDC_Descriptor_FunctionalHeader_t;
+
+typedef struct
+{
+  USB_Descriptor_Header_t Header;
+  uint8_t Subtype;
+  uint8_t Capabilities;
+} ATTR_PACKED USB_CDC_Descriptor_FunctionalACM_t;
+
+typedef struct
+{
+  USB_Descriptor_Header_t Header;
+  uint8_t Subtype;
+  uint8_t MasterInterfaceNumber;
+  uint8_t SlaveInterfaceNumber;
+} ATTR_PACKED USB_CDC_Descriptor_FunctionalUnion_t;
+
+// USB device
+enum USB_Device_States_t
+{
+  DEVICE_STATE_Unattached = 0,
+  DEVICE_STATE_Powered = 1,
+  DEVICE_STATE_Default = 2,
+  DEVICE_STATE_Addressed = 3,
+  DEVICE_STATE_Configured = 4,
+  DEVICE_STATE_Suspended = 5,
+};
+
+extern volatile uint8_t USB_DeviceState;
+
+void USB_Init(void);
+void USB_USBTask(void);
+
+// Mass Storage class driver
+void MS_Device_USBTask(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo);
+bool MS_Device_ConfigureEndpoints(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo);
+void MS_Device_ProcessControlRequest(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo);
+bool CALLBACK_MS_Device_SCSICommandReceived(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo);
+
+// CDC class driver
+bool CDC_Device_ConfigureEndpoints(USB_ClassInfo_CDC_Device_t *const CDCInterfaceInfo);
+void CDC_Device_ProcessControlRequest(USB_ClassInfo_CDC_Device_t *const CDCInterfaceInfo);
+int16_t CDC_Device_ReceiveByte(USB_ClassInfo_CDC_Device_t *const CDCInterfaceInfo);
+
+// endpoints
+void Endpoint_SelectEndpoint(uint8_t Address);
+uint8_t Endpoint_GetCurrentEndpoint(void);
+uint16_t Endpoint_BytesInEndpoint(void);
+uint8_t Endpoint_WaitUntilReady(void);
+bool Endpoint_IsReadWriteAllowed(void);
+bool Endpoint_IsOUTReceived(void);
+bool Endpoint_IsINReady(void);
+void Endpoint_ClearIN(void);
+void Endpoint_ClearOUT(void);
+void Endpoint_StallTransaction(void);
+void Endpoint_ClearStall(void);
+bool Endpoint_IsStalled(void);
+void Endpoint_ResetEndpoint(uint8_t Address);
+void Endpoint_ResetDataToggle(void);
+
+uint8_t Endpoint_Read_8(void);
+void Endpoint_Write_8(uint8_t Data);
+void Endpoint_Write_16_LE(uint16_t Data);
+void Endpoint_Write_16_BE(uint16_t Data);
+void Endpoint_Write_32_LE(uint32_t Data);
+void Endpoint_Write_32_BE(uint32_t Data);
+
+uint8_t Endpoint_Write_Stream_LE(const void *const Buffer, uint16_t Length, uint16_t *const BytesProcessed);
+uint8_t Endpoint_Write_Stream_BE(const void *const Buffer, uint16_t Length, uint16_t *const BytesProcessed);
+uint8_t Endpoint_Read_Stream_LE(void *const Buffer, uint16_t Length, uint16_t *const BytesProcessed);
+uint8_t Endpoint_Null_Stream(uint16_t Length, uint16_t *const BytesProcessed);
+uint8_t Endpoint_Discard_Stream(uint16_t Length, uint16_t *const BytesProcessed);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // HOST_LUFA_USB_H
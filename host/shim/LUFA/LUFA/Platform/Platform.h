@@ -0,0 +1,6 @@
+// Host replacement of the LUFA platform header, nothing to set up on the host.
+
+#ifndef HOST_LUFA_PLATFORM_H
+#define HOST_LUFA_PLATFORM_H
+
+#endif // HOST_LUFA_PLATFORM_H
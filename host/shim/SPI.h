@@ -0,0 +1,33 @@
+// Host replacement of the Arduino SPI library, transfers go to the SD card model attached with
+// HostArduino_AttachCard().
+
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+
+#include "Arduino.h"
+
+#define MSBFIRST 1
+#define SPI_MODE0 0x00
+
+class SPISettings {
+public:
+  SPISettings() : m_clock(4000000) {}
+  SPISettings(uint32_t clock, uint8_t, uint8_t) : m_clock(clock) {}
+  uint32_t clock() const { return m_clock; }
+
+private:
+  uint32_t m_clock;
+};
+
+class SPIClass {
+public:
+  void begin() {}
+  void end() {}
+  void beginTransaction(const SPISettings &settings);
+  void endTransaction() {}
+  uint8_t transfer(uint8_t data);
+  uint16_t transfer16(uint16_t data);
+};
+extern SPIClass SPI;
+
+#endif // HOST_SPI_H
@@ -0,0 +1,23 @@
+// Host replacement of the avr-libc EEPROM access, the 1 KiB EEPROM of the ATmega32U4 is kept in
+// memory and starts out erased. Programming a byte that changed keeps the EEPROM busy for 3.3 ms of
+// virtual time like on the AVR, the functions wait for the last write to finish first.
+
+#ifndef HOST_AVR_EEPROM_H
+#define HOST_AVR_EEPROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define E2END 0x3FF
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_update_byte(uint8_t *dst, uint8_t value);
+int eeprom_is_ready(void);
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // HOST_AVR_EEPROM_H
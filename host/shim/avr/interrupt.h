@@ -0,0 +1,9 @@
+// Host replacement of the avr-libc interrupt functions, the host build has no interrupts.
+
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#define sei()
+#define cli()
+
+#endif // HOST_AVR_INTERRUPT_H
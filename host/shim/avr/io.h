@@ -0,0 +1,43 @@
+// Host replacement of the AVR register definitions used by the firmware. The SPI data and status
+// registers are proxies to the SPI object, so that the OPTIMIZE_SDCARD_HARDWARE_SPI loops of the
+// card driver run against the card model.
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+#define SPIF 7
+#define WDRF 3
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+// only cleared by the firmware at startup
+extern uint8_t MCUSR;
+#if defined(__cplusplus)
+}
+#endif
+
+#if defined(__cplusplus)
+class HostSpiDataRegister {
+public:
+  // writing starts a transfer, the received byte is read back afterwards
+  HostSpiDataRegister &operator=(uint8_t value);
+  operator uint8_t() const { return m_received; }
+
+private:
+  uint8_t m_received = 0xFF;
+};
+
+class HostSpiStatusRegister {
+public:
+  // transfers complete immediately
+  operator uint8_t() const { return 1 << SPIF; }
+};
+
+extern HostSpiDataRegister SPDR;
+extern HostSpiStatusRegister SPSR;
+#endif
+
+#endif // HOST_AVR_IO_H
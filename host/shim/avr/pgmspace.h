@@ -0,0 +1,17 @@
+// Host replacement of the avr-libc program memory access, the host has a single address space.
+
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+#define pgm_read_byte(address)  (*(const uint8_t *)(address))
+#define pgm_read_word(address)  (*(const uint16_t *)(address))
+#define pgm_read_dword(address) (*(const uint32_t *)(address))
+#define memcpy_P                memcpy
+
+#endif // HOST_AVR_PGMSPACE_H
@@ -0,0 +1,10 @@
+// Host replacement of the avr-libc clock prescaler functions.
+
+#ifndef HOST_AVR_POWER_H
+#define HOST_AVR_POWER_H
+
+#define clock_div_1 0
+
+#define clock_prescale_set(x) ((void)(x))
+
+#endif // HOST_AVR_POWER_H
@@ -0,0 +1,9 @@
+// Host replacement of the avr-libc watchdog functions, there is no watchdog on the host.
+
+#ifndef HOST_AVR_WDT_H
+#define HOST_AVR_WDT_H
+
+#define wdt_disable()
+#define wdt_reset()
+
+#endif // HOST_AVR_WDT_H